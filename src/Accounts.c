@@ -0,0 +1,847 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Accounts.c implements the server's account layer on top of Bank.c.
+ *
+ *      Everything the server keeps about an account sits in one 16 byte entry
+ *      of the account table: a 64-bit balance word, a version and a lock word,
+ *      so a TRANS touches a single cache line per account. The lock word is a
+ *      futex lock: bit ACC_LOCKED is the lock, ACC_WAITERS tells the holder
+ *      someone sleeps on the word, and ACC_DIRTY is the write-back dirty flag.
+ *      With --lock-stripes the lock bits live in a small array of cache line
+ *      sized stripes instead, shared by every account mapping to the stripe.
+ *      Accounts are materialized lazily. The table is mapped anonymously, so
+ *      every untouched entry reads as a zero balance with a free lock, and a
+ *      page only becomes resident when one of its accounts is first written.
+ *      Bank.c is only ever reached through Bank.h: initialize_accounts and
+ *      free_accounts manage its storage. initialize_accounts mallocs and
+ *      zeroes an int per account, and Bank.c may not change, so startup time
+ *      and RSS still grow as O(n) with the account count, 4 bytes resident
+ *      per account (0.45 s and 384 MB at 100M accounts). Only this layer's
+ *      own state is lazy, so it adds nothing per account until first use.
+ *      With --hugepages the table is advised into huge pages: fewer TLB misses
+ *      once it is resident, but each first touch then materializes 2 MB of
+ *      accounts.
+ *
+ *      A deposit can never cause ISF, so it does not need to read the balance
+ *      first and is applied without taking the account lock.
+ *
+ *      CACHE_NONE: Bank.c holds the balances. account_deposit adds the amount
+ *      atomically to the account's balance word, which holds the pending
+ *      deposits. The real balance is the backend value plus the pending
+ *      deposits, and readers holding the account lock see both. When a locked
+ *      writer stores a new balance, it also removes the pending deposits it
+ *      already counted, so deposits that arrive in between are kept. An
+ *      account that only ever receives deposits is never written that way, so
+ *      accounts_free folds whatever is still pending into Bank.c before the
+ *      backend is released.
+ *      account_check reads without the lock under the version (seqlock): a
+ *      writer makes it odd before touching the pending deposits and even once
+ *      Bank.c holds the new balance, and a reader that saw it change retries.
+ *
+ *      CACHE_WRITETHROUGH / CACHE_WRITEBACK: the authoritative balances live in
+ *      the balance word. Bank.c starts every account at 0 and only this server
+ *      writes to it, so the cache starts out coherent without reading anything.
+ *      Reads never touch Bank.c. A locked writer adds the difference between
+ *      its new balance and the one it read, again so concurrent deposits are
+ *      kept. Write-through copies every change to Bank.c before
+ *      returning. Write-back marks the account dirty, and a flusher thread
+ *      copies dirty balances to Bank.c in batches. accounts_free drains every
+ *      dirty account before the backend is released. Every change to the cache
+ *      is a single atomic update, so account_check is one atomic load. Bank.c
+ *      only stores int, so its copy of a balance outside that range is cut to
+ *      the nearest int. Under CACHE_NONE the part that does not fit stays
+ *      pending instead, so the balance itself is never cut while running.
+ *
+ *      A locked writer makes the version odd while it changes the balance and
+ *      even again once it is done. Deposits do not change it: they only ever
+ *      add, so they cannot turn a sufficient balance into ISF. An optimistic
+ *      TRANS (--exec=occ) reads balances and versions without locks, then
+ *      takes the locks of its debited accounts only to check that no version
+ *      moved before writing.
+ *
+ *      A shard of a sharded deployment can also hold funds for the router:
+ *      the debits of a prepared TRANS spanning shards stay in the balance but
+ *      are counted in a separate hold table, lazily mapped like the account
+ *      table, and every TRANS must leave the balance at least its held funds.
+ *      Changing a hold bumps the version like a locked write, so optimistic
+ *      readers see holds through the same validation.
+ *
+ *      Every Bank.c call sleeps, so when several are needed at once (the
+ *      accounts of one TRANS, a flusher batch) they go through io_run and
+ *      overlap instead of adding up.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "Futex.h"
+#include "Bank.h"
+#include "IO_Pool.h"
+#include "Accounts.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define IO_STRIPES 1024             // locks ordering write-through copies to Bank.c
+#define CHECK_RETRIES 3             // CACHE_NONE: lock-free CHECK attempts before falling back to the account lock
+#define STRIPE_SIZE 64              // bytes per lock stripe, one cache line
+#define HUGE_PAGE_SIZE (2 << 20)    // the table is mapped in multiples of this
+#define DRAIN_BATCH 4096            // CACHE_NONE: pending deposits folded into Bank.c per io_run at shutdown
+
+// Bits of a lock word
+#define ACC_LOCKED 1u               // the lock is held
+#define ACC_WAITERS 2u              // a thread may be asleep on the word
+#define ACC_DIRTY 4u                // CACHE_WRITEBACK: the account is on the dirty list (table entries only)
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct account {                    // One account table entry, four share a cache line and none straddles two
+    _Atomic int64_t balance;        // cached policies: the balance, CACHE_NONE: deposits not yet in Bank.c
+    _Atomic uint32_t version;       // odd while a locked writer is changing the account
+    _Atomic uint32_t word;          // ACC_LOCKED, ACC_WAITERS and ACC_DIRTY
+};
+
+struct lock_stripe {                // Lock word shared by the accounts of one stripe
+    _Alignas(STRIPE_SIZE) _Atomic uint32_t word;   // ACC_LOCKED and ACC_WAITERS
+};
+
+struct flusher {                // Background writer of dirty balances (CACHE_WRITEBACK)
+    pthread_t tid;              // flusher thread
+    pthread_mutex_t mut;        // guards the dirty list and stopping
+    pthread_cond_t cv;          // signaled when a batch is ready or on shutdown
+    int * dirty_ids;            // accounts waiting to be flushed, each listed at most once
+    int * flushing_ids;         // list being flushed, swapped with dirty_ids
+    struct io_op * ops;         // backend writes of one flush
+    int num_dirty;              // number of IDs in dirty_ids
+    int stopping;               // set by accounts_free
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static int numAccs;                             // number of accounts
+static int cachePolicy;                         // CACHE_NONE, CACHE_WRITETHROUGH or CACHE_WRITEBACK
+static int flushBatch;                          // dirty accounts that wake the flusher early
+static int flushInterval;                       // most milliseconds a change waits before being flushed
+static struct account * table = NULL;           // one entry per account, indexed by account ID - 1
+static size_t tableBytes = 0;                   // size of the table mapping
+static _Atomic int64_t * holds = NULL;          // funds held for prepared TRANS, indexed by account ID - 1
+static struct lock_stripe * stripes = NULL;     // --lock-stripes: lock words, NULL if every account has its own
+static int numStripes = 0;                      // number of stripes
+static pthread_mutex_t io_mut[IO_STRIPES];      // CACHE_WRITETHROUGH: one backend copy of an account at a time
+static struct flusher flush;                    // CACHE_WRITEBACK: background flusher
+static __thread void (*lockYield)(void) = NULL; // suspends the running coroutine while a lock is taken
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static _Atomic uint32_t * lock_word(int id);
+static void word_lock(_Atomic uint32_t * word);
+static void word_unlock(_Atomic uint32_t * word);
+static int collect_words(const int * ids, int n, _Atomic uint32_t ** words);
+static void write_cached(int id, int64_t value, int64_t seen);
+static void read_op(struct io_op * op);
+static void write_op(struct io_op * op);
+static void write_through_op(struct io_op * op);
+static void flush_op(struct io_op * op);
+static void drain_op(struct io_op * op);
+static void drain_pending();
+static int bank_value(int64_t balance);
+static void write_through(int id);
+static void write_through_one(int id);
+static void mark_dirty(int id);
+static uint32_t settled_version(int id);
+static void* flusher_loop(void * arg);
+static void* map_zeroed(size_t bytes);
+/*===============================================================*/
+
+/**
+ * Intializes n bank accounts in the backend, the account table and, depending on the policy, the balance cache's
+ * flusher.
+ *
+ * @param n                 - Number of bank accounts
+ * @param policy            - CACHE_NONE, CACHE_WRITETHROUGH or CACHE_WRITEBACK
+ * @param flush_batch       - CACHE_WRITEBACK: dirty accounts that wake the flusher early
+ * @param flush_interval_ms - CACHE_WRITEBACK: most milliseconds a change waits before being flushed
+ * @param lock_stripes      - number of lock words shared by all accounts, 0 gives every account its own
+ * @param hugepages         - 1 to back the table with huge pages where the kernel allows it
+ * @return int - 1 if succeeded, 0 if error
+ */
+int accounts_init(int n, int policy, int flush_batch, int flush_interval_ms, int lock_stripes, int hugepages) {
+    if (!initialize_accounts(n)) {
+        return 0;
+    }
+    numAccs = n;
+    cachePolicy = policy;
+    flushBatch = flush_batch;
+    flushInterval = flush_interval_ms;
+
+    // Every balance and version at 0, every lock free, nothing to initialize
+    tableBytes = ((size_t)n * sizeof(struct account) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    table = map_zeroed(tableBytes);
+    if (table == NULL) {
+        return 0;
+    }
+    // Only a shard ever holds funds, untouched it never becomes resident
+    holds = map_zeroed(sizeof(int64_t) * (size_t)n);
+    if (holds == NULL) {
+        return 0;
+    }
+    if (hugepages) {
+        // Only advice, the table works the same without huge pages
+        madvise(table, tableBytes, MADV_HUGEPAGE);
+    }
+
+    if (lock_stripes > 0) {
+        stripes = aligned_alloc(STRIPE_SIZE, sizeof(struct lock_stripe) * lock_stripes);
+        if (stripes == NULL) {
+            return 0;
+        }
+        memset(stripes, 0, sizeof(struct lock_stripe) * lock_stripes);
+        numStripes = lock_stripes;
+    }
+
+    if (policy == CACHE_NONE) {
+        return 1;
+    }
+    int i;
+    if (policy == CACHE_WRITETHROUGH) {
+        for (i = 0; i < IO_STRIPES; i++) {
+            pthread_mutex_init(&io_mut[i], NULL);
+        }
+        return 1;
+    }
+
+    // Sized for every account being dirty at once, but only the part ever used becomes resident
+    flush.dirty_ids = map_zeroed(sizeof(int) * (size_t)n);
+    flush.flushing_ids = map_zeroed(sizeof(int) * (size_t)n);
+    flush.ops = map_zeroed(sizeof(struct io_op) * (size_t)n);
+    if (flush.dirty_ids == NULL || flush.flushing_ids == NULL || flush.ops == NULL) {
+        return 0;
+    }
+    flush.num_dirty = 0;
+    flush.stopping = 0;
+    pthread_mutex_init(&flush.mut, NULL);
+    pthread_cond_init(&flush.cv, NULL);
+    return pthread_create(&flush.tid, NULL, flusher_loop, NULL) == 0;
+}
+
+/**
+ * Deallocates the accounts. Under CACHE_WRITEBACK every dirty balance is flushed to Bank.c first, under CACHE_NONE
+ * every pending deposit. No other thread may be using the accounts anymore.
+ */
+void accounts_free() {
+    if (cachePolicy == CACHE_NONE && table != NULL) {
+        drain_pending();
+    }
+    if (cachePolicy == CACHE_WRITEBACK) {
+        // Drain: the flusher writes out everything still dirty before it exits
+        pthread_mutex_lock(&flush.mut);
+        flush.stopping = 1;
+        pthread_cond_signal(&flush.cv);
+        pthread_mutex_unlock(&flush.mut);
+        pthread_join(flush.tid, NULL);
+        munmap(flush.dirty_ids, sizeof(int) * (size_t)numAccs);
+        munmap(flush.flushing_ids, sizeof(int) * (size_t)numAccs);
+        munmap(flush.ops, sizeof(struct io_op) * (size_t)numAccs);
+    }
+    if (table != NULL) {
+        munmap(table, tableBytes);
+        table = NULL;
+    }
+    if (holds != NULL) {
+        munmap(holds, sizeof(int64_t) * (size_t)numAccs);
+        holds = NULL;
+    }
+    free(stripes);
+    stripes = NULL;
+    free_accounts();
+}
+
+/**
+ * Acquires the lock of an account. Needed around account_read. A TRANS locking several accounts must use
+ * account_lock_many.
+ *
+ * @param id - Account ID
+ */
+void account_lock(int id) {
+    word_lock(lock_word(id));
+}
+
+/**
+ * Relinquishes the lock of an account.
+ *
+ * @param id - Account ID
+ */
+void account_unlock(int id) {
+    word_unlock(lock_word(id));
+}
+
+/**
+ * Acquires the locks of several accounts, each lock word once and in address order, so callers never deadlock each
+ * other even when accounts share a stripe.
+ *
+ * @param ids - Account IDs, in any order, each at most once
+ * @param n   - number of accounts
+ */
+void account_lock_many(const int * ids, int n) {
+    _Atomic uint32_t * words[n];
+    int num = collect_words(ids, n, words);
+    int i;
+    for (i = 0; i < num; i++) {
+        word_lock(words[i]);
+    }
+}
+
+/**
+ * Relinquishes the locks taken by account_lock_many.
+ *
+ * @param ids - the Account IDs given to account_lock_many
+ * @param n   - number of accounts
+ */
+void account_unlock_many(const int * ids, int n) {
+    _Atomic uint32_t * words[n];
+    int num = collect_words(ids, n, words);
+    int i;
+    for (i = 0; i < num; i++) {
+        word_unlock(words[i]);
+    }
+}
+
+/**
+ * Makes account_lock on the calling thread yield instead of blocking. Used by coroutine schedulers.
+ *
+ * @param yield - suspends the running coroutine for a while, NULL restores blocking locks
+ */
+void accounts_set_yield(void (*yield)(void)) {
+    lockYield = yield;
+}
+
+/**
+ * Reads the balance of an account, including deposits not yet stored in the backend. Caller holds the account lock.
+ *
+ * @param id - Account ID
+ * @return int64_t - current balance
+ */
+int64_t account_read(int id) {
+    struct account_view view;
+    view.id = id;
+    account_read_many(&view, 1);
+    return view.balance;
+}
+
+/**
+ * Reads the balance of an account without its lock, for CHECK. The result is a balance the account had between
+ * two TRANS in some serial order: never one with a debit half applied.
+ *
+ * @param id - Account ID
+ * @return int64_t - current balance
+ */
+int64_t account_check(int id) {
+    struct account * a = &table[id - 1];
+    if (cachePolicy != CACHE_NONE) {
+        return atomic_load(&a->balance);
+    }
+    int attempt;
+    for (attempt = 0; attempt < CHECK_RETRIES; attempt++) {
+        uint32_t before = atomic_load(&a->version);
+        if (before & 1) {
+            // A writer is busy, wait for it rather than read a balance about to change
+            if (lockYield != NULL) {
+                lockYield();
+            } else {
+                futex_wait(&a->version, before);
+            }
+            continue;
+        }
+        struct io_op op;
+        op.run = read_op;
+        op.id = id;
+        io_run(&op, 1);
+        int64_t balance = op.value + atomic_load(&a->balance);
+        if (atomic_load(&a->version) == before) {
+            return balance;
+        }
+    }
+    // Writers keep getting in the way, exclude them
+    account_lock(id);
+    int64_t balance = account_read(id);
+    account_unlock(id);
+    return balance;
+}
+
+/**
+ * Adds a non-negative amount to an account without taking its lock.
+ *
+ * @param id     - Account ID
+ * @param amount - amount to deposit
+ */
+void account_deposit(int id, int amount) {
+    atomic_fetch_add(&table[id - 1].balance, amount);
+    if (cachePolicy == CACHE_WRITETHROUGH) {
+        write_through_one(id);
+    } else if (cachePolicy == CACHE_WRITEBACK) {
+        mark_dirty(id);
+    }
+}
+
+/**
+ * Reads the balances of several accounts at once, issuing the backend reads in parallel. Caller holds every
+ * account's lock, and each account appears at most once.
+ *
+ * @param views - Account IDs to read, receive the balance of each account and what a write must build on
+ * @param n     - number of accounts
+ */
+void account_read_many(struct account_view * views, int n) {
+    int i;
+    if (cachePolicy != CACHE_NONE) {
+        for (i = 0; i < n; i++) {
+            views[i].seen = atomic_load(&table[views[i].id - 1].balance);
+            views[i].balance = views[i].seen;
+            views[i].held = atomic_load(&holds[views[i].id - 1]);
+        }
+        return;
+    }
+    struct io_op ops[n];
+    for (i = 0; i < n; i++) {
+        ops[i].run = read_op;
+        ops[i].id = views[i].id;
+    }
+    io_run(ops, n);
+    for (i = 0; i < n; i++) {
+        // Remember how much of the pending deposits this balance accounts for
+        views[i].seen = atomic_load(&table[views[i].id - 1].balance);
+        views[i].balance = ops[i].value + views[i].seen;
+        views[i].held = atomic_load(&holds[views[i].id - 1]);
+    }
+}
+
+/**
+ * Applies several writes and deposits at once, issuing the backend writes in parallel. Caller holds the lock of every
+ * account written (deposits need none), and each written account appears at most once.
+ *
+ * @param updates - changes to make
+ * @param n       - number of changes
+ */
+void account_update_many(const struct account_update * updates, int n) {
+    int i;
+    if (cachePolicy == CACHE_WRITEBACK) {
+        for (i = 0; i < n; i++) {
+            if (updates[i].deposit) {
+                account_deposit(updates[i].id, updates[i].value);
+            } else {
+                write_cached(updates[i].id, updates[i].value, updates[i].seen);
+                mark_dirty(updates[i].id);
+            }
+        }
+        return;
+    }
+
+    struct io_op ops[n];
+    int num = 0;
+    for (i = 0; i < n; i++) {
+        int id = updates[i].id;
+        struct account * a = &table[id - 1];
+        if (cachePolicy == CACHE_NONE) {
+            if (updates[i].deposit) {
+                // Stays pending, no backend call
+                atomic_fetch_add(&a->balance, updates[i].value);
+                continue;
+            }
+            // Lock-free readers retry from here until the backend holds the new balance
+            atomic_fetch_add(&a->version, 1);
+            // value already includes the deposits seen by the read, anything that arrived since stays pending,
+            // and so does whatever of it Bank.c cannot hold
+            ops[num].value = bank_value(updates[i].value);
+            atomic_fetch_add(&a->balance, updates[i].value - ops[num].value - updates[i].seen);
+            ops[num].run = write_op;
+        } else {
+            if (updates[i].deposit) {
+                atomic_fetch_add(&a->balance, updates[i].value);
+            } else {
+                write_cached(id, updates[i].value, updates[i].seen);
+            }
+            ops[num].run = write_through_op;
+        }
+        ops[num++].id = id;
+    }
+    io_run(ops, num);
+    if (cachePolicy == CACHE_NONE) {
+        for (i = 0; i < num; i++) {
+            atomic_fetch_add(&table[ops[i].id - 1].version, 1);
+            futex_wake(&table[ops[i].id - 1].version, INT_MAX);
+        }
+    }
+}
+
+/**
+ * Reads several accounts without their locks, for an optimistic TRANS. A balance is only known to be current while
+ * its version is: check with account_unchanged, under the locks before writing.
+ *
+ * @param views - Account IDs to read, receive the balance and version of each account
+ * @param n     - number of accounts
+ */
+void account_read_optimistic(struct account_view * views, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        // Taken before the balance, so a write that lands in between is caught by validation
+        views[i].version = settled_version(views[i].id);
+    }
+    account_read_many(views, n);
+}
+
+/**
+ * Tells whether any locked writer changed the accounts since they were read by account_read_optimistic. Deposits do
+ * not count, they can only make a balance larger. Called under the account locks, a 1 means the views may be used
+ * to write the accounts.
+ *
+ * @param views - accounts as read by account_read_optimistic
+ * @param n     - number of accounts
+ * @return int - 1 if every version is the one read, 0 if the read must be redone
+ */
+int account_unchanged(const struct account_view * views, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (atomic_load(&table[views[i].id - 1].version) != views[i].version) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Changes the funds held on an account for prepared TRANS, without touching its balance. Caller holds the account
+ * lock (or otherwise owns the account).
+ *
+ * @param id     - Account ID
+ * @param amount - amount to add to the held funds, negative to release them
+ */
+void account_hold(int id, int64_t amount) {
+    struct account * a = &table[id - 1];
+    atomic_fetch_add(&a->version, 1);
+    atomic_fetch_add(&holds[id - 1], amount);
+    atomic_fetch_add(&a->version, 1);
+    if (cachePolicy == CACHE_NONE) {
+        futex_wake(&a->version, INT_MAX);
+    }
+}
+
+/**
+ * Adds an amount of either sign to an account while the balances are being recovered, before any request runs.
+ * Bank.c is not told: the cached policies never read it, and under CACHE_NONE the amount waits with the pending
+ * deposits until the account is next written.
+ *
+ * @param id     - Account ID
+ * @param amount - amount to add
+ */
+void account_restore(int id, int64_t amount) {
+    atomic_fetch_add(&table[id - 1].balance, amount);
+}
+
+/**
+ * @param id - Account ID
+ * @return _Atomic uint32_t* - the word holding the account's lock
+ */
+static _Atomic uint32_t * lock_word(int id) {
+    if (stripes != NULL) {
+        return &stripes[(id - 1) % numStripes].word;
+    }
+    return &table[id - 1].word;
+}
+
+/**
+ * Acquires a lock word. Other bits of the word are left alone.
+ *
+ * @param word - lock word
+ */
+static void word_lock(_Atomic uint32_t * word) {
+    uint32_t old = atomic_fetch_or(word, ACC_LOCKED);
+    if (!(old & ACC_LOCKED)) {
+        return;
+    }
+    if (lockYield != NULL) {
+        // A coroutine must not block its thread, let the others run until the lock is free
+        while (atomic_fetch_or(word, ACC_LOCKED) & ACC_LOCKED) {
+            lockYield();
+        }
+        return;
+    }
+    // Announce a sleeper so the holder wakes us. Whoever takes the lock from here keeps the flag, since there may be
+    // other sleepers left
+    while ((old = atomic_fetch_or(word, ACC_LOCKED | ACC_WAITERS)) & ACC_LOCKED) {
+        futex_wait(word, old | ACC_LOCKED | ACC_WAITERS);
+    }
+}
+
+/**
+ * Relinquishes a lock word, waking one sleeper if there may be any.
+ *
+ * @param word - lock word held by the caller
+ */
+static void word_unlock(_Atomic uint32_t * word) {
+    if (atomic_fetch_and(word, ~(ACC_LOCKED | ACC_WAITERS)) & ACC_WAITERS) {
+        futex_wake(word, 1);
+    }
+}
+
+/**
+ * Finds the distinct lock words of several accounts, sorted by address.
+ *
+ * @param ids   - Account IDs
+ * @param n     - number of accounts
+ * @param words - receives the lock words
+ * @return int - number of distinct lock words
+ */
+static int collect_words(const int * ids, int n, _Atomic uint32_t ** words) {
+    int num = 0;
+    int i, j;
+    for (i = 0; i < n; i++) {
+        _Atomic uint32_t * word = lock_word(ids[i]);
+        // Insertion sort, a TRANS has few accounts
+        for (j = num; j > 0 && words[j - 1] > word; j--) {
+            words[j] = words[j - 1];
+        }
+        if (j > 0 && words[j - 1] == word) {
+            // Shared stripe, already listed: undo the shift
+            for (; j < num; j++) {
+                words[j] = words[j + 1];
+            }
+            continue;
+        }
+        words[j] = word;
+        num++;
+    }
+    return num;
+}
+
+/**
+ * Stores a new balance in the cache as the difference from the one it was computed from, so lock-free deposits made
+ * since the read are kept. Caller holds the account lock.
+ *
+ * @param id    - Account ID
+ * @param value - new balance
+ * @param seen  - cached balance it was computed from
+ */
+static void write_cached(int id, int64_t value, int64_t seen) {
+    struct account * a = &table[id - 1];
+    atomic_fetch_add(&a->version, 1);
+    atomic_fetch_add(&a->balance, value - seen);
+    atomic_fetch_add(&a->version, 1);
+}
+
+/**
+ * Backend read of op->id into op->value.
+ */
+static void read_op(struct io_op * op) {
+    op->value = read_account(op->id);
+}
+
+/**
+ * Backend write of op->value to op->id.
+ */
+static void write_op(struct io_op * op) {
+    write_account(op->id, op->value);
+}
+
+/**
+ * Backend copy of the cached balance of op->id, see write_through.
+ */
+static void write_through_op(struct io_op * op) {
+    write_through(op->id);
+}
+
+/**
+ * Backend copy of the cached balance of op->id for the flusher. An account is listed once per flush and flushes run
+ * one after the other, so no lock is needed.
+ */
+static void flush_op(struct io_op * op) {
+    write_account(op->id, bank_value(atomic_load(&table[op->id - 1].balance)));
+}
+
+/**
+ * Folds the pending deposits of op->id into its Bank.c balance at shutdown, see drain_pending.
+ */
+static void drain_op(struct io_op * op) {
+    struct account * a = &table[op->id - 1];
+    int64_t balance = read_account(op->id) + atomic_load(&a->balance);
+    op->value = bank_value(balance);
+    write_account(op->id, op->value);
+    atomic_store(&a->balance, balance - op->value);
+}
+
+/**
+ * CACHE_NONE: writes every account with pending deposits to Bank.c, DRAIN_BATCH accounts at a time. Only accounts
+ * that received a deposit since their last write have any, so for most accounts this is one load.
+ */
+static void drain_pending() {
+    struct io_op * ops = malloc(sizeof(struct io_op) * DRAIN_BATCH);
+    if (ops == NULL) {
+        // Still correct, just one account at a time
+        struct io_op op;
+        int id;
+        op.run = drain_op;
+        for (id = 1; id <= numAccs; id++) {
+            if (atomic_load(&table[id - 1].balance) != 0) {
+                op.id = id;
+                io_run(&op, 1);
+            }
+        }
+        return;
+    }
+    int id, num = 0;
+    for (id = 1; id <= numAccs; id++) {
+        if (atomic_load(&table[id - 1].balance) == 0) {
+            continue;
+        }
+        ops[num].run = drain_op;
+        ops[num++].id = id;
+        if (num == DRAIN_BATCH) {
+            io_run(ops, num);
+            num = 0;
+        }
+    }
+    io_run(ops, num);
+    free(ops);
+}
+
+/**
+ * @param balance - balance of an account
+ * @return int - the balance Bank.c stores for it, cut to the range of an int
+ */
+static int bank_value(int64_t balance) {
+    return balance > INT_MAX ? INT_MAX : (balance < INT_MIN ? INT_MIN : (int)balance);
+}
+
+/**
+ * Copies the cached balance of an account to Bank.c. The stripe lock is a leaf lock (nothing is acquired while
+ * holding it), and the balance is loaded under it, so the last copy to finish always carries the newest balance.
+ *
+ * @param id - Account ID
+ */
+static void write_through(int id) {
+    pthread_mutex_t * m = &io_mut[(id - 1) % IO_STRIPES];
+    pthread_mutex_lock(m);
+    write_account(id, bank_value(atomic_load(&table[id - 1].balance)));
+    pthread_mutex_unlock(m);
+}
+
+/**
+ * Copies the cached balance of one account to Bank.c through the helpers, so a coroutine is suspended rather than its
+ * thread.
+ *
+ * @param id - Account ID
+ */
+static void write_through_one(int id) {
+    struct io_op op;
+    op.run = write_through_op;
+    op.id = id;
+    io_run(&op, 1);
+}
+
+/**
+ * Puts an account on the flusher's dirty list unless it is already there.
+ *
+ * @param id - Account ID
+ */
+static void mark_dirty(int id) {
+    if (atomic_fetch_or(&table[id - 1].word, ACC_DIRTY) & ACC_DIRTY) {
+        // Already listed, the flusher reads the balance after clearing the flag so it will see this change
+        return;
+    }
+    pthread_mutex_lock(&flush.mut);
+    flush.dirty_ids[flush.num_dirty++] = id;
+    if (flush.num_dirty == flushBatch) {
+        pthread_cond_signal(&flush.cv);
+    }
+    pthread_mutex_unlock(&flush.mut);
+}
+
+/**
+ * Waits until no locked writer is changing an account.
+ *
+ * @param id - Account ID
+ * @return uint32_t - the account's version, even
+ */
+static uint32_t settled_version(int id) {
+    _Atomic uint32_t * version = &table[id - 1].version;
+    uint32_t v;
+    while ((v = atomic_load(version)) & 1) {
+        if (lockYield != NULL) {
+            lockYield();
+        } else if (cachePolicy == CACHE_NONE) {
+            // Held odd across a Bank.c write, the writer wakes us
+            futex_wait(version, v);
+        } else {
+            // Held odd for a single atomic update
+            sched_yield();
+        }
+    }
+    return v;
+}
+
+/**
+ * Flusher thread. Wakes when flushBatch accounts are dirty or flushInterval milliseconds have passed, and copies
+ * every dirty balance to Bank.c. On shutdown it keeps going until the dirty list is empty.
+ */
+static void* flusher_loop(void * arg) {
+    for (;;) {
+        pthread_mutex_lock(&flush.mut);
+        if (!flush.stopping && flush.num_dirty < flushBatch) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += flushInterval / 1000;
+            deadline.tv_nsec += (long)(flushInterval % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            while (!flush.stopping && flush.num_dirty < flushBatch) {
+                if (pthread_cond_timedwait(&flush.cv, &flush.mut, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+        // Take the whole list so workers can keep marking accounts meanwhile
+        int * ids = flush.dirty_ids;
+        int num = flush.num_dirty;
+        int stopping = flush.stopping;
+        flush.dirty_ids = flush.flushing_ids;
+        flush.flushing_ids = ids;
+        flush.num_dirty = 0;
+        pthread_mutex_unlock(&flush.mut);
+
+        if (num == 0 && stopping) {
+            return NULL;
+        }
+        int i;
+        for (i = 0; i < num; i++) {
+            // Clear first: a change made after flush_op loads the balance re-lists the account
+            atomic_fetch_and(&table[ids[i] - 1].word, ~ACC_DIRTY);
+            flush.ops[i].run = flush_op;
+            flush.ops[i].id = ids[i];
+        }
+        io_run(flush.ops, num);
+    }
+}
+
+/**
+ * Maps anonymous memory whose pages read as zero and only become resident once written. Nothing is reserved up front,
+ * so a table for many more accounts than ever get used costs only address space.
+ *
+ * @param bytes - size of the mapping
+ * @return void* - the mapping, NULL if error
+ */
+static void* map_zeroed(size_t bytes) {
+    void * p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
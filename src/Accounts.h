@@ -0,0 +1,71 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Accounts.h declares the server's view of the bank accounts. It wraps
+ *      the fixed Bank.c backend together with the account table, which keeps
+ *      each account's 64-bit balance, version and lock word in 16 bytes. It
+ *      lets deposits be applied without taking any lock, and can keep the
+ *      authoritative balances in memory in front of Bank.c.
+ *      The _many calls issue their Bank.c calls in parallel. Every locked write
+ *      bumps the account's version, so a TRANS may also read without locks and
+ *      only lock to validate and commit (--exec=occ).
+*/
+#ifndef ACCOUNTS_H
+#define ACCOUNTS_H
+
+#include <stdint.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+// Cache policies selected with --cache
+#define CACHE_NONE 0            // reads and debits go to Bank.c, deposits wait in memory until the next debit or shutdown
+#define CACHE_WRITETHROUGH 1    // reads come from memory, every change is written to Bank.c before returning
+#define CACHE_WRITEBACK 2       // reads come from memory, changes are flushed to Bank.c in the background
+
+#define FLUSH_BATCH_DEFAULT 64          // dirty accounts that wake the flusher early
+#define FLUSH_INTERVAL_DEFAULT 100      // most milliseconds a change waits before being flushed
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct account_update {         // One change made by account_update_many
+    int id;                     // Account ID
+    int deposit;                // 1 if value is a non-negative amount to add (lock-free)
+    int64_t value;              // new balance, or the amount added for a deposit
+    int64_t seen;               // new balance: seen of the account_view it was computed from
+};
+
+struct account_view {           // One account as read by account_read_many or account_read_optimistic
+    int id;                     // Account ID, filled in by the caller
+    uint32_t version;           // account_read_optimistic: version the balance belongs to
+    int64_t balance;            // balance including deposits
+    int64_t seen;               // pending deposits or cached balance the read saw
+    int64_t held;               // funds held for prepared TRANS, not there to spend
+};
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int accounts_init(int n, int policy, int flush_batch, int flush_interval_ms, int lock_stripes, int hugepages);
+void accounts_free();
+void account_lock(int id);
+void account_unlock(int id);
+void account_lock_many(const int * ids, int n);
+void account_unlock_many(const int * ids, int n);
+int64_t account_read(int id);
+int64_t account_check(int id);
+void account_deposit(int id, int amount);
+void account_read_many(struct account_view * views, int n);
+void account_update_many(const struct account_update * updates, int n);
+void account_read_optimistic(struct account_view * views, int n);
+int account_unchanged(const struct account_view * views, int n);
+void account_hold(int id, int64_t amount);
+void account_restore(int id, int64_t amount);
+void accounts_set_yield(void (*yield)(void));
+/*===============================================================*/
+
+#endif
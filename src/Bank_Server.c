@@ -13,70 +13,133 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <pthread.h>
-#include "Bank.h"
+#include <stdatomic.h>
+#include "Accounts.h"
+#include "IO_Pool.h"
+#include "Request_Queue.h"
+#include "Request_Pool.h"
+#include "Server.h"
+#include "Net_Server.h"
+#include "Partition_Exec.h"
+#include "Batch_Exec.h"
+#include "Fiber_Exec.h"
+#include "Stats.h"
+#include "Result_Writer.h"
+#include "Commit_Log.h"
+#include "Snapshot.h"
+#include "Replication.h"
 
 /*================================================================
  *                         CONSTANTS                             *
 =================================================================*/
-#define STR_MAX_SIZE 256
+#define QUEUE_CAPACITY 4096     // number of jobs the request queue can hold before the input thread waits
+#define INPUT_BUF_SIZE 65536    // bytes read from stdin at a time
+#define OCC_CONFLICT -2         // transaction_optimistic: a debited account was written first, nothing was done
 /*===============================================================*/
 
 /*================================================================
  *                         STRUCTURES                            *
 =================================================================*/
-struct trans {      // Structure for a transaction pair
-    int acc_id;     // Account ID
-    int amount;     // amount to be added, could be positive or negative
+struct prepared {                   // One shard's part of a TRANS spanning shards, its debits held until COMMIT or ABORT
+    int client;                     // connection of the router that sent the PREPARE
+    struct parsed_request req;      // the PREPARE, with the router's transaction ID and the part's pairs
+    struct prepared * next;         // next part in the list
 };
 
-struct request {                        // Structure for a request object    
-    struct request * next;              // pointer to the next request in the list
-    int request_id;                     // request ID assigned by the main thread
-    int check_acc_id;                   // account ID for a CHECK request
-    struct trans * transactions;        // array of transaction data
-    int num_trans;                      // number of accounts in this transaction
-    struct timeval starttime, endtime;  // starttime and endtime for TIME
-};
-
-struct queue {                      // Structure for a queue 
-    struct request * head, * tail;  // head and tail of the list
-    int num_jobs;                   // number of jobs currently in queue
+struct preparer {                   // A client that sent PREPARE, normally the router of a sharded deployment
+    int client;                     // its connection
+    int closed;                     // it went away, its parts are aborted and nothing more is held for it
+    struct preparer * next;         // next client in the list
 };
 /*===============================================================*/
 
 /*================================================================
  *                      GLOBAL VARIABLES                         *
 =================================================================*/
-pthread_mutex_t q_mut;          // q_mut: mutex for accessing queue  
-pthread_mutex_t * acc_mut;      // acc_mut: points to an array mutexs associated with every account
-pthread_cond_t jobs_cv;         
-struct queue Q;                 // Global Queue containing the requests
-int clockOut = 0;               // Signifies to the workers that it is time to clock out
+struct request_queue Q;         // Global Queue containing the requests
 FILE *fp;                       // Pointer to output file
 int numWorkersRemaining;        // Variable containing number of worker threads in action
 int numAccounts;                // Number of accounts
 int numWThreads;                // Number of threads at startup
-int q_Occupied;                 // Holds the status of whether or not the queue is occupied
+struct server_config config;    // Startup options
+atomic_int requestCount = 1;    // Next request ID, shared by every input source
+static struct prepared * prepared = NULL;   // parts held for a router, waiting for its COMMIT or ABORT
+static struct preparer * preparers = NULL;  // clients that sent PREPARE
+static pthread_mutex_t preparedMut = PTHREAD_MUTEX_INITIALIZER;    // guards prepared and preparers
 /*===============================================================*/
 
 /*================================================================
  *                    FUNCTION DECLARATIONS                      *
  ================================================================*/
+int parse_options(int argc, char *argv[]);
 void* program_loop(void * arg);
 void* worker(void * arg);
+void finish_trans(struct request * job, int insufAccID);
+void finish_check(struct request * job, int64_t balance);
+void write_result(int id, const char * line, int len);
+void emit_result(int id, const char * line, int len);
 int transaction_operation(struct request * job);
-void add_request(struct request * r);
+int transaction_optimistic(struct request * job);
+int add_request(struct request * r);
 struct request * get_request();
-void sortIDLeastToGreatest(struct trans * transactions, int num_trans);
+static int locked_transaction(struct request * job);
+static int step_operation(struct request * job);
+static void note_preparer(int client);
+static int hold_prepared(struct request * job);
+static int take_prepared(int client, int txid, struct parsed_request * out);
+static void commit_updates(struct request * job, const struct account_update * updates, int n);
+static void stamp(uint64_t * at);
 /*===============================================================*/
 
 /**
  * Main function of the server that handles server startup and initialization as well as a few exit protocols. 
  * 
  * Syntax to the launch the server program:
- *      $ appserver <# of worker threads> <# of accounts> <output file>;
+ *      $ appserver <# of worker threads> <# of accounts> <output file> [options]
+ * 
+ * Options:
+ *      --tcp=PORT          also accept clients on 127.0.0.1:PORT
+ *      --unix=PATH         also accept clients on a Unix domain socket at PATH
+ *      --net-threads=N     number of epoll loops serving clients (default 1)
+ *      --stdin=0           do not read requests from the terminal
+ *      --exec=MODE         lock (default): workers share every account through per-account mutexes
+ *                          partition: accounts are split between workers, each runs its own accounts lock-free
+ *                          occ: a TRANS reads without locks, then locks only to validate and write
+ *                          batch: requests run in waves sharing no account, with the results of a serial run in ID order
+ *      --cache=POLICY      writeback (default): balances are kept in memory and flushed to the bank in batches
+ *                          writethrough: balances are kept in memory, every change is written to the bank at once
+ *                          none: reads and debits go to the bank, deposits reach it with the next debit or at shutdown
+ *      --flush-batch=N     writeback: dirty accounts that trigger a flush (default 64)
+ *      --flush-interval=MS writeback: longest a change waits before being flushed (default 100)
+ *      --io-threads=N      helpers issuing one request's storage calls in parallel (default workers * 9, 0 = off)
+ *      --fibers=N          each worker thread runs N coroutines, one request each (lock and occ modes, default 0 = off)
+ *      --stats=0           do not time the stages of each request, STATS then only reports queue depth and throughput
+ *      --writer=0          workers print results to the output file themselves instead of through the writer thread
+ *      --writer-interval=MS longest a result waits in its worker's buffer (default 10)
+ *      --writer-batch=N    buffered bytes of one worker that make the writer flush early (default 65536)
+ *      --ordered=1         the writer puts results in request ID order
+ *      --order-window=N    starting size of the ordered-mode reorder window, it grows as needed (default 4096)
+ *      --check=MODE        lockfree (default): CHECK reads without the account lock
+ *                          lock: CHECK holds the account lock like a TRANS
+ *      --occ-retries=N     occ: optimistic attempts of a TRANS before it takes its locks up front (default 8)
+ *      --batch-size=N      batch: most requests split into waves at once (default 256)
+ *      --batch-latency=US  batch: longest the scheduler waits for a batch to fill (default 1000)
+ *      --lock-stripes=N    accounts share N cache line sized lock words instead of each having its own (default 0 = off)
+ *      --wal=PATH          log every TRANS to PATH before it is applied, hold results until the log is durable and
+ *                          replay PATH at startup
+ *      --wal-window=US     wal: longest a commit waits for others to share its fdatasync (default 0 = sync at once)
+ *      --snapshot=PATH     wal: keep a checkpointed copy of every balance in PATH, load it at startup and only replay
+ *                          the log written since
+ *      --checkpoint-interval=MS snapshot: longest between checkpoints (default 1000)
+ *      --replicate=PATH    wal: let standbys connect on a Unix domain socket at PATH and ship them the log as it becomes
+ *                          durable
+ *      --standby=PATH      follow the primary whose --replicate is PATH: apply its log, answer CHECK only and report
+ *                          the lag in STATS
+ *      --hugepages=1       back the account table with huge pages, faster once resident but materialized 2 MB at a time
  * 
  * @param argc - number of command line arguments
  * @param argv - array of command line arguments
@@ -84,32 +147,136 @@ void sortIDLeastToGreatest(struct trans * transactions, int num_trans);
  */
 int main(int argc, char *argv[]) {
     // Command Line Input Error Handling
-    if (argc != 4) {
-        printf("ERROR: Command line input invalid, required format:\n\t$ server <# of worker threads> <# of account> <output file>\n");
+    if (argc < 4 || !parse_options(argc, argv)) {
+        printf("ERROR: Command line input invalid, required format:\n\t$ server <# of worker threads> <# of account> <output file> [--tcp=PORT] [--unix=PATH] [--net-threads=N] [--stdin=0|1] [--exec=lock|partition|occ|batch]\n\t\t[--cache=none|writethrough|writeback] [--flush-batch=N] [--flush-interval=MS] [--io-threads=N] [--fibers=N] [--stats=0|1]\n\t\t[--writer=0|1] [--writer-interval=MS] [--writer-batch=N] [--ordered=0|1] [--order-window=N] [--check=lock|lockfree]\n\t\t[--occ-retries=N] [--batch-size=N] [--batch-latency=US] [--lock-stripes=N] [--hugepages=0|1]\n\t\t[--wal=PATH] [--wal-window=US] [--snapshot=PATH] [--checkpoint-interval=MS]\n\t\t[--replicate=PATH] [--standby=PATH]\n");
+        return 0;
+    }
+    if (!config.stdin_enabled && !config.tcp_port && config.unix_path == NULL) {
+        printf("ERROR: No input source, enable stdin or give --tcp/--unix.\n");
         return 0;
     }
     
     // Setting Up Output File
     fp = fopen(argv[3], "w");
 
+    // Validate Worker Quantity
+    numWThreads = atoi(argv[1]);
+    if (numWThreads < 1) {
+        printf("ERROR: Invalid worker thread amount, must be at least 1.\n");
+        return 0;
+    }
+
+    if (config.fibers > 0 && config.exec_mode != EXEC_LOCK && config.exec_mode != EXEC_OCC) {
+        printf("ERROR: --fibers needs --exec=lock or --exec=occ.\n");
+        return 0;
+    }
+
+    // Storage helpers, by default enough for every worker to issue a full TRANS at once, or for every coroutine to
+    // have one call in flight
+    if (config.io_threads < 0) {
+        config.io_threads = config.fibers > 0 ? numWThreads * config.fibers : numWThreads * (MAX_TRANS_PAIRS - 1);
+    }
+    if (!io_pool_init(config.io_threads)) {
+        printf("ERROR: Storage helper creation failed.\n");
+        return 0;
+    }
+
     // Initializing Accounts
     numAccounts = atoi(argv[2]);
-    if (!initialize_accounts(numAccounts)) {
+    if (!accounts_init(numAccounts, config.cache_policy, config.flush_batch, config.flush_interval, config.lock_stripes,
+                       config.hugepages)) {
         printf("ERROR: Account creation failed.\n");
         return 0;
     }
 
-    // Validate Worker Quantity
-    numWThreads = atoi(argv[1]);
-    if (numWThreads < 1) {
-        printf("ERROR: Invalid worker thread amount, must be at least 1.\n");
+    // Initialize queue Q
+    if (!rq_init(&Q, QUEUE_CAPACITY)) {
+        printf("ERROR: Request queue creation failed.\n");
         return 0;
     }
 
-    // Initialize queue Q
-    Q.head = NULL;
-    Q.tail = NULL;
-    Q.num_jobs = 0;
+    // One queue per worker when each worker owns a partition of the accounts, together about as large as Q
+    size_t queued = QUEUE_CAPACITY;
+    if (config.exec_mode == EXEC_PARTITION) {
+        size_t partCapacity = QUEUE_CAPACITY / numWThreads < PARTITION_MIN_QUEUE ? PARTITION_MIN_QUEUE : QUEUE_CAPACITY / numWThreads;
+        queued = partCapacity * numWThreads;
+    }
+    if (config.exec_mode == EXEC_PARTITION && !partition_init(numWThreads, queued / numWThreads)) {
+        printf("ERROR: Partition queue creation failed.\n");
+        return 0;
+    }
+
+    // The scheduler holds a batch on top of the queue
+    if (config.exec_mode == EXEC_BATCH) {
+        queued += config.batch_size;
+    }
+    if (config.exec_mode == EXEC_BATCH && !batch_init(&Q, numAccounts, config.batch_size, config.batch_latency)) {
+        printf("ERROR: Batch scheduler creation failed.\n");
+        return 0;
+    }
+
+    if (!stats_init(numWThreads)) {
+        printf("ERROR: Statistics creation failed.\n");
+        return 0;
+    }
+
+    if (config.ordered && !config.writer) {
+        printf("ERROR: --ordered needs the result writer.\n");
+        return 0;
+    }
+    if (config.writer && !writer_init(fileno(fp), numWThreads, config.writer_interval, config.writer_batch, config.ordered, config.order_window)) {
+        printf("ERROR: Result writer creation failed.\n");
+        return 0;
+    }
+
+    // Rebuild the balances before any worker runs: the snapshot first, then the log written since
+    off_t covered = 0;
+    if (config.snapshot_path != NULL && config.wal_path == NULL) {
+        printf("ERROR: --snapshot needs --wal.\n");
+        return 0;
+    }
+    if (config.snapshot_path != NULL && !snapshot_init(config.snapshot_path, numAccounts, &covered)) {
+        printf("ERROR: Snapshot could not be opened or does not match the number of accounts.\n");
+        return 0;
+    }
+    if (config.wal_path != NULL && !commit_log_init(config.wal_path, covered, numAccounts, config.wal_window, emit_result)) {
+        printf("ERROR: Commit log could not be opened or replayed.\n");
+        return 0;
+    }
+    if (config.snapshot_path != NULL && !snapshot_start(config.wal_path, config.checkpoint_interval)) {
+        printf("ERROR: Checkpointer creation failed.\n");
+        return 0;
+    }
+
+    // A primary ships its log, a standby's balances come from nothing but the primary's log
+    if (config.replicate_path != NULL && config.wal_path == NULL) {
+        printf("ERROR: --replicate needs --wal.\n");
+        return 0;
+    }
+    if (config.standby_path != NULL && (config.wal_path != NULL || config.replicate_path != NULL)) {
+        printf("ERROR: --standby cannot be used with --wal, --snapshot or --replicate.\n");
+        return 0;
+    }
+    if (config.replicate_path != NULL && !replication_serve(config.replicate_path, config.wal_path)) {
+        printf("ERROR: Could not open the standby listener.\n");
+        return 0;
+    }
+    if (config.standby_path != NULL && !replication_follow(config.standby_path, numAccounts)) {
+        printf("ERROR: Could not reach the primary.\n");
+        return 0;
+    }
+
+    if (config.fibers > 0 && !fiber_init(numWThreads, config.fibers)) {
+        printf("ERROR: Coroutine creation failed.\n");
+        return 0;
+    }
+
+    // Enough requests to fill the queue, the coroutines, plus every thread's private free list, so the pool never
+    // runs dry while requests sit unused in an idle thread's list
+    if (!pool_init(queued + numWThreads * config.fibers + (numWThreads + config.net_threads + 1) * (POOL_CACHE_MAX + 1))) {
+        printf("ERROR: Request pool creation failed.\n");
+        return 0;
+    }
 
     /*================================================================
      *                     THREAD INITIALIZATION                     *
@@ -119,21 +286,16 @@ int main(int argc, char *argv[]) {
     int thread_index[numWThreads];
     numWorkersRemaining = numWThreads;
 
-    q_Occupied = 0;
-    pthread_cond_init(&jobs_cv, NULL);
-
-    // Allocating enough space for all the locks
-    acc_mut = malloc(sizeof(pthread_t) * numAccounts);  
-    
-    // initialized mutex for queue
-    pthread_mutex_init(&q_mut, NULL); 
     int t;
-    for (t = 0; t < numAccounts; t++) {
-        // initializes mutex for every account
-        pthread_mutex_init(&acc_mut[t], NULL); 
-    }
 
-    pthread_create(&input_tid, NULL, program_loop, NULL);
+    // Start listening before the terminal so clients are never refused
+    if ((config.tcp_port || config.unix_path != NULL) && !net_start()) {
+        printf("ERROR: Could not open the client listeners.\n");
+        return 0;
+    }
+    if (config.stdin_enabled) {
+        pthread_create(&input_tid, NULL, program_loop, NULL);
+    }
 
     for (t = 0; t < numWThreads; t++) {
         thread_index[t] = t;
@@ -143,34 +305,232 @@ int main(int argc, char *argv[]) {
     /*===============================================================*/
 
     // Join Threads to make main wait for input and worker threads before proceeding
-    pthread_join(input_tid, NULL);
+    if (config.stdin_enabled) {
+        pthread_join(input_tid, NULL);
+    }
+    net_join();
     for (t = 0; t < numWThreads; t++) {
         pthread_join(workers_tid[t], NULL);
     }
 
     // Program Termination
-    free_accounts();
+    if (config.wal_path != NULL) {
+        // Held results are released to the writer once the log is durable
+        commit_log_close();
+    }
+    if (config.snapshot_path != NULL) {
+        // One last checkpoint of the whole log
+        snapshot_close();
+    }
+    // Standbys get the whole log before they are disconnected
+    replication_stop();
+    if (config.writer) {
+        // Every result still buffered reaches the file before it is closed
+        writer_stop();
+    }
+    rq_destroy(&Q);
+    partition_destroy();
+    batch_destroy();
+    pool_destroy();
+    accounts_free();
+    io_pool_destroy();
+    fiber_destroy();
+    stats_destroy();
     fclose(fp);
     return 0;
 }
 
 /**
- * The event loop of the program, with each the loop the program takes in a request, parses the request, 
- * then builds the request based on the type of request. After each request is built, they are added to the 
- * request queue where they will wait to be chosen by a worker thread.
+ * Reads the optional "--name=value" arguments that follow the required command line arguments into config.
  * 
- * @param workersArray - pointer to the start of the worker thread array
- * @param numWThreads  - number worker threads in the thread array
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int - 1 if every option was recognized, 0 otherwise
+ */
+int parse_options(int argc, char *argv[]) {
+    // Defaults
+    config.stdin_enabled = 1;
+    config.tcp_port = 0;
+    config.unix_path = NULL;
+    config.net_threads = 1;
+    config.exec_mode = EXEC_LOCK;
+    config.cache_policy = CACHE_WRITEBACK;
+    config.flush_batch = FLUSH_BATCH_DEFAULT;
+    config.flush_interval = FLUSH_INTERVAL_DEFAULT;
+    config.io_threads = -1;
+    config.fibers = 0;
+    config.stats = 1;
+    config.writer = 1;
+    config.writer_interval = WRITER_INTERVAL_DEFAULT;
+    config.writer_batch = WRITER_BATCH_DEFAULT;
+    config.ordered = 0;
+    config.order_window = ORDER_WINDOW_DEFAULT;
+    config.check_lockfree = 1;
+    config.occ_retries = OCC_RETRIES_DEFAULT;
+    config.batch_size = BATCH_SIZE_DEFAULT;
+    config.batch_latency = BATCH_LATENCY_DEFAULT;
+    config.lock_stripes = 0;
+    config.hugepages = 0;
+    config.wal_path = NULL;
+    config.wal_window = WAL_WINDOW_DEFAULT;
+    config.snapshot_path = NULL;
+    config.checkpoint_interval = CHECKPOINT_INTERVAL_DEFAULT;
+    config.replicate_path = NULL;
+    config.standby_path = NULL;
+
+    int i;
+    for (i = 4; i < argc; i++) {
+        if (!strncmp(argv[i], "--tcp=", 6)) {
+            config.tcp_port = atoi(argv[i] + 6);
+        } else if (!strncmp(argv[i], "--unix=", 7)) {
+            config.unix_path = argv[i] + 7;
+        } else if (!strncmp(argv[i], "--net-threads=", 14)) {
+            config.net_threads = atoi(argv[i] + 14);
+            if (config.net_threads < 1) {
+                return 0;
+            }
+        } else if (!strcmp(argv[i], "--exec=lock")) {
+            config.exec_mode = EXEC_LOCK;
+        } else if (!strcmp(argv[i], "--exec=partition")) {
+            config.exec_mode = EXEC_PARTITION;
+        } else if (!strcmp(argv[i], "--exec=occ")) {
+            config.exec_mode = EXEC_OCC;
+        } else if (!strcmp(argv[i], "--exec=batch")) {
+            config.exec_mode = EXEC_BATCH;
+        } else if (!strcmp(argv[i], "--cache=none")) {
+            config.cache_policy = CACHE_NONE;
+        } else if (!strcmp(argv[i], "--cache=writethrough")) {
+            config.cache_policy = CACHE_WRITETHROUGH;
+        } else if (!strcmp(argv[i], "--cache=writeback")) {
+            config.cache_policy = CACHE_WRITEBACK;
+        } else if (!strncmp(argv[i], "--flush-batch=", 14)) {
+            config.flush_batch = atoi(argv[i] + 14);
+            if (config.flush_batch < 1) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--flush-interval=", 17)) {
+            config.flush_interval = atoi(argv[i] + 17);
+            if (config.flush_interval < 1) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--io-threads=", 13)) {
+            config.io_threads = atoi(argv[i] + 13);
+            if (config.io_threads < 0) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--fibers=", 9)) {
+            config.fibers = atoi(argv[i] + 9);
+            if (config.fibers < 0) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--stats=", 8)) {
+            config.stats = atoi(argv[i] + 8);
+        } else if (!strncmp(argv[i], "--writer=", 9)) {
+            config.writer = atoi(argv[i] + 9);
+        } else if (!strncmp(argv[i], "--writer-interval=", 18)) {
+            config.writer_interval = atoi(argv[i] + 18);
+            if (config.writer_interval < 1) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--writer-batch=", 15)) {
+            config.writer_batch = atoi(argv[i] + 15);
+            if (config.writer_batch < 1) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--ordered=", 10)) {
+            config.ordered = atoi(argv[i] + 10);
+        } else if (!strncmp(argv[i], "--order-window=", 15)) {
+            config.order_window = atoi(argv[i] + 15);
+            if (config.order_window < 1) {
+                return 0;
+            }
+        } else if (!strcmp(argv[i], "--check=lock")) {
+            config.check_lockfree = 0;
+        } else if (!strcmp(argv[i], "--check=lockfree")) {
+            config.check_lockfree = 1;
+        } else if (!strncmp(argv[i], "--occ-retries=", 14)) {
+            config.occ_retries = atoi(argv[i] + 14);
+            if (config.occ_retries < 0) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--batch-size=", 13)) {
+            config.batch_size = atoi(argv[i] + 13);
+            if (config.batch_size < 1) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--batch-latency=", 16)) {
+            config.batch_latency = atoi(argv[i] + 16);
+            if (config.batch_latency < 0) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--lock-stripes=", 15)) {
+            config.lock_stripes = atoi(argv[i] + 15);
+            if (config.lock_stripes < 0) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--wal=", 6)) {
+            config.wal_path = argv[i] + 6;
+        } else if (!strncmp(argv[i], "--wal-window=", 13)) {
+            config.wal_window = atoi(argv[i] + 13);
+            if (config.wal_window < 0) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--snapshot=", 11)) {
+            config.snapshot_path = argv[i] + 11;
+        } else if (!strncmp(argv[i], "--checkpoint-interval=", 22)) {
+            config.checkpoint_interval = atoi(argv[i] + 22);
+            if (config.checkpoint_interval < 1) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--replicate=", 12)) {
+            config.replicate_path = argv[i] + 12;
+        } else if (!strncmp(argv[i], "--standby=", 10)) {
+            config.standby_path = argv[i] + 10;
+        } else if (!strncmp(argv[i], "--hugepages=", 12)) {
+            config.hugepages = atoi(argv[i] + 12);
+        } else if (!strncmp(argv[i], "--stdin=", 8)) {
+            config.stdin_enabled = atoi(argv[i] + 8);
+        } else {
+            printf("ERROR: Unknown option %s\n", argv[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Called by the parser for each request line typed at the terminal. Answers the user on stdout.
+ * 
+ * @param ctx - points to program_loop's done flag
+ * @param p   - the parsed request
+ */
+static void terminal_request(void * ctx, const struct parsed_request * p) {
+    int * done = ctx;
+    char reply[STATS_REPLY_SIZE];
+    // Lines after END are ignored
+    if (*done) {
+        return;
+    }
+    if (p->type == REQ_END) {
+        *done = 1;
+    }
+    if (dispatch_request(p, 0, reply, sizeof(reply)) > 0) {
+        // Output indicator
+        printf("< %s", reply);
+    }
+}
+
+/**
+ * The terminal input source of the program. Each loop reads whatever is available on stdin in one large chunk
+ * and hands it to the request parser, which builds every request in the chunk and adds it to the request queue
+ * where it will wait to be chosen by a worker thread. Lines may be split across chunks.
  */
 void* program_loop(void * arg) {     
-    // Allocate space for input string
-    char *userInput = malloc(STR_MAX_SIZE);     
-    // Tells token where to split
-    const char delim[2] = " ";       
-    // Temporarly store input chunk           
-    char * token;  
-    // Used as the request ID                             
-    int requestCount = 1;       
+    // Allocate space for raw input
+    char *userInput = malloc(INPUT_BUF_SIZE);     
+    // Parser keeps partial lines between reads
+    struct request_parser parser;
+    parser_init(&parser, numAccounts);
     // Loop Condition                
     int done = 0;                               
 
@@ -178,228 +538,404 @@ void* program_loop(void * arg) {
     while(!done) {
         // Input indicator
         printf("> ");
-        // Snags entire line from stdin
-        fgets(userInput, STR_MAX_SIZE, stdin);  
-        // Replaces newline char with a terminating char
-        userInput[strlen(userInput) - 1] = '\0';
-        // Gets first input chunk    
-        token = strtok(userInput, delim);
-        if (!strcmp(token, "END")) {
+        fflush(stdout);
+        ssize_t got = read(STDIN_FILENO, userInput, INPUT_BUF_SIZE);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            // Closed input is treated like END, after any unterminated last line
+            parser_finish(&parser, terminal_request, &done);
+            if (!done) {
+                done = 1;
+                server_shutdown();
+            }
+            break;
+        }
+        parser_feed(&parser, userInput, got, terminal_request, &done);
+    }
+    free(userInput);
+    return NULL;
+}
+
+/**
+ * Acts on one parsed request: END begins the exit protocol, CHECK and TRANS are built and queued. The text to send
+ * back to whoever made the request is written to reply. PREPARE is queued like a TRANS; COMMIT and ABORT are queued
+ * as the part the same client prepared under their transaction ID, and refused if there is none.
+ * 
+ * @param p      - the parsed request
+ * @param client - connection the request came from, 0 for the terminal
+ * @param reply  - buffer receiving the answer, including its newline
+ * @param size   - size of reply
+ * @return int - length of the answer, 0 if there is nothing to answer
+ */
+int dispatch_request(const struct parsed_request * p, int client, char * reply, size_t size) {
+    struct request * req;
+    struct parsed_request part;
+    int len;
+    switch (p->type) {
+        case REQ_END:
             // Begin Exit Protocol
-            done =  1;
-            clockOut = 1;
-            // Exit the program loop function
-            exit(0);
-        } else if (!strcmp(token, "CHECK")) {       
-            // CHECK REQUEST PROTOCOL
-            // Output indicator
-            printf("< ");
-            // Get Account ID to check
-            token = strtok(NULL, delim);            
-            if (token != NULL) {
-                // Build Balance Check Request
-                struct request bReq;
-                bReq.next = NULL;
-                bReq.request_id = requestCount;
-                bReq.transactions = NULL;
-                bReq.num_trans = -1;
-                bReq.check_acc_id = atoi(token);
-                
-                // If valid ID is provided finsish building request and add it to the queue
-                if (bReq.check_acc_id <= numAccounts && bReq.check_acc_id > 0) {
-                    // Store current time as start time for request
-                    gettimeofday(&bReq.starttime, NULL);
-
-                    // Lock the queue
-                    pthread_mutex_lock(&q_mut);
-                    while(q_Occupied) {
-                        pthread_cond_wait(&jobs_cv, &q_mut);
-                    }
-                    q_Occupied = 1;
-                    // Add Request to queue 
-                    add_request(&bReq);
-                    pthread_cond_broadcast(&jobs_cv);
-                    q_Occupied = 0;
-                    // unlock the queue
-                    pthread_mutex_unlock(&q_mut);
-
-                    // Console Response
-                    printf("ID %d\n", requestCount);             
-                    // Increment Request Count        
-                    requestCount++;       
-                } else {
-                    // Error message
-                    printf("INVALID REQUEST: The account provided with CHECK request does not exist.\n");   
-                }               
-            } else {   
-                // ERROR
-                printf("INVALID REQUEST: Balance Check was not provided an account ID.\n");
+            server_shutdown();
+            reply[0] = '\0';
+            return 0;
+        case REQ_INVALID:
+            return snprintf(reply, size, "%s\n", p->error);
+        case REQ_STATS:
+            // Answered right away, never queued
+            // Each part is cut to what fits, so the next one always gets a valid place and size
+            len = stats_fit(stats_report(reply, size, rq_size(&Q) + partition_depth()), size);
+            if (config.writer) {
+                len = stats_fit(len + writer_report(reply + len, size - len), size);
             }
-        } else if (!strcmp(token, "TRANS")) {       
-            // TRANSACTION REQUEST PROTOCOL
-            // Output indicator
-            printf("< ");
-            // Stores request validity: 1 = valid, 0 = invalid
-            int validRequest = 1;                   
-            // Build Transaction Request
-            struct request tReq;
-            tReq.next = NULL;
-            tReq.request_id = requestCount;
-            tReq.check_acc_id = -1;
-            gettimeofday(&tReq.starttime, NULL);
-            // Allocating Space for up to 10 transaction pairs
-            tReq.transactions = malloc(sizeof(struct trans) * 10);  
-            // Set number of transactions
-            tReq.num_trans = 0;                                    
-            // Build Transaction Pairs
-            int i;
-            for (i = 0; i < 10; i++) {
-                // Get Account ID
-                token = strtok(NULL, delim);                        
-                if (token != NULL) { 
-                    // Assign token to account ID
-                    tReq.transactions[i].acc_id = atoi(token);     
-                    // Get amount value
-                    token = strtok(NULL, delim);                    
-                    if (token != NULL && tReq.transactions[i].acc_id <= numAccounts && tReq.transactions[i].acc_id > 0) {
-                        // Assign token to amount
-                        tReq.transactions[i].amount = atoi(token);  
-                        // Increase Transaction count
-                        tReq.num_trans++;                           
-                    } else {
-                        printf("INVALID REQUEST: an account within the Transaction Request was not provided a transaction amount or an invalid account number was provided.\n");
-                        // Request Failed
-                        validRequest = 0; 
-                        // End loop
-                        i = 10;             
-                    }
-                } else {
-                    // End of transaction pairs
-                    i = 10; // End loop
-                    if (tReq.num_trans < 1) {
-                        printf("INVALID REQUEST: no transaction pairs were provided with transaction request.\n");
-                        validRequest = 0;   // Request failed
-                    }
-                }
+            if (config.exec_mode == EXEC_BATCH) {
+                len = stats_fit(len + batch_report(reply + len, size - len), size);
+            }
+            if (config.wal_path != NULL) {
+                len = stats_fit(len + commit_log_report(reply + len, size - len), size);
+            }
+            if (config.snapshot_path != NULL) {
+                len = stats_fit(len + snapshot_report(reply + len, size - len), size);
             }
-            // Add request and Increment Request Count
-            if (validRequest) {
-                // Lock the queue
-                pthread_mutex_lock(&q_mut);
-                while(q_Occupied) {
-                    pthread_cond_wait(&jobs_cv, &q_mut);
+            if (config.replicate_path != NULL || config.standby_path != NULL) {
+                len = stats_fit(len + replication_report(reply + len, size - len), size);
+            }
+            return len;
+        case REQ_TRANS:
+        case REQ_PREPARE:
+        case REQ_COMMIT:
+        case REQ_ABORT:
+            if (config.standby_path != NULL) {
+                // Balances only change through the primary's log
+                return snprintf(reply, size, "INVALID REQUEST: this server is a standby, send TRANS to the primary.\n");
+            }
+            if (p->type == REQ_PREPARE) {
+                note_preparer(client);
+            } else if (p->type != REQ_TRANS) {
+                // Once taken, the part is no longer aborted if the client goes away
+                if (!take_prepared(client, p->txid, &part)) {
+                    return snprintf(reply, size, "INVALID REQUEST: no transaction with that ID is prepared.\n");
                 }
-                q_Occupied = 1;
-                // Add request to queue
-                add_request(&tReq);
-                pthread_cond_broadcast(&jobs_cv);
-                q_Occupied = 0;
-                // unlock the queue
-                pthread_mutex_unlock(&q_mut);
-                // Console Response
-                printf("ID %d\n", requestCount); 
-                requestCount++;
+                part.type = p->type;
+                p = &part;
             }
-        } else {
-            printf("INVALID REQUEST: no action taken.\n");
-        }
-        // Clear input string
-        strcpy(userInput, "");
+            // fall through
+        default:
+            req = create_request(p, client);
+            // Add Request to queue and give the user its ID
+            if (submit_request(req)) {
+                return snprintf(reply, size, "ID %d\n", req->request_id);
+            }
+            if (config.writer) {
+                // The ID is used up, ordered output must not wait for it
+                writer_skip(req->request_id);
+            }
+            pool_free(req);
+            return snprintf(reply, size, "INVALID REQUEST: the server is shutting down.\n");
     }
-    exit(0);
 }
 
 /**
- * Handles the worker thread operations. Continues to loop until clockOut signals the loop to end. Worker will wait until a
+ * Builds the request structure a worker executes from a parsed CHECK or TRANS request, or from a part of a TRANS
+ * spanning shards. The request is taken from the request pool and belongs to the caller until it is queued with
+ * submit_request.
+ * 
+ * @param p      - the parsed request, type REQ_CHECK, REQ_TRANS, REQ_PREPARE, REQ_COMMIT or REQ_ABORT
+ * @param client - connection the request came from
+ * @return struct request* - request from the pool
+ */
+struct request * create_request(const struct parsed_request * p, int client) {
+    struct request * r = pool_alloc();
+    r->step = p->type;
+    r->txid = p->txid;
+    r->client = client;
+    if (p->type == REQ_CHECK) {
+        // Build Balance Check Request
+        r->check_acc_id = p->check_acc_id;
+        r->num_trans = -1;
+        r->num_debits = 0;
+    } else {
+        // Build Transaction Request
+        r->check_acc_id = -1;
+        r->num_trans = p->num_trans;
+        memcpy(r->transactions, p->transactions, sizeof(struct trans) * p->num_trans);
+        // Canonical already, the worker executes it as is
+        r->num_debits = p->num_debits;
+        memcpy(r->debit_ids, p->debit_ids, sizeof(int) * p->num_debits);
+    }
+    return r;
+}
+
+/**
+ * Gives a built request the next request ID, stamps its start time and adds it to the job queue. Once queued,
+ * the request belongs to the worker that takes it.
+ * 
+ * @param r - request returned by create_request
+ * @return int - 1 if the request was queued, 0 if the server is shutting down (the caller still owns r)
+ */
+int submit_request(struct request * r) {
+    // Store current time as start time for request
+    gettimeofday(&r->starttime, NULL);
+    if (config.stats) {
+        r->enqueued_ns = stats_now();
+    }
+    r->request_id = atomic_fetch_add(&requestCount, 1);
+    if (config.exec_mode == EXEC_PARTITION) {
+        return partition_submit(r);
+    }
+    return add_request(r);
+}
+
+/**
+ * Begins the exit protocol: stops the client listeners and closes the job queue. Workers finish the jobs already
+ * queued and then clock out. Safe to call more than once.
+ */
+void server_shutdown() {
+    net_stop();
+    rq_close(&Q);
+    partition_close();
+}
+
+/**
+ * Handles the worker thread operations. Continues to loop until the queue is closed and drained. Worker sleeps until a
  * job is available, and once the job is acquired the worker determines whether it is a CHECK request or a TRANS request. 
  * Worker then carrys out the job and repeats the process. 
  * 
  * @return void* 
  */
 void* worker(void * arg) {
-    while (clockOut == 0 || Q.num_jobs > 0) {
-        // Pointer to worker's current task
-        struct request * job = NULL;
-        
-        // Lock the queue
-        pthread_mutex_lock(&q_mut);
-        while(q_Occupied) {
-            pthread_cond_wait(&jobs_cv, &q_mut);
-        }
-        q_Occupied = 1;
-        // Attempts to get a job, if NULL, there are no current jobs in the queue
-        job = get_request();
-        pthread_cond_broadcast(&jobs_cv);
-        q_Occupied = 0;
-        // Unlock the queue
-        pthread_mutex_unlock(&q_mut);
-
-
-        // TEMPORARY
-        int reqNum = -1;
-        if (job != NULL) {
-            reqNum = job->request_id;
+    // Worker records into its own STATS histograms and buffers its own results
+    stats_attach(*(int *)arg);
+    if (config.writer) {
+        writer_attach(*(int *)arg);
+    }
+    if (config.exec_mode == EXEC_PARTITION) {
+        // Worker owns one partition of the accounts and only serves that partition's queue
+        partition_worker(*(int *)arg);
+        numWorkersRemaining--;
+        return NULL;
+    }
+    if (config.exec_mode == EXEC_BATCH) {
+        // Worker runs whatever the batch scheduler hands out, one wave at a time
+        batch_worker(*(int *)arg);
+        numWorkersRemaining--;
+        return NULL;
+    }
+    if (config.fibers > 0) {
+        // Worker schedules its own coroutines, each carrying out one request at a time
+        fiber_worker(*(int *)arg);
+        numWorkersRemaining--;
+        return NULL;
+    }
+
+    // Pointer to worker's current task
+    struct request * job;
+    // Sleeps until a job is available, NULL means the queue was closed and drained
+    while ((job = get_request()) != NULL) {
+        if (config.exec_mode == EXEC_OCC) {
+            execute_optimistic(job);
+        } else {
+            execute_locked(job);
         }
-        printf("Thread #%d: Job #%d\n", *(int *)arg, reqNum);
+        // Job is finished, hand it back to the pool
+        pool_free(job);
+    }
+    numWorkersRemaining--;
+    return NULL;
+}
 
-        if (job != NULL && job->check_acc_id == -1) {
-            // Perform Transaction operation
-            // Sort Transactions by Account ID from least to greatest
-            sortIDLeastToGreatest(job->transactions, job->num_trans);
-            // Acquire Locks for each of the accounts
+/**
+ * Carries out a CHECK or TRANS request under the per-account locks and writes its result. Used when any worker may
+ * touch any account. Only accounts being debited are locked: deposits cannot cause ISF and are added atomically,
+ * so a deposit-only TRANS takes no lock at all. CHECK takes no lock either unless --check=lock.
+ * 
+ * @param job - request to execute
+ */
+void execute_locked(struct request * job) {
+    stamp(&job->dequeued_ns);
+    if (job->check_acc_id == -1) {
+        // Perform Transaction operation
+        // Only the debited accounts need locking, the parser listed them
+        if (job->step != REQ_TRANS) {
+            // A part of a TRANS spanning shards, even without debits it goes through the prepared list
+            finish_trans(job, locked_transaction(job));
+            return;
+        }
+        if (job->num_debits == 0) {
+            // Deposit-only: cannot fail, apply every amount lock-free
+            job->locked_ns = job->dequeued_ns;
             int i;
+            struct account_update updates[job->num_trans];
             for (i = 0; i < job->num_trans; i++) {
-                pthread_mutex_lock(&acc_mut[job->transactions[i].acc_id - 1]);
+                updates[i].id = job->transactions[i].acc_id;
+                updates[i].value = job->transactions[i].amount;
+                updates[i].deposit = 1;
+                updates[i].seen = 0;
             }
-            // Attempt operation
-            int insufAccID = transaction_operation(job);
-            // Relenquishe Locks for each account
-            for (i = 0; i < job->num_trans; i++) {
-                pthread_mutex_unlock(&acc_mut[job->transactions[i].acc_id - 1]);
-            }
-            // Get endtime
-            gettimeofday(&job->endtime, NULL);
-            // Print result to file
-            if (insufAccID == -1) {
-                // lock print file
-                flockfile(fp);
-                fprintf(fp, "%d OK TIME %ld.%06ld %ld.%06ld\n", job->request_id, job->starttime.tv_sec, job->starttime.tv_usec, job->endtime.tv_sec, job->endtime.tv_usec);
-                // unlock print file
-                funlockfile(fp);
-            } else {
-                // lock print file
-                flockfile(fp);
-                fprintf(fp, "%d ISF %d TIME %ld.%06ld %ld.%06ld\n", job->request_id, insufAccID, job->starttime.tv_sec, job->starttime.tv_usec, job->endtime.tv_sec, job->endtime.tv_usec);
-                // unlock print file
-                funlockfile(fp);
-            }
-        } 
-
-        if (job != NULL && job->check_acc_id != -1) {
-            // Perform Balance operation
-            // Get lock associated account id
-            pthread_mutex_lock(&acc_mut[job->check_acc_id - 1]);
-            // Call read account and store result
-            int balance = read_account(job->check_acc_id);
-            // reliquishe the lock 
-            pthread_mutex_unlock(&acc_mut[job->check_acc_id - 1]);
-            // Get endtime
-            gettimeofday(&job->endtime, NULL);
-            // lock print file
-            flockfile(fp);
-            // Print result to file
-            fprintf(fp, "%d BAL %d TIME %ld.%06ld %ld.%06ld\n", job->request_id, balance, job->starttime.tv_sec, job->starttime.tv_usec, job->endtime.tv_sec, job->endtime.tv_usec);
-            // unlock print file
-            funlockfile(fp);
+            commit_updates(job, updates, job->num_trans);
+            stamp(&job->stored_ns);
+            finish_trans(job, -1);
+            return;
         }
+        finish_trans(job, locked_transaction(job));
+    } else {
+        // Perform Balance operation
+        if (config.check_lockfree) {
+            // Readers do not exclude each other or wait behind a TRANS
+            job->locked_ns = job->dequeued_ns;
+            int64_t balance = account_check(job->check_acc_id);
+            stamp(&job->stored_ns);
+            finish_check(job, balance);
+            return;
+        }
+        // Get lock associated account id
+        account_lock(job->check_acc_id);
+        stamp(&job->locked_ns);
+        // Read the account and store result
+        int64_t balance = account_read(job->check_acc_id);
+        stamp(&job->stored_ns);
+        // reliquishe the lock 
+        account_unlock(job->check_acc_id);
+        finish_check(job, balance);
+    }
+}
+
+/**
+ * Carries out a CHECK or TRANS request with optimistic concurrency control and writes its result. A TRANS with debits
+ * reads its balances without locks, then locks the debited accounts only to check that no other TRANS wrote them
+ * meanwhile and to write. On a conflict it starts over, and after config.occ_retries conflicts it runs like
+ * execute_locked so it cannot starve. CHECK and deposit-only TRANS take no locks anyway and run as in execute_locked.
+ *
+ * @param job - request to execute
+ */
+void execute_optimistic(struct request * job) {
+    if (job->num_debits == 0 || job->step != REQ_TRANS) {
+        execute_locked(job);
+        return;
+    }
+    stamp(&job->dequeued_ns);
+    // No lock is waited for up front, retries count as storage time
+    job->locked_ns = job->dequeued_ns;
+    int attempt;
+    for (attempt = 0; attempt < config.occ_retries; attempt++) {
+        int insufAccID = transaction_optimistic(job);
+        if (insufAccID != OCC_CONFLICT) {
+            stamp(&job->stored_ns);
+            stats_occ(attempt, 0);
+            finish_trans(job, insufAccID);
+            return;
+        }
+    }
+    // Too contended, hold the locks from the first read
+    stats_occ(attempt, 1);
+    finish_trans(job, locked_transaction(job));
+}
+
+/**
+ * Carries out a CHECK or TRANS request without taking any account lock and writes its result. The caller must
+ * guarantee no other thread touches the request's accounts meanwhile, apart from CHECKs reading alongside a CHECK and
+ * deposits alongside a deposit.
+ * 
+ * @param job - request to execute
+ */
+void execute_unlocked(struct request * job) {
+    stamp(&job->dequeued_ns);
+    job->locked_ns = job->dequeued_ns;
+    if (job->check_acc_id == -1) {
+        int insufAccID = job->step == REQ_TRANS ? transaction_operation(job) : step_operation(job);
+        stamp(&job->stored_ns);
+        finish_trans(job, insufAccID);
+    } else {
+        // Other readers of the account may run at the same time
+        int64_t balance = account_check(job->check_acc_id);
+        stamp(&job->stored_ns);
+        finish_check(job, balance);
+    }
+}
+
+/**
+ * Stamps the end time of a TRANS request and hands its result to the result writer, or prints it to the output file
+ * directly with --writer=0.
+ * 
+ * @param job        - finished request
+ * @param insufAccID - -1 if the transaction went through, otherwise the first account with insufficient funds
+ */
+void finish_trans(struct request * job, int insufAccID) {
+    // Get endtime
+    gettimeofday(&job->endtime, NULL);
+    char line[STR_MAX_SIZE];
+    int len;
+    if (insufAccID == -1) {
+        len = snprintf(line, sizeof(line), "%d OK TIME %ld.%06ld %ld.%06ld\n", job->request_id, job->starttime.tv_sec, job->starttime.tv_usec, job->endtime.tv_sec, job->endtime.tv_usec);
+    } else {
+        len = snprintf(line, sizeof(line), "%d ISF %d TIME %ld.%06ld %ld.%06ld\n", job->request_id, insufAccID, job->starttime.tv_sec, job->starttime.tv_usec, job->endtime.tv_sec, job->endtime.tv_usec);
+    }
+    write_result(job->request_id, line, len);
+    if (config.stats) {
+        stats_record(job, stats_now());
     }
-    numWorkersRemaining--;
-    exit(0);
+}
+
+/**
+ * Stamps the end time of a CHECK request and hands its result to the result writer, or prints it to the output file
+ * directly with --writer=0.
+ * 
+ * @param job     - finished request
+ * @param balance - balance read from the account
+ */
+void finish_check(struct request * job, int64_t balance) {
+    // Get endtime
+    gettimeofday(&job->endtime, NULL);
+    char line[STR_MAX_SIZE];
+    int len = snprintf(line, sizeof(line), "%d BAL %lld TIME %ld.%06ld %ld.%06ld\n", job->request_id, (long long)balance, job->starttime.tv_sec, job->starttime.tv_usec, job->endtime.tv_sec, job->endtime.tv_usec);
+    write_result(job->request_id, line, len);
+    if (config.stats) {
+        stats_record(job, stats_now());
+    }
+}
+
+/**
+ * Sends one formatted result line to the output file, or with --wal to the commit log, which sends it on once
+ * everything the request saw is durable.
+ * 
+ * @param id   - request ID the line answers
+ * @param line - result including its newline
+ * @param len  - length of line
+ */
+void write_result(int id, const char * line, int len) {
+    if (config.wal_path != NULL) {
+        commit_log_hold(id, line, len);
+        return;
+    }
+    emit_result(id, line, len);
+}
+
+/**
+ * Puts one formatted result line in the output file.
+ * 
+ * @param id   - request ID the line answers
+ * @param line - result including its newline
+ * @param len  - length of line
+ */
+void emit_result(int id, const char * line, int len) {
+    if (config.writer) {
+        // Buffered by this worker, the writer thread puts it in the file
+        writer_append(id, line, len);
+        return;
+    }
+    // lock print file
+    flockfile(fp);
+    fwrite(line, 1, len, fp);
+    // unlock print file
+    funlockfile(fp);
 }
 
 /**
  * Performs a transaction operation on the provided request structure. If any account is incapable of carrying out the transaction
  * without suffficient funds, then all transactions in the structure are voided and keep their original balances.
+ * Only debits are read and checked; deposits are applied once every debit is known to succeed. All reads are issued at
+ * once and so are all writes, so a request costs about two storage calls however many pairs it has. The caller must hold
+ * the lock of every debited account (or otherwise own the accounts).
  * 
  * @param job - structure containing request information.
  * @return int - returns -1 if transactions were sufficient, or returns account ID of the first account with insufficient funds.
@@ -407,113 +943,324 @@ void* worker(void * arg) {
 int transaction_operation(struct request * job) {
     // Gets value of ISF account if found    
     int firstISFAcc = -1;
-    // Array of the balances corresponding to accounts
-    int balanceArr[job->num_trans];
+    // Debited accounts and their balances, read together
+    struct account_view views[job->num_trans];
+    // Every change, written together
+    struct account_update updates[job->num_trans];
 
-    int i;
+    // A deposit can never be insufficient, only the debited accounts are read
+    int i, debits = job->num_debits;
+    for (i = 0; i < debits; i++) {
+        views[i].id = job->debit_ids[i];
+    }
+    // Get Account Balances
+    account_read_many(views, debits);
+
+    int d = 0;
     for (i = 0; i < job->num_trans && firstISFAcc == -1; i++) {
-        // Get Account Balance
-        balanceArr[i] = read_account(job->transactions[i].acc_id);
-        // Perform Transaction
-        balanceArr[i] = balanceArr[i] + job->transactions[i].amount;
-        // Check if transaction is valid
-        if(balanceArr[i] < 0) {
+        updates[i].id = job->transactions[i].acc_id;
+        updates[i].deposit = job->transactions[i].amount >= 0;
+        updates[i].seen = 0;
+        if (updates[i].deposit) {
+            updates[i].value = job->transactions[i].amount;
+            continue;
+        }
+        // Perform Transaction, building on the balance as read
+        updates[i].seen = views[d].seen;
+        updates[i].value = views[d].balance + job->transactions[i].amount;
+        // Check if transaction is valid, funds held for a prepared TRANS cannot be spent
+        if (updates[i].value - views[d++].held < 0) {
             // Transaction was not valid, store account ID
             firstISFAcc = job->transactions[i].acc_id;
         }
     }
     // Write new balances to accounts if all transactions are valid
     if (firstISFAcc == -1) {
-        // Write new balances
-        for (i = 0; i < job->num_trans; i++) {
-            // Write new balance to the account
-            write_account(job->transactions[i].acc_id, balanceArr[i]);
-        }
+        commit_updates(job, updates, job->num_trans);
     }
     // Return ID of the ISF account or -1 if all accounts performed transactions successfully
     return firstISFAcc;
 }
 
 /**
- * Adds a new job to the end of the job queue.
- * 
- * @param r - job of struct request type to be added to the queue
+ * Performs one optimistic attempt at a transaction operation, with the same all-or-nothing result as
+ * transaction_operation. The debited balances are read without locks. An ISF answer writes nothing and holds if no
+ * debited account was written while it was read. Otherwise the debited accounts are locked in ID order, checked for
+ * writes since the read and written. Transactions must be sorted by account ID.
+ *
+ * @param job - structure containing request information.
+ * @return int - -1 if the transaction went through, the account ID of the first account with insufficient funds, or
+ *               OCC_CONFLICT if another TRANS wrote a debited account first and nothing was done
  */
-void add_request(struct request * r) {
-    // Skip if new request is NULL
-    if (r != NULL) {
-        // Check if queue is empty
-        if (Q.num_jobs < 1) {
-            // r will be the head and tail 
-            Q.head = r;
-            Q.tail = r;
-        } else {
-            // previous tail now points to new tail
-            Q.tail->next = r;
-            // tail gets new tail
-            Q.tail = r;
+int transaction_optimistic(struct request * job) {
+    int firstISFAcc = -1;
+    // Debited accounts as read without locks
+    struct account_view views[job->num_trans];
+    struct account_update updates[job->num_trans];
+
+    int i, debits = job->num_debits;
+    for (i = 0; i < debits; i++) {
+        views[i].id = job->debit_ids[i];
+    }
+    account_read_optimistic(views, debits);
+
+    int d = 0;
+    for (i = 0; i < job->num_trans && firstISFAcc == -1; i++) {
+        updates[i].id = job->transactions[i].acc_id;
+        updates[i].deposit = job->transactions[i].amount >= 0;
+        updates[i].seen = 0;
+        if (updates[i].deposit) {
+            updates[i].value = job->transactions[i].amount;
+            continue;
         }
-        // Increment job count
-        Q.num_jobs++;
+        updates[i].seen = views[d].seen;
+        updates[i].value = views[d].balance + job->transactions[i].amount;
+        if (updates[i].value - views[d++].held < 0) {
+            firstISFAcc = job->transactions[i].acc_id;
+        }
+    }
+    if (firstISFAcc != -1) {
+        // Read-only, valid if every balance read was still current once all were read
+        return account_unchanged(views, debits) ? firstISFAcc : OCC_CONFLICT;
+    }
 
-        // Return 1 for succesul request addition
-        return;
+    // Commit: lock the debited accounts the way the locked path does, then make sure no write got in first
+    account_lock_many(job->debit_ids, debits);
+    int valid = account_unchanged(views, debits);
+    if (valid) {
+        commit_updates(job, updates, job->num_trans);
     }
-    printf("WARNING: Request to add was NULL, so it was not added to the job queue.\n");
+    account_unlock_many(job->debit_ids, debits);
+    return valid ? -1 : OCC_CONFLICT;
 }
 
 /**
- * Removes the job at the front of the job queue and returns a pointer the removed job.
+ * Adds a new job to the end of the job queue. Sleeps while the queue is full.
  * 
- * @return struct request* - the job from the front of the queue. Returns NULL if queue is empty.
+ * @param r - job of struct request type to be added to the queue
+ * @return int - 1 if the job was added, 0 if it was NULL or the queue has been closed
+ */
+int add_request(struct request * r) {
+    return rq_push(&Q, r);
+}
+
+/**
+ * Removes the job at the front of the job queue and returns a pointer the removed job. Sleeps while the queue is empty.
+ * 
+ * @return struct request* - the job from the front of the queue. Returns NULL once the queue is closed and empty.
  */
 struct request * get_request() {  
-    if (Q.num_jobs < 1) {
-        // Queue is empty return NULL
-        return NULL;
-    } 
-    // struct value to return
-    struct request * task;
-    // Task gets the first job in line
-    task = Q.head;
-    
-    // Give queue pointer NULL if no more jobs exist
-    if(Q.num_jobs == 1) {
-        // Reassign head to NULL since queue would now be empty
-        Q.head = NULL;
-        // Reassign tail to NULL since queue would now be empty
-        Q.tail = NULL;
-    } else {
-        // Head gets the next job in line
-        Q.head = Q.head->next;
+    return rq_pop(&Q);
+}
+
+/**
+ * Locks the debited accounts of a sorted TRANS, performs it and releases the locks.
+ *
+ * @param job - TRANS request with at least one debit or part of a TRANS spanning shards, sorted by account ID
+ * @return int - -1 if the transaction went through, otherwise the first account with insufficient funds
+ */
+static int locked_transaction(struct request * job) {
+    // Acquire Locks for each of the debited accounts
+    account_lock_many(job->debit_ids, job->num_debits);
+    stamp(&job->locked_ns);
+    // Attempt operation
+    int insufAccID = job->step == REQ_TRANS ? transaction_operation(job) : step_operation(job);
+    stamp(&job->stored_ns);
+    // Relenquishe Locks for each debited account
+    account_unlock_many(job->debit_ids, job->num_debits);
+    return insufAccID;
+}
+
+/**
+ * Performs one part of a TRANS spanning shards sent by the router. PREPARE checks the part's debits like
+ * transaction_operation, then holds them without changing any balance. COMMIT releases the hold and applies the
+ * part, which cannot be insufficient since its debits were held. ABORT only releases the hold. The caller must hold
+ * the lock of every debited account (or otherwise own the accounts).
+ *
+ * @param job - PREPARE, COMMIT or ABORT request
+ * @return int - -1 if the step went through, otherwise the first account with insufficient funds (PREPARE only)
+ */
+static int step_operation(struct request * job) {
+    int i, d = 0;
+    if (job->step != REQ_PREPARE) {
+        for (i = 0; i < job->num_trans; i++) {
+            if (job->transactions[i].amount < 0) {
+                account_hold(job->transactions[i].acc_id, job->transactions[i].amount);
+            }
+        }
+        return job->step == REQ_COMMIT ? transaction_operation(job) : -1;
     }
-    // Decrement job count
-    Q.num_jobs--;
 
-    // return the task
-    return task;
+    struct account_view views[job->num_trans];
+    for (i = 0; i < job->num_debits; i++) {
+        views[i].id = job->debit_ids[i];
+    }
+    account_read_many(views, job->num_debits);
+    for (i = 0; i < job->num_trans; i++) {
+        if (job->transactions[i].amount >= 0) {
+            continue;
+        }
+        if (views[d].balance - views[d].held + job->transactions[i].amount < 0) {
+            return job->transactions[i].acc_id;
+        }
+        d++;
+    }
+    if (!hold_prepared(job)) {
+        // The router went away and would never commit or abort it, refuse it instead of holding anything
+        return job->transactions[0].acc_id;
+    }
+    for (i = 0; i < job->num_trans; i++) {
+        if (job->transactions[i].amount < 0) {
+            account_hold(job->transactions[i].acc_id, -(int64_t)job->transactions[i].amount);
+        }
+    }
+    return -1;
 }
 
 /**
- * Takes a pointer to an array of trans type objects and sorts the elements from least to greatest based on account id.
- * 
- * @param transactions - array to be sorted
- * @param num_trans - number of elements in the array
+ * Remembers that a client sends PREPARE, so its prepared parts can be aborted when it goes away.
+ *
+ * @param client - connection the PREPARE came from
+ */
+static void note_preparer(int client) {
+    pthread_mutex_lock(&preparedMut);
+    struct preparer * c;
+    for (c = preparers; c != NULL && c->client != client; c = c->next);
+    if (c == NULL) {
+        // Without memory the client is never found, and hold_prepared refuses its parts
+        c = malloc(sizeof(struct preparer));
+        if (c != NULL) {
+            c->client = client;
+            c->closed = 0;
+            c->next = preparers;
+            preparers = c;
+        }
+    }
+    pthread_mutex_unlock(&preparedMut);
+}
+
+/**
+ * Adds a PREPARE that went through to the prepared parts, unless the client that sent it is gone.
+ *
+ * @param job - PREPARE request whose debits are about to be held
+ * @return int - 1 if the part was added, 0 if its client is gone or there is no memory for it
+ */
+static int hold_prepared(struct request * job) {
+    pthread_mutex_lock(&preparedMut);
+    struct preparer * c;
+    for (c = preparers; c != NULL && c->client != job->client; c = c->next);
+    struct prepared * t = NULL;
+    if (c != NULL && !c->closed) {
+        t = malloc(sizeof(struct prepared));
+    }
+    if (t != NULL) {
+        t->client = job->client;
+        t->req.type = REQ_PREPARE;
+        t->req.check_acc_id = -1;
+        t->req.txid = job->txid;
+        t->req.num_trans = job->num_trans;
+        memcpy(t->req.transactions, job->transactions, sizeof(struct trans) * job->num_trans);
+        t->req.num_debits = job->num_debits;
+        memcpy(t->req.debit_ids, job->debit_ids, sizeof(int) * job->num_debits);
+        t->req.error = NULL;
+        t->next = prepared;
+        prepared = t;
+    }
+    pthread_mutex_unlock(&preparedMut);
+    return t != NULL;
+}
+
+/**
+ * Removes a prepared part from the list.
+ *
+ * @param client - connection that prepared it
+ * @param txid   - the router's transaction ID
+ * @param out    - receives the PREPARE of the part
+ * @return int - 1 if the part was found, 0 if no such part is prepared
+ */
+static int take_prepared(int client, int txid, struct parsed_request * out) {
+    pthread_mutex_lock(&preparedMut);
+    struct prepared ** at = &prepared;
+    while (*at != NULL && ((*at)->client != client || (*at)->req.txid != txid)) {
+        at = &(*at)->next;
+    }
+    struct prepared * t = *at;
+    if (t != NULL) {
+        *at = t->next;
+        *out = t->req;
+    }
+    pthread_mutex_unlock(&preparedMut);
+    free(t);
+    return t != NULL;
+}
+
+/**
+ * Called by the network front end once a client is gone. If it was a router, every part it prepared and did not
+ * commit or abort yet is aborted, and nothing more is held for it.
+ *
+ * @param client - connection that closed
  */
-void sortIDLeastToGreatest(struct trans * transactions, int num_trans) {
-    // Temporary trans object
-    struct trans temp;
-    int i, j;
-    for (i = 0; i < num_trans; i++) {
-        // Checking current i against every other object in the array
-        for (j = i + 1; j < num_trans; j++) {
-            // If true swap the two transactions
-            if (transactions[i].acc_id > transactions[j].acc_id) {
-                // swapping positions
-                temp = transactions[j];
-                transactions[j] = transactions[i];
-                transactions[i] = temp;
+void client_closed(int client) {
+    pthread_mutex_lock(&preparedMut);
+    struct preparer * c;
+    for (c = preparers; c != NULL && c->client != client; c = c->next);
+    // Unlink every part the client left prepared
+    struct prepared * left = NULL;
+    struct prepared ** at = &prepared;
+    if (c != NULL) {
+        c->closed = 1;
+        while (*at != NULL) {
+            struct prepared * t = *at;
+            if (t->client == client) {
+                *at = t->next;
+                t->next = left;
+                left = t;
+            } else {
+                at = &t->next;
             }
         }
     }
-}
\ No newline at end of file
+    pthread_mutex_unlock(&preparedMut);
+
+    while (left != NULL) {
+        struct prepared * t = left;
+        left = t->next;
+        t->req.type = REQ_ABORT;
+        struct request * req = create_request(&t->req, client);
+        free(t);
+        if (!submit_request(req)) {
+            // Shutting down, the holds go away with the server
+            if (config.writer) {
+                writer_skip(req->request_id);
+            }
+            pool_free(req);
+        }
+    }
+}
+
+/**
+ * Applies the changes of a TRANS that goes through, logging it first with --wal. Caller holds the locks of the
+ * debited accounts, and nothing of the TRANS is visible before the append, so any request that sees its changes is
+ * logged after it.
+ *
+ * @param job     - TRANS being committed
+ * @param updates - its changes
+ * @param n       - number of changes
+ */
+static void commit_updates(struct request * job, const struct account_update * updates, int n) {
+    if (config.wal_path != NULL) {
+        commit_log_append(job->request_id, job->transactions, job->num_trans);
+    }
+    account_update_many(updates, n);
+}
+
+/**
+ * Records the current monotonic time into one of a request's STATS stamps, unless --stats=0.
+ * 
+ * @param at - stamp to fill
+ */
+static void stamp(uint64_t * at) {
+    if (config.stats) {
+        *at = stats_now();
+    }
+}
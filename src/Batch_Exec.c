@@ -0,0 +1,407 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Batch_Exec.c implements the deterministic batch execution mode. The
+ *      scheduler thread is the only consumer of the request queue. It parks
+ *      what it takes in a window indexed by request ID, since input sources
+ *      can queue their requests slightly out of ID order, and only schedules
+ *      the run of consecutive IDs that has fully arrived.
+ *
+ *      A batch is up to batch size such requests, taken once the batch is full
+ *      or latency microseconds after the scheduler started filling it. Each
+ *      request is placed in the first wave after every earlier request of the
+ *      batch it conflicts with. Two requests conflict when they share an
+ *      account, unless both only read it (CHECK) or both only deposit to it,
+ *      which commute. Requests of one wave therefore never touch the same
+ *      account in conflicting ways and run on the workers without locks. The
+ *      next wave is only handed out once the whole wave is done, so every pair
+ *      of conflicting requests runs in ID order, and the balances and ISF
+ *      results are those of a serial run in ID order.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "Futex.h"
+#include "Server.h"
+#include "Request_Pool.h"
+#include "Batch_Exec.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define WINDOW_INITIAL 1024     // starting request IDs of the window, it grows as needed
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct id_window {              // Requests taken from the queue but not yet scheduled, by request ID
+    struct request ** slots;    // ring of requests, ID i lives at i % cap, NULL if it has not arrived
+    int cap;                    // number of slots, a power of two
+    int next_id;                // lowest ID not yet scheduled
+    int ready_end;              // first ID from next_id on that has not arrived
+    int high_id;                // highest ID that arrived
+};
+
+struct account_marks {          // Latest wave of the current batch that touched an account
+    int batch;                  // batch the marks belong to, marks of an older batch count as 0
+    int read;                   // wave of the latest CHECK
+    int deposit;                // wave of the latest deposit
+    int write;                  // wave of the latest debit
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct request_queue * inQ = NULL;       // queue the requests arrive on
+static struct request_queue waveQ;              // requests of the wave being run, served by the workers
+static _Atomic uint32_t remaining;              // requests of the current wave not yet finished
+static struct id_window window;                 // requests waiting for their batch
+static struct account_marks * marks = NULL;     // per account, indexed by account ID - 1
+static struct request ** batch = NULL;          // requests of the batch, in ID order
+static struct request ** order = NULL;          // requests of the batch, by wave
+static int * levels = NULL;                     // wave of each request of the batch
+static int * waveSize = NULL;                   // requests per wave, then where each wave starts in order
+static int batchSize;                           // most requests per batch
+static int latencyUs;                           // most microseconds spent filling a batch
+static size_t marksBytes;                       // size of the marks mapping
+static int batchNo = 0;                         // batches scheduled so far
+static pthread_t schedTid;                      // scheduler thread
+static _Atomic uint64_t numBatches;             // STATS: batches run
+static _Atomic uint64_t numWaves;               // STATS: waves run
+static _Atomic uint64_t numScheduled;           // STATS: requests run
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static void* scheduler_loop(void * arg);
+static void park(struct request * r);
+static void window_grow(int need);
+static void run_batch();
+static int wave_of(const struct request * r);
+static struct account_marks * marks_of(int acc_id);
+static void run_wave(struct request ** jobs, int n);
+static void out_of_memory();
+/*===============================================================*/
+
+/**
+ * Allocates the scheduler's state and starts the scheduler thread, which becomes the only consumer of in.
+ *
+ * @param in           - queue the requests are submitted to
+ * @param num_accounts - number of accounts
+ * @param batch_size   - most requests split into waves at once
+ * @param latency_us   - most microseconds the scheduler waits for a batch to fill
+ * @return int - 1 if succeeded, 0 if memory or the thread could not be allocated
+ */
+int batch_init(struct request_queue * in, int num_accounts, int batch_size, int latency_us) {
+    inQ = in;
+    batchSize = batch_size;
+    latencyUs = latency_us;
+    window.cap = WINDOW_INITIAL;
+    window.next_id = 1;
+    window.ready_end = 1;
+    window.high_id = 0;
+    window.slots = calloc(window.cap, sizeof(struct request *));
+    // Zeroed pages, resident only for the accounts requests actually touch
+    marksBytes = sizeof(struct account_marks) * (size_t)num_accounts;
+    marks = mmap(NULL, marksBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (marks == MAP_FAILED) {
+        marks = NULL;
+    }
+    batch = malloc(sizeof(struct request *) * batch_size);
+    order = malloc(sizeof(struct request *) * batch_size);
+    levels = malloc(sizeof(int) * batch_size);
+    waveSize = malloc(sizeof(int) * (batch_size + 2));
+    if (window.slots == NULL || marks == NULL || batch == NULL || order == NULL || levels == NULL || waveSize == NULL) {
+        return 0;
+    }
+    // A wave is never larger than its batch, so handing it out never waits
+    if (!rq_init(&waveQ, batch_size)) {
+        return 0;
+    }
+    return pthread_create(&schedTid, NULL, scheduler_loop, NULL) == 0;
+}
+
+/**
+ * Waits for the scheduler to finish, which it does once the request queue is closed and every request has been
+ * run, and frees its state.
+ */
+void batch_destroy() {
+    if (inQ == NULL) {
+        return;
+    }
+    pthread_join(schedTid, NULL);
+    rq_destroy(&waveQ);
+    free(window.slots);
+    munmap(marks, marksBytes);
+    free(batch);
+    free(order);
+    free(levels);
+    free(waveSize);
+    inQ = NULL;
+}
+
+/**
+ * Loop of a worker in batch mode. Runs requests of the current wave until the scheduler is done.
+ *
+ * @param index - index of the calling worker
+ */
+void batch_worker(int index) {
+    struct request * job;
+    while ((job = rq_pop(&waveQ)) != NULL) {
+        // Nothing else in the wave touches these accounts in a conflicting way
+        execute_unlocked(job);
+        pool_free(job);
+        if (atomic_fetch_sub(&remaining, 1) == 1) {
+            futex_wake(&remaining, 1);
+        }
+    }
+}
+
+/**
+ * Writes the BATCH line of the STATS answer.
+ *
+ * @param buf  - receives the line, ending in a newline
+ * @param size - size of buf
+ * @return int - length of the line
+ */
+int batch_report(char * buf, size_t size) {
+    uint64_t batches = atomic_load_explicit(&numBatches, memory_order_relaxed);
+    uint64_t waves = atomic_load_explicit(&numWaves, memory_order_relaxed);
+    uint64_t requests = atomic_load_explicit(&numScheduled, memory_order_relaxed);
+    return snprintf(buf, size, "BATCH batches %llu waves %llu requests %llu per_batch %.1f per_wave %.1f\n",
+                    (unsigned long long)batches, (unsigned long long)waves, (unsigned long long)requests,
+                    batches ? (double)requests / batches : 0.0, waves ? (double)requests / waves : 0.0);
+}
+
+/**
+ * Scheduler thread. Fills a batch from the request queue, runs it wave by wave and repeats. Once the queue is closed
+ * and drained, runs what is left in the window in ID order, skipping IDs that were never queued, and releases the
+ * workers.
+ */
+static void* scheduler_loop(void * arg) {
+    struct request * r;
+    for (;;) {
+        if (window.ready_end - window.next_id < batchSize) {
+            if (window.ready_end == window.next_id) {
+                // Nothing can run yet, sleep until a request arrives
+                if ((r = rq_pop(inQ)) == NULL) {
+                    break;
+                }
+                park(r);
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += latencyUs / 1000000;
+            deadline.tv_nsec += (long)(latencyUs % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            while (window.ready_end - window.next_id < batchSize && (r = rq_pop_until(inQ, &deadline)) != NULL) {
+                park(r);
+            }
+        }
+        run_batch();
+    }
+
+    // The IDs still missing were given out but their requests were never queued
+    while (window.next_id <= window.high_id) {
+        if (window.ready_end == window.next_id) {
+            window.next_id++;
+            window.ready_end++;
+            while (window.ready_end <= window.high_id && window.slots[window.ready_end & (window.cap - 1)] != NULL) {
+                window.ready_end++;
+            }
+            continue;
+        }
+        run_batch();
+    }
+    rq_close(&waveQ);
+    return NULL;
+}
+
+/**
+ * Puts a request taken from the queue in the window and extends the run of consecutive IDs that arrived.
+ *
+ * @param r - request taken from the queue
+ */
+static void park(struct request * r) {
+    if (r->request_id - window.next_id + 1 > window.cap) {
+        window_grow(r->request_id - window.next_id + 1);
+    }
+    window.slots[r->request_id & (window.cap - 1)] = r;
+    if (r->request_id > window.high_id) {
+        window.high_id = r->request_id;
+    }
+    while (window.ready_end <= window.high_id && window.slots[window.ready_end & (window.cap - 1)] != NULL) {
+        window.ready_end++;
+    }
+}
+
+/**
+ * Doubles the window until it holds need IDs from next_id on.
+ *
+ * @param need - IDs the window must cover
+ */
+static void window_grow(int need) {
+    int cap = window.cap;
+    while (cap < need) {
+        cap <<= 1;
+    }
+    struct request ** slots = calloc(cap, sizeof(struct request *));
+    if (slots == NULL) {
+        out_of_memory();
+    }
+    int id;
+    for (id = window.next_id; id <= window.high_id; id++) {
+        slots[id & (cap - 1)] = window.slots[id & (window.cap - 1)];
+    }
+    free(window.slots);
+    window.slots = slots;
+    window.cap = cap;
+}
+
+/**
+ * Takes up to batchSize consecutive requests from the window, places each in its wave and runs the waves in order.
+ */
+static void run_batch() {
+    int n = window.ready_end - window.next_id;
+    if (n > batchSize) {
+        n = batchSize;
+    }
+    if (n == 0) {
+        return;
+    }
+    int i;
+    for (i = 0; i < n; i++) {
+        struct request ** slot = &window.slots[(window.next_id + i) & (window.cap - 1)];
+        batch[i] = *slot;
+        *slot = NULL;
+    }
+    window.next_id += n;
+
+    // Waves are numbered from 1, in ID order every request lands after the ones it conflicts with
+    batchNo++;
+    int numLevels = 0;
+    for (i = 0; i <= n + 1; i++) {
+        waveSize[i] = 0;
+    }
+    for (i = 0; i < n; i++) {
+        levels[i] = wave_of(batch[i]);
+        waveSize[levels[i]]++;
+        if (levels[i] > numLevels) {
+            numLevels = levels[i];
+        }
+    }
+    // Turn the sizes into start offsets, then lay the batch out wave by wave
+    int start = 0;
+    for (i = 1; i <= numLevels; i++) {
+        int size = waveSize[i];
+        waveSize[i] = start;
+        start += size;
+    }
+    for (i = 0; i < n; i++) {
+        order[waveSize[levels[i]]++] = batch[i];
+    }
+    // Each offset now points at the start of the next wave
+    start = 0;
+    for (i = 1; i <= numLevels; i++) {
+        run_wave(&order[start], waveSize[i] - start);
+        start = waveSize[i];
+    }
+
+    atomic_store_explicit(&numBatches, numBatches + 1, memory_order_relaxed);
+    atomic_store_explicit(&numWaves, numWaves + numLevels, memory_order_relaxed);
+    atomic_store_explicit(&numScheduled, numScheduled + n, memory_order_relaxed);
+}
+
+/**
+ * Finds the wave of a request: the one after the latest wave of the batch that touched any of its accounts in a way
+ * that does not commute with it. Records the request's own accesses.
+ *
+ * @param r - next request of the batch in ID order
+ * @return int - wave of the request, starting at 1
+ */
+static int wave_of(const struct request * r) {
+    struct account_marks * m;
+    int level = 0;
+    int i;
+    if (r->check_acc_id != -1) {
+        m = marks_of(r->check_acc_id);
+        level = (m->deposit > m->write ? m->deposit : m->write) + 1;
+        if (m->read < level) {
+            m->read = level;
+        }
+        return level;
+    }
+    for (i = 0; i < r->num_trans; i++) {
+        m = marks_of(r->transactions[i].acc_id);
+        int after = m->read > m->write ? m->read : m->write;
+        if (r->transactions[i].amount < 0 && m->deposit > after) {
+            after = m->deposit;
+        }
+        if (after + 1 > level) {
+            level = after + 1;
+        }
+    }
+    for (i = 0; i < r->num_trans; i++) {
+        m = marks_of(r->transactions[i].acc_id);
+        if (r->transactions[i].amount < 0) {
+            m->write = level;
+        } else if (m->deposit < level) {
+            m->deposit = level;
+        }
+    }
+    return level;
+}
+
+/**
+ * @param acc_id - account ID
+ * @return struct account_marks* - marks of the account for the current batch
+ */
+static struct account_marks * marks_of(int acc_id) {
+    struct account_marks * m = &marks[acc_id - 1];
+    if (m->batch != batchNo) {
+        m->batch = batchNo;
+        m->read = 0;
+        m->deposit = 0;
+        m->write = 0;
+    }
+    return m;
+}
+
+/**
+ * Hands the requests of one wave to the workers and waits until all of them are finished.
+ *
+ * @param jobs - requests of the wave
+ * @param n    - number of requests
+ */
+static void run_wave(struct request ** jobs, int n) {
+    atomic_store(&remaining, n);
+    int i;
+    for (i = 0; i < n; i++) {
+        rq_push(&waveQ, jobs[i]);
+    }
+    uint32_t left;
+    while ((left = atomic_load(&remaining)) != 0) {
+        futex_wait(&remaining, left);
+    }
+}
+
+/**
+ * Stops the server when the scheduler cannot hold the requests it was handed.
+ */
+static void out_of_memory() {
+    printf("ERROR: Batch scheduler out of memory: %s\n", strerror(errno));
+    exit(1);
+}
@@ -0,0 +1,35 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Batch_Exec.h declares the deterministic batch execution mode
+ *      (--exec=batch). A scheduler thread takes the queued requests in
+ *      request ID order, splits each batch into waves of requests that share
+ *      no account, and the workers run one wave at a time without account
+ *      locks. The results are those of running every request serially in ID
+ *      order.
+*/
+#ifndef BATCH_EXEC_H
+#define BATCH_EXEC_H
+
+#include <stddef.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define BATCH_SIZE_DEFAULT 256      // most requests split into waves at once
+#define BATCH_LATENCY_DEFAULT 1000  // most microseconds the scheduler waits for a batch to fill
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+struct request_queue;
+
+int batch_init(struct request_queue * in, int num_accounts, int batch_size, int latency_us);
+void batch_destroy();
+void batch_worker(int index);
+int batch_report(char * buf, size_t size);
+/*===============================================================*/
+
+#endif
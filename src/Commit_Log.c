@@ -0,0 +1,551 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Commit_Log.c implements the write-ahead commit log. The log is a file
+ *      of records, one per TRANS that went through: a header with a checksum,
+ *      the request ID and the number of pairs, followed by the pairs. Only the
+ *      amounts are logged, never balances, so records commute and replaying
+ *      the whole log adds every amount back whatever order the workers logged
+ *      them in.
+ *
+ *      A TRANS is appended while it still holds its account locks and before
+ *      any of its changes can be seen, so anything that read its changes is
+ *      appended after it. A durable prefix of the log therefore never holds a
+ *      TRANS without the ones it depended on.
+ *
+ *      Workers append records and held result lines to two buffers under one
+ *      mutex. The log thread takes both buffers at once, writes the records
+ *      and makes them durable with one fdatasync, then emits the held results.
+ *      Every result taken had its record, or everything it read, appended
+ *      before it, so it is durable once that group is. Appends made while the
+ *      log thread syncs form the next group. With a window the log thread also
+ *      waits up to that many microseconds for more commits to join a group,
+ *      trading latency for fewer syncs. A result held while nothing is logged
+ *      or being synced depends on nothing new and is emitted at once.
+ *
+ *      At startup every whole record is replayed into the account table,
+ *      from where the snapshot (if any) left off. A torn record at the end,
+ *      from a crash in the middle of a write, fails its checksum and is cut
+ *      off before new records are appended. Readers of the durable log (the
+ *      checkpointer, replication) can wait for it to grow.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "Accounts.h"
+#include "Stats.h"
+#include "Commit_Log.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define LOG_BUF_INITIAL 65536       // starting size of each buffer
+#define LOG_READ_CHUNK (1 << 20)    // bytes of the log read at a time
+#define FNV_OFFSET 2166136261u      // FNV-1a starting hash
+#define FNV_PRIME 16777619u         // FNV-1a multiplier
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct log_record {             // Header of one logged TRANS, followed by its pairs
+    uint32_t check;             // FNV-1a of the rest of the record
+    int32_t request_id;         // request ID of the TRANS
+    int32_t num_pairs;          // number of pairs that follow
+};
+
+struct held_result {            // Header of a held result, followed by the line
+    int id;                     // request ID the line answers
+    int len;                    // length of the line
+};
+
+struct log_buf {                // Records or held results of one group
+    char * data;                // buffered bytes
+    size_t len;                 // bytes in data
+    size_t cap;                 // size of data
+    int count;                  // entries in data
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static int logFd = -1;                          // log file
+static int windowUs;                            // most microseconds a group waits for more commits
+static void (*emitResult)(int, const char *, int);  // writes a result that may be released
+static pthread_t logTid;                        // log thread
+static pthread_mutex_t logMut = PTHREAD_MUTEX_INITIALIZER;  // guards records, held, syncing and stopping
+static pthread_cond_t logCond = PTHREAD_COND_INITIALIZER;   // signaled when a group starts or fills up, and on close
+static struct log_buf records;                  // records of the group being filled
+static struct log_buf held;                     // results waiting for the group being filled
+static struct log_buf syncRecords;              // log thread's side, swapped with records
+static struct log_buf syncHeld;                 // log thread's side, swapped with held
+static int syncing = 0;                         // the log thread is writing a group
+static int stopping = 0;                        // set by commit_log_close
+static _Atomic uint64_t numRecords;             // STATS: records made durable
+static _Atomic uint64_t numSyncs;               // STATS: fdatasync calls
+static _Atomic uint64_t syncTotalNs;            // STATS: time spent writing and syncing groups
+static _Atomic off_t durableEnd;                // offset the durable records end at
+static uint64_t durableNs;                      // monotonic time durableEnd last moved
+static pthread_mutex_t durableMut = PTHREAD_MUTEX_INITIALIZER;  // guards durableNs and waits for durableEnd
+static pthread_cond_t durableCond = PTHREAD_COND_INITIALIZER;   // broadcast whenever durableEnd moves
+static uint64_t numReplayed;                    // STATS: records replayed at startup
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static void restore_record(void * ctx, const struct trans * pairs, int num_pairs);
+static uint32_t record_check(const struct log_record * rec, const struct trans * pairs);
+static uint32_t fnv(uint32_t hash, const void * data, size_t len);
+static int buf_init(struct log_buf * b);
+static void buf_append(struct log_buf * b, const void * data, size_t len, const void * more, size_t more_len);
+static void release(const struct log_buf * b);
+static void write_all(const char * data, size_t len);
+static void log_failed();
+static void* log_loop(void * arg);
+/*===============================================================*/
+
+/**
+ * Opens the log, replays every record in it from start on into the accounts and starts the log thread. The accounts
+ * must be initialized, and no request may run before this returns.
+ *
+ * @param path         - log file, created if missing
+ * @param start        - offset of the first record not already in the balances (see Snapshot.c)
+ * @param num_accounts - number of accounts, every logged account ID must be one of them
+ * @param window_us    - most microseconds a group waits for more commits before being synced, 0 syncs at once
+ * @param emit         - writes a result line once it may be released
+ * @return int - 1 if succeeded, 0 if the log could not be opened or replayed
+ */
+int commit_log_init(const char * path, off_t start, int num_accounts, int window_us,
+                    void (*emit)(int id, const char * line, int len)) {
+    logFd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (logFd < 0 || fstat(logFd, &st) != 0 || st.st_size < start) {
+        // A log shorter than what the balances already hold is not this log
+        return 0;
+    }
+    off_t valid = commit_log_read(logFd, start, st.st_size, num_accounts, restore_record, NULL);
+    if (valid < 0) {
+        return 0;
+    }
+    atomic_store(&durableEnd, valid);
+    durableNs = stats_now();
+    // Drop a torn record so new records follow the last whole one
+    if (ftruncate(logFd, valid) != 0 || lseek(logFd, valid, SEEK_SET) < 0) {
+        return 0;
+    }
+    windowUs = window_us;
+    emitResult = emit;
+    if (!buf_init(&records) || !buf_init(&held) || !buf_init(&syncRecords) || !buf_init(&syncHeld)) {
+        return 0;
+    }
+    return pthread_create(&logTid, NULL, log_loop, NULL) == 0;
+}
+
+/**
+ * Logs a TRANS that is about to go through. Called before any of its changes are made, while its account locks are
+ * held.
+ *
+ * @param request_id - request ID of the TRANS
+ * @param pairs      - its transaction pairs
+ * @param num_pairs  - number of pairs
+ */
+void commit_log_append(int request_id, const struct trans * pairs, int num_pairs) {
+    struct log_record rec;
+    rec.request_id = request_id;
+    rec.num_pairs = num_pairs;
+    rec.check = record_check(&rec, pairs);
+
+    pthread_mutex_lock(&logMut);
+    int first = records.len == 0;
+    buf_append(&records, &rec, sizeof(rec), pairs, sizeof(struct trans) * num_pairs);
+    int full = records.len >= WAL_BATCH_BYTES;
+    if (first || full) {
+        pthread_cond_signal(&logCond);
+    }
+    pthread_mutex_unlock(&logMut);
+}
+
+/**
+ * Hands over a result line, which is written once everything logged before it is durable.
+ *
+ * @param id   - request ID the line answers
+ * @param line - formatted result, including its newline
+ * @param len  - length of line
+ */
+void commit_log_hold(int id, const char * line, int len) {
+    pthread_mutex_lock(&logMut);
+    if (records.len == 0 && !syncing) {
+        // Everything logged so far is durable already
+        pthread_mutex_unlock(&logMut);
+        emitResult(id, line, len);
+        return;
+    }
+    // The log thread is busy or about to be, it releases held results after its next sync
+    struct held_result h = { id, len };
+    buf_append(&held, &h, sizeof(h), line, len);
+    pthread_mutex_unlock(&logMut);
+}
+
+/**
+ * Writes the WAL line of the STATS answer.
+ *
+ * @param buf  - receives the line, ending in a newline
+ * @param size - size of buf
+ * @return int - length of the line
+ */
+int commit_log_report(char * buf, size_t size) {
+    uint64_t logged = atomic_load_explicit(&numRecords, memory_order_relaxed);
+    uint64_t syncs = atomic_load_explicit(&numSyncs, memory_order_relaxed);
+    uint64_t ns = atomic_load_explicit(&syncTotalNs, memory_order_relaxed);
+    return snprintf(buf, size, "WAL records %llu syncs %llu per_sync %.1f sync_avg %.1f us replayed %llu\n",
+                    (unsigned long long)logged, (unsigned long long)syncs, syncs ? (double)logged / syncs : 0.0,
+                    syncs ? ns / 1e3 / syncs : 0.0, (unsigned long long)numReplayed);
+}
+
+/**
+ * @return off_t - offset the durable records of the log end at, 0 before commit_log_init
+ */
+off_t commit_log_durable() {
+    return atomic_load(&durableEnd);
+}
+
+/**
+ * Waits for the durable part of the log to grow past an offset.
+ *
+ * @param seen       - offset the caller has already handled
+ * @param timeout_ms - most milliseconds to wait
+ * @param durable_ns - receives the monotonic time the durable records came to end where they do
+ * @return off_t - offset the durable records end at, seen if the wait timed out
+ */
+off_t commit_log_wait(off_t seen, int timeout_ms, uint64_t * durable_ns) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&durableMut);
+    while (atomic_load(&durableEnd) <= seen) {
+        if (pthread_cond_timedwait(&durableCond, &durableMut, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    off_t end = atomic_load(&durableEnd);
+    *durable_ns = durableNs;
+    pthread_mutex_unlock(&durableMut);
+    return end;
+}
+
+/**
+ * Makes everything logged durable, emits every held result and stops the log thread. No worker may be running
+ * anymore.
+ */
+void commit_log_close() {
+    if (logFd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&logMut);
+    stopping = 1;
+    pthread_cond_signal(&logCond);
+    pthread_mutex_unlock(&logMut);
+    pthread_join(logTid, NULL);
+    close(logFd);
+    logFd = -1;
+    free(records.data);
+    free(held.data);
+    free(syncRecords.data);
+    free(syncHeld.data);
+}
+
+/**
+ * Applies whole records of a log to something, stopping at the first torn one. Safe to call on a log that is being
+ * appended to, for the part that is durable.
+ *
+ * @param fd           - log file
+ * @param from         - offset of the first record
+ * @param to           - offset the records end at, or the file size
+ * @param num_accounts - number of accounts, every logged account ID must be one of them
+ * @param apply        - called with ctx and the pairs of every record in log order
+ * @param ctx          - passed to apply
+ * @return off_t - offset after the last whole record, -1 if the log could not be read or names an account that does
+ *                 not exist
+ */
+off_t commit_log_read(int fd, off_t from, off_t to, int num_accounts,
+                      void (*apply)(void * ctx, const struct trans * pairs, int num_pairs), void * ctx) {
+    char * buf = malloc(LOG_READ_CHUNK);
+    if (buf == NULL) {
+        return -1;
+    }
+    off_t pos = from;
+    int torn = 0;
+    while (!torn && pos < to) {
+        size_t want = to - pos < LOG_READ_CHUNK ? (size_t)(to - pos) : LOG_READ_CHUNK;
+        ssize_t got = pread(fd, buf, want, pos);
+        if (got <= 0) {
+            // Nothing where the file was supposed to go on counts as the end of the log
+            if (got < 0) {
+                pos = -1;
+            }
+            break;
+        }
+        int bad;
+        long used = commit_log_apply(buf, got, num_accounts, apply, ctx, &bad);
+        if (used < 0) {
+            free(buf);
+            return -1;
+        }
+        // A record cut by the chunk is read again from its start, unless the log ends first. A whole chunk without
+        // a whole record means the file ends before to.
+        torn = bad || (used < got && pos + got >= to) || used == 0;
+        pos += used;
+    }
+    free(buf);
+    return pos;
+}
+
+/**
+ * Applies the whole records at the start of a buffer of log bytes, as read from the log or received from a primary.
+ *
+ * @param buf          - log bytes starting at a record
+ * @param len          - number of bytes in buf
+ * @param num_accounts - number of accounts, every logged account ID must be one of them
+ * @param apply        - called with ctx and the pairs of every record in log order
+ * @param ctx          - passed to apply
+ * @param torn         - set to 1 if the records end at one that is not valid, 0 if buf only ends inside a record or
+ *                       at a record boundary
+ * @return long - bytes of whole records applied, -1 if a record names an account that does not exist
+ */
+long commit_log_apply(const char * buf, size_t len, int num_accounts,
+                      void (*apply)(void * ctx, const struct trans * pairs, int num_pairs), void * ctx, int * torn) {
+    size_t used = 0;
+    *torn = 0;
+    while (len - used >= sizeof(struct log_record)) {
+        struct log_record rec;
+        memcpy(&rec, buf + used, sizeof(rec));
+        if (rec.num_pairs < 1 || rec.num_pairs > MAX_TRANS_PAIRS) {
+            *torn = 1;
+            break;
+        }
+        size_t size = sizeof(rec) + sizeof(struct trans) * rec.num_pairs;
+        if (len - used < size) {
+            break;
+        }
+        struct trans pairs[MAX_TRANS_PAIRS];
+        memcpy(pairs, buf + used + sizeof(rec), sizeof(struct trans) * rec.num_pairs);
+        if (record_check(&rec, pairs) != rec.check) {
+            *torn = 1;
+            break;
+        }
+        int i;
+        for (i = 0; i < rec.num_pairs; i++) {
+            if (pairs[i].acc_id < 1 || pairs[i].acc_id > num_accounts) {
+                // A whole record, so the log was written for more accounts than this server has
+                return -1;
+            }
+        }
+        apply(ctx, pairs, rec.num_pairs);
+        used += size;
+    }
+    return used;
+}
+
+/**
+ * Replays one record into the accounts.
+ *
+ * @param ctx       - unused
+ * @param pairs     - the record's pairs
+ * @param num_pairs - number of pairs
+ */
+static void restore_record(void * ctx, const struct trans * pairs, int num_pairs) {
+    int i;
+    for (i = 0; i < num_pairs; i++) {
+        account_restore(pairs[i].acc_id, pairs[i].amount);
+    }
+    numReplayed++;
+}
+
+/**
+ * @param rec   - record header, request_id and num_pairs filled in
+ * @param pairs - the record's pairs
+ * @return uint32_t - checksum of the record
+ */
+static uint32_t record_check(const struct log_record * rec, const struct trans * pairs) {
+    int32_t head[2] = { rec->request_id, rec->num_pairs };
+    return fnv(fnv(FNV_OFFSET, head, sizeof(head)), pairs, sizeof(struct trans) * rec->num_pairs);
+}
+
+/**
+ * Continues an FNV-1a hash over some bytes.
+ *
+ * @param hash - hash so far
+ * @param data - bytes to add
+ * @param len  - number of bytes
+ * @return uint32_t - the new hash
+ */
+static uint32_t fnv(uint32_t hash, const void * data, size_t len) {
+    const unsigned char * p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @param b - buffer to set up empty
+ * @return int - 1 if succeeded, 0 if memory could not be allocated
+ */
+static int buf_init(struct log_buf * b) {
+    b->data = malloc(LOG_BUF_INITIAL);
+    b->len = 0;
+    b->cap = LOG_BUF_INITIAL;
+    b->count = 0;
+    return b->data != NULL;
+}
+
+/**
+ * Appends one entry made of one or two pieces to a buffer, growing it as needed. Caller holds logMut or owns the
+ * buffer.
+ *
+ * @param b        - buffer to append to
+ * @param data     - first piece
+ * @param len      - length of data
+ * @param more     - second piece
+ * @param more_len - length of more
+ */
+static void buf_append(struct log_buf * b, const void * data, size_t len, const void * more, size_t more_len) {
+    if (b->len + len + more_len > b->cap) {
+        // The disk is behind, keep everything rather than block the worker
+        b->cap = (b->len + len + more_len) * 2;
+        b->data = realloc(b->data, b->cap);
+        if (b->data == NULL) {
+            log_failed();
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    memcpy(b->data + b->len + len, more, more_len);
+    b->len += len + more_len;
+    b->count++;
+}
+
+/**
+ * Emits every result of a group of held results.
+ *
+ * @param b - held results
+ */
+static void release(const struct log_buf * b) {
+    size_t pos = 0;
+    while (pos < b->len) {
+        struct held_result h;
+        memcpy(&h, b->data + pos, sizeof(h));
+        emitResult(h.id, b->data + pos + sizeof(h), h.len);
+        pos += sizeof(h) + h.len;
+    }
+}
+
+/**
+ * Writes bytes to the end of the log.
+ *
+ * @param data - bytes to write
+ * @param len  - number of bytes
+ */
+static void write_all(const char * data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(logFd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_failed();
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * Stops the server when the log can no longer be written. Results waiting for it cannot be acknowledged anymore.
+ */
+static void log_failed() {
+    printf("ERROR: Commit log write failed: %s\n", strerror(errno));
+    exit(1);
+}
+
+/**
+ * Log thread. Waits for a group to start, lets it fill for up to the window, then writes and syncs its records and
+ * releases its held results. On close it keeps going until nothing is left.
+ */
+static void* log_loop(void * arg) {
+    pthread_mutex_lock(&logMut);
+    for (;;) {
+        while (!stopping && records.len == 0 && held.len == 0) {
+            pthread_cond_wait(&logCond, &logMut);
+        }
+        if (stopping && records.len == 0 && held.len == 0) {
+            break;
+        }
+        if (windowUs > 0 && records.len > 0 && !stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += windowUs / 1000000;
+            deadline.tv_nsec += (long)(windowUs % 1000000) * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            while (!stopping && records.len < WAL_BATCH_BYTES) {
+                if (pthread_cond_timedwait(&logCond, &logMut, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+        // Take the whole group so workers can start the next one meanwhile
+        struct log_buf b = records;
+        records = syncRecords;
+        syncRecords = b;
+        records.len = 0;
+        records.count = 0;
+        b = held;
+        held = syncHeld;
+        syncHeld = b;
+        held.len = 0;
+        held.count = 0;
+        syncing = 1;
+        pthread_mutex_unlock(&logMut);
+
+        if (syncRecords.len > 0) {
+            uint64_t start = stats_now();
+            write_all(syncRecords.data, syncRecords.len);
+            if (fdatasync(logFd) != 0) {
+                log_failed();
+            }
+            atomic_fetch_add_explicit(&syncTotalNs, stats_now() - start, memory_order_relaxed);
+            atomic_fetch_add_explicit(&numRecords, syncRecords.count, memory_order_relaxed);
+            atomic_fetch_add_explicit(&numSyncs, 1, memory_order_relaxed);
+            pthread_mutex_lock(&durableMut);
+            atomic_fetch_add(&durableEnd, syncRecords.len);
+            durableNs = stats_now();
+            pthread_cond_broadcast(&durableCond);
+            pthread_mutex_unlock(&durableMut);
+        }
+        release(&syncHeld);
+
+        pthread_mutex_lock(&logMut);
+        syncing = 0;
+    }
+    pthread_mutex_unlock(&logMut);
+    return NULL;
+}
@@ -0,0 +1,44 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Commit_Log.h declares the write-ahead commit log (--wal). Every TRANS
+ *      that goes through is appended to the log before its changes are made,
+ *      and every result is held back until the log is durable up to the point
+ *      the request saw. A log thread makes each group of appends durable with
+ *      one fdatasync. At startup the log is replayed to rebuild the balances.
+*/
+#ifndef COMMIT_LOG_H
+#define COMMIT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "Request_Parser.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define WAL_WINDOW_DEFAULT 0            // most microseconds a group waits for more commits before being synced
+#define WAL_BATCH_BYTES (256 * 1024)    // logged bytes that sync a group without waiting out the window
+#define WAL_RECORD_MAX (12 + 8 * MAX_TRANS_PAIRS)   // bytes of the largest record
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int commit_log_init(const char * path, off_t start, int num_accounts, int window_us,
+                    void (*emit)(int id, const char * line, int len));
+off_t commit_log_read(int fd, off_t from, off_t to, int num_accounts,
+                      void (*apply)(void * ctx, const struct trans * pairs, int num_pairs), void * ctx);
+long commit_log_apply(const char * buf, size_t len, int num_accounts,
+                      void (*apply)(void * ctx, const struct trans * pairs, int num_pairs), void * ctx, int * torn);
+off_t commit_log_durable();
+off_t commit_log_wait(off_t seen, int timeout_ms, uint64_t * durable_ns);
+void commit_log_append(int request_id, const struct trans * pairs, int num_pairs);
+void commit_log_hold(int id, const char * line, int len);
+int commit_log_report(char * buf, size_t size);
+void commit_log_close();
+/*===============================================================*/
+
+#endif
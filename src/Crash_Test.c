@@ -0,0 +1,413 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Crash_Test.c checks that --wal survives the server being killed. It
+ *      starts a server with a fresh commit log, streams TRANS at it and kills
+ *      it with SIGKILL partway through the stream, then restarts it on the
+ *      same log and CHECKs every account.
+ *
+ *      Every TRANS also deposits 1 into a witness account of its own, so the
+ *      recovered witnesses tell exactly which TRANS the log kept, whatever
+ *      order they ran in. The test passes if:
+ *          - every TRANS answered OK before the kill was kept
+ *          - no TRANS answered ISF was kept
+ *          - every witness is 0 or 1, so no TRANS was kept twice
+ *          - every balance is the sum of the TRANS kept, so none was kept
+ *            in part
+ *          - no balance is negative
+ *
+ *      Build with: make test_crash
+ *      Run:        ./crash_test <# of worker threads> <# of accounts> <# of TRANS> <ms before the kill> [seed]
+ *                               [-- server options]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define SERVER_BIN "./appserver"                // server program, started from the build directory
+#define CRASH_WAL "/tmp/crash_test.wal"         // commit log shared by both runs of the server
+#define CRASH_SOCK "/tmp/crash_test.sock"       // client socket of the server
+#define CRASH_OUT "/tmp/crash_test.%d.out"      // output file of run n, 1 before the kill and 2 after
+#define MAX_PAIRS 3                             // most pairs of a TRANS, besides its witness
+#define MAX_DEBIT 150                           // largest debit of a pair
+#define MAX_DEPOSIT 200                         // largest deposit of a pair
+#define CONNECT_TRIES 1000                      // attempts to reach the server's socket
+#define CONNECT_WAIT_US 10000                   // microseconds between attempts
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct trans_line {             // One TRANS of the stream, without its witness
+    int num_pairs;              // number of pairs
+    int acc_ids[MAX_PAIRS];     // distinct accounts
+    int amounts[MAX_PAIRS];     // amount of each pair
+};
+
+struct stream {                 // Request lines and the connection they go to
+    int fd;                     // connection to the server
+    char * data;                // request lines
+    size_t len;                 // bytes of data
+    int replies;                // "ID n" replies expected on fd
+};
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+char * generate(struct trans_line * lines, int count, int numAccounts, unsigned int seed, size_t * len);
+pid_t start_server(int run, int workers, int numAccounts, char ** serverArgs, int numServerArgs, int * fd);
+int connect_server();
+void* send_all(void * arg);
+void* read_replies(void * arg);
+int read_outcomes(int run, char * outcomes, int count);
+int read_balances(int run, long long * balances, int count);
+/*===============================================================*/
+
+/**
+ * Runs the stream, kills the server, recovers it and checks what the log kept.
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int - 0 if the test passed, 1 if it failed
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        printf("Usage: %s <# of worker threads> <# of accounts> <# of TRANS> <ms before the kill> [seed] [-- server options]\n", argv[0]);
+        return 1;
+    }
+    int workers = atoi(argv[1]);
+    int numAccounts = atoi(argv[2]);
+    int numTrans = atoi(argv[3]);
+    int killMs = atoi(argv[4]);
+    unsigned int seed = 1;
+    int a = 5;
+    if (argc > a && strcmp(argv[a], "--")) {
+        seed = atoi(argv[a++]);
+    }
+    char ** serverArgs = NULL;
+    int numServerArgs = 0;
+    if (argc > a && !strcmp(argv[a], "--")) {
+        serverArgs = argv + a + 1;
+        numServerArgs = argc - a - 1;
+    }
+    if (workers < 1 || numAccounts < MAX_PAIRS || numTrans < 1 || killMs < 0) {
+        printf("ERROR: invalid arguments\n");
+        return 1;
+    }
+    // Witness i + 1 follows the accounts
+    int totalAccounts = numAccounts + numTrans;
+
+    struct trans_line * lines = malloc(sizeof(struct trans_line) * numTrans);
+    char * outcomes = calloc(numTrans, 1);
+    long long * balances = calloc(totalAccounts, sizeof(long long));
+    long long * expected = calloc(numAccounts, sizeof(long long));
+    if (lines == NULL || outcomes == NULL || balances == NULL || expected == NULL) {
+        printf("ERROR: out of memory\n");
+        return 1;
+    }
+    struct stream s;
+    s.data = generate(lines, numTrans, numAccounts, seed, &s.len);
+    s.replies = numTrans;
+
+    // Run 1: stream the TRANS and kill the server partway
+    unlink(CRASH_WAL);
+    pid_t pid = start_server(1, workers, totalAccounts, serverArgs, numServerArgs, &s.fd);
+    if (pid < 0) {
+        printf("ERROR: server did not start\n");
+        return 1;
+    }
+    pthread_t sender, reader;
+    pthread_create(&sender, NULL, send_all, &s);
+    pthread_create(&reader, NULL, read_replies, &s);
+    usleep(killMs * 1000);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    // The socket is gone, both threads see it fail
+    shutdown(s.fd, SHUT_RDWR);
+    pthread_join(sender, NULL);
+    pthread_join(reader, NULL);
+    close(s.fd);
+    int answered = read_outcomes(1, outcomes, numTrans);
+
+    // Run 2: recover from the same log and read every balance
+    pid = start_server(2, workers, totalAccounts, serverArgs, numServerArgs, &s.fd);
+    if (pid < 0) {
+        printf("ERROR: server did not restart\n");
+        return 1;
+    }
+    free(s.data);
+    s.data = malloc((size_t)totalAccounts * 20 + 8);
+    s.len = 0;
+    int i, j;
+    for (i = 1; i <= totalAccounts; i++) {
+        s.len += sprintf(s.data + s.len, "CHECK %d\n", i);
+    }
+    s.len += sprintf(s.data + s.len, "END\n");
+    s.replies = totalAccounts;
+    pthread_create(&reader, NULL, read_replies, &s);
+    send_all(&s);
+    pthread_join(reader, NULL);
+    int status;
+    waitpid(pid, &status, 0);
+    close(s.fd);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || read_balances(2, balances, totalAccounts) != totalAccounts) {
+        printf("ERROR: recovered server did not answer every CHECK\n");
+        return 1;
+    }
+
+    // Every check works from the witnesses
+    int kept = 0, lostOK = 0, keptISF = 0, badWitness = 0, wrong = 0, negative = 0, unanswered = 0;
+    for (i = 0; i < numTrans; i++) {
+        long long witness = balances[numAccounts + i];
+        if (witness != 0 && witness != 1) {
+            badWitness++;
+            continue;
+        }
+        if (witness == 1) {
+            kept++;
+            unanswered += outcomes[i] == 0;
+            keptISF += outcomes[i] == 'I';
+            for (j = 0; j < lines[i].num_pairs; j++) {
+                expected[lines[i].acc_ids[j] - 1] += lines[i].amounts[j];
+            }
+        } else {
+            lostOK += outcomes[i] == 'O';
+        }
+    }
+    for (i = 0; i < numAccounts; i++) {
+        wrong += balances[i] != expected[i];
+        negative += balances[i] < 0;
+    }
+    int passed = !lostOK && !keptISF && !badWitness && !wrong && !negative;
+    printf("crash: killed after %d ms, %d of %d TRANS answered, %d kept by the log (%d of them unanswered)\n",
+           killMs, answered, numTrans, kept, unanswered);
+    printf("crash: %d OK lost, %d ISF kept, %d bad witnesses, %d wrong balances, %d negative: %s\n",
+           lostOK, keptISF, badWitness, wrong, negative, passed ? "PASSED" : "FAILED");
+    free(lines);
+    free(outcomes);
+    free(balances);
+    free(expected);
+    free(s.data);
+    return passed ? 0 : 1;
+}
+
+/**
+ * Builds the TRANS stream. Each TRANS has one to MAX_PAIRS distinct accounts that mostly debit, so many go ISF once
+ * the balances run low, and a witness deposit of 1 into account numAccounts + i + 1.
+ *
+ * @param lines       - receives each TRANS without its witness
+ * @param count       - number of TRANS
+ * @param numAccounts - accounts to pick from
+ * @param seed        - seed of the picks, the same seed gives the same stream
+ * @param len         - receives the size of the stream
+ * @return char* - request lines
+ */
+char * generate(struct trans_line * lines, int count, int numAccounts, unsigned int seed, size_t * len) {
+    char * data = malloc((size_t)count * (8 + (MAX_PAIRS + 1) * 24) + 1);
+    size_t off = 0;
+    int i, j, k;
+    for (i = 0; i < count; i++) {
+        struct trans_line * t = &lines[i];
+        t->num_pairs = rand_r(&seed) % MAX_PAIRS + 1;
+        off += sprintf(data + off, "TRANS");
+        for (j = 0; j < t->num_pairs; j++) {
+            // Distinct accounts, so each one's amount is the pair's
+            do {
+                t->acc_ids[j] = rand_r(&seed) % numAccounts + 1;
+                for (k = 0; k < j && t->acc_ids[k] != t->acc_ids[j]; k++);
+            } while (k < j);
+            t->amounts[j] = rand_r(&seed) % 2 ? rand_r(&seed) % MAX_DEPOSIT + 1 : -(rand_r(&seed) % MAX_DEBIT + 1);
+            off += sprintf(data + off, " %d %d", t->acc_ids[j], t->amounts[j]);
+        }
+        off += sprintf(data + off, " %d 1\n", numAccounts + i + 1);
+    }
+    *len = off;
+    return data;
+}
+
+/**
+ * Starts the server on the commit log and connects to it.
+ *
+ * @param run           - 1 for the run that is killed, 2 for the recovery
+ * @param workers       - worker threads
+ * @param numAccounts   - accounts including the witnesses
+ * @param serverArgs    - options passed to the server
+ * @param numServerArgs - number of serverArgs
+ * @param fd            - receives the connection
+ * @return pid_t - the server process, -1 if it could not be reached
+ */
+pid_t start_server(int run, int workers, int numAccounts, char ** serverArgs, int numServerArgs, int * fd) {
+    char workerCount[16], accountCount[16], outPath[64];
+    snprintf(workerCount, sizeof(workerCount), "%d", workers);
+    snprintf(accountCount, sizeof(accountCount), "%d", numAccounts);
+    snprintf(outPath, sizeof(outPath), CRASH_OUT, run);
+    char * argv[numServerArgs + 10];
+    int a = 0, i;
+    argv[a++] = SERVER_BIN;
+    argv[a++] = workerCount;
+    argv[a++] = accountCount;
+    argv[a++] = outPath;
+    argv[a++] = "--unix=" CRASH_SOCK;
+    argv[a++] = "--stdin=0";
+    // The result writer gets every line to the output file within its interval, stdio would hold them past the kill
+    argv[a++] = "--writer=1";
+    argv[a++] = "--wal=" CRASH_WAL;
+    for (i = 0; i < numServerArgs; i++) {
+        argv[a++] = serverArgs[i];
+    }
+    argv[a] = NULL;
+
+    unlink(CRASH_SOCK);
+    unlink(outPath);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execv(SERVER_BIN, argv);
+        perror(SERVER_BIN);
+        _exit(127);
+    }
+    *fd = connect_server();
+    if (*fd < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Connects to the server's socket, waiting for the server to start.
+ *
+ * @return int - connected socket, -1 if the server never listened
+ */
+int connect_server() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, CRASH_SOCK);
+    int i;
+    for (i = 0; i < CONNECT_TRIES; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(CONNECT_WAIT_US);
+    }
+    return -1;
+}
+
+/**
+ * Sender thread: writes every request line to the server, stopping early if the server is gone.
+ *
+ * @param arg - the struct stream to send
+ */
+void* send_all(void * arg) {
+    struct stream * s = arg;
+    size_t sent = 0;
+    while (sent < s->len) {
+        ssize_t n = send(s->fd, s->data + sent, s->len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        sent += n;
+    }
+    return NULL;
+}
+
+/**
+ * Reader thread: takes every "ID n" reply off the socket so the server never has to hold them.
+ *
+ * @param arg - the struct stream to read the replies of
+ */
+void* read_replies(void * arg) {
+    struct stream * s = arg;
+    char buf[65536];
+    int replies = 0;
+    while (replies < s->replies) {
+        ssize_t got = read(s->fd, buf, sizeof(buf));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        ssize_t i;
+        for (i = 0; i < got; i++) {
+            replies += buf[i] == '\n';
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Reads the outcome of every TRANS the killed server answered. Request ID i + 1 is TRANS i, as the stream is the
+ * only input. A last line cut short by the kill is not counted.
+ *
+ * @param run      - run whose output file to read
+ * @param outcomes - receives 'O' for OK and 'I' for ISF by TRANS, 0 for unanswered
+ * @param count    - number of TRANS
+ * @return int - number of TRANS answered
+ */
+int read_outcomes(int run, char * outcomes, int count) {
+    char path[64], line[256], word[8];
+    snprintf(path, sizeof(path), CRASH_OUT, run);
+    FILE * f = fopen(path, "r");
+    int id, answered = 0;
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strchr(line, '\n') != NULL && sscanf(line, "%d %7s", &id, word) == 2 && id >= 1 && id <= count) {
+            outcomes[id - 1] = word[0];
+            answered++;
+        }
+    }
+    fclose(f);
+    return answered;
+}
+
+/**
+ * Reads every balance the recovered server answered. Request ID i is CHECK i, as the CHECKs are the only input.
+ *
+ * @param run      - run whose output file to read
+ * @param balances - receives the balance of account i at i - 1
+ * @param count    - number of accounts
+ * @return int - number of balances read
+ */
+int read_balances(int run, long long * balances, int count) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), CRASH_OUT, run);
+    FILE * f = fopen(path, "r");
+    int id, found = 0;
+    long long balance;
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%d BAL %lld", &id, &balance) == 2 && id >= 1 && id <= count) {
+            balances[id - 1] = balance;
+            found++;
+        }
+    }
+    fclose(f);
+    return found;
+}
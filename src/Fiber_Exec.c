@@ -0,0 +1,236 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Fiber_Exec.c implements the coroutine worker mode with ucontext. Every
+ *      worker thread is a scheduler for its own coroutines, which never move
+ *      to another thread.
+ *
+ *      A coroutine waiting on Bank.c hands its calls to the storage helpers
+ *      and is suspended; the helper that finishes the last call bumps the
+ *      scheduler's wake word. A coroutine that finds an account lock taken
+ *      is suspended and retries on the scheduler's next pass. Locks are still
+ *      taken in ascending account order, so coroutines cannot deadlock each
+ *      other. When nothing can run the scheduler sleeps on its wake word, for
+ *      at most FIBER_POLL_US so lock waiters and new requests are noticed, or
+ *      blocks on the queue if all of its coroutines are idle.
+*/
+#include <stdlib.h>
+#include <ucontext.h>
+#include "Futex.h"
+#include "Server.h"
+#include "Accounts.h"
+#include "IO_Pool.h"
+#include "Request_Pool.h"
+#include "Fiber_Exec.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+// Coroutine states
+#define FIBER_IDLE 0        // has no request
+#define FIBER_READY 1       // can run
+#define FIBER_IO 2          // waiting for storage calls
+#define FIBER_LOCK 3        // waiting for an account lock
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct fiber {                          // One coroutine
+    ucontext_t ctx;                     // saved registers and stack
+    char * stack;                       // FIBER_STACK_SIZE bytes
+    struct request * job;               // request being carried out, NULL when idle
+    int state;                          // FIBER_IDLE, FIBER_READY, FIBER_IO or FIBER_LOCK
+    _Atomic uint32_t * io_remaining;    // FIBER_IO: storage calls still unfinished
+};
+
+struct scheduler {                      // Per worker thread
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t wake;   // bumped by a helper when storage calls finish
+    ucontext_t main_ctx;                // the scheduler loop itself
+    struct fiber * fibers;              // coroutines of this thread
+    struct fiber * current;             // coroutine running right now
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct scheduler * scheds = NULL;    // one scheduler per worker thread
+static int numScheds = 0;                   // number of schedulers
+static int fibersPerSched = 0;              // coroutines per scheduler
+static __thread struct scheduler * self;    // the calling thread's scheduler
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static void fiber_main(int index);
+static void suspend(int state);
+static void wait_io(_Atomic uint32_t * remaining);
+static void wait_lock();
+/*===============================================================*/
+
+/**
+ * Creates the schedulers and their coroutines.
+ *
+ * @param num_threads       - number of worker threads
+ * @param fibers_per_thread - coroutines run by each worker thread
+ * @return int - 1 if succeeded, 0 if memory could not be allocated
+ */
+int fiber_init(int num_threads, int fibers_per_thread) {
+    scheds = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct scheduler) * num_threads);
+    if (scheds == NULL) {
+        return 0;
+    }
+    int t, i;
+    for (t = 0; t < num_threads; t++) {
+        struct scheduler * s = &scheds[t];
+        atomic_store(&s->wake, 0);
+        s->fibers = calloc(fibers_per_thread, sizeof(struct fiber));
+        if (s->fibers == NULL) {
+            return 0;
+        }
+        for (i = 0; i < fibers_per_thread; i++) {
+            struct fiber * f = &s->fibers[i];
+            f->stack = malloc(FIBER_STACK_SIZE);
+            if (f->stack == NULL) {
+                return 0;
+            }
+            f->job = NULL;
+            f->state = FIBER_IDLE;
+            getcontext(&f->ctx);
+            f->ctx.uc_stack.ss_sp = f->stack;
+            f->ctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+            f->ctx.uc_link = &s->main_ctx;
+            makecontext(&f->ctx, (void (*)())fiber_main, 1, i);
+        }
+        numScheds++;
+    }
+    fibersPerSched = fibers_per_thread;
+    return 1;
+}
+
+/**
+ * Frees the schedulers. No worker may be running anymore and the storage helpers must be stopped, since they write
+ * to the wake words.
+ */
+void fiber_destroy() {
+    int t, i;
+    for (t = 0; t < numScheds; t++) {
+        for (i = 0; i < fibersPerSched; i++) {
+            free(scheds[t].fibers[i].stack);
+        }
+        free(scheds[t].fibers);
+    }
+    free(scheds);
+    scheds = NULL;
+    numScheds = 0;
+}
+
+/**
+ * Loop of a worker thread in coroutine mode. Hands queued requests to idle coroutines and runs whichever can make
+ * progress, until the queue is closed and drained and every coroutine is idle.
+ *
+ * @param index - scheduler of the calling thread
+ */
+void fiber_worker(int index) {
+    self = &scheds[index];
+    io_set_waiter(&self->wake, wait_io);
+    accounts_set_yield(wait_lock);
+    struct timespec poll = { 0, FIBER_POLL_US * 1000L };
+    // Coroutines carrying a request
+    int busy = 0;
+
+    for (;;) {
+        uint32_t wake = atomic_load(&self->wake);
+        int progress = 0;
+        int i;
+        for (i = 0; i < fibersPerSched; i++) {
+            struct fiber * f = &self->fibers[i];
+            if (f->state == FIBER_IDLE) {
+                if (busy == 0) {
+                    // Nothing in flight, sleep until a request comes in
+                    f->job = rq_pop(&Q);
+                    if (f->job == NULL) {
+                        io_set_waiter(NULL, NULL);
+                        accounts_set_yield(NULL);
+                        return;
+                    }
+                } else if ((f->job = rq_try_pop(&Q)) == NULL) {
+                    continue;
+                }
+                busy++;
+                progress = 1;
+            } else if (f->state == FIBER_IO) {
+                if (atomic_load(f->io_remaining) != 0) {
+                    continue;
+                }
+                progress = 1;
+            }
+
+            int before = f->state;
+            f->state = FIBER_READY;
+            self->current = f;
+            swapcontext(&self->main_ctx, &f->ctx);
+            if (f->state == FIBER_IDLE) {
+                busy--;
+            }
+            // A lock waiter that is still waiting got nothing done
+            if (before != FIBER_LOCK || f->state != FIBER_LOCK) {
+                progress = 1;
+            }
+        }
+        if (!progress) {
+            futex_wait_timeout(&self->wake, wake, &poll);
+        }
+    }
+}
+
+/**
+ * Body of every coroutine. Only started or resumed when it has a request.
+ *
+ * @param index - position of the coroutine in its scheduler
+ */
+static void fiber_main(int index) {
+    struct fiber * f = &self->fibers[index];
+    for (;;) {
+        if (config.exec_mode == EXEC_OCC) {
+            execute_optimistic(f->job);
+        } else {
+            execute_locked(f->job);
+        }
+        // Job is finished, hand it back to the pool
+        pool_free(f->job);
+        f->job = NULL;
+        suspend(FIBER_IDLE);
+    }
+}
+
+/**
+ * Switches from the running coroutine back to its scheduler.
+ *
+ * @param state - why the coroutine stops
+ */
+static void suspend(int state) {
+    struct fiber * f = self->current;
+    f->state = state;
+    swapcontext(&f->ctx, &self->main_ctx);
+}
+
+/**
+ * io_run waiter: suspends the running coroutine until its storage calls are finished.
+ *
+ * @param remaining - storage calls still unfinished
+ */
+static void wait_io(_Atomic uint32_t * remaining) {
+    self->current->io_remaining = remaining;
+    suspend(FIBER_IO);
+}
+
+/**
+ * account_lock waiter: suspends the running coroutine until the scheduler's next pass.
+ */
+static void wait_lock() {
+    suspend(FIBER_LOCK);
+}
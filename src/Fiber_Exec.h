@@ -0,0 +1,27 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Fiber_Exec.h declares the coroutine worker mode (--fibers=N). Each
+ *      worker thread runs N coroutines, each carrying out one request at a
+ *      time, so a few threads can keep many requests in flight.
+*/
+#ifndef FIBER_EXEC_H
+#define FIBER_EXEC_H
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define FIBER_STACK_SIZE (64 * 1024)    // stack of one coroutine
+#define FIBER_POLL_US 1000              // longest a scheduler with nothing to run sleeps before looking again
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int fiber_init(int num_threads, int fibers_per_thread);
+void fiber_destroy();
+void fiber_worker(int index);
+/*===============================================================*/
+
+#endif
@@ -0,0 +1,52 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Futex.h contains thin wrappers around the Linux futex system call
+ *      so threads that have nothing to do can sleep in the kernel instead
+ *      of spinning on a lock.
+*/
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * Puts the calling thread to sleep as long as *addr still holds val. Returns immediately
+ * if the value has already changed, so callers must always re-check their condition.
+ *
+ * @param addr - 32 bit word to wait on
+ * @param val  - value the word is expected to hold
+ */
+static inline void futex_wait(_Atomic uint32_t * addr, uint32_t val) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/**
+ * Like futex_wait, but gives up after timeout.
+ *
+ * @param addr    - 32 bit word to wait on
+ * @param val     - value the word is expected to hold
+ * @param timeout - longest time to sleep, relative
+ */
+static inline void futex_wait_timeout(_Atomic uint32_t * addr, uint32_t val, const struct timespec * timeout) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+/**
+ * Wakes up to count threads sleeping on addr.
+ *
+ * @param addr  - 32 bit word threads are waiting on
+ * @param count - max number of threads to wake, INT_MAX wakes everyone
+ */
+static inline void futex_wake(_Atomic uint32_t * addr, int count) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,202 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      IO_Pool.c implements the storage helper pool. io_run runs the first
+ *      call itself and puts the rest on a shared list served by the helper
+ *      threads, so n calls take about as long as one. With no helpers every
+ *      call runs on the caller, one after the other. A coroutine hands all of
+ *      its calls to the helpers and is resumed by its scheduler when they finish.
+*/
+#include <stdlib.h>
+#include <pthread.h>
+#include "Futex.h"
+#include "IO_Pool.h"
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static pthread_t * helpers = NULL;      // helper threads
+static int numHelpers = 0;              // number of helper threads
+static pthread_mutex_t listMut = PTHREAD_MUTEX_INITIALIZER; // guards the pending list and stopping
+static pthread_cond_t listCond = PTHREAD_COND_INITIALIZER;  // signaled when calls are added or on shutdown
+static struct io_op * head = NULL;      // first pending call
+static struct io_op * tail = NULL;      // last pending call
+static int stopping = 0;                // set by io_pool_destroy
+static __thread _Atomic uint32_t * waitNotify = NULL;                   // this thread's scheduler word, see io_set_waiter
+static __thread void (*waitHook)(_Atomic uint32_t * remaining) = NULL;  // suspends the running coroutine
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static void submit(struct io_op * ops, int n);
+static void complete(struct io_op * op);
+static void* helper(void * arg);
+/*===============================================================*/
+
+/**
+ * Starts the helper threads.
+ *
+ * @param num_threads - number of helpers, 0 runs every call on the calling thread
+ * @return int - 1 if succeeded, 0 if a helper could not be started
+ */
+int io_pool_init(int num_threads) {
+    if (num_threads == 0) {
+        return 1;
+    }
+    helpers = malloc(sizeof(pthread_t) * num_threads);
+    if (helpers == NULL) {
+        return 0;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, IO_STACK_SIZE);
+    for (numHelpers = 0; numHelpers < num_threads; numHelpers++) {
+        if (pthread_create(&helpers[numHelpers], &attr, helper, NULL) != 0) {
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return numHelpers == num_threads;
+}
+
+/**
+ * Stops the helper threads. No call may be in progress anymore.
+ */
+void io_pool_destroy() {
+    pthread_mutex_lock(&listMut);
+    stopping = 1;
+    pthread_cond_broadcast(&listCond);
+    pthread_mutex_unlock(&listMut);
+    int i;
+    for (i = 0; i < numHelpers; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+    helpers = NULL;
+    numHelpers = 0;
+}
+
+/**
+ * Performs n storage calls concurrently and returns once all of them have finished. On a thread with a waiter
+ * installed every call goes to the helpers and the calling coroutine is suspended until they are done.
+ *
+ * @param ops - calls to perform, results are left in their value fields
+ * @param n   - number of calls
+ */
+void io_run(struct io_op * ops, int n) {
+    int i;
+    if (waitHook != NULL && numHelpers > 0 && n > 0) {
+        _Atomic uint32_t remaining = n;
+        for (i = 0; i < n; i++) {
+            ops[i].remaining = &remaining;
+            ops[i].notify = waitNotify;
+        }
+        submit(ops, n);
+        waitHook(&remaining);
+        return;
+    }
+    if (numHelpers == 0 || n < 2) {
+        for (i = 0; i < n; i++) {
+            ops[i].run(&ops[i]);
+        }
+        return;
+    }
+
+    _Atomic uint32_t remaining = n - 1;
+    for (i = 1; i < n; i++) {
+        ops[i].remaining = &remaining;
+        ops[i].notify = NULL;
+    }
+    // Hand everything but the first call to the helpers
+    submit(&ops[1], n - 1);
+    ops[0].run(&ops[0]);
+
+    uint32_t left;
+    while ((left = atomic_load(&remaining)) != 0) {
+        futex_wait(&remaining, left);
+    }
+}
+
+/**
+ * Installs how io_run waits on the calling thread. Used by coroutine schedulers: wait suspends the running coroutine
+ * until *remaining reaches 0, and notify is bumped and woken whenever a call group of this thread finishes.
+ *
+ * @param notify - word the scheduler sleeps on, must outlive the helpers
+ * @param wait   - suspends the running coroutine, NULL restores blocking waits
+ */
+void io_set_waiter(_Atomic uint32_t * notify, void (*wait)(_Atomic uint32_t * remaining)) {
+    waitNotify = notify;
+    waitHook = wait;
+}
+
+/**
+ * Appends calls to the pending list in one go and wakes enough helpers.
+ *
+ * @param ops - calls to hand to the helpers, remaining and notify already set
+ * @param n   - number of calls
+ */
+static void submit(struct io_op * ops, int n) {
+    int i;
+    for (i = 0; i < n - 1; i++) {
+        ops[i].next = &ops[i + 1];
+    }
+    ops[n - 1].next = NULL;
+    pthread_mutex_lock(&listMut);
+    if (tail == NULL) {
+        head = &ops[0];
+    } else {
+        tail->next = &ops[0];
+    }
+    tail = &ops[n - 1];
+    if (n == 1) {
+        pthread_cond_signal(&listCond);
+    } else {
+        pthread_cond_broadcast(&listCond);
+    }
+    pthread_mutex_unlock(&listMut);
+}
+
+/**
+ * Marks a call handed to a helper as finished and wakes its io_run once the last one is done.
+ *
+ * @param op - finished call
+ */
+static void complete(struct io_op * op) {
+    _Atomic uint32_t * remaining = op->remaining;
+    _Atomic uint32_t * notify = op->notify;
+    if (atomic_fetch_sub(remaining, 1) == 1) {
+        if (notify != NULL) {
+            atomic_fetch_add(notify, 1);
+            futex_wake(notify, 1);
+        } else {
+            futex_wake(remaining, 1);
+        }
+    }
+}
+
+/**
+ * Helper thread. Takes pending calls one at a time until the pool is stopped.
+ */
+static void* helper(void * arg) {
+    for (;;) {
+        pthread_mutex_lock(&listMut);
+        while (head == NULL && !stopping) {
+            pthread_cond_wait(&listCond, &listMut);
+        }
+        if (head == NULL) {
+            pthread_mutex_unlock(&listMut);
+            return NULL;
+        }
+        struct io_op * op = head;
+        head = op->next;
+        if (head == NULL) {
+            tail = NULL;
+        }
+        pthread_mutex_unlock(&listMut);
+
+        op->run(op);
+        complete(op);
+    }
+}
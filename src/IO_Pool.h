@@ -0,0 +1,46 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      IO_Pool.h declares the storage helper pool. Each Bank.c call sleeps for
+ *      a fixed time, so a thread that needs several of them hands them to
+ *      io_run, which issues them all at once on helper threads and returns
+ *      when every one has finished. A thread running coroutines installs a
+ *      waiter with io_set_waiter so io_run suspends the coroutine instead of
+ *      blocking the thread.
+*/
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define IO_STACK_SIZE (64 * 1024)       // helpers only sleep in Bank.c, a small stack is plenty
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct io_op {                          // One storage call
+    void (*run)(struct io_op * op);     // performs the call, may store a result in value
+    int id;                             // account ID
+    int value;                          // argument or result of the call
+    _Atomic uint32_t * remaining;       // calls of the same io_run still unfinished
+    _Atomic uint32_t * notify;          // bumped and woken when the last call finishes, may be NULL
+    struct io_op * next;                // next pending call in the pool
+};
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int io_pool_init(int num_threads);
+void io_pool_destroy();
+void io_run(struct io_op * ops, int n);
+void io_set_waiter(_Atomic uint32_t * notify, void (*wait)(_Atomic uint32_t * remaining));
+/*===============================================================*/
+
+#endif
@@ -0,0 +1,829 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Load_Gen.c drives the server with a generated workload and measures
+ *      its throughput and latency. It starts the server, deposits into every
+ *      account, then streams the measured requests over a Unix domain socket
+ *      in one of two ways:
+ *          open loop:   requests are due at a fixed rate whether or not the
+ *                       server keeps up, all due requests sent at once
+ *          closed loop: a fixed number of requests are outstanding, the next
+ *                       is sent as soon as one finishes
+ *      Every request is matched to its result through the "ID n" reply and
+ *      the output file, and its latency runs to the server's end TIME stamp.
+ *      In open loop the latency is measured from when the request was due,
+ *      not when it got sent, so a server that falls behind is not excused by
+ *      the requests it kept the generator from sending (coordinated
+ *      omission). The latency from the actual send is printed as well.
+ *
+ *      TRANS only debit what an account is sure to hold in any order of
+ *      execution, except the ones picked to fail, which debit more than any
+ *      account can hold. So with --verify=1 the outcome of every TRANS and
+ *      every final balance is known in advance and checked, like the
+ *      analyzeOutputFile step of Project2Test_v2.
+ *
+ *      Build with: make loadgen
+ *      Run:        ./loadgen <# of worker threads> <# of accounts> [options] [-- server options]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define SERVER_BIN "./appserver"                // server program, started from the build directory
+#define GEN_SOCK "/tmp/loadgen.sock"            // client socket of the server
+#define GEN_OUT "/tmp/loadgen.out"              // output file of the server
+#define MAX_PAIRS 10                            // most pairs a TRANS may carry
+#define INITIAL_DEPOSIT 10000                   // deposited into every account before measuring
+#define DEPOSIT_PAIRS 10                        // accounts per initial deposit TRANS
+#define MAX_AMOUNT 100                          // largest amount a measured TRANS moves per pair
+#define ISF_AMOUNT 1000000000                   // debit of a TRANS picked to fail, more than any balance
+#define CONNECT_TRIES 1000                      // attempts to reach the server's socket
+#define CONNECT_WAIT_US 10000                   // microseconds between attempts
+#define POLL_WAIT_US 100                        // microseconds between looks at the output file
+#define DONE_TIMEOUT 60                         // seconds to wait for the results after the last request
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct gen_config {             // Workload and how to send it
+    int closed;                 // --mode=open|closed
+    double rate;                // --rate=N, open loop: requests per second
+    int outstanding;            // --outstanding=N, closed loop: requests in flight
+    int requests;               // --requests=N, measured requests
+    int check_pct;              // --check=PCT, share of CHECKs
+    int pairs;                  // --pairs=N, pairs per TRANS
+    double zipf;                // --zipf=S, exponent of the Zipfian account pick, 0 = uniform
+    double isf_pct;             // --isf=PCT, share of TRANS that fail with insufficient funds
+    double hot_pct;             // --hot=PCT, share of TRANS whose first account is account 1
+    int verify;                 // --verify=0|1, check every outcome and final balance
+    unsigned long seed;         // --seed=N
+    int kill;                   // --stop=end|kill, kill the server instead of waiting for it to flush and exit
+};
+
+struct result {                 // One line of the output file, indexed by request ID
+    double end;                 // end TIME stamp, 0 until the line is read
+    char kind;                  // 'B', 'O' or 'I' for BAL, OK and ISF
+    long long value;            // balance of a BAL, account of an ISF
+};
+
+struct stream {                 // Request lines sent in order, with what is known of each
+    char * data;                // every line back to back
+    size_t * offset;            // where each line starts, plus the end
+    int count;                  // number of lines
+    int * isf;                  // TRANS: account expected to be reported, 0 if it should go through, -1 for a CHECK
+    int * check;                // CHECK: account checked, 0 for a TRANS
+    double * due;               // realtime the line was due, the same as sent in closed loop
+    double * sent;              // realtime the line was written
+    int * ids;                  // request ID the server replied with, -1 if none
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct gen_config config;
+static int serverFd;                        // connection to the server
+static struct result * results;             // output file lines by request ID
+static int maxId;                           // size of results
+static _Atomic int completed = 0;           // results read so far
+static int malformed = 0;                   // output file lines that are not a result
+static atomic_int tailing = 1;              // the output file is still being read
+static struct stream * replying;            // stream whose replies are being read
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int parse_options(int argc, char *argv[], char *** serverArgs, int * numServerArgs);
+void generate(struct stream * s, int numAccounts, int * balances, int count);
+void deposits(struct stream * s, int numAccounts, int * balances);
+void checks(struct stream * s, int numAccounts);
+int pick_account(const double * cdf, int numAccounts, uint64_t * r);
+uint64_t next_random(uint64_t * r);
+void send_stream(struct stream * s, int open);
+int wait_results(int count);
+void* read_replies(void * arg);
+void* tail_output(void * arg);
+int report(struct stream * s, double offered);
+int verify(struct stream ** streams, int numStreams, const int * balances, int numAccounts);
+int compare_doubles(const void * a, const void * b);
+double cpu_seconds(pid_t pid);
+double wall();
+/*===============================================================*/
+
+/**
+ * Starts the server, deposits into every account, runs the measured requests, optionally checks every balance, and
+ * prints the throughput and latency percentiles.
+ *
+ * Options:
+ *      --mode=open|closed  open loop at --rate, or closed loop with --outstanding requests in flight (default closed)
+ *      --rate=N            open loop: requests sent per second (default 100000)
+ *      --outstanding=N     closed loop: requests in flight (default 64)
+ *      --requests=N        measured requests (default 200000)
+ *      --check=PCT         share of CHECKs, the rest are TRANS (default 20)
+ *      --pairs=N           pairs per TRANS, 1 to 10 (default 2)
+ *      --zipf=S            pick accounts Zipfian with exponent S, account 1 the hottest; 0 picks uniformly (default 0)
+ *      --isf=PCT           share of TRANS that fail with insufficient funds (default 1)
+ *      --hot=PCT           share of TRANS whose first account is account 1, 100 for a single hot account (default 0)
+ *      --verify=0|1        check every outcome and CHECK every account at the end (default 0)
+ *      --seed=N            seed of the workload (default 1)
+ *      --stop=end|kill     end the server with END, or kill it once measured so it skips flushing every account to
+ *                          the bank (default end)
+ * Everything after -- is passed to the server.
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int - 0 if the run (and verification) succeeded
+ */
+int main(int argc, char *argv[]) {
+    char ** serverArgs = NULL;
+    int numServerArgs = 0;
+    if (argc < 3 || !parse_options(argc, argv, &serverArgs, &numServerArgs)) {
+        printf("Usage: %s <# of worker threads> <# of accounts> [--mode=open|closed] [--rate=N] [--outstanding=N]\n\t\t"
+               "[--requests=N] [--check=PCT] [--pairs=N] [--zipf=S] [--isf=PCT] [--hot=PCT] [--verify=0|1]\n\t\t"
+               "[--seed=N] [--stop=end|kill] [-- server options]\n", argv[0]);
+        return 1;
+    }
+    int numAccounts = atoi(argv[2]);
+    if (atoi(argv[1]) < 1 || numAccounts < config.pairs) {
+        printf("ERROR: invalid arguments\n");
+        return 1;
+    }
+
+    // Everything is generated before the server starts, so generating costs the measurement nothing
+    int * balances = malloc(sizeof(int) * (numAccounts + 1));
+    struct stream pre, measured, final;
+    deposits(&pre, numAccounts, balances);
+    generate(&measured, numAccounts, balances, config.requests);
+    checks(&final, numAccounts);
+    maxId = pre.count + measured.count + final.count + 1;
+    results = calloc(maxId, sizeof(struct result));
+
+    char * args[numServerArgs + 10];
+    int a = 0, i;
+    args[a++] = SERVER_BIN;
+    args[a++] = argv[1];
+    args[a++] = argv[2];
+    args[a++] = GEN_OUT;
+    args[a++] = "--unix=" GEN_SOCK;
+    args[a++] = "--stdin=0";
+    // Results reach the file within a millisecond; the closed loop waits on them
+    args[a++] = "--writer=1";
+    args[a++] = "--writer-interval=1";
+    for (i = 0; i < numServerArgs; i++) {
+        args[a++] = serverArgs[i];
+    }
+    args[a] = NULL;
+    unlink(GEN_SOCK);
+    unlink(GEN_OUT);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return 1;
+    }
+    if (pid == 0) {
+        execv(SERVER_BIN, args);
+        perror(SERVER_BIN);
+        _exit(127);
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, GEN_SOCK);
+    serverFd = -1;
+    for (i = 0; i < CONNECT_TRIES && serverFd < 0; i++) {
+        serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(serverFd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(serverFd);
+            serverFd = -1;
+            usleep(CONNECT_WAIT_US);
+        }
+    }
+    if (serverFd < 0) {
+        printf("ERROR: could not reach the server\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+    pthread_t tailTid;
+    pthread_create(&tailTid, NULL, tail_output, NULL);
+
+    printf("%s loop", config.closed ? "closed" : "open");
+    if (config.closed) {
+        printf(", %d outstanding", config.outstanding);
+    } else {
+        printf(" at %.0f requests/s", config.rate);
+    }
+    printf(", %d requests (%d%% CHECK, TRANS with %d pairs, %.1f%% ISF), %s accounts of %d\n", config.requests,
+           config.check_pct, config.pairs, config.isf_pct, config.zipf > 0 ? "Zipfian" : "uniform", numAccounts);
+    if (config.zipf > 0) {
+        printf("Zipf exponent %.2f\n", config.zipf);
+    }
+    if (config.hot_pct > 0) {
+        printf("%.1f%% of TRANS on hot account 1\n", config.hot_pct);
+    }
+
+    // Deposits run closed loop and are not measured
+    int ok = 1;
+    send_stream(&pre, 0);
+    ok &= wait_results(pre.count);
+    double cpuStart = cpu_seconds(pid), wallStart = wall();
+    send_stream(&measured, !config.closed);
+    ok &= wait_results(pre.count + measured.count);
+    double cores = (cpu_seconds(pid) - cpuStart) / (wall() - wallStart);
+    if (ok) {
+        ok &= report(&measured, config.closed ? 0 : config.rate);
+        printf("server cpu %.2f cores of %ld (%.0f%%)\n", cores, sysconf(_SC_NPROCESSORS_ONLN),
+               100 * cores / sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    if (ok && config.verify) {
+        send_stream(&final, 0);
+        ok &= wait_results(pre.count + measured.count + final.count);
+        struct stream * streams[] = { &pre, &measured, &final };
+        ok &= ok && verify(streams, 3, balances, numAccounts);
+    }
+    if (!ok) {
+        printf("ERROR: %d of %d results arrived\n", atomic_load(&completed), maxId - 1);
+    }
+
+    if (config.kill) {
+        kill(pid, SIGKILL);
+    } else if (write(serverFd, "END\n", 4) != 4) {
+        perror("END");
+    }
+    atomic_store(&tailing, 0);
+    pthread_join(tailTid, NULL);
+    int status;
+    waitpid(pid, &status, 0);
+    close(serverFd);
+    return ok && (config.kill || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) ? 0 : 1;
+}
+
+/**
+ * Reads the --name=value options into config, the defaults where none is given.
+ *
+ * @param argc          - number of command line arguments
+ * @param argv          - array of command line arguments
+ * @param serverArgs    - receives the arguments after --
+ * @param numServerArgs - receives their number
+ * @return int - 1 if every option was understood and in range, 0 otherwise
+ */
+int parse_options(int argc, char *argv[], char *** serverArgs, int * numServerArgs) {
+    config.closed = 1;
+    config.rate = 100000;
+    config.outstanding = 64;
+    config.requests = 200000;
+    config.check_pct = 20;
+    config.pairs = 2;
+    config.zipf = 0;
+    config.isf_pct = 1;
+    config.verify = 0;
+    config.hot_pct = 0;
+    config.seed = 1;
+    config.kill = 0;
+    int i;
+    for (i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "--")) {
+            *serverArgs = argv + i + 1;
+            *numServerArgs = argc - i - 1;
+            break;
+        } else if (!strcmp(argv[i], "--mode=open")) {
+            config.closed = 0;
+        } else if (!strcmp(argv[i], "--mode=closed")) {
+            config.closed = 1;
+        } else if (!strncmp(argv[i], "--rate=", 7)) {
+            config.rate = atof(argv[i] + 7);
+        } else if (!strncmp(argv[i], "--outstanding=", 14)) {
+            config.outstanding = atoi(argv[i] + 14);
+        } else if (!strncmp(argv[i], "--requests=", 11)) {
+            config.requests = atoi(argv[i] + 11);
+        } else if (!strncmp(argv[i], "--check=", 8)) {
+            config.check_pct = atoi(argv[i] + 8);
+        } else if (!strncmp(argv[i], "--pairs=", 8)) {
+            config.pairs = atoi(argv[i] + 8);
+        } else if (!strncmp(argv[i], "--zipf=", 7)) {
+            config.zipf = atof(argv[i] + 7);
+        } else if (!strncmp(argv[i], "--isf=", 6)) {
+            config.isf_pct = atof(argv[i] + 6);
+        } else if (!strncmp(argv[i], "--verify=", 9)) {
+            config.verify = atoi(argv[i] + 9);
+        } else if (!strncmp(argv[i], "--hot=", 6)) {
+            config.hot_pct = atof(argv[i] + 6);
+        } else if (!strcmp(argv[i], "--stop=end")) {
+            config.kill = 0;
+        } else if (!strcmp(argv[i], "--stop=kill")) {
+            config.kill = 1;
+        } else if (!strncmp(argv[i], "--seed=", 7)) {
+            config.seed = strtoul(argv[i] + 7, NULL, 10);
+        } else {
+            printf("ERROR: unknown option %s\n", argv[i]);
+            return 0;
+        }
+    }
+    return config.rate > 0 && config.outstanding > 0 && config.requests > 0 && config.check_pct >= 0 &&
+           config.check_pct <= 100 && config.pairs >= 1 && config.pairs <= MAX_PAIRS && config.zipf >= 0 &&
+           config.isf_pct >= 0 && config.isf_pct <= 100 && config.hot_pct >= 0 && config.hot_pct <= 100;
+}
+
+/**
+ * Builds the measured requests. A TRANS picks distinct accounts and debits one only as far as every debit generated
+ * for it so far is covered by what it surely holds, so it goes through in any order; otherwise it deposits. A TRANS
+ * picked to fail gets one debit no account can cover, the rest of it as usual but never applied.
+ *
+ * @param s           - receives the requests
+ * @param numAccounts - accounts to pick from
+ * @param balances    - every account's balance so far, updated with the TRANS that go through
+ * @param count       - number of requests
+ */
+void generate(struct stream * s, int numAccounts, int * balances, int count) {
+    s->data = malloc((size_t)count * (8 + MAX_PAIRS * 24) + 1);
+    s->offset = malloc(sizeof(size_t) * (count + 1));
+    s->isf = malloc(sizeof(int) * count);
+    s->check = malloc(sizeof(int) * count);
+    s->count = count;
+    // What each account is sure to hold: the deposits made before these requests less every debit among them
+    int * floor = malloc(sizeof(int) * (numAccounts + 1));
+    memcpy(floor, balances, sizeof(int) * (numAccounts + 1));
+
+    // Cumulative weights of the Zipfian pick, account 1 weighing the most
+    double * cdf = NULL;
+    int i, j, k;
+    if (config.zipf > 0) {
+        cdf = malloc(sizeof(double) * numAccounts);
+        double sum = 0;
+        for (i = 0; i < numAccounts; i++) {
+            sum += 1.0 / pow(i + 1, config.zipf);
+            cdf[i] = sum;
+        }
+        for (i = 0; i < numAccounts; i++) {
+            cdf[i] /= sum;
+        }
+    }
+
+    uint64_t r = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+    size_t off = 0;
+    for (i = 0; i < count; i++) {
+        s->offset[i] = off;
+        if ((int)(next_random(&r) % 100) < config.check_pct) {
+            s->check[i] = pick_account(cdf, numAccounts, &r);
+            s->isf[i] = -1;
+            off += sprintf(s->data + off, "CHECK %d\n", s->check[i]);
+            continue;
+        }
+        int accs[MAX_PAIRS], amounts[MAX_PAIRS];
+        int fail = next_random(&r) % 1000000 < config.isf_pct * 10000;
+        int hot = next_random(&r) % 1000000 < config.hot_pct * 10000;
+        for (j = 0; j < config.pairs; j++) {
+            if (j == 0 && hot) {
+                accs[0] = 1;
+            } else do {
+                accs[j] = pick_account(cdf, numAccounts, &r);
+                for (k = 0; k < j && accs[k] != accs[j]; k++);
+            } while (k < j);
+            amounts[j] = next_random(&r) % MAX_AMOUNT + 1;
+            if (next_random(&r) % 2 && floor[accs[j]] >= amounts[j]) {
+                amounts[j] = -amounts[j];
+            }
+        }
+        s->check[i] = 0;
+        s->isf[i] = 0;
+        if (fail) {
+            // The failing debit is reported whatever else the TRANS debits, since nothing else can fail
+            j = next_random(&r) % config.pairs;
+            amounts[j] = -ISF_AMOUNT;
+            s->isf[i] = accs[j];
+        }
+        off += sprintf(s->data + off, "TRANS");
+        for (j = 0; j < config.pairs; j++) {
+            off += sprintf(s->data + off, " %d %d", accs[j], amounts[j]);
+            if (!fail) {
+                balances[accs[j]] += amounts[j];
+                if (amounts[j] < 0) {
+                    floor[accs[j]] += amounts[j];
+                }
+            }
+        }
+        off += sprintf(s->data + off, "\n");
+    }
+    s->offset[count] = off;
+    s->due = calloc(count, sizeof(double));
+    s->sent = calloc(count, sizeof(double));
+    s->ids = malloc(sizeof(int) * count);
+    free(floor);
+    free(cdf);
+}
+
+/**
+ * Builds the initial deposits, DEPOSIT_PAIRS accounts per TRANS, and sets every balance to INITIAL_DEPOSIT.
+ *
+ * @param s           - receives the requests
+ * @param numAccounts - number of accounts
+ * @param balances    - receives every account's balance, index 0 unused
+ */
+void deposits(struct stream * s, int numAccounts, int * balances) {
+    int count = (numAccounts + DEPOSIT_PAIRS - 1) / DEPOSIT_PAIRS;
+    s->data = malloc((size_t)count * (8 + DEPOSIT_PAIRS * 24) + 1);
+    s->offset = malloc(sizeof(size_t) * (count + 1));
+    s->isf = calloc(count, sizeof(int));
+    s->check = calloc(count, sizeof(int));
+    s->due = calloc(count, sizeof(double));
+    s->sent = calloc(count, sizeof(double));
+    s->ids = malloc(sizeof(int) * count);
+    s->count = count;
+    size_t off = 0;
+    int i, acc;
+    balances[0] = 0;
+    for (i = 0; i < count; i++) {
+        s->offset[i] = off;
+        off += sprintf(s->data + off, "TRANS");
+        for (acc = i * DEPOSIT_PAIRS + 1; acc <= (i + 1) * DEPOSIT_PAIRS && acc <= numAccounts; acc++) {
+            off += sprintf(s->data + off, " %d %d", acc, INITIAL_DEPOSIT);
+            balances[acc] = INITIAL_DEPOSIT;
+        }
+        off += sprintf(s->data + off, "\n");
+    }
+    s->offset[count] = off;
+}
+
+/**
+ * Builds one CHECK of every account.
+ *
+ * @param s           - receives the requests
+ * @param numAccounts - number of accounts
+ */
+void checks(struct stream * s, int numAccounts) {
+    s->data = malloc((size_t)numAccounts * 20 + 1);
+    s->offset = malloc(sizeof(size_t) * (numAccounts + 1));
+    s->isf = malloc(sizeof(int) * numAccounts);
+    s->check = malloc(sizeof(int) * numAccounts);
+    s->due = calloc(numAccounts, sizeof(double));
+    s->sent = calloc(numAccounts, sizeof(double));
+    s->ids = malloc(sizeof(int) * numAccounts);
+    s->count = numAccounts;
+    size_t off = 0;
+    int i;
+    for (i = 0; i < numAccounts; i++) {
+        s->offset[i] = off;
+        s->isf[i] = -1;
+        s->check[i] = i + 1;
+        off += sprintf(s->data + off, "CHECK %d\n", i + 1);
+    }
+    s->offset[numAccounts] = off;
+}
+
+/**
+ * @param cdf         - cumulative Zipfian weights, NULL to pick uniformly
+ * @param numAccounts - accounts to pick from
+ * @param r           - random state
+ * @return int - an account ID
+ */
+int pick_account(const double * cdf, int numAccounts, uint64_t * r) {
+    if (cdf == NULL) {
+        return next_random(r) % numAccounts + 1;
+    }
+    double u = (next_random(r) >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = numAccounts - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo + 1;
+}
+
+/**
+ * xorshift64* random numbers: cheap and the same on every platform for a seed.
+ *
+ * @param r - random state, never 0
+ * @return uint64_t - next random number
+ */
+uint64_t next_random(uint64_t * r) {
+    *r ^= *r >> 12;
+    *r ^= *r << 25;
+    *r ^= *r >> 27;
+    return *r * 2685821657736338717ULL;
+}
+
+/**
+ * Writes a stream to the server. Open loop: request i is due i / rate seconds after the first, and every request
+ * that is due gets written at once. Closed loop: requests are written whenever fewer than --outstanding are
+ * unfinished. The replies are read by a thread of their own.
+ *
+ * @param s    - requests to send
+ * @param open - 1 for open loop, 0 for closed loop
+ */
+void send_stream(struct stream * s, int open) {
+    replying = s;
+    pthread_t tid;
+    pthread_create(&tid, NULL, read_replies, NULL);
+    int base = atomic_load(&completed);
+    double start = wall();
+    int written = 0, last, i;
+    while (written < s->count) {
+        double t = wall();
+        if (open) {
+            double due = start + written / config.rate;
+            if (t < due) {
+                struct timespec ts = { 0, (long)((due - t) * 1e9) };
+                nanosleep(&ts, NULL);
+                continue;
+            }
+            // Everything due by now
+            last = (int)((t - start) * config.rate) + 1;
+        } else {
+            int inFlight = written - (atomic_load(&completed) - base);
+            if (inFlight >= config.outstanding) {
+                usleep(POLL_WAIT_US / 10);
+                continue;
+            }
+            last = written + config.outstanding - inFlight;
+        }
+        if (last > s->count) {
+            last = s->count;
+        }
+        for (i = written; i < last; i++) {
+            s->due[i] = open ? start + i / config.rate : t;
+            s->sent[i] = t;
+        }
+        size_t from = s->offset[written], to = s->offset[last];
+        while (from < to) {
+            ssize_t n = write(serverFd, s->data + from, to - from);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                perror("send");
+                pthread_join(tid, NULL);
+                return;
+            }
+            from += n;
+        }
+        written = last;
+    }
+    pthread_join(tid, NULL);
+}
+
+/**
+ * Waits for the output file to hold a number of results, giving up once none arrives for DONE_TIMEOUT seconds.
+ *
+ * @param count - results expected in total
+ * @return int - 1 if they all arrived
+ */
+int wait_results(int count) {
+    int seen = atomic_load(&completed);
+    double last = wall();
+    while (seen < count) {
+        usleep(POLL_WAIT_US);
+        int now = atomic_load(&completed);
+        if (now != seen) {
+            seen = now;
+            last = wall();
+        } else if (wall() - last > DONE_TIMEOUT) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Reply thread: reads the "ID n" reply of every request in the stream being sent, in the order sent.
+ *
+ * @param arg - unused
+ */
+void* read_replies(void * arg) {
+    struct stream * s = replying;
+    char buf[65536];
+    size_t have = 0;
+    int n = 0;
+    while (n < s->count) {
+        ssize_t got = read(serverFd, buf + have, sizeof(buf) - have);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        have += got;
+        char * line = buf;
+        char * nl;
+        while (n < s->count && (nl = memchr(line, '\n', buf + have - line)) != NULL) {
+            // Anything but an ID, such as INVALID REQUEST, leaves the request unanswered
+            s->ids[n++] = strncmp(line, "ID ", 3) ? -1 : atoi(line + 3);
+            line = nl + 1;
+        }
+        have -= line - buf;
+        memmove(buf, line, have);
+    }
+    for (; n < s->count; n++) {
+        s->ids[n] = -1;
+    }
+    return NULL;
+}
+
+/**
+ * Tail thread: reads result lines as the server writes them and files each under its request ID.
+ *
+ * @param arg - unused
+ */
+void* tail_output(void * arg) {
+    FILE * in = NULL;
+    char line[256];
+    while (atomic_load(&tailing)) {
+        if (in == NULL && (in = fopen(GEN_OUT, "r")) == NULL) {
+            usleep(POLL_WAIT_US);
+            continue;
+        }
+        clearerr(in);
+        long pos = ftell(in);
+        int got = 0;
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (strchr(line, '\n') == NULL) {
+                // Still being written, read again once whole
+                fseek(in, pos, SEEK_SET);
+                break;
+            }
+            pos = ftell(in);
+            int id;
+            char kind[8];
+            long long value = 0;
+            char * time = strstr(line, " TIME ");
+            double start, end;
+            if (sscanf(line, "%d %7s", &id, kind) != 2 || time == NULL || sscanf(time + 6, "%lf %lf", &start, &end) != 2 ||
+                id < 1 || id >= maxId || (strcmp(kind, "OK") && sscanf(line, "%*d %*s %lld", &value) != 1)) {
+                malformed++;
+                continue;
+            }
+            results[id].end = end;
+            results[id].kind = kind[0] == 'B' ? 'B' : kind[0] == 'O' ? 'O' : 'I';
+            results[id].value = value;
+            got++;
+        }
+        if (got > 0) {
+            atomic_fetch_add(&completed, got);
+        } else {
+            usleep(POLL_WAIT_US);
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    return NULL;
+}
+
+/**
+ * Prints the throughput and latency percentiles of the measured requests. Latency runs from when a request was due
+ * (open loop) or sent to the server's end TIME stamp of its result.
+ *
+ * @param s       - the measured requests
+ * @param offered - open loop: requests per second sent, 0 for closed loop
+ * @return int - 1 if every request has a result
+ */
+int report(struct stream * s, double offered) {
+    double * fromDue = malloc(sizeof(double) * s->count);
+    double * fromSent = malloc(sizeof(double) * s->count);
+    double first = s->sent[0], lastEnd = 0;
+    int n = 0, i, ok = 0, isf = 0, bal = 0;
+    for (i = 0; i < s->count; i++) {
+        int id = s->ids[i];
+        if (id < 1 || id >= maxId || results[id].end == 0) {
+            continue;
+        }
+        struct result * r = &results[id];
+        lastEnd = r->end > lastEnd ? r->end : lastEnd;
+        // The stamps have microseconds, the send times more
+        fromDue[n] = r->end > s->due[i] ? (r->end - s->due[i]) * 1e3 : 0;
+        fromSent[n++] = r->end > s->sent[i] ? (r->end - s->sent[i]) * 1e3 : 0;
+        ok += r->kind == 'O';
+        isf += r->kind == 'I';
+        bal += r->kind == 'B';
+    }
+    qsort(fromDue, n, sizeof(double), compare_doubles);
+    qsort(fromSent, n, sizeof(double), compare_doubles);
+    printf("%d results: %d OK, %d ISF, %d BAL\n", n, ok, isf, bal);
+    printf("throughput %.0f requests/s", n / (lastEnd - first));
+    if (offered > 0) {
+        printf(" (offered %.0f requests/s)", offered);
+    }
+    printf("\n%-22s %9s %9s %9s %9s %9s %9s\n", "latency ms", "mean", "p50", "p90", "p99", "p99.9", "max");
+    int pass;
+    for (pass = offered > 0 ? 0 : 1; pass < 2 && n > 0; pass++) {
+        double * lat = pass ? fromSent : fromDue;
+        double sum = 0;
+        for (i = 0; i < n; i++) {
+            sum += lat[i];
+        }
+        printf("%-22s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", pass ? "from sent" : "from due (corrected)", sum / n,
+               lat[(int)(n * 0.5)], lat[(int)(n * 0.9)], lat[(int)(n * 0.99)], lat[(int)(n * 0.999)], lat[n - 1]);
+    }
+    free(fromDue);
+    free(fromSent);
+    return n == s->count;
+}
+
+/**
+ * Checks every request was answered once, with the outcome it was generated for, and every account's final balance.
+ *
+ * @param streams     - every stream sent, the last the final CHECK of every account
+ * @param numStreams  - number of streams
+ * @param balances    - expected final balance of every account
+ * @param numAccounts - number of accounts
+ * @return int - 1 if everything matched
+ */
+int verify(struct stream ** streams, int numStreams, const int * balances, int numAccounts) {
+    char * seen = calloc(maxId, 1);
+    int missing = 0, duplicate = 0, outcome = 0, isfAccount = 0, balance = 0;
+    long long total = 0, expected = 0;
+    int i, k;
+    for (k = 0; k < numStreams; k++) {
+        struct stream * s = streams[k];
+        for (i = 0; i < s->count; i++) {
+            int id = s->ids[i];
+            if (id < 1 || id >= maxId || results[id].end == 0) {
+                missing++;
+                continue;
+            }
+            duplicate += seen[id]++ > 0;
+            struct result * r = &results[id];
+            if (s->check[i]) {
+                outcome += r->kind != 'B';
+                if (k == numStreams - 1 && r->kind == 'B') {
+                    balance += r->value != balances[s->check[i]];
+                    total += r->value;
+                }
+            } else if (s->isf[i]) {
+                outcome += r->kind != 'I';
+                isfAccount += r->kind == 'I' && r->value != s->isf[i];
+            } else {
+                outcome += r->kind != 'O';
+            }
+        }
+    }
+    for (i = 1; i <= numAccounts; i++) {
+        expected += balances[i];
+    }
+    free(seen);
+    int passed = !missing && !duplicate && !outcome && !isfAccount && !balance && !malformed;
+    printf("verify: %d malformed lines, %d missing, %d duplicate IDs, %d wrong outcomes, %d wrong ISF accounts, "
+           "%d wrong balances, total %lld of %lld: %s\n", malformed, missing, duplicate, outcome, isfAccount, balance,
+           total, expected, passed ? "PASSED" : "FAILED");
+    return passed;
+}
+
+/**
+ * qsort comparator for doubles in ascending order.
+ */
+int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @param pid - a process
+ * @return double - CPU seconds the process has used in user and kernel mode, 0 if unknown
+ */
+double cpu_seconds(pid_t pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE * in = fopen(path, "r");
+    if (in == NULL) {
+        return 0;
+    }
+    size_t got = fread(buf, 1, sizeof(buf) - 1, in);
+    fclose(in);
+    buf[got] = '\0';
+    // utime and stime are the 14th and 15th fields, the 12th and 13th after the parenthesized program name
+    char * p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * @return double - realtime in seconds, the clock of the server's TIME stamps
+ */
+double wall() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
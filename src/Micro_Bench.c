@@ -0,0 +1,484 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Micro_Bench.c times the server's hot components one at a time, away
+ *      from the rest of the server:
+ *          queue   producers rq_push and consumers rq_pop one job each, as
+ *                  add_request and get_request do
+ *          parser  the streaming parser over TRANS lines of a given size
+ *          lock    account_lock_many and account_unlock_many of a sorted set
+ *                  of accounts, the acquisition done for every debiting TRANS
+ *          sort    sortIDLeastToGreatest on pairs in random order
+ *      Every case runs once per thread count (queue and lock) or input size
+ *      (parser and sort). Each is warmed up, then repeated, and the mean,
+ *      standard deviation and best of the repeats are printed in ns per
+ *      operation along with the operations per second of the mean.
+ *
+ *      Build with: make bench_micro
+ *      Run:        ./micro_bench [--only=queue|parser|lock|sort] [--threads=LIST] [--sizes=LIST] [--ops=N]
+ *                                [--warmup=N] [--repeats=N] [--accounts=N]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "Accounts.h"
+#include "Request_Parser.h"
+#include "Request_Queue.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define MAX_VALUES 16                   // most thread counts or sizes
+#define DEFAULT_THREADS "1,2,4"
+#define DEFAULT_SIZES "1,2,6,10"
+#define DEFAULT_OPS 1000000             // operations per repeat, shared by the threads
+#define DEFAULT_WARMUP 1                // repeats run and thrown away first
+#define DEFAULT_REPEATS 5               // repeats measured
+#define DEFAULT_ACCOUNTS 1000           // accounts the lock case picks from, fewer means more contention
+#define QUEUE_CAPACITY 1024             // slots of the benchmarked queue
+#define CHUNK_SIZE 65536                // bytes handed to the parser per call, like one read()
+#define SORT_INPUTS 4096                // different pair orders the sort case cycles through
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct bench_case {                     // One component timed at one thread count or input size
+    const char * name;                  // component
+    int threads;                        // threads running it
+    int size;                           // pairs per TRANS, 0 where it does not apply
+    long ops;                           // operations per repeat
+    double (*run)(struct bench_case * c);   // runs one repeat, returns seconds
+    void * data;                        // input prepared for the case
+    size_t len;                         // bytes of data
+};
+
+struct worker_arg {                     // What one thread of a case does
+    struct bench_case * c;              // the case
+    int index;                          // thread number
+    long ops;                           // operations of this thread
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct request_queue Q;                  // queue of the queue case
+static pthread_barrier_t startLine;             // lets a case's threads start together
+static int numAccounts = DEFAULT_ACCOUNTS;
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int parse_list(const char * list, int * values);
+void measure(struct bench_case * c, int warmup, int repeats);
+double run_threads(struct bench_case * c, void* (*body)(void *), int numThreads);
+double run_queue(struct bench_case * c);
+void* queue_producer(void * arg);
+void* queue_consumer(void * arg);
+double run_parser(struct bench_case * c);
+void count_request(void * ctx, const struct parsed_request * p);
+double run_lock(struct bench_case * c);
+void* lock_worker(void * arg);
+double run_sort(struct bench_case * c);
+unsigned int next_random(unsigned int * r);
+double now();
+/*===============================================================*/
+
+/**
+ * Runs the selected cases and prints one row per case.
+ *
+ * Options:
+ *      --only=NAME         run only queue, parser, lock or sort (default all)
+ *      --threads=LIST      thread counts of queue and lock, comma separated (default 1,2,4)
+ *      --sizes=LIST        pairs per TRANS of parser, sort and lock, comma separated (default 1,2,6,10)
+ *      --ops=N             operations per repeat (default 1000000)
+ *      --warmup=N          repeats thrown away before measuring (default 1)
+ *      --repeats=N         repeats measured (default 5)
+ *      --accounts=N        accounts the lock case picks from (default 1000)
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int
+ */
+int main(int argc, char *argv[]) {
+    int threads[MAX_VALUES], sizes[MAX_VALUES];
+    int numThreads = parse_list(DEFAULT_THREADS, threads), numSizes = parse_list(DEFAULT_SIZES, sizes);
+    long ops = DEFAULT_OPS;
+    int warmup = DEFAULT_WARMUP, repeats = DEFAULT_REPEATS;
+    const char * only = NULL;
+    int i, j;
+    for (i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--only=", 7)) {
+            only = argv[i] + 7;
+        } else if (!strncmp(argv[i], "--threads=", 10)) {
+            numThreads = parse_list(argv[i] + 10, threads);
+        } else if (!strncmp(argv[i], "--sizes=", 8)) {
+            numSizes = parse_list(argv[i] + 8, sizes);
+        } else if (!strncmp(argv[i], "--ops=", 6)) {
+            ops = atol(argv[i] + 6);
+        } else if (!strncmp(argv[i], "--warmup=", 9)) {
+            warmup = atoi(argv[i] + 9);
+        } else if (!strncmp(argv[i], "--repeats=", 10)) {
+            repeats = atoi(argv[i] + 10);
+        } else if (!strncmp(argv[i], "--accounts=", 11)) {
+            numAccounts = atoi(argv[i] + 11);
+        } else {
+            printf("Usage: %s [--only=queue|parser|lock|sort] [--threads=LIST] [--sizes=LIST] [--ops=N] [--warmup=N]\n\t\t"
+                   "[--repeats=N] [--accounts=N]\n", argv[0]);
+            return 1;
+        }
+    }
+    for (i = 0; i < numSizes; i++) {
+        if (sizes[i] > MAX_TRANS_PAIRS) {
+            numSizes = 0;
+        }
+    }
+    if (numThreads < 1 || numSizes < 1 || ops < 1 || warmup < 0 || repeats < 1 || numAccounts < MAX_TRANS_PAIRS) {
+        printf("ERROR: invalid arguments\n");
+        return 1;
+    }
+    // Write-back keeps the lock case off the simulated bank
+    if (!accounts_init(numAccounts, CACHE_WRITEBACK, FLUSH_BATCH_DEFAULT, FLUSH_INTERVAL_DEFAULT, 0, 0) ||
+        !rq_init(&Q, QUEUE_CAPACITY)) {
+        printf("ERROR: setup failed\n");
+        return 1;
+    }
+
+    printf("%ld operations per repeat, %d warm-up, %d repeats, %d accounts\n", ops, warmup, repeats, numAccounts);
+    printf("%-8s %8s %6s %12s %10s %12s %14s\n", "case", "threads", "pairs", "ns/op mean", "stddev", "ns/op best", "ops/s");
+    struct bench_case c;
+    if (only == NULL || !strcmp(only, "queue")) {
+        for (i = 0; i < numThreads; i++) {
+            c = (struct bench_case){ "queue", threads[i], 0, ops, run_queue, NULL, 0 };
+            measure(&c, warmup, repeats);
+        }
+    }
+    if (only == NULL || !strcmp(only, "parser")) {
+        for (i = 0; i < numSizes; i++) {
+            // One TRANS line per operation, the accounts and amounts random
+            char * data = malloc((size_t)ops * (8 + sizes[i] * 16) + 1);
+            size_t off = 0;
+            unsigned int r = 5;
+            long k;
+            for (k = 0; k < ops; k++) {
+                off += sprintf(data + off, "TRANS");
+                for (j = 0; j < sizes[i]; j++) {
+                    off += sprintf(data + off, " %u %d", next_random(&r) % numAccounts + 1,
+                                   (int)(next_random(&r) % 20001) - 10000);
+                }
+                data[off++] = '\n';
+            }
+            c = (struct bench_case){ "parser", 1, sizes[i], ops, run_parser, data, off };
+            measure(&c, warmup, repeats);
+            free(data);
+        }
+    }
+    if (only == NULL || !strcmp(only, "lock")) {
+        for (i = 0; i < numSizes; i++) {
+            for (j = 0; j < numThreads; j++) {
+                c = (struct bench_case){ "lock", threads[j], sizes[i], ops, run_lock, NULL, 0 };
+                measure(&c, warmup, repeats);
+            }
+        }
+    }
+    if (only == NULL || !strcmp(only, "sort")) {
+        for (i = 0; i < numSizes; i++) {
+            // Distinct accounts in random order, as many orders as SORT_INPUTS
+            struct trans * inputs = malloc(sizeof(struct trans) * SORT_INPUTS * sizes[i]);
+            unsigned int r = 7;
+            int k, m;
+            for (k = 0; k < SORT_INPUTS; k++) {
+                struct trans * t = inputs + k * sizes[i];
+                for (j = 0; j < sizes[i]; j++) {
+                    t[j].acc_id = j + 1;
+                    t[j].amount = j;
+                }
+                for (j = sizes[i] - 1; j > 0; j--) {
+                    m = next_random(&r) % (j + 1);
+                    struct trans tmp = t[j];
+                    t[j] = t[m];
+                    t[m] = tmp;
+                }
+            }
+            c = (struct bench_case){ "sort", 1, sizes[i], ops, run_sort, inputs, 0 };
+            measure(&c, warmup, repeats);
+            free(inputs);
+        }
+    }
+    rq_destroy(&Q);
+    accounts_free();
+    return 0;
+}
+
+/**
+ * @param list   - comma separated positive numbers
+ * @param values - receives the numbers, at most MAX_VALUES
+ * @return int - how many there are, 0 if one is not a positive number
+ */
+int parse_list(const char * list, int * values) {
+    int n = 0;
+    while (*list != '\0' && n < MAX_VALUES) {
+        char * end;
+        long v = strtol(list, &end, 10);
+        if (end == list || v < 1 || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        values[n++] = v;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+/**
+ * Runs a case warmup + repeats times and prints the statistics of the measured repeats.
+ *
+ * @param c       - the case
+ * @param warmup  - repeats thrown away
+ * @param repeats - repeats measured
+ */
+void measure(struct bench_case * c, int warmup, int repeats) {
+    int i;
+    for (i = 0; i < warmup; i++) {
+        c->run(c);
+    }
+    double sum = 0, sumSq = 0, best = 0;
+    for (i = 0; i < repeats; i++) {
+        double ns = c->run(c) * 1e9 / c->ops;
+        sum += ns;
+        sumSq += ns * ns;
+        best = (i == 0 || ns < best) ? ns : best;
+    }
+    double mean = sum / repeats;
+    double var = sumSq / repeats - mean * mean;
+    char pairs[16] = "-";
+    if (c->size > 0) {
+        snprintf(pairs, sizeof(pairs), "%d", c->size);
+    }
+    printf("%-8s %8d %6s %12.1f %10.1f %12.1f %14.0f\n", c->name, c->threads, pairs, mean, var > 0 ? sqrt(var) : 0,
+           best, 1e9 / mean);
+    fflush(stdout);
+}
+
+/**
+ * Starts threads running body, the operations split between them, and times them from a common start to the last
+ * one finishing.
+ *
+ * @param c          - the case, its ops split between the threads
+ * @param body       - what every thread runs, given its struct worker_arg
+ * @param numThreads - number of threads
+ * @return double - seconds taken
+ */
+double run_threads(struct bench_case * c, void* (*body)(void *), int numThreads) {
+    pthread_t tids[numThreads];
+    struct worker_arg args[numThreads];
+    int i;
+    pthread_barrier_init(&startLine, NULL, numThreads + 1);
+    for (i = 0; i < numThreads; i++) {
+        args[i].c = c;
+        args[i].index = i;
+        args[i].ops = c->ops / numThreads + (i < c->ops % numThreads);
+        pthread_create(&tids[i], NULL, body, &args[i]);
+    }
+    pthread_barrier_wait(&startLine);
+    double start = now();
+    for (i = 0; i < numThreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now() - start;
+    pthread_barrier_destroy(&startLine);
+    return elapsed;
+}
+
+/**
+ * Queue case: as many producers as consumers, every job pushed and popped once. An operation is one job through the
+ * queue.
+ *
+ * @param c - the case
+ * @return double - seconds taken
+ */
+double run_queue(struct bench_case * c) {
+    pthread_t tids[c->threads * 2];
+    struct worker_arg args[c->threads * 2];
+    int i;
+    pthread_barrier_init(&startLine, NULL, c->threads * 2 + 1);
+    for (i = 0; i < c->threads * 2; i++) {
+        args[i].c = c;
+        args[i].index = i;
+        args[i].ops = c->ops / c->threads + (i % c->threads < c->ops % c->threads);
+        pthread_create(&tids[i], NULL, i < c->threads ? queue_producer : queue_consumer, &args[i]);
+    }
+    pthread_barrier_wait(&startLine);
+    double start = now();
+    for (i = 0; i < c->threads * 2; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now() - start;
+    pthread_barrier_destroy(&startLine);
+    return elapsed;
+}
+
+/**
+ * Queue producer: pushes its share of jobs. The queue only stores the pointers, so they need not point anywhere.
+ *
+ * @param arg - its struct worker_arg
+ */
+void* queue_producer(void * arg) {
+    struct worker_arg * a = arg;
+    pthread_barrier_wait(&startLine);
+    long i;
+    for (i = 0; i < a->ops; i++) {
+        rq_push(&Q, (struct request *)(uintptr_t)(i + 1));
+    }
+    return NULL;
+}
+
+/**
+ * Queue consumer: pops its share of jobs.
+ *
+ * @param arg - its struct worker_arg
+ */
+void* queue_consumer(void * arg) {
+    struct worker_arg * a = arg;
+    pthread_barrier_wait(&startLine);
+    long i;
+    for (i = 0; i < a->ops; i++) {
+        rq_pop(&Q);
+    }
+    return NULL;
+}
+
+/**
+ * Parser case: parses the prepared TRANS lines CHUNK_SIZE bytes at a time. An operation is one line.
+ *
+ * @param c - the case
+ * @return double - seconds taken
+ */
+double run_parser(struct bench_case * c) {
+    struct request_parser parser;
+    long count = 0;
+    size_t off;
+    double start = now();
+    parser_init(&parser, numAccounts);
+    for (off = 0; off < c->len; off += CHUNK_SIZE) {
+        size_t n = c->len - off < CHUNK_SIZE ? c->len - off : CHUNK_SIZE;
+        parser_feed(&parser, (const char *)c->data + off, n, count_request, &count);
+    }
+    parser_finish(&parser, count_request, &count);
+    double elapsed = now() - start;
+    if (count != c->ops) {
+        printf("ERROR: parsed %ld of %ld requests\n", count, c->ops);
+    }
+    return elapsed;
+}
+
+/**
+ * Parser callback that counts TRANS.
+ *
+ * @param ctx - points to the running count
+ * @param p   - the parsed request
+ */
+void count_request(void * ctx, const struct parsed_request * p) {
+    *(long *)ctx += p->type == REQ_TRANS;
+}
+
+/**
+ * Lock case: every thread locks and unlocks sorted sets of size distinct accounts. An operation is one set locked
+ * and unlocked.
+ *
+ * @param c - the case
+ * @return double - seconds taken
+ */
+double run_lock(struct bench_case * c) {
+    return run_threads(c, lock_worker, c->threads);
+}
+
+/**
+ * Lock worker: picks sorted sets of distinct accounts, then locks and unlocks them one after another.
+ *
+ * @param arg - its struct worker_arg
+ */
+void* lock_worker(void * arg) {
+    struct worker_arg * a = arg;
+    int size = a->c->size;
+    // Sets picked beforehand so picking is not timed, reused round robin
+    int numSets = 1024;
+    int * sets = malloc(sizeof(int) * numSets * size);
+    unsigned int r = 11 + a->index;
+    int i, j, k;
+    for (i = 0; i < numSets; i++) {
+        int * ids = sets + i * size;
+        for (j = 0; j < size; j++) {
+            do {
+                ids[j] = next_random(&r) % numAccounts + 1;
+                for (k = 0; k < j && ids[k] != ids[j]; k++);
+            } while (k < j);
+        }
+        for (j = 1; j < size; j++) {
+            int id = ids[j];
+            for (k = j; k > 0 && ids[k - 1] > id; k--) {
+                ids[k] = ids[k - 1];
+            }
+            ids[k] = id;
+        }
+    }
+    pthread_barrier_wait(&startLine);
+    long op;
+    for (op = 0; op < a->ops; op++) {
+        int * ids = sets + (op % numSets) * size;
+        account_lock_many(ids, size);
+        account_unlock_many(ids, size);
+    }
+    free(sets);
+    return NULL;
+}
+
+/**
+ * Sort case: sorts a copy of one of the prepared pair orders. An operation is one copy and sort, the copy being the
+ * same 8 bytes a pair as a worker's job.
+ *
+ * @param c - the case
+ * @return double - seconds taken
+ */
+double run_sort(struct bench_case * c) {
+    const struct trans * inputs = c->data;
+    struct trans t[MAX_TRANS_PAIRS];
+    long op;
+    int check = 0;
+    double start = now();
+    for (op = 0; op < c->ops; op++) {
+        memcpy(t, inputs + (op % SORT_INPUTS) * c->size, sizeof(struct trans) * c->size);
+        sortIDLeastToGreatest(t, c->size);
+        check += t[0].acc_id;
+    }
+    double elapsed = now() - start;
+    if (check != c->ops) {
+        printf("ERROR: sort left the pairs out of order\n");
+    }
+    return elapsed;
+}
+
+/**
+ * @param r - random state
+ * @return unsigned int - next random number, the same on every platform for a seed
+ */
+unsigned int next_random(unsigned int * r) {
+    *r = *r * 1103515245 + 12345;
+    return *r >> 1;
+}
+
+/**
+ * @return double - monotonic time in seconds
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
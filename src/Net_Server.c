@@ -0,0 +1,462 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Net_Server.c contains the network front end of the server. Each net
+ *      thread runs an edge-triggered epoll loop that accepts clients from the
+ *      shared TCP and Unix domain listeners, streams whatever each client sent
+ *      through its own request parser and answers "ID n" on the same connection.
+ *      A client that sends faster than it reads its replies stops being read
+ *      once NET_OUT_MAX bytes of replies wait for it, so the kernel pushes
+ *      back on it instead of the server buffering without bound. Reading
+ *      resumes once the replies drain. One read can still add many replies,
+ *      so a client whose replies pass NET_OUT_LIMIT anyway is disconnected.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "Server.h"
+#include "Stats.h"
+#include "Net_Server.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define NET_READ_SIZE 65536     // bytes read from a client at a time
+#define NET_MAX_EVENTS 256      // events handled per epoll_wait call
+#define NET_BACKLOG 4096        // pending connections the kernel may hold per listener
+#define NET_OUT_MAX (1024 * 1024)           // reply bytes waiting for a client that stop reading from it
+#define NET_OUT_LIMIT (16 * NET_OUT_MAX)    // reply bytes waiting for a client that disconnect it
+
+// Kinds of file descriptors registered with epoll
+#define NET_LISTENER 0
+#define NET_CLIENT 1
+#define NET_WAKE 2
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct net_conn {                       // Structure for anything registered with epoll
+    int kind;                           // NET_LISTENER, NET_CLIENT or NET_WAKE
+    int fd;                             // socket or eventfd
+    int id;                             // client number given to dispatch_request, never 0
+    struct net_conn * prev, * next;     // list of the clients owned by one net thread
+    struct request_parser parser;       // parser state, holds any partial line between reads
+    char * out;                         // responses not yet accepted by the socket
+    size_t out_len, out_cap;            // used and allocated size of out
+    int paused;                         // not read from until out drops below NET_OUT_MAX
+    int failed;                         // replies were lost (NET_OUT_LIMIT or no memory), the client is closed
+};
+
+struct net_loop {                       // Structure for one net thread
+    pthread_t tid;                      // thread running the loop
+    int epfd;                           // epoll instance of the loop
+    struct net_conn clients;            // sentinel of the loop's client list
+    char buf[NET_READ_SIZE];            // read buffer shared by the loop's clients
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct net_conn listeners[2];    // TCP and Unix domain listeners, shared by every loop
+static int numListeners = 0;            // number of listeners opened
+static struct net_conn wakeup;          // eventfd that tells every loop to stop
+static struct net_loop * loops = NULL;  // array of config.net_threads loops
+static atomic_int stopping = 0;         // set once net_stop was called
+static atomic_int nextClient = 1;       // number of the next client accepted
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static void* net_loop_run(void * arg);
+static int open_tcp_listener(int port);
+static int open_unix_listener(const char * path);
+static void accept_clients(struct net_loop * loop, struct net_conn * listener);
+static int read_client(struct net_loop * loop, struct net_conn * c);
+static void handle_request(void * ctx, const struct parsed_request * p);
+static void queue_reply(struct net_conn * c, const char * text, size_t len);
+static int flush_client(struct net_conn * c);
+static void close_client(struct net_conn * c);
+/*===============================================================*/
+
+/**
+ * Opens the listeners requested in config and starts config.net_threads epoll loops.
+ *
+ * @return int - 1 if succeeded, 0 if a listener or loop could not be created
+ */
+int net_start() {
+    // Eventfd stays readable once written so every loop sees the stop request
+    wakeup.kind = NET_WAKE;
+    wakeup.fd = eventfd(0, EFD_NONBLOCK);
+    if (wakeup.fd < 0) {
+        return 0;
+    }
+
+    if (config.tcp_port) {
+        listeners[numListeners].kind = NET_LISTENER;
+        listeners[numListeners].fd = open_tcp_listener(config.tcp_port);
+        if (listeners[numListeners++].fd < 0) {
+            perror("tcp listener");
+            return 0;
+        }
+    }
+    if (config.unix_path != NULL) {
+        listeners[numListeners].kind = NET_LISTENER;
+        listeners[numListeners].fd = open_unix_listener(config.unix_path);
+        if (listeners[numListeners++].fd < 0) {
+            perror("unix listener");
+            return 0;
+        }
+    }
+
+    loops = calloc(config.net_threads, sizeof(struct net_loop));
+    if (loops == NULL) {
+        return 0;
+    }
+    int t, l;
+    for (t = 0; t < config.net_threads; t++) {
+        struct net_loop * loop = &loops[t];
+        loop->clients.next = loop->clients.prev = &loop->clients;
+        loop->epfd = epoll_create1(0);
+        if (loop->epfd < 0) {
+            return 0;
+        }
+        struct epoll_event ev;
+        // Every loop watches every listener, EPOLLEXCLUSIVE wakes only one of them per new client
+        for (l = 0; l < numListeners; l++) {
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = &listeners[l];
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listeners[l].fd, &ev);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wakeup;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, wakeup.fd, &ev);
+    }
+    for (t = 0; t < config.net_threads; t++) {
+        pthread_create(&loops[t].tid, NULL, net_loop_run, &loops[t]);
+    }
+    return 1;
+}
+
+/**
+ * Tells every net thread to stop accepting and serving clients. Safe to call from any thread, more than once,
+ * or when the network front end was never started.
+ */
+void net_stop() {
+    if (loops == NULL || atomic_exchange(&stopping, 1)) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(wakeup.fd, &one, sizeof(one)) < 0) {
+        perror("net_stop");
+    }
+}
+
+/**
+ * Waits for every net thread to exit, then closes the listeners.
+ */
+void net_join() {
+    if (loops == NULL) {
+        return;
+    }
+    int t;
+    for (t = 0; t < config.net_threads; t++) {
+        pthread_join(loops[t].tid, NULL);
+        close(loops[t].epfd);
+    }
+    for (t = 0; t < numListeners; t++) {
+        close(listeners[t].fd);
+    }
+    if (config.unix_path != NULL) {
+        unlink(config.unix_path);
+    }
+    close(wakeup.fd);
+    free(loops);
+    loops = NULL;
+}
+
+/**
+ * Event loop of one net thread. Runs until net_stop is called, then closes the clients it owns.
+ *
+ * @param arg - the struct net_loop this thread runs
+ */
+static void* net_loop_run(void * arg) {
+    struct net_loop * loop = arg;
+    struct epoll_event events[NET_MAX_EVENTS];
+    int done = 0;
+
+    while (!done) {
+        int n = epoll_wait(loop->epfd, events, NET_MAX_EVENTS, -1);
+        int i;
+        for (i = 0; i < n; i++) {
+            struct net_conn * c = events[i].data.ptr;
+            if (c->kind == NET_WAKE) {
+                done = 1;
+            } else if (c->kind == NET_LISTENER) {
+                accept_clients(loop, c);
+            } else {
+                // Edge triggered: drain everything the event reported before going back to sleep
+                int alive = 1;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    alive = read_client(loop, c);
+                }
+                while (alive) {
+                    alive = flush_client(c);
+                    if (!alive || !c->paused || c->out_len >= NET_OUT_MAX) {
+                        break;
+                    }
+                    // Replies drained, go back to what the client sent meanwhile
+                    c->paused = 0;
+                    alive = read_client(loop, c);
+                }
+                if (!alive) {
+                    close_client(c);
+                }
+            }
+        }
+    }
+
+    // Hang up on every client still connected to this loop
+    while (loop->clients.next != &loop->clients) {
+        close_client(loop->clients.next);
+    }
+    return NULL;
+}
+
+/**
+ * Opens a non-blocking TCP listener on the loopback interface.
+ *
+ * @param port - port to listen on
+ * @return int - listening socket, or -1 on error
+ */
+static int open_tcp_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, NET_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Opens a non-blocking Unix domain socket listener, replacing a stale socket file left at path.
+ *
+ * @param path - file system path of the socket
+ * @return int - listening socket, or -1 on error
+ */
+static int open_unix_listener(const char * path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, NET_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Accepts every pending client on the listener and registers it with the loop.
+ *
+ * @param loop     - loop that will own the new clients
+ * @param listener - listener that reported new connections
+ */
+static void accept_clients(struct net_loop * loop, struct net_conn * listener) {
+    for (;;) {
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            // EAGAIN means the backlog is empty, anything else is a client that already went away
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        // Replies are tiny, send them right away (fails harmlessly on Unix sockets)
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct net_conn * c = malloc(sizeof(struct net_conn));
+        if (c == NULL) {
+            // Turn this client away, the ones already connected keep being served
+            close(fd);
+            continue;
+        }
+        c->kind = NET_CLIENT;
+        c->fd = fd;
+        c->id = atomic_fetch_add(&nextClient, 1);
+        parser_init(&c->parser, numAccounts);
+        c->out = NULL;
+        c->out_len = c->out_cap = 0;
+        c->paused = 0;
+        c->failed = 0;
+        // Link into the loop's client list
+        c->next = loop->clients.next;
+        c->prev = &loop->clients;
+        loop->clients.next->prev = c;
+        loop->clients.next = c;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+/**
+ * Reads everything the client has sent so far and parses it in place, handling each completed request. Stops early,
+ * pausing the client, once NET_OUT_MAX bytes of replies wait for it.
+ *
+ * @param loop - loop owning the client, provides the read buffer
+ * @param c    - client to read from
+ * @return int - 1 if the client is still connected, 0 if it hung up or failed
+ */
+static int read_client(struct net_loop * loop, struct net_conn * c) {
+    for (;;) {
+        if (c->failed) {
+            return 0;
+        }
+        if (c->out_len >= NET_OUT_MAX) {
+            // The rest stays in the socket until the client reads its replies
+            c->paused = 1;
+            return 1;
+        }
+        ssize_t got = read(c->fd, loop->buf, NET_READ_SIZE);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (got == 0) {
+            // Client hung up, still answer what it already sent
+            parser_finish(&c->parser, handle_request, c);
+            flush_client(c);
+            return 0;
+        }
+        parser_feed(&c->parser, loop->buf, got, handle_request, c);
+    }
+}
+
+/**
+ * Called by the parser for each request a client sent. Queues it and records the reply.
+ *
+ * @param ctx - client that sent the request
+ * @param p   - the parsed request
+ */
+static void handle_request(void * ctx, const struct parsed_request * p) {
+    struct net_conn * c = ctx;
+    char reply[STATS_REPLY_SIZE];
+    int len = dispatch_request(p, c->id, reply, sizeof(reply));
+    if (len > 0) {
+        queue_reply(c, reply, len);
+    }
+}
+
+/**
+ * Appends text to the client's pending replies. If they would pass NET_OUT_LIMIT or there is no memory for them, the
+ * client is marked failed instead and closed by its loop.
+ *
+ * @param c    - client to answer
+ * @param text - reply bytes
+ * @param len  - number of reply bytes
+ */
+static void queue_reply(struct net_conn * c, const char * text, size_t len) {
+    if (c->failed) {
+        return;
+    }
+    if (c->out_len + len > NET_OUT_LIMIT) {
+        c->failed = 1;
+        return;
+    }
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = (c->out_len + len) * 2;
+        char * out = realloc(c->out, cap);
+        if (out == NULL) {
+            c->failed = 1;
+            return;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, text, len);
+    c->out_len += len;
+}
+
+/**
+ * Sends as much of the pending replies as the socket accepts. The rest is sent on the next EPOLLOUT.
+ *
+ * @param c - client to flush
+ * @return int - 1 if the client is still usable, 0 if the socket failed or replies were lost
+ */
+static int flush_client(struct net_conn * c) {
+    if (c->failed) {
+        return 0;
+    }
+    size_t sent = 0;
+    while (sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return 0;
+            }
+            break;
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    return 1;
+}
+
+/**
+ * Unlinks a client from its loop, closes its socket, tells the server it is gone and frees it.
+ *
+ * @param c - client to close
+ */
+static void close_client(struct net_conn * c) {
+    client_closed(c->id);
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    // Closing the fd also removes it from the epoll set
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
@@ -0,0 +1,19 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Net_Server.h declares the network front end that lets many clients
+ *      send CHECK/TRANS/END requests over TCP (loopback) or a Unix domain socket.
+*/
+#ifndef NET_SERVER_H
+#define NET_SERVER_H
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int net_start();
+void net_stop();
+void net_join();
+/*===============================================================*/
+
+#endif
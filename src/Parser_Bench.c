@@ -0,0 +1,233 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Parser_Bench.c measures request parsing throughput on a recorded input
+ *      file. It runs the streaming parser from Request_Parser.c over the file in
+ *      read()-sized chunks and, for comparison, the old fgets/strtok/atoi loop.
+ *
+ *      Build with: make bench_parser
+ *      Record an input file:   ./parser_bench --generate <# of requests> <file>
+ *      Run the benchmark:      ./parser_bench <file> [passes]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Request_Parser.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define STR_MAX_SIZE 256        // line buffer size of the old parser
+#define CHUNK_SIZE 65536        // bytes handed to the streaming parser per call, like one read()
+#define NUM_ACCOUNTS 1000       // accounts assumed by the generated input and validation
+#define DEFAULT_PASSES 20       // times the file is parsed per parser
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int generate(int numRequests, const char * path);
+char * load_file(const char * path, size_t * len);
+double now();
+void count_request(void * ctx, const struct parsed_request * p);
+long run_streaming(const char * data, size_t len);
+long run_legacy(const char * data, size_t len);
+/*===============================================================*/
+
+/**
+ * Either records an input file or benchmarks both parsers on one.
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int
+ */
+int main(int argc, char *argv[]) {
+    if (argc == 4 && !strcmp(argv[1], "--generate")) {
+        return generate(atoi(argv[2]), argv[3]) ? 0 : 1;
+    }
+    if (argc < 2) {
+        printf("Usage: %s <input file> [passes]\n       %s --generate <# of requests> <file>\n", argv[0], argv[0]);
+        return 1;
+    }
+    int passes = argc > 2 ? atoi(argv[2]) : DEFAULT_PASSES;
+
+    size_t len;
+    char * data = load_file(argv[1], &len);
+    if (data == NULL) {
+        printf("ERROR: could not read %s\n", argv[1]);
+        return 1;
+    }
+
+    // Warm up caches and page in the file once for each parser
+    long requests = run_streaming(data, len);
+    run_legacy(data, len);
+    printf("Input: %s, %zu bytes, %ld requests, %d passes\n", argv[1], len, requests, passes);
+
+    const char * names[2] = {"streaming", "fgets/strtok/atoi"};
+    int k, i;
+    for (k = 0; k < 2; k++) {
+        double start = now();
+        long total = 0;
+        for (i = 0; i < passes; i++) {
+            total += (k == 0) ? run_streaming(data, len) : run_legacy(data, len);
+        }
+        double elapsed = now() - start;
+        printf("%-18s %12.0f requests/s  %8.1f MB/s\n", names[k], total / elapsed, (double)len * passes / elapsed / 1e6);
+    }
+    free(data);
+    return 0;
+}
+
+/**
+ * Writes a request file shaped like the test script's traffic: TRANS with 1 to 10 pairs mixed with CHECKs.
+ *
+ * @param numRequests - number of lines to write
+ * @param path        - file to create
+ * @return int - 1 if succeeded, 0 if the file could not be written
+ */
+int generate(int numRequests, const char * path) {
+    FILE * out = fopen(path, "w");
+    if (out == NULL) {
+        return 0;
+    }
+    srand(5);
+    int i, j;
+    for (i = 0; i < numRequests; i++) {
+        if (rand() % 4 == 0) {
+            fprintf(out, "CHECK %d\n", rand() % NUM_ACCOUNTS + 1);
+        } else {
+            int pairs = rand() % MAX_TRANS_PAIRS + 1;
+            fprintf(out, "TRANS");
+            for (j = 0; j < pairs; j++) {
+                fprintf(out, " %d %d", rand() % NUM_ACCOUNTS + 1, rand() % 20001 - 10000);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    fclose(out);
+    return 1;
+}
+
+/**
+ * Reads a whole file into memory.
+ *
+ * @param path - file to read
+ * @param len  - receives the file size
+ * @return char* - file contents, NULL on error
+ */
+char * load_file(const char * path, size_t * len) {
+    FILE * in = fopen(path, "r");
+    if (in == NULL) {
+        return NULL;
+    }
+    fseek(in, 0, SEEK_END);
+    *len = ftell(in);
+    rewind(in);
+    char * data = malloc(*len + 1);
+    if (data == NULL || fread(data, 1, *len, in) != *len) {
+        free(data);
+        fclose(in);
+        return NULL;
+    }
+    fclose(in);
+    return data;
+}
+
+/**
+ * @return double - monotonic time in seconds
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Parser callback that only counts valid requests.
+ *
+ * @param ctx - points to the running count
+ * @param p   - the parsed request
+ */
+void count_request(void * ctx, const struct parsed_request * p) {
+    if (p->type == REQ_CHECK || p->type == REQ_TRANS) {
+        (*(long *)ctx)++;
+    }
+}
+
+/**
+ * Parses the data with the streaming parser, CHUNK_SIZE bytes at a time.
+ *
+ * @param data - input bytes
+ * @param len  - number of input bytes
+ * @return long - number of valid requests parsed
+ */
+long run_streaming(const char * data, size_t len) {
+    struct request_parser parser;
+    long count = 0;
+    size_t off;
+    parser_init(&parser, NUM_ACCOUNTS);
+    for (off = 0; off < len; off += CHUNK_SIZE) {
+        size_t n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+        parser_feed(&parser, data + off, n, count_request, &count);
+    }
+    parser_finish(&parser, count_request, &count);
+    return count;
+}
+
+/**
+ * Parses the data the way program_loop used to: fgets into a line buffer, strtok, atoi and a final strcpy.
+ *
+ * @param data - input bytes
+ * @param len  - number of input bytes
+ * @return long - number of valid requests parsed
+ */
+long run_legacy(const char * data, size_t len) {
+    FILE * in = fmemopen((void *)data, len, "r");
+    char userInput[STR_MAX_SIZE];
+    const char delim[2] = " ";
+    struct parsed_request req;
+    long count = 0;
+    char * token;
+
+    while (fgets(userInput, STR_MAX_SIZE, in) != NULL) {
+        userInput[strcspn(userInput, "\n")] = '\0';
+        token = strtok(userInput, delim);
+        if (token == NULL) {
+            continue;
+        } else if (!strcmp(token, "CHECK")) {
+            token = strtok(NULL, delim);
+            if (token != NULL) {
+                req.check_acc_id = atoi(token);
+                if (req.check_acc_id <= NUM_ACCOUNTS && req.check_acc_id > 0) {
+                    count++;
+                }
+            }
+        } else if (!strcmp(token, "TRANS")) {
+            int i, valid = 1;
+            req.num_trans = 0;
+            for (i = 0; i < MAX_TRANS_PAIRS; i++) {
+                token = strtok(NULL, delim);
+                if (token == NULL) {
+                    break;
+                }
+                req.transactions[i].acc_id = atoi(token);
+                token = strtok(NULL, delim);
+                if (token == NULL || req.transactions[i].acc_id > NUM_ACCOUNTS || req.transactions[i].acc_id < 1) {
+                    valid = 0;
+                    break;
+                }
+                req.transactions[i].amount = atoi(token);
+                req.num_trans++;
+            }
+            if (valid && req.num_trans > 0) {
+                count++;
+            }
+        }
+        strcpy(userInput, "");
+    }
+    fclose(in);
+    return count;
+}
@@ -0,0 +1,176 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Partition_Exec.c implements the partitioned execution mode. Account ID
+ *      a belongs to partition (a - 1) % P and every partition has exactly one
+ *      owner, the worker with the same index, fed by its own queue.
+ *
+ *      A request whose accounts all fall in one partition goes straight to the
+ *      owner's queue and runs without locks. A TRANS spanning several partitions
+ *      is placed in each involved owner's queue. Each owner that reaches it stops
+ *      and waits; the last one to arrive runs the whole request while the others
+ *      are parked, which keeps its all-or-nothing ISF result. Multi-partition
+ *      requests are queued under one routing lock, so every owner sees them in
+ *      the same relative order and two owners can never wait on each other.
+*/
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include "Futex.h"
+#include "Server.h"
+#include "Request_Pool.h"
+#include "Partition_Exec.h"
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct request_queue * partQ = NULL;    // one queue per partition, served by the owning worker
+static int numPartitions = 0;                   // number of partitions (equal to worker count)
+static pthread_mutex_t routeMut = PTHREAD_MUTEX_INITIALIZER;  // orders multi-partition requests
+/*===============================================================*/
+
+/**
+ * Creates one queue per partition.
+ *
+ * @param num_partitions - number of partitions, one per worker
+ * @param capacity       - jobs each partition queue can hold
+ * @return int - 1 if succeeded, 0 if a queue could not be allocated
+ */
+int partition_init(int num_partitions, size_t capacity) {
+    partQ = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct request_queue) * num_partitions);
+    if (partQ == NULL) {
+        return 0;
+    }
+    int p;
+    for (p = 0; p < num_partitions; p++) {
+        if (!rq_init(&partQ[p], capacity)) {
+            return 0;
+        }
+    }
+    numPartitions = num_partitions;
+    return 1;
+}
+
+/**
+ * Frees the partition queues. No worker may be using them anymore.
+ */
+void partition_destroy() {
+    int p;
+    for (p = 0; p < numPartitions; p++) {
+        rq_destroy(&partQ[p]);
+    }
+    free(partQ);
+    partQ = NULL;
+    numPartitions = 0;
+}
+
+/**
+ * @param acc_id - account ID
+ * @return int - index of the partition (and worker) owning the account
+ */
+int partition_of(int acc_id) {
+    return (acc_id - 1) % numPartitions;
+}
+
+/**
+ * Routes a request to the queues of the partitions it touches.
+ *
+ * @param r - request to queue, owned by the caller until this returns 1
+ * @return int - 1 if the request was queued, 0 if the server is shutting down
+ */
+int partition_submit(struct request * r) {
+    if (r->check_acc_id != -1) {
+        r->num_parts = 1;
+        return rq_push(&partQ[partition_of(r->check_acc_id)], r);
+    }
+
+    // Collect the distinct partitions of the pairs
+    int parts[MAX_TRANS_PAIRS];
+    int num = 0;
+    int i, j;
+    for (i = 0; i < r->num_trans; i++) {
+        int part = partition_of(r->transactions[i].acc_id);
+        for (j = 0; j < num && parts[j] != part; j++);
+        if (j == num) {
+            parts[num++] = part;
+        }
+    }
+
+    r->num_parts = num;
+    if (num == 1) {
+        // Single owner, no coordination needed
+        return rq_push(&partQ[parts[0]], r);
+    }
+
+    atomic_store(&r->arrived, 0);
+    atomic_store(&r->done, 0);
+    atomic_store(&r->refs, num);
+    // Queue into every involved partition as one step so all owners agree on the order
+    int queued = 1;
+    pthread_mutex_lock(&routeMut);
+    for (i = 0; i < num && queued; i++) {
+        queued = rq_push(&partQ[parts[i]], r);
+    }
+    pthread_mutex_unlock(&routeMut);
+    // partition_close takes routeMut, so a request is either in all of its queues or in none
+    return queued;
+}
+
+/**
+ * Loop of the worker owning partition index. Serves the partition's queue until it is closed and drained.
+ *
+ * @param index - partition owned by the calling worker
+ */
+void partition_worker(int index) {
+    struct request_queue * q = &partQ[index];
+    struct request * job;
+
+    while ((job = rq_pop(q)) != NULL) {
+        if (job->num_parts == 1) {
+            // Only this worker ever touches these accounts
+            execute_unlocked(job);
+            pool_free(job);
+            continue;
+        }
+
+        // Multi-partition TRANS: the last owner to arrive runs it while the others wait
+        if (atomic_fetch_add(&job->arrived, 1) + 1 == (uint32_t)job->num_parts) {
+            execute_unlocked(job);
+            atomic_store(&job->done, 1);
+            futex_wake(&job->done, INT_MAX);
+        } else {
+            while (!atomic_load(&job->done)) {
+                futex_wait(&job->done, 0);
+            }
+        }
+        // Last owner to let go returns the request
+        if (atomic_fetch_sub(&job->refs, 1) == 1) {
+            pool_free(job);
+        }
+    }
+}
+
+/**
+ * Closes every partition queue. Owners finish the jobs already queued and then return.
+ */
+void partition_close() {
+    int p;
+    pthread_mutex_lock(&routeMut);
+    for (p = 0; p < numPartitions; p++) {
+        rq_close(&partQ[p]);
+    }
+    pthread_mutex_unlock(&routeMut);
+}
+
+/**
+ * @return size_t - jobs waiting in the partition queues, a multi-partition request counts once per partition
+ */
+size_t partition_depth() {
+    size_t depth = 0;
+    int p;
+    for (p = 0; p < numPartitions; p++) {
+        depth += rq_size(&partQ[p]);
+    }
+    return depth;
+}
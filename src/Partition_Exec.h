@@ -0,0 +1,34 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Partition_Exec.h declares the partitioned execution mode (--exec=partition).
+ *      Accounts are split between the workers and every account is only ever
+ *      touched by the worker that owns its partition, so no account locks are needed.
+*/
+#ifndef PARTITION_EXEC_H
+#define PARTITION_EXEC_H
+
+#include <stddef.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define PARTITION_MIN_QUEUE 256     // smallest queue given to a single partition
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+struct request;
+
+int partition_init(int num_partitions, size_t capacity);
+void partition_destroy();
+int partition_of(int acc_id);
+int partition_submit(struct request * r);
+void partition_worker(int index);
+void partition_close();
+size_t partition_depth();
+/*===============================================================*/
+
+#endif
@@ -0,0 +1,464 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Replica_Bench.c measures how CHECK throughput grows with the number of
+ *      standbys and how far they lag behind a primary taking mostly TRANS. For
+ *      0 to N standbys it starts a primary with --wal and --replicate and the
+ *      standbys following it, streams the TRANS to the primary and the CHECKs
+ *      to the standbys (to the primary when there are none), all at once, and
+ *      waits for every result to be written. The lag is read from each
+ *      standby's STATS.
+ *
+ *      Build with: make bench_replica
+ *      Run:        ./replica_bench <max standbys> <# of worker threads> <# of accounts> <# of TRANS> <# of CHECKs>
+ *                                  [-- server options]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define SERVER_BIN "./appserver"                // server program, started from the build directory
+#define BENCH_WAL "/tmp/replica_bench.wal"      // commit log of the primary
+#define BENCH_REPL "/tmp/replica_bench.repl"    // socket standbys follow the primary on
+#define BENCH_FILE "/tmp/replica_bench.%d.%s"   // socket and output file of server n, 0 being the primary
+#define MAX_STANDBYS 16                         // most standbys run at once
+#define TRANS_PAIRS 2                           // pairs per TRANS, a first account and any other
+#define CONNECT_TRIES 1000                      // attempts to reach a server's socket
+#define CONNECT_WAIT_US 10000                   // microseconds between attempts
+#define POLL_WAIT_US 1000                       // microseconds between looks at the output files
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct server {             // One running server and the requests streamed to it
+    pid_t pid;              // the server process
+    int fd;                 // connection to it
+    FILE * out;             // its output file, read as it grows
+    char * data;            // request lines sent to it
+    size_t len;             // bytes of data
+    int replies;            // "ID n" replies expected on fd
+    pthread_t sender;       // thread writing data to fd
+    pthread_t reader;       // thread taking the replies off fd
+    int reads;              // CHECK results written so far
+    int writes;             // TRANS results written so far
+};
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+char * generate(int numAccounts, int count, int checks, int seed, size_t * len);
+int run(int standbys, int workers, int numAccounts, int numTrans, int numChecks, char ** serverArgs, int numServerArgs, double * writeSecs, double * readSecs, double * lagAvgMs, double * lagMaxMs);
+int start_server(struct server * s, int n, int workers, int numAccounts, int standby, char ** serverArgs, int numServerArgs);
+int stop_server(struct server * s, double * lagAvgMs, double * lagMaxMs);
+int connect_server(int n);
+void* send_all(void * arg);
+void* read_replies(void * arg);
+void count_results(struct server * s);
+double now();
+/*===============================================================*/
+
+/**
+ * Runs the benchmark once for every standby count from 0 to the maximum and prints one row per run.
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 6) {
+        printf("Usage: %s <max standbys> <# of worker threads> <# of accounts> <# of TRANS> <# of CHECKs> [-- server options]\n", argv[0]);
+        return 1;
+    }
+    int maxStandbys = atoi(argv[1]);
+    int workers = atoi(argv[2]);
+    int numAccounts = atoi(argv[3]);
+    int numTrans = atoi(argv[4]);
+    int numChecks = atoi(argv[5]);
+    char ** serverArgs = NULL;
+    int numServerArgs = 0;
+    if (argc > 6 && !strcmp(argv[6], "--")) {
+        serverArgs = argv + 7;
+        numServerArgs = argc - 7;
+    }
+    if (maxStandbys < 0 || maxStandbys > MAX_STANDBYS || workers < 1 || numAccounts < TRANS_PAIRS || numTrans < 1 || numChecks < 1) {
+        printf("ERROR: invalid arguments\n");
+        return 1;
+    }
+
+    printf("%d TRANS with %d pairs to the primary, %d CHECKs spread over the standbys, %d accounts, %d workers per server\n",
+           numTrans, TRANS_PAIRS, numChecks, numAccounts, workers);
+    printf("%8s %12s %12s %12s %12s %12s\n", "standbys", "TRANS/s", "CHECK/s", "speedup", "lag avg ms", "lag max ms");
+
+    double base = 0;
+    int standbys;
+    for (standbys = 0; standbys <= maxStandbys; standbys++) {
+        double writeSecs, readSecs, lagAvgMs, lagMaxMs;
+        if (!run(standbys, workers, numAccounts, numTrans, numChecks, serverArgs, numServerArgs, &writeSecs, &readSecs, &lagAvgMs, &lagMaxMs)) {
+            printf("ERROR: run with %d standbys failed\n", standbys);
+            return 1;
+        }
+        double rate = numChecks / readSecs;
+        if (standbys == 0) {
+            base = rate;
+            printf("%8d %12.0f %12.0f %11.2fx %12s %12s\n", standbys, numTrans / writeSecs, rate, 1.0, "-", "-");
+        } else {
+            printf("%8d %12.0f %12.0f %11.2fx %12.2f %12.2f\n", standbys, numTrans / writeSecs, rate, rate / base,
+                   lagAvgMs, lagMaxMs);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
+
+/**
+ * Builds a request stream of one kind: CHECKs, or TRANS with distinct accounts that mostly deposit so the debits
+ * mostly go through.
+ *
+ * @param numAccounts - accounts to pick from
+ * @param count       - number of requests
+ * @param checks      - 1 for CHECKs, 0 for TRANS
+ * @param seed        - seed of the account picks, so every standby reads different accounts
+ * @param len         - receives the size of the stream
+ * @return char* - request lines
+ */
+char * generate(int numAccounts, int count, int checks, int seed, size_t * len) {
+    char * data = malloc((size_t)count * (8 + TRANS_PAIRS * 24) + 1);
+    size_t off = 0;
+    unsigned int r = seed;
+    int i, j;
+    for (i = 0; i < count; i++) {
+        if (checks) {
+            off += sprintf(data + off, "CHECK %d\n", rand_r(&r) % numAccounts + 1);
+            continue;
+        }
+        int first = rand_r(&r) % numAccounts + 1;
+        off += sprintf(data + off, "TRANS");
+        for (j = 0; j < TRANS_PAIRS; j++) {
+            // Any account but the first for the second pair
+            int acc = (first - 1 + j * (rand_r(&r) % (numAccounts - 1) + 1)) % numAccounts + 1;
+            off += sprintf(data + off, " %d %d", acc, rand_r(&r) % 3 ? rand_r(&r) % 100 + 1 : -(rand_r(&r) % 100 + 1));
+        }
+        off += sprintf(data + off, "\n");
+    }
+    *len = off;
+    return data;
+}
+
+/**
+ * Starts a primary and the standbys, streams the TRANS to the primary and the CHECKs to the standbys all at once and
+ * waits for every result to be written. Stopping the servers is not timed.
+ *
+ * @param standbys      - number of standbys, 0 to send the CHECKs to the primary
+ * @param workers       - worker threads per server
+ * @param numAccounts   - number of accounts
+ * @param numTrans      - TRANS sent to the primary
+ * @param numChecks     - CHECKs sent, split evenly over the standbys
+ * @param serverArgs    - options passed to every server
+ * @param numServerArgs - number of serverArgs
+ * @param writeSecs     - receives the seconds until the last TRANS result was written
+ * @param readSecs      - receives the seconds until the last CHECK result was written
+ * @param lagAvgMs      - receives the standbys' mean lag in milliseconds
+ * @param lagMaxMs      - receives the standbys' largest lag in milliseconds
+ * @return int - 1 if the run succeeded, 0 if it failed
+ */
+int run(int standbys, int workers, int numAccounts, int numTrans, int numChecks, char ** serverArgs, int numServerArgs, double * writeSecs, double * readSecs, double * lagAvgMs, double * lagMaxMs) {
+    struct server servers[MAX_STANDBYS + 2];
+    int numServers = standbys + 1;
+    int numConns = standbys ? numServers : 2;
+    int i, ok = 1;
+    unlink(BENCH_WAL);
+    memset(servers, 0, sizeof(servers));
+    for (i = 0; i < numServers; i++) {
+        if (!start_server(&servers[i], i, workers, numAccounts, i > 0, serverArgs, numServerArgs)) {
+            while (--i >= 0) {
+                stop_server(&servers[i], NULL, NULL);
+            }
+            return 0;
+        }
+    }
+
+    // The CHECKs go on a connection of their own even to the primary, so they do not queue behind the TRANS
+    struct server * readers = servers + 1;
+    int numReaders = standbys;
+    if (standbys == 0) {
+        readers = &servers[1];
+        numReaders = 1;
+        readers->pid = -1;
+        readers->fd = connect_server(0);
+        readers->out = NULL;
+        if (readers->fd < 0) {
+            stop_server(&servers[0], NULL, NULL);
+            return 0;
+        }
+    }
+    servers[0].data = generate(numAccounts, numTrans, 0, 7, &servers[0].len);
+    servers[0].replies = numTrans;
+    for (i = 0; i < numReaders; i++) {
+        int count = numChecks / numReaders + (i < numChecks % numReaders);
+        readers[i].data = generate(numAccounts, count, 1, 11 + i, &readers[i].len);
+        readers[i].replies = count;
+    }
+
+    double start = now();
+    for (i = 0; i < numConns; i++) {
+        pthread_create(&servers[i].sender, NULL, send_all, &servers[i]);
+        pthread_create(&servers[i].reader, NULL, read_replies, &servers[i]);
+    }
+    int readsLeft = 1, writesLeft = 1;
+    while (readsLeft || writesLeft) {
+        usleep(POLL_WAIT_US);
+        int reads = 0;
+        for (i = 0; i < numServers; i++) {
+            if (servers[i].out != NULL) {
+                count_results(&servers[i]);
+            }
+            reads += servers[i].reads;
+        }
+        if (writesLeft && servers[0].writes >= numTrans) {
+            *writeSecs = now() - start;
+            writesLeft = 0;
+        }
+        if (readsLeft && reads >= numChecks) {
+            *readSecs = now() - start;
+            readsLeft = 0;
+        }
+    }
+    for (i = 0; i < numConns; i++) {
+        pthread_join(servers[i].sender, NULL);
+        pthread_join(servers[i].reader, NULL);
+        free(servers[i].data);
+    }
+
+    // Standbys first, so their STATS show the lag under load rather than the final catch-up
+    double sum = 0, max = 0;
+    if (standbys == 0) {
+        close(readers->fd);
+    }
+    for (i = 1; i < numServers; i++) {
+        double avg, top;
+        ok &= stop_server(&servers[i], &avg, &top);
+        sum += avg;
+        max = top > max ? top : max;
+    }
+    ok &= stop_server(&servers[0], NULL, NULL);
+    *lagAvgMs = standbys ? sum / standbys : 0;
+    *lagMaxMs = max;
+    return ok;
+}
+
+/**
+ * Starts server n and connects to it.
+ *
+ * @param s             - receives the running server
+ * @param n             - 0 for the primary, 1 and up for the standbys
+ * @param workers       - worker threads
+ * @param numAccounts   - number of accounts
+ * @param standby       - 1 to follow the primary
+ * @param serverArgs    - options passed to the server
+ * @param numServerArgs - number of serverArgs
+ * @return int - 1 if the server is up, 0 if it could not be reached
+ */
+int start_server(struct server * s, int n, int workers, int numAccounts, int standby, char ** serverArgs, int numServerArgs) {
+    char workerCount[16], accountCount[16], outPath[64], sockOpt[80];
+    snprintf(workerCount, sizeof(workerCount), "%d", workers);
+    snprintf(accountCount, sizeof(accountCount), "%d", numAccounts);
+    snprintf(outPath, sizeof(outPath), BENCH_FILE, n, "out");
+    strcpy(sockOpt, "--unix=");
+    snprintf(sockOpt + 7, sizeof(sockOpt) - 7, BENCH_FILE, n, "sock");
+    char * argv[numServerArgs + 10];
+    int a = 0, i;
+    argv[a++] = SERVER_BIN;
+    argv[a++] = workerCount;
+    argv[a++] = accountCount;
+    argv[a++] = outPath;
+    argv[a++] = sockOpt;
+    argv[a++] = "--stdin=0";
+    // The result writer gets every line to the output file within its interval, stdio would hold the last ones
+    argv[a++] = "--writer=1";
+    if (standby) {
+        argv[a++] = "--standby=" BENCH_REPL;
+    } else {
+        argv[a++] = "--wal=" BENCH_WAL;
+        argv[a++] = "--replicate=" BENCH_REPL;
+    }
+    for (i = 0; i < numServerArgs; i++) {
+        argv[a++] = serverArgs[i];
+    }
+    argv[a] = NULL;
+
+    unlink(sockOpt + 7);
+    unlink(outPath);
+    s->pid = fork();
+    if (s->pid < 0) {
+        return 0;
+    }
+    if (s->pid == 0) {
+        execv(SERVER_BIN, argv);
+        perror(SERVER_BIN);
+        _exit(127);
+    }
+    s->fd = connect_server(n);
+    s->out = fopen(outPath, "r");
+    if (s->fd < 0 || s->out == NULL) {
+        kill(s->pid, SIGKILL);
+        waitpid(s->pid, NULL, 0);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Asks a standby for its lag, then ends the server and waits for it to exit.
+ *
+ * @param s        - the running server
+ * @param lagAvgMs - receives the STANDBY line's lag_avg, NULL to skip asking
+ * @param lagMaxMs - receives the STANDBY line's lag_max
+ * @return int - 1 if the server exited cleanly (and reported its lag when asked)
+ */
+int stop_server(struct server * s, double * lagAvgMs, double * lagMaxMs) {
+    int found = lagAvgMs == NULL;
+    if (lagAvgMs != NULL && write(s->fd, "STATS\n", 6) == 6) {
+        // The STATS answer comes back on the socket, the STANDBY line last but for the blank line after it
+        char buf[8192];
+        size_t have = 0;
+        while (!found && have < sizeof(buf) - 1) {
+            ssize_t got = read(s->fd, buf + have, sizeof(buf) - 1 - have);
+            if (got <= 0) {
+                break;
+            }
+            have += got;
+            buf[have] = '\0';
+            char * line = strstr(buf, "STANDBY ");
+            found = line != NULL && strchr(line, '\n') != NULL &&
+                    sscanf(strstr(line, "lag_avg "), "lag_avg %lf ms lag_max %lf", lagAvgMs, lagMaxMs) == 2;
+        }
+    }
+    if (write(s->fd, "END\n", 4) != 4) {
+        perror("END");
+    }
+    int status;
+    waitpid(s->pid, &status, 0);
+    close(s->fd);
+    if (s->out != NULL) {
+        fclose(s->out);
+    }
+    return found && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Connects to server n's socket, waiting for the server to start.
+ *
+ * @param n - 0 for the primary, 1 and up for the standbys
+ * @return int - connected socket, -1 if the server never listened
+ */
+int connect_server(int n) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), BENCH_FILE, n, "sock");
+    int i;
+    for (i = 0; i < CONNECT_TRIES; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(CONNECT_WAIT_US);
+    }
+    return -1;
+}
+
+/**
+ * Sender thread: writes every request line to the server.
+ *
+ * @param arg - the struct server to send to
+ */
+void* send_all(void * arg) {
+    struct server * s = arg;
+    size_t sent = 0;
+    while (sent < s->len) {
+        ssize_t n = write(s->fd, s->data + sent, s->len - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("send");
+            break;
+        }
+        sent += n;
+    }
+    return NULL;
+}
+
+/**
+ * Reader thread: takes every "ID n" reply off the socket so the server never has to hold them.
+ *
+ * @param arg - the struct server to read from
+ */
+void* read_replies(void * arg) {
+    struct server * s = arg;
+    char buf[65536];
+    int replies = 0;
+    while (replies < s->replies) {
+        ssize_t got = read(s->fd, buf, sizeof(buf));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        ssize_t i;
+        for (i = 0; i < got; i++) {
+            replies += buf[i] == '\n';
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Counts the CHECK and TRANS results the server wrote since the last call.
+ *
+ * @param s - the running server
+ */
+void count_results(struct server * s) {
+    char line[256];
+    clearerr(s->out);
+    // A line still being written is read again once it is whole
+    long pos = ftell(s->out);
+    while (fgets(line, sizeof(line), s->out) != NULL) {
+        if (strchr(line, '\n') == NULL) {
+            fseek(s->out, pos, SEEK_SET);
+            break;
+        }
+        if (strstr(line, " BAL ") != NULL) {
+            s->reads++;
+        } else {
+            s->writes++;
+        }
+        pos = ftell(s->out);
+    }
+}
+
+/**
+ * @return double - monotonic time in seconds
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
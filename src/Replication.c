@@ -0,0 +1,420 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Replication.c implements log shipping. The primary listens on a Unix
+ *      domain socket and gives every standby that connects a thread of its
+ *      own, which reads the durable part of the commit log from the start and
+ *      then follows it as the log thread syncs more. Nothing is buffered for a
+ *      standby: a slow standby just reads further behind in the log file.
+ *
+ *      Each message is a header with the primary's durable log end and the
+ *      time the log got there, followed by the next log bytes, or none for a
+ *      heartbeat. The standby applies whole records to its balances in log
+ *      order, the same way the log is replayed at startup, so its balances are
+ *      always those of a durable prefix of the primary's log. Both ends run on
+ *      one host and share the monotonic clock, so the standby can tell how old
+ *      the newest change it applied was when it applied it.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Accounts.h"
+#include "Commit_Log.h"
+#include "Stats.h"
+#include "Replication.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define REPL_BACKLOG 64             // pending standby connections the kernel may hold
+#define CONNECT_TRIES 1000          // attempts to reach a primary that is still starting
+#define CONNECT_WAIT_US 10000       // microseconds between attempts
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct repl_header {            // Header of every message to a standby, followed by len bytes of the log
+    int64_t durable_end;        // offset the primary's durable log ended at when the message was sent
+    uint64_t durable_ns;        // monotonic time the log became durable up to durable_end
+    uint32_t len;               // log bytes that follow, 0 for a heartbeat
+    uint32_t pad;               // keeps the header the same size everywhere
+};
+
+struct standby_conn {           // Primary side: one connected standby
+    int fd;                     // socket to the standby
+    pthread_t tid;              // thread shipping the log to it
+    _Atomic int64_t sent;       // log bytes sent so far
+    atomic_int done;            // the standby went away or shipping stopped
+    struct standby_conn * next; // next standby connected
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+// Primary
+static int listenFd = -1;                       // socket standbys connect to
+static char * listenPath;                       // its path, removed at stop
+static const char * logPath;                    // commit log shipped to every standby
+static pthread_t acceptTid;                     // thread accepting standbys
+static pthread_mutex_t standbyMut = PTHREAD_MUTEX_INITIALIZER;  // guards standbys
+static struct standby_conn * standbys = NULL;   // every standby that ever connected
+static atomic_int stopping = 0;                 // set by replication_stop
+
+// Standby
+static int primaryFd = -1;                      // socket to the primary
+static int numAccs;                             // accounts a record may name
+static pthread_t followTid;                     // thread applying the stream
+static atomic_int following = 0;                // still connected to the primary
+static _Atomic int64_t applied;                 // STATS: log bytes applied
+static _Atomic int64_t primaryEnd;              // STATS: primary's durable log end as last heard
+static _Atomic uint64_t appliedRecords;         // STATS: records applied
+static _Atomic uint64_t lagLastNs;              // STATS: age of the newest change when it was applied
+static _Atomic uint64_t lagMaxNs;               // STATS: largest lagLastNs
+static _Atomic uint64_t lagSumNs;               // STATS: sum of lagLastNs over lagCount messages
+static _Atomic uint64_t lagCount;               // STATS: messages that brought the standby up to date
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static void* accept_loop(void * arg);
+static void* ship_loop(void * arg);
+static void* follow_loop(void * arg);
+static void apply_record(void * ctx, const struct trans * pairs, int num_pairs);
+static int send_all(int fd, const void * data, size_t len);
+static int read_all(int fd, void * data, size_t len);
+/*===============================================================*/
+
+/**
+ * Primary: starts accepting standbys on a Unix domain socket. The commit log must be open.
+ *
+ * @param path     - socket path, replacing a stale socket file
+ * @param log_path - commit log to ship
+ * @return int - 1 if succeeded, 0 if the socket could not be opened
+ */
+int replication_serve(const char * path, const char * log_path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return 0;
+    }
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, REPL_BACKLOG) < 0) {
+        close(listenFd);
+        listenFd = -1;
+        return 0;
+    }
+    listenPath = strdup(path);
+    logPath = log_path;
+    return pthread_create(&acceptTid, NULL, accept_loop, NULL) == 0;
+}
+
+/**
+ * Standby: connects to the primary, waiting for it to start if needed, and starts applying what it ships. The
+ * accounts must be initialized and empty.
+ *
+ * @param path         - socket the primary accepts standbys on
+ * @param num_accounts - number of accounts, the same as the primary's
+ * @return int - 1 if connected, 0 if the primary could not be reached
+ */
+int replication_follow(const char * path, int num_accounts) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int i;
+    for (i = 0; i < CONNECT_TRIES; i++) {
+        primaryFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(primaryFd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        close(primaryFd);
+        primaryFd = -1;
+        usleep(CONNECT_WAIT_US);
+    }
+    if (primaryFd < 0) {
+        return 0;
+    }
+    numAccs = num_accounts;
+    atomic_store(&following, 1);
+    return pthread_create(&followTid, NULL, follow_loop, NULL) == 0;
+}
+
+/**
+ * Writes the REPLICATION line (primary) or STANDBY line (standby) of the STATS answer.
+ *
+ * @param buf  - receives the line, ending in a newline
+ * @param size - size of buf
+ * @return int - length of the line
+ */
+int replication_report(char * buf, size_t size) {
+    if (listenFd >= 0) {
+        int64_t durable = commit_log_durable();
+        int64_t behind = 0;
+        int connected = 0;
+        pthread_mutex_lock(&standbyMut);
+        struct standby_conn * c;
+        for (c = standbys; c != NULL; c = c->next) {
+            if (!atomic_load(&c->done)) {
+                connected++;
+                if (durable - atomic_load(&c->sent) > behind) {
+                    behind = durable - atomic_load(&c->sent);
+                }
+            }
+        }
+        pthread_mutex_unlock(&standbyMut);
+        return snprintf(buf, size, "REPLICATION standbys %d durable %lld behind_max %lld bytes\n", connected,
+                        (long long)durable, (long long)behind);
+    }
+    uint64_t count = atomic_load(&lagCount);
+    int64_t done = atomic_load(&applied);
+    return snprintf(buf, size, "STANDBY connected %d applied %lld records %llu behind %lld bytes lag %.2f ms "
+                    "lag_avg %.2f ms lag_max %.2f ms\n", atomic_load(&following), (long long)done,
+                    (unsigned long long)atomic_load(&appliedRecords), (long long)(atomic_load(&primaryEnd) - done),
+                    atomic_load(&lagLastNs) / 1e6, count ? atomic_load(&lagSumNs) / 1e6 / count : 0.0,
+                    atomic_load(&lagMaxNs) / 1e6);
+}
+
+/**
+ * Primary: ships what is left of the durable log to every standby and disconnects them. Called after
+ * commit_log_close, so the log is final. Standby: disconnects from the primary. Safe to call when replication was
+ * never started.
+ */
+void replication_stop() {
+    if (listenFd >= 0) {
+        atomic_store(&stopping, 1);
+        // Wakes the accept thread
+        shutdown(listenFd, SHUT_RDWR);
+        pthread_join(acceptTid, NULL);
+        close(listenFd);
+        listenFd = -1;
+        unlink(listenPath);
+        free(listenPath);
+        while (standbys != NULL) {
+            struct standby_conn * c = standbys;
+            standbys = c->next;
+            pthread_join(c->tid, NULL);
+            close(c->fd);
+            free(c);
+        }
+    }
+    if (primaryFd >= 0) {
+        // Wakes the follow thread
+        shutdown(primaryFd, SHUT_RDWR);
+        pthread_join(followTid, NULL);
+        close(primaryFd);
+        primaryFd = -1;
+    }
+}
+
+/**
+ * Primary: accepts standbys until replication_stop, starting a shipping thread for each.
+ */
+static void* accept_loop(void * arg) {
+    for (;;) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (!atomic_load(&stopping) && (errno == EINTR || errno == ECONNABORTED)) {
+                continue;
+            }
+            break;
+        }
+        struct standby_conn * c = calloc(1, sizeof(struct standby_conn));
+        if (c == NULL) {
+            // Turn this standby away, the ones already connected keep being shipped to
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        if (pthread_create(&c->tid, NULL, ship_loop, c) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_mutex_lock(&standbyMut);
+        c->next = standbys;
+        standbys = c;
+        pthread_mutex_unlock(&standbyMut);
+    }
+    return NULL;
+}
+
+/**
+ * Primary: ships the durable log to one standby from the start, then everything made durable after, with heartbeats
+ * while nothing is. Once stopping, exits as soon as the standby has the whole log.
+ *
+ * @param arg - the struct standby_conn to serve
+ */
+static void* ship_loop(void * arg) {
+    struct standby_conn * c = arg;
+    int fd = open(logPath, O_RDONLY | O_CLOEXEC);
+    char * buf = malloc(sizeof(struct repl_header) + REPL_CHUNK);
+    int64_t sent = 0;
+    while (fd >= 0 && buf != NULL) {
+        struct repl_header h;
+        uint64_t durableNs;
+        int64_t end = commit_log_wait(sent, REPL_HEARTBEAT_MS, &durableNs);
+        h.durable_end = end;
+        h.durable_ns = durableNs;
+        h.pad = 0;
+        if (end == sent) {
+            if (atomic_load(&stopping)) {
+                break;
+            }
+            h.len = 0;
+            if (!send_all(c->fd, &h, sizeof(h))) {
+                break;
+            }
+            continue;
+        }
+        // Read straight out of the log file, usually still in the page cache
+        while (sent < end) {
+            size_t want = end - sent < REPL_CHUNK ? (size_t)(end - sent) : REPL_CHUNK;
+            ssize_t got = pread(fd, buf + sizeof(h), want, sent);
+            if (got <= 0) {
+                break;
+            }
+            h.len = got;
+            memcpy(buf, &h, sizeof(h));
+            if (!send_all(c->fd, buf, sizeof(h) + got)) {
+                break;
+            }
+            sent += got;
+            atomic_store(&c->sent, sent);
+        }
+        if (sent < end) {
+            break;
+        }
+    }
+    atomic_store(&c->done, 1);
+    // The standby sees the end of the stream
+    shutdown(c->fd, SHUT_WR);
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Standby: applies every message from the primary until it goes away. A record cut between two messages is kept
+ * until the rest arrives.
+ */
+static void* follow_loop(void * arg) {
+    char * buf = malloc(REPL_CHUNK + WAL_RECORD_MAX);
+    size_t have = 0;
+    struct repl_header h;
+    while (buf != NULL && read_all(primaryFd, &h, sizeof(h))) {
+        if (h.len > REPL_CHUNK || !read_all(primaryFd, buf + have, h.len)) {
+            break;
+        }
+        have += h.len;
+        int torn;
+        long used = commit_log_apply(buf, have, numAccs, apply_record, NULL, &torn);
+        if (used < 0 || torn) {
+            printf("ERROR: The primary's log does not fit this standby, stopped following it.\n");
+            break;
+        }
+        memmove(buf, buf + used, have - used);
+        have -= used;
+        int64_t done = atomic_fetch_add(&applied, used) + used;
+        atomic_store(&primaryEnd, h.durable_end);
+
+        if (done == h.durable_end) {
+            // Up to date with the primary as of this message: a heartbeat means nothing was waiting, otherwise
+            // the newest change applied became durable at durable_ns
+            uint64_t lag = h.len == 0 ? 0 : stats_now() - h.durable_ns;
+            atomic_store(&lagLastNs, lag);
+            if (h.len > 0) {
+                atomic_fetch_add(&lagSumNs, lag);
+                atomic_fetch_add(&lagCount, 1);
+                if (lag > atomic_load(&lagMaxNs)) {
+                    atomic_store(&lagMaxNs, lag);
+                }
+            }
+        }
+    }
+    atomic_store(&following, 0);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Standby: applies one record of the primary's log to the balances.
+ *
+ * @param ctx       - unused
+ * @param pairs     - the record's pairs
+ * @param num_pairs - number of pairs
+ */
+static void apply_record(void * ctx, const struct trans * pairs, int num_pairs) {
+    int i;
+    for (i = 0; i < num_pairs; i++) {
+        account_restore(pairs[i].acc_id, pairs[i].amount);
+    }
+    atomic_fetch_add_explicit(&appliedRecords, 1, memory_order_relaxed);
+}
+
+/**
+ * @param fd   - socket
+ * @param data - bytes to send
+ * @param len  - number of bytes
+ * @return int - 1 if everything was sent, 0 if the peer went away
+ */
+static int send_all(int fd, const void * data, size_t len) {
+    const char * p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * @param fd   - socket
+ * @param data - receives the bytes
+ * @param len  - number of bytes to read
+ * @return int - 1 if all of them were read, 0 if the stream ended first
+ */
+static int read_all(int fd, void * data, size_t len) {
+    char * p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
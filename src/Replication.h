@@ -0,0 +1,32 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Replication.h declares log shipping between servers on one host. A
+ *      primary (--replicate) streams its commit log to every standby that
+ *      connects, as the log becomes durable. A standby (--standby) applies
+ *      the stream to its balances in log order, answers CHECK requests only
+ *      and reports how far it lags behind the primary.
+*/
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define REPL_HEARTBEAT_MS 100       // most milliseconds the primary stays silent towards a standby
+#define REPL_CHUNK (256 * 1024)     // most log bytes in one message to a standby
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int replication_serve(const char * path, const char * log_path);
+int replication_follow(const char * path, int num_accounts);
+int replication_report(char * buf, size_t size);
+void replication_stop();
+/*===============================================================*/
+
+#endif
@@ -0,0 +1,387 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Request_Parser.c implements a single-pass parser for the text protocol.
+ *      Every byte is looked at once: verbs are matched and numbers converted
+ *      as they stream past, straight into the request being built, with no
+ *      line buffer, tokenizing or string copies in between. A valid TRANS is
+ *      canonicalized before it is reported: its pairs are sorted by account
+ *      ID, pairs naming the same account are merged into one with the net
+ *      amount, and the debited accounts are listed in lock order. Workers
+ *      then neither sort nor lock an account twice, which used to deadlock a
+ *      TRANS that named an account twice.
+*/
+#include <string.h>
+#include <limits.h>
+#include "Request_Parser.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+// Parser states
+#define P_LINE_START 0      // nothing but blanks seen on this line
+#define P_VERB 1            // reading the verb
+#define P_ARGS 2            // between arguments
+#define P_NUM 3             // reading the digits of an argument
+#define P_NUM_TAIL 4        // skipping non-digits at the end of an argument (atoi semantics)
+#define P_DISCARD 5         // ignoring the rest of the line
+
+#define VERB_MAX 7          // longest verb the protocol knows ("PREPARE")
+
+// Verbs packed the same way parser_feed packs the letters it reads
+#define PACK3(a, b, c) (((unsigned long long)(a) << 16) | ((unsigned long long)(b) << 8) | (unsigned long long)(c))
+#define PACK5(a, b, c, d, e) ((PACK3(a, b, c) << 16) | ((unsigned long long)(d) << 8) | (unsigned long long)(e))
+#define PACK6(a, b, c, d, e, f) ((PACK5(a, b, c, d, e) << 8) | (unsigned long long)(f))
+#define PACK7(a, b, c, d, e, f, g) ((PACK6(a, b, c, d, e, f) << 8) | (unsigned long long)(g))
+#define VERB_END PACK3('E', 'N', 'D')
+#define VERB_CHECK PACK5('C', 'H', 'E', 'C', 'K')
+#define VERB_TRANS PACK5('T', 'R', 'A', 'N', 'S')
+#define VERB_STATS PACK5('S', 'T', 'A', 'T', 'S')
+#define VERB_ABORT PACK5('A', 'B', 'O', 'R', 'T')
+#define VERB_COMMIT PACK6('C', 'O', 'M', 'M', 'I', 'T')
+#define VERB_PREPARE PACK7('P', 'R', 'E', 'P', 'A', 'R', 'E')
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static void reset_line(struct request_parser * p);
+static void end_verb(struct request_parser * p);
+static void end_arg(struct request_parser * p);
+static void end_line(struct request_parser * p, parser_callback cb, void * ctx);
+static void canonicalize_trans(struct parsed_request * r);
+/*===============================================================*/
+
+/**
+ * Prepares a parser for a new stream.
+ *
+ * @param p          - parser to initialize
+ * @param max_acc_id - largest account ID a request may name
+ */
+void parser_init(struct request_parser * p, int max_acc_id) {
+    p->max_acc_id = max_acc_id;
+    reset_line(p);
+}
+
+/**
+ * Parses a buffer of input, calling cb once for each line completed inside it. Any partial line at the end of the
+ * buffer is remembered and continued by the next call.
+ *
+ * @param p   - parser state
+ * @param buf - raw input bytes
+ * @param len - number of bytes in buf
+ * @param cb  - function receiving each parsed request
+ * @param ctx - passed through to cb
+ * @return size_t - number of lines completed
+ */
+size_t parser_feed(struct request_parser * p, const char * buf, size_t len, parser_callback cb, void * ctx) {
+    const char * end = buf + len;
+    size_t lines = 0;
+    // Local copies of the hot fields so the loop runs out of registers
+    int state = p->state;
+    long num = p->num;
+    int digits = p->digits;
+
+    while (buf < end) {
+        char ch = *buf++;
+        if (ch == '\n') {
+            // Line is complete, finish whatever token it ended in
+            p->state = state;
+            p->num = num;
+            p->digits = digits;
+            end_line(p, cb, ctx);
+            state = P_LINE_START;
+            num = 0;
+            digits = 0;
+            lines++;
+            continue;
+        }
+        int blank = (ch == ' ' || ch == '\t' || ch == '\r');
+        switch (state) {
+            case P_LINE_START:
+                if (blank) {
+                    break;
+                }
+                state = P_VERB;
+                // fall through
+            case P_VERB:
+                if (blank) {
+                    p->state = P_VERB;
+                    end_verb(p);
+                    state = p->state;
+                } else if (p->verb_len <= VERB_MAX) {
+                    // Anything longer than the longest verb can never match
+                    p->verb = (p->verb << 8) | (unsigned char)ch;
+                    p->verb_len++;
+                }
+                break;
+            case P_ARGS:
+                if (blank) {
+                    break;
+                }
+                num = 0;
+                digits = 0;
+                p->negative = 0;
+                if (ch == '-' || ch == '+') {
+                    p->negative = (ch == '-');
+                    state = P_NUM;
+                } else if (ch >= '0' && ch <= '9') {
+                    num = ch - '0';
+                    digits = 1;
+                    state = P_NUM;
+                } else {
+                    // Like atoi, an argument that does not start with a number reads as 0
+                    state = P_NUM_TAIL;
+                }
+                break;
+            case P_NUM:
+                if (ch >= '0' && ch <= '9') {
+                    // Saturate instead of overflowing; anything past INT range is invalid anyway
+                    if (num <= (long)INT_MAX + 1) {
+                        num = num * 10 + (ch - '0');
+                    }
+                    digits++;
+                    break;
+                }
+                if (!blank) {
+                    state = P_NUM_TAIL;
+                    break;
+                }
+                // fall through
+            case P_NUM_TAIL:
+                if (blank) {
+                    p->num = num;
+                    p->digits = digits;
+                    p->state = P_ARGS;
+                    end_arg(p);
+                    state = p->state;
+                }
+                break;
+            default:
+                // P_DISCARD
+                break;
+        }
+    }
+    p->state = state;
+    p->num = num;
+    p->digits = digits;
+    return lines;
+}
+
+/**
+ * Completes a last line that was not terminated by a newline, as happens when the input ends.
+ *
+ * @param p   - parser state
+ * @param cb  - function receiving the parsed request
+ * @param ctx - passed through to cb
+ * @return int - 1 if a request was reported, 0 if nothing was pending
+ */
+int parser_finish(struct request_parser * p, parser_callback cb, void * ctx) {
+    if (p->state == P_LINE_START) {
+        return 0;
+    }
+    end_line(p, cb, ctx);
+    return 1;
+}
+
+/**
+ * Clears the per-line state.
+ *
+ * @param p - parser state
+ */
+static void reset_line(struct request_parser * p) {
+    p->state = P_LINE_START;
+    p->verb = 0;
+    p->verb_len = 0;
+    p->num = 0;
+    p->negative = 0;
+    p->digits = 0;
+    p->num_args = 0;
+    p->has_txid = 0;
+    p->cur.type = REQ_INVALID;
+    p->cur.check_acc_id = 0;
+    p->cur.num_trans = 0;
+    p->cur.error = NULL;
+}
+
+/**
+ * Decides the request type once the verb is complete.
+ *
+ * @param p - parser state
+ */
+static void end_verb(struct request_parser * p) {
+    if (p->verb_len == 5 && p->verb == VERB_CHECK) {
+        p->cur.type = REQ_CHECK;
+        p->state = P_ARGS;
+    } else if (p->verb_len == 5 && p->verb == VERB_TRANS) {
+        p->cur.type = REQ_TRANS;
+        p->state = P_ARGS;
+    } else if (p->verb_len == 5 && p->verb == VERB_STATS) {
+        // Takes no arguments, anything after it is ignored
+        p->cur.type = REQ_STATS;
+        p->state = P_DISCARD;
+    } else if (p->verb_len == 7 && p->verb == VERB_PREPARE) {
+        p->cur.type = REQ_PREPARE;
+        p->state = P_ARGS;
+    } else if (p->verb_len == 6 && p->verb == VERB_COMMIT) {
+        p->cur.type = REQ_COMMIT;
+        p->state = P_ARGS;
+    } else if (p->verb_len == 5 && p->verb == VERB_ABORT) {
+        p->cur.type = REQ_ABORT;
+        p->state = P_ARGS;
+    } else if (p->verb_len == 3 && p->verb == VERB_END) {
+        // Anything after END is ignored
+        p->cur.type = REQ_END;
+        p->state = P_DISCARD;
+    } else {
+        p->cur.type = REQ_INVALID;
+        p->cur.error = "INVALID REQUEST: no action taken.";
+        p->state = P_DISCARD;
+    }
+}
+
+/**
+ * Stores a completed numeric argument into the request being built.
+ *
+ * @param p - parser state
+ */
+static void end_arg(struct request_parser * p) {
+    int value = 0;
+    if (p->digits) {
+        long num = p->negative ? -p->num : p->num;
+        // Out of range values become values no account or amount check accepts
+        value = num > INT_MAX ? INT_MAX : (num < INT_MIN ? INT_MIN : (int)num);
+    }
+
+    if (p->cur.type == REQ_CHECK) {
+        // Only the first argument matters for CHECK
+        p->cur.check_acc_id = value;
+        p->num_args = 1;
+        p->state = P_DISCARD;
+        return;
+    }
+
+    if (p->cur.type != REQ_TRANS && !p->has_txid) {
+        // PREPARE, COMMIT and ABORT name the router's transaction first, only a PREPARE has pairs after it
+        p->cur.txid = value;
+        p->has_txid = 1;
+        if (p->cur.type != REQ_PREPARE) {
+            p->state = P_DISCARD;
+        }
+        return;
+    }
+
+    // TRANS and PREPARE: arguments alternate account ID, amount
+    int pair = p->num_args / 2;
+    if (p->num_args % 2 == 0) {
+        p->cur.transactions[pair].acc_id = value;
+    } else {
+        if (p->cur.transactions[pair].acc_id > p->max_acc_id || p->cur.transactions[pair].acc_id < 1) {
+            p->cur.type = REQ_INVALID;
+            p->cur.error = "INVALID REQUEST: an account within the Transaction Request was not provided a transaction amount or an invalid account number was provided.";
+            p->state = P_DISCARD;
+            return;
+        }
+        p->cur.transactions[pair].amount = value;
+        p->cur.num_trans = pair + 1;
+    }
+    p->num_args++;
+    if (p->num_args == MAX_TRANS_PAIRS * 2) {
+        // Pairs past the tenth are ignored
+        p->state = P_DISCARD;
+    }
+}
+
+/**
+ * Validates the finished line, reports it through the callback and resets for the next line.
+ *
+ * @param p   - parser state
+ * @param cb  - function receiving the parsed request
+ * @param ctx - passed through to cb
+ */
+static void end_line(struct request_parser * p, parser_callback cb, void * ctx) {
+    // Finish the token the line ended in
+    if (p->state == P_VERB) {
+        end_verb(p);
+    } else if (p->state == P_NUM || p->state == P_NUM_TAIL) {
+        end_arg(p);
+    }
+
+    struct parsed_request * r = &p->cur;
+    if (p->state == P_LINE_START) {
+        r->type = REQ_INVALID;
+        r->error = "INVALID REQUEST: no action taken.";
+    } else if (r->type == REQ_CHECK) {
+        if (p->num_args == 0) {
+            r->type = REQ_INVALID;
+            r->error = "INVALID REQUEST: Balance Check was not provided an account ID.";
+        } else if (r->check_acc_id > p->max_acc_id || r->check_acc_id < 1) {
+            r->type = REQ_INVALID;
+            r->error = "INVALID REQUEST: The account provided with CHECK request does not exist.";
+        }
+    } else if (r->type >= REQ_PREPARE && !p->has_txid) {
+        r->type = REQ_INVALID;
+        r->error = "INVALID REQUEST: no transaction ID was provided.";
+    } else if (r->type == REQ_TRANS || r->type == REQ_PREPARE) {
+        r->check_acc_id = -1;
+        if (p->num_args % 2 == 1) {
+            r->type = REQ_INVALID;
+            r->error = "INVALID REQUEST: an account within the Transaction Request was not provided a transaction amount or an invalid account number was provided.";
+        } else if (r->num_trans < 1) {
+            r->type = REQ_INVALID;
+            r->error = "INVALID REQUEST: no transaction pairs were provided with transaction request.";
+        } else {
+            canonicalize_trans(r);
+        }
+    }
+    cb(ctx, r);
+    reset_line(p);
+}
+
+/**
+ * Puts a valid TRANS in the form workers execute: sorted by account ID, one pair per account and its debited accounts
+ * listed. The net amount keeps the all-or-nothing outcome of the pairs it replaces, as the TRANS either applies all
+ * of them or none; a net amount beyond the range of an int saturates like an out-of-range amount does.
+ *
+ * @param r - parsed TRANS with at least one pair
+ */
+static void canonicalize_trans(struct parsed_request * r) {
+    sortIDLeastToGreatest(r->transactions, r->num_trans);
+    int i, n = 0;
+    for (i = 0; i < r->num_trans; i++) {
+        if (n > 0 && r->transactions[n - 1].acc_id == r->transactions[i].acc_id) {
+            // Same account as the pair before it, fold the amount in
+            long long sum = (long long)r->transactions[n - 1].amount + r->transactions[i].amount;
+            r->transactions[n - 1].amount = sum > INT_MAX ? INT_MAX : (sum < INT_MIN ? INT_MIN : (int)sum);
+        } else {
+            r->transactions[n++] = r->transactions[i];
+        }
+    }
+    r->num_trans = n;
+    r->num_debits = 0;
+    for (i = 0; i < n; i++) {
+        if (r->transactions[i].amount < 0) {
+            r->debit_ids[r->num_debits++] = r->transactions[i].acc_id;
+        }
+    }
+}
+
+/**
+ * Takes a pointer to an array of trans type objects and sorts the elements from least to greatest based on account id.
+ * Insertion sort: a TRANS has at most MAX_TRANS_PAIRS pairs, and pairs already in order cost one comparison each.
+ * 
+ * @param transactions - array to be sorted
+ * @param num_trans - number of elements in the array
+ */
+void sortIDLeastToGreatest(struct trans * transactions, int num_trans) {
+    int i, j;
+    for (i = 1; i < num_trans; i++) {
+        struct trans cur = transactions[i];
+        // Shift the larger IDs before it up one place
+        for (j = i; j > 0 && transactions[j - 1].acc_id > cur.acc_id; j--) {
+            transactions[j] = transactions[j - 1];
+        }
+        transactions[j] = cur;
+    }
+}
@@ -0,0 +1,82 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Request_Parser.h declares the incremental parser for the CHECK/TRANS/END
+ *      text protocol. The parser is fed raw read() buffers of any size and
+ *      keeps its place between calls, so lines may be split across buffers.
+ *      A TRANS comes out canonical, ready for a worker to execute: one pair
+ *      per account with the net amount, sorted by account ID, along with the
+ *      accounts to lock.
+ *      PREPARE, COMMIT and ABORT are only sent by the router of a sharded
+ *      deployment. Each names the router's transaction ID first; a PREPARE
+ *      then carries one shard's pairs of a TRANS spanning shards, in the same
+ *      canonical form as a TRANS.
+*/
+#ifndef REQUEST_PARSER_H
+#define REQUEST_PARSER_H
+
+#include <stddef.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define MAX_TRANS_PAIRS 10      // most transaction pairs a single TRANS may carry
+
+// Request types reported by the parser
+#define REQ_INVALID 0
+#define REQ_CHECK 1
+#define REQ_TRANS 2
+#define REQ_END 3
+#define REQ_STATS 4
+#define REQ_PREPARE 5   // router: hold the debits of one shard's part of a TRANS spanning shards
+#define REQ_COMMIT 6    // router: apply a prepared part
+#define REQ_ABORT 7     // router: release a prepared part
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct trans {      // Structure for a transaction pair
+    int acc_id;     // Account ID
+    int amount;     // amount to be added, could be positive or negative
+};
+
+struct parsed_request {                     // One parsed line of the protocol
+    int type;                               // one of the REQ_ types above
+    int check_acc_id;                       // account ID for a CHECK request
+    int txid;                               // PREPARE, COMMIT and ABORT: the router's transaction ID
+    int num_trans;                          // number of pairs filled in transactions
+    struct trans transactions[MAX_TRANS_PAIRS];  // pairs of a TRANS or PREPARE, distinct accounts sorted by ID
+    int num_debits;                         // TRANS: pairs with a negative amount, 0 for a deposit-only TRANS
+    int debit_ids[MAX_TRANS_PAIRS];         // TRANS: accounts of those pairs in ID order, the ones to lock
+    const char * error;                     // message for the user when type is REQ_INVALID
+};
+
+struct request_parser {             // Parser state carried between buffers
+    int state;                      // where in the line the parser is
+    int max_acc_id;                 // largest valid account ID
+    unsigned long long verb;        // letters of the verb packed one byte each
+    int verb_len;                   // number of verb letters seen
+    long num;                       // number being read
+    int negative;                   // sign of the number being read
+    int digits;                     // digits seen in the number being read
+    int num_args;                   // numbers completed on this line, not counting a transaction ID
+    int has_txid;                   // PREPARE, COMMIT and ABORT: the transaction ID was read
+    struct parsed_request cur;      // request being filled in
+};
+
+// Called once per complete line; the parsed request is only valid during the call
+typedef void (*parser_callback)(void * ctx, const struct parsed_request * req);
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+void parser_init(struct request_parser * p, int max_acc_id);
+size_t parser_feed(struct request_parser * p, const char * buf, size_t len, parser_callback cb, void * ctx);
+int parser_finish(struct request_parser * p, parser_callback cb, void * ctx);
+void sortIDLeastToGreatest(struct trans * transactions, int num_trans);
+/*===============================================================*/
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Request_Pool.c implements the request pool. All requests live in one
+ *      slab allocated at startup. Each thread keeps a small free list of its
+ *      own, so taking or returning a request is normally a couple of pointer
+ *      moves; only every POOL_BATCH requests does a thread visit the shared
+ *      depot to refill or spill its list.
+*/
+#include <stdlib.h>
+#include <pthread.h>
+#include "Server.h"
+#include "Request_Pool.h"
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct pool_cache {             // Free list private to one thread
+    struct request * head;      // first free request
+    int count;                  // number of free requests in the list
+};
+
+struct pool_depot {             // Free requests shared by every thread
+    pthread_mutex_t mut;        // guards the depot
+    pthread_cond_t available;   // signaled when requests are returned to an empty depot
+    struct request * head;      // first free request
+    size_t count;               // number of free requests in the depot
+    int waiting;                // threads sleeping until requests are returned
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct request * slab = NULL;        // every request the server will ever use
+static size_t slabSize = 0;                 // number of requests in the slab
+static struct pool_depot depot;             // shared free requests
+static __thread struct pool_cache cache;    // this thread's free requests
+/*===============================================================*/
+
+/**
+ * Allocates the slab and puts every request in the shared depot.
+ *
+ * @param size - number of requests in the pool, must cover the queue plus every thread's free list
+ * @return int - 1 if succeeded, 0 if the slab could not be allocated
+ */
+int pool_init(size_t size) {
+    slab = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct request) * size);
+    if (slab == NULL) {
+        return 0;
+    }
+    slabSize = size;
+    pthread_mutex_init(&depot.mut, NULL);
+    pthread_cond_init(&depot.available, NULL);
+    depot.head = NULL;
+    depot.count = size;
+    depot.waiting = 0;
+    size_t i;
+    for (i = size; i > 0; i--) {
+        slab[i - 1].pool_next = depot.head;
+        depot.head = &slab[i - 1];
+    }
+    return 1;
+}
+
+/**
+ * Frees the slab. No request may be in use anymore.
+ */
+void pool_destroy() {
+    free(slab);
+    slab = NULL;
+    pthread_mutex_destroy(&depot.mut);
+    pthread_cond_destroy(&depot.available);
+}
+
+/**
+ * Takes a request from the pool. Uses the calling thread's free list and refills it from the depot when empty,
+ * sleeping if every request is in use.
+ *
+ * @return struct request* - request now owned by the caller
+ */
+struct request * pool_alloc() {
+    if (cache.count == 0) {
+        // Refill a batch from the depot
+        pthread_mutex_lock(&depot.mut);
+        while (depot.count == 0) {
+            depot.waiting++;
+            pthread_cond_wait(&depot.available, &depot.mut);
+            depot.waiting--;
+        }
+        while (depot.count > 0 && cache.count < POOL_BATCH) {
+            struct request * r = depot.head;
+            depot.head = r->pool_next;
+            depot.count--;
+            r->pool_next = cache.head;
+            cache.head = r;
+            cache.count++;
+        }
+        pthread_mutex_unlock(&depot.mut);
+    }
+    struct request * r = cache.head;
+    cache.head = r->pool_next;
+    cache.count--;
+    return r;
+}
+
+/**
+ * Returns a finished request to the pool. It goes on the calling thread's free list, and a batch is moved to the
+ * depot when the list grows past POOL_CACHE_MAX.
+ *
+ * @param r - request owned by the caller, must not be used afterwards
+ */
+void pool_free(struct request * r) {
+    r->pool_next = cache.head;
+    cache.head = r;
+    cache.count++;
+    if (cache.count < POOL_CACHE_MAX) {
+        return;
+    }
+
+    // Unlink a batch from the front of the list
+    struct request * first = cache.head;
+    struct request * last = first;
+    int i;
+    for (i = 1; i < POOL_BATCH; i++) {
+        last = last->pool_next;
+    }
+    cache.head = last->pool_next;
+    cache.count -= POOL_BATCH;
+
+    // And splice it into the depot
+    pthread_mutex_lock(&depot.mut);
+    last->pool_next = depot.head;
+    depot.head = first;
+    depot.count += POOL_BATCH;
+    if (depot.waiting > 0) {
+        pthread_cond_broadcast(&depot.available);
+    }
+    pthread_mutex_unlock(&depot.mut);
+}
+
+/**
+ * @return size_t - total number of requests in the pool
+ */
+size_t pool_capacity() {
+    return slabSize;
+}
@@ -0,0 +1,34 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Request_Pool.h declares the fixed-size pool every request is taken from.
+ *      An input source takes a request with pool_alloc, fills it and queues it;
+ *      from then on the request belongs to the worker that dequeues it, which
+ *      hands it back with pool_free once the result is written.
+*/
+#ifndef REQUEST_POOL_H
+#define REQUEST_POOL_H
+
+#include <stddef.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define POOL_BATCH 32                   // requests moved between a thread's free list and the shared depot at once
+#define POOL_CACHE_MAX (2 * POOL_BATCH) // most free requests a single thread may hold on to
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+struct request;
+
+int pool_init(size_t size);
+void pool_destroy();
+struct request * pool_alloc();
+void pool_free(struct request * r);
+size_t pool_capacity();
+/*===============================================================*/
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Request_Queue.c implements the bounded multi-producer/multi-consumer
+ *      job queue. Every slot carries a ticket number so producers and consumers
+ *      claim slots with a single compare-and-swap instead of a shared mutex.
+ *      Threads that find the queue empty (or full) sleep on a futex and are
+ *      woken one at a time, only when someone is actually waiting.
+ *      Closing sets a bit in the producers' ticket counter itself, so no
+ *      producer can claim a ticket after the close, and consumers only give
+ *      up once every ticket claimed before it has been taken.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "Futex.h"
+#include "Request_Queue.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define RQ_CLOSED ((size_t)1 << (sizeof(size_t) * 8 - 1))  // enq_pos bit set once no more jobs will be added
+/*===============================================================*/
+
+/**
+ * Initializes the queue with room for at least capacity jobs. The capacity is rounded up
+ * to the next power of two so the ring index is a simple mask.
+ *
+ * @param q        - queue to initialize
+ * @param capacity - minimum number of jobs the queue must hold
+ * @return int - 1 if succeeded, 0 if the ring could not be allocated
+ */
+int rq_init(struct request_queue * q, size_t capacity) {
+    // Round capacity up to a power of two
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    // Every cell sits on its own cache line so neighbouring slots do not false share
+    q->cells = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct rq_cell) * size);
+    if (q->cells == NULL) {
+        return 0;
+    }
+    size_t i;
+    for (i = 0; i < size; i++) {
+        // Slot i is ready for the producer holding ticket i
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].req = NULL;
+    }
+    q->mask = size - 1;
+    atomic_init(&q->enq_pos, 0);
+    atomic_init(&q->deq_pos, 0);
+    atomic_init(&q->not_empty, 0);
+    atomic_init(&q->consumers_waiting, 0);
+    atomic_init(&q->not_full, 0);
+    atomic_init(&q->producers_waiting, 0);
+    return 1;
+}
+
+/**
+ * Frees the ring. No thread may be using the queue anymore.
+ *
+ * @param q - queue to destroy
+ */
+void rq_destroy(struct request_queue * q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+/**
+ * Wakes a single sleeper on the given event word if anyone is waiting on it.
+ *
+ * @param event   - futex word the sleepers wait on
+ * @param waiting - number of sleepers registered on the word
+ */
+static void wake_one(_Atomic uint32_t * event, _Atomic uint32_t * waiting) {
+    // Pairs with the fence a sleeper issues after registering itself
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) > 0) {
+        atomic_fetch_add(event, 1);
+        futex_wake(event, 1);
+    }
+}
+
+/**
+ * Attempts to add a job to the end of the queue without blocking.
+ *
+ * @param q - queue to add to
+ * @param r - job to be added
+ * @return int - 1 if the job was added, 0 if the queue was full or closed
+ */
+int rq_try_push(struct request_queue * q, struct request * r) {
+    struct rq_cell * cell;
+    size_t pos = atomic_load_explicit(&q->enq_pos, memory_order_relaxed);
+    for (;;) {
+        if (pos & RQ_CLOSED) {
+            // The close changed enq_pos, so no ticket can be claimed after it
+            return 0;
+        }
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // Slot is free, try to claim ticket pos
+            if (atomic_compare_exchange_weak_explicit(&q->enq_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Slot still holds a job from the previous lap, queue is full
+            return 0;
+        } else {
+            // Another producer took this ticket, reload
+            pos = atomic_load_explicit(&q->enq_pos, memory_order_relaxed);
+        }
+    }
+    cell->req = r;
+    // Publish the job to the consumer holding ticket pos
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    wake_one(&q->not_empty, &q->consumers_waiting);
+    return 1;
+}
+
+/**
+ * Attempts to remove the job at the front of the queue without blocking.
+ *
+ * @param q - queue to take from
+ * @return struct request* - the job from the front of the queue. Returns NULL if queue is empty.
+ */
+struct request * rq_try_pop(struct request_queue * q) {
+    struct rq_cell * cell;
+    size_t pos = atomic_load_explicit(&q->deq_pos, memory_order_relaxed);
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            // Slot holds a job, try to claim ticket pos
+            if (atomic_compare_exchange_weak_explicit(&q->deq_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Producer has not filled this slot yet, queue is empty
+            return NULL;
+        } else {
+            // Another consumer took this ticket, reload
+            pos = atomic_load_explicit(&q->deq_pos, memory_order_relaxed);
+        }
+    }
+    struct request * r = cell->req;
+    // Hand the slot back to the producer one lap ahead
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    wake_one(&q->not_full, &q->producers_waiting);
+    return r;
+}
+
+/**
+ * Adds a job to the end of the queue, sleeping while the queue is full.
+ *
+ * @param q - queue to add to
+ * @param r - job to be added
+ * @return int - 1 if the job was added, 0 if the queue was closed
+ */
+int rq_push(struct request_queue * q, struct request * r) {
+    if (r == NULL) {
+        printf("WARNING: Request to add was NULL, so it was not added to the job queue.\n");
+        return 0;
+    }
+    for (;;) {
+        if (atomic_load(&q->enq_pos) & RQ_CLOSED) {
+            return 0;
+        }
+        if (rq_try_push(q, r)) {
+            return 1;
+        }
+        // Register as a sleeper, then look once more before going to sleep
+        uint32_t event = atomic_load(&q->not_full);
+        atomic_fetch_add(&q->producers_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (rq_try_push(q, r)) {
+            atomic_fetch_sub(&q->producers_waiting, 1);
+            return 1;
+        }
+        if (!(atomic_load(&q->enq_pos) & RQ_CLOSED)) {
+            futex_wait(&q->not_full, event);
+        }
+        atomic_fetch_sub(&q->producers_waiting, 1);
+    }
+}
+
+/**
+ * Removes the job at the front of the queue, sleeping while the queue is empty.
+ *
+ * @param q - queue to take from
+ * @return struct request* - the job from the front of the queue. Returns NULL once the queue is closed and drained.
+ */
+struct request * rq_pop(struct request_queue * q) {
+    return rq_pop_until(q, NULL);
+}
+
+/**
+ * Removes the job at the front of the queue, sleeping while the queue is empty but no later than a deadline.
+ *
+ * @param q        - queue to take from
+ * @param deadline - CLOCK_MONOTONIC time to give up at, NULL to wait as long as it takes
+ * @return struct request* - the job from the front of the queue. Returns NULL once the queue is closed and drained,
+ *                           or if the deadline passed first.
+ */
+struct request * rq_pop_until(struct request_queue * q, const struct timespec * deadline) {
+    struct request * r;
+    for (;;) {
+        if ((r = rq_try_pop(q)) != NULL) {
+            return r;
+        }
+        // Register as a sleeper, then look once more before going to sleep
+        uint32_t event = atomic_load(&q->not_empty);
+        atomic_fetch_add(&q->consumers_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((r = rq_try_pop(q)) != NULL) {
+            atomic_fetch_sub(&q->consumers_waiting, 1);
+            return r;
+        }
+        size_t enq = atomic_load(&q->enq_pos);
+        if (enq & RQ_CLOSED) {
+            atomic_fetch_sub(&q->consumers_waiting, 1);
+            // No ticket is claimed after the close, but a producer may still be filling one it claimed before
+            if (atomic_load(&q->deq_pos) == (enq & ~RQ_CLOSED)) {
+                return NULL;
+            }
+            continue;
+        }
+        if (deadline == NULL) {
+            futex_wait(&q->not_empty, event);
+        } else {
+            struct timespec now, left;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline->tv_sec - now.tv_sec;
+            left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0) {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000;
+            }
+            if (left.tv_sec < 0) {
+                atomic_fetch_sub(&q->consumers_waiting, 1);
+                return NULL;
+            }
+            futex_wait_timeout(&q->not_empty, event, &left);
+        }
+        atomic_fetch_sub(&q->consumers_waiting, 1);
+    }
+}
+
+/**
+ * Marks the queue as closed and wakes every sleeper. Consumers keep draining the jobs
+ * already in the queue and then receive NULL.
+ *
+ * @param q - queue to close
+ */
+void rq_close(struct request_queue * q) {
+    atomic_fetch_or(&q->enq_pos, RQ_CLOSED);
+    atomic_fetch_add(&q->not_empty, 1);
+    atomic_fetch_add(&q->not_full, 1);
+    futex_wake(&q->not_empty, INT_MAX);
+    futex_wake(&q->not_full, INT_MAX);
+}
+
+/**
+ * Returns the number of jobs currently waiting in the queue. Only a snapshot while
+ * other threads are active.
+ *
+ * @param q - queue to measure
+ * @return size_t - number of queued jobs
+ */
+size_t rq_size(struct request_queue * q) {
+    size_t enq = atomic_load_explicit(&q->enq_pos, memory_order_relaxed) & ~RQ_CLOSED;
+    size_t deq = atomic_load_explicit(&q->deq_pos, memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+}
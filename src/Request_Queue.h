@@ -0,0 +1,59 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Request_Queue.h declares the bounded job queue shared by the input
+ *      thread and the worker threads. The queue is a preallocated ring buffer
+ *      that any number of threads may add to or take from at the same time.
+*/
+#ifndef REQUEST_QUEUE_H
+#define REQUEST_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define CACHE_LINE_SIZE 64
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct request;
+
+struct rq_cell {                                // One slot of the ring, padded to its own cache line
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t seq;   // ticket telling whether the slot is ready to fill or to empty
+    struct request * req;                       // job stored in the slot
+};
+
+struct request_queue {                                      // Structure for the job queue
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t enq_pos;       // next ticket handed to a producer, with RQ_CLOSED
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t deq_pos;       // next ticket handed to a consumer
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t not_empty;   // bumped to wake sleeping consumers
+    _Atomic uint32_t consumers_waiting;                     // number of consumers asleep (or about to be)
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t not_full;    // bumped to wake sleeping producers
+    _Atomic uint32_t producers_waiting;                     // number of producers asleep (or about to be)
+    _Alignas(CACHE_LINE_SIZE) size_t mask;                                            // capacity - 1, capacity is a power of two
+    struct rq_cell * cells;                                 // the ring itself
+};
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int rq_init(struct request_queue * q, size_t capacity);
+void rq_destroy(struct request_queue * q);
+int rq_try_push(struct request_queue * q, struct request * r);
+struct request * rq_try_pop(struct request_queue * q);
+int rq_push(struct request_queue * q, struct request * r);
+struct request * rq_pop(struct request_queue * q);
+struct request * rq_pop_until(struct request_queue * q, const struct timespec * deadline);
+void rq_close(struct request_queue * q);
+size_t rq_size(struct request_queue * q);
+/*===============================================================*/
+
+#endif
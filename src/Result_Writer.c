@@ -0,0 +1,492 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Result_Writer.c implements the asynchronous result writer. Each worker
+ *      appends to its own buffer under its own mutex, which only the writer
+ *      ever contends for, and only long enough to swap the buffer for an
+ *      empty one. The writer wakes every interval, or earlier when a worker
+ *      has buffered batch bytes, and writes all buffers with writev. Result
+ *      lines are whole within a buffer, so the file holds the same lines as
+ *      before, possibly in a different order across workers.
+ *
+ *      In ordered mode every line is buffered with its request ID, and the
+ *      writer sorts them through a reorder window: a ring of slots indexed by
+ *      request ID. Lines are written only once every lower ID has been
+ *      written. A slow request only holds lines back in the window, which
+ *      grows instead of making workers wait. IDs that will never produce a
+ *      result are released with writer_skip.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include "Server.h"
+#include "Stats.h"
+#include "Result_Writer.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define WRITEV_MAX 1024     // most buffers one writev takes (IOV_MAX on Linux)
+#define ORDER_SKIP -1       // record length of an ID released without a result
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct writer_buf {                             // Results of one worker
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t mut; // guards data, len and cap
+    char * data;                                // buffered result lines
+    size_t len;                                 // bytes in data
+    size_t cap;                                 // size of data
+    char * spare;                               // writer's side, swapped with data on every flush
+    size_t spare_cap;                           // size of spare
+};
+
+struct order_record {           // Header of a buffered line in ordered mode, followed by the line
+    int id;                     // request ID
+    int len;                    // length of the line, ORDER_SKIP if there is none
+    uint64_t done_ns;           // when the worker handed the line over
+};
+
+struct order_slot {             // One request ID of the reorder window
+    char text[WRITER_LINE_MAX]; // the line
+    int len;                    // length of the line, ORDER_SKIP if there is none
+    int present;                // 1 once the ID has been handed over
+    uint64_t done_ns;           // when the worker handed the line over
+};
+
+struct order_window {           // Reorder window, only touched by the writer thread
+    struct order_slot * slots;  // ring of slots, ID i lives at i % cap
+    int cap;                    // number of slots, a power of two
+    int next_id;                // lowest ID not yet written
+    int high_id;                // highest ID handed over so far
+    char * out;                 // lines ready to be written, in ID order
+    size_t out_len;             // bytes in out
+    size_t out_cap;             // size of out
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct writer_buf * bufs = NULL;     // one buffer per worker
+static int numBufs = 0;                     // number of buffers
+static int outFd = -1;                      // output file
+static int intervalMs;                      // most milliseconds between flushes
+static size_t batchBytes;                   // bytes of one buffer that wake the writer early
+static pthread_t writerTid;                 // writer thread
+static pthread_mutex_t wakeMut = PTHREAD_MUTEX_INITIALIZER;  // guards stopping
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;   // signaled when a batch is ready or on shutdown
+static atomic_int wakePending = 0;          // a worker already asked for an early flush
+static int stopping = 0;                    // set by writer_stop
+static int ordered = 0;                     // write lines in request ID order
+static struct order_window window;          // ordered mode: lines waiting for lower IDs
+static _Atomic int windowNow = 0;           // metric: IDs between the lowest unwritten and the highest handed over
+static _Atomic int windowPeak = 0;          // metric: largest windowNow so far
+static _Atomic uint64_t delayMaxNs = 0;     // metric: longest a line waited in the writer before being written
+static __thread struct writer_buf * mine = NULL;    // the calling thread's buffer, NULL outside workers
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static void* writer_loop(void * arg);
+static void flush_all(int last);
+static void write_all(struct iovec * iov, int count);
+static void append(struct writer_buf * b, const void * data, size_t len, const void * more, size_t more_len);
+static void reorder(const char * data, size_t len);
+static void window_grow(int need);
+static void window_emit(int drain);
+static void* grow(void * data, size_t cap);
+static void out_of_memory();
+/*===============================================================*/
+
+/**
+ * Allocates the worker buffers and starts the writer thread.
+ *
+ * @param fd          - output file, written only by the writer from now on
+ * @param num_workers - number of worker threads
+ * @param interval_ms - most milliseconds a result waits before being written
+ * @param batch_bytes - buffered bytes of one worker that wake the writer early
+ * @param in_order    - 1 to write lines in request ID order
+ * @param order_window - starting number of slots of the reorder window
+ * @return int - 1 if succeeded, 0 if memory or the thread could not be allocated
+ */
+int writer_init(int fd, int num_workers, int interval_ms, size_t batch_bytes, int in_order, int order_window) {
+    // One extra buffer shared by threads that are not workers
+    bufs = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct writer_buf) * (num_workers + 1));
+    if (bufs == NULL) {
+        return 0;
+    }
+    int w;
+    for (w = 0; w <= num_workers; w++) {
+        pthread_mutex_init(&bufs[w].mut, NULL);
+        bufs[w].data = malloc(WRITER_BUF_INITIAL);
+        bufs[w].spare = malloc(WRITER_BUF_INITIAL);
+        if (bufs[w].data == NULL || bufs[w].spare == NULL) {
+            return 0;
+        }
+        bufs[w].len = 0;
+        bufs[w].cap = WRITER_BUF_INITIAL;
+        bufs[w].spare_cap = WRITER_BUF_INITIAL;
+    }
+    numBufs = num_workers + 1;
+    ordered = in_order;
+    if (ordered) {
+        int cap = 1;
+        while (cap < order_window) {
+            cap <<= 1;
+        }
+        window.slots = calloc(cap, sizeof(struct order_slot));
+        window.out = malloc(WRITER_BUF_INITIAL);
+        if (window.slots == NULL || window.out == NULL) {
+            return 0;
+        }
+        window.cap = cap;
+        window.next_id = 1;
+        window.high_id = 0;
+        window.out_len = 0;
+        window.out_cap = WRITER_BUF_INITIAL;
+    }
+    outFd = fd;
+    intervalMs = interval_ms;
+    batchBytes = batch_bytes;
+    return pthread_create(&writerTid, NULL, writer_loop, NULL) == 0;
+}
+
+/**
+ * Makes the calling thread append to the buffer of a worker.
+ *
+ * @param worker - index of the worker
+ */
+void writer_attach(int worker) {
+    mine = &bufs[worker];
+}
+
+/**
+ * Buffers one result line. Workers use their own buffer, any other thread the shared one.
+ *
+ * @param id   - request ID the line answers
+ * @param line - formatted result, including its newline
+ * @param len  - length of line, at most WRITER_LINE_MAX in ordered mode
+ */
+void writer_append(int id, const char * line, size_t len) {
+    struct writer_buf * b = mine != NULL ? mine : &bufs[numBufs - 1];
+    if (!ordered) {
+        append(b, line, len, NULL, 0);
+        return;
+    }
+    struct order_record rec = { id, (int)len, stats_now() };
+    append(b, &rec, sizeof(rec), line, len);
+}
+
+/**
+ * Releases a request ID that will never have a result, so ordered mode does not wait for it. No effect otherwise.
+ *
+ * @param id - request ID given out but never queued
+ */
+void writer_skip(int id) {
+    if (!ordered) {
+        return;
+    }
+    struct order_record rec = { id, ORDER_SKIP, stats_now() };
+    append(mine != NULL ? mine : &bufs[numBufs - 1], &rec, sizeof(rec), NULL, 0);
+}
+
+/**
+ * Appends one or two pieces to a buffer as one unit, and wakes the writer if the buffer is full.
+ *
+ * @param b        - buffer to append to
+ * @param data     - first piece
+ * @param len      - length of data
+ * @param more     - second piece, may be NULL
+ * @param more_len - length of more
+ */
+static void append(struct writer_buf * b, const void * data, size_t len, const void * more, size_t more_len) {
+    pthread_mutex_lock(&b->mut);
+    if (b->len + len + more_len > b->cap) {
+        // Writer is behind, keep everything rather than block the worker
+        b->cap = (b->len + len + more_len) * 2;
+        b->data = grow(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    if (more_len > 0) {
+        memcpy(b->data + b->len + len, more, more_len);
+    }
+    b->len += len + more_len;
+    int full = b->len >= batchBytes;
+    pthread_mutex_unlock(&b->mut);
+
+    // Plain load first so a writer that is already on its way costs nothing
+    if (full && !atomic_load_explicit(&wakePending, memory_order_relaxed) && !atomic_exchange(&wakePending, 1)) {
+        pthread_mutex_lock(&wakeMut);
+        pthread_cond_signal(&wakeCond);
+        pthread_mutex_unlock(&wakeMut);
+    }
+}
+
+/**
+ * Writes the ordered-mode metrics for STATS.
+ *
+ * @param buf  - receives one line ending in a newline
+ * @param size - size of buf
+ * @return int - length written, 0 when not in ordered mode
+ */
+int writer_report(char * buf, size_t size) {
+    if (!ordered) {
+        return 0;
+    }
+    return snprintf(buf, size, "WRITER ordered window %d peak %d max_delay %.1f us\n", atomic_load(&windowNow),
+                    atomic_load(&windowPeak), atomic_load(&delayMaxNs) / 1e3);
+}
+
+/**
+ * Writes every buffered result and stops the writer thread. No worker may be appending anymore.
+ */
+void writer_stop() {
+    pthread_mutex_lock(&wakeMut);
+    stopping = 1;
+    pthread_cond_signal(&wakeCond);
+    pthread_mutex_unlock(&wakeMut);
+    pthread_join(writerTid, NULL);
+
+    int w;
+    for (w = 0; w < numBufs; w++) {
+        pthread_mutex_destroy(&bufs[w].mut);
+        free(bufs[w].data);
+        free(bufs[w].spare);
+    }
+    free(bufs);
+    bufs = NULL;
+    numBufs = 0;
+    if (ordered) {
+        free(window.slots);
+        free(window.out);
+    }
+}
+
+/**
+ * Writer thread. Flushes every interval or when woken early, and once more after being stopped.
+ */
+static void* writer_loop(void * arg) {
+    for (;;) {
+        pthread_mutex_lock(&wakeMut);
+        if (!stopping && !atomic_load(&wakePending)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += intervalMs / 1000;
+            deadline.tv_nsec += (long)(intervalMs % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            while (!stopping && !atomic_load(&wakePending)) {
+                if (pthread_cond_timedwait(&wakeCond, &wakeMut, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+        int stop = stopping;
+        pthread_mutex_unlock(&wakeMut);
+
+        atomic_store(&wakePending, 0);
+        flush_all(stop);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Swaps every non-empty worker buffer for its empty spare and writes them all out, or in ordered mode passes them
+ * through the reorder window and writes the lines that are next in order.
+ *
+ * @param last - 1 on shutdown: every line still in the window is written, gaps included
+ */
+static void flush_all(int last) {
+    struct iovec iov[numBufs];
+    int count = 0;
+    int w;
+    for (w = 0; w < numBufs; w++) {
+        struct writer_buf * b = &bufs[w];
+        pthread_mutex_lock(&b->mut);
+        if (b->len > 0) {
+            char * full = b->data;
+            size_t fullCap = b->cap;
+            iov[count].iov_base = full;
+            iov[count].iov_len = b->len;
+            count++;
+            b->data = b->spare;
+            b->cap = b->spare_cap;
+            b->len = 0;
+            b->spare = full;
+            b->spare_cap = fullCap;
+        }
+        pthread_mutex_unlock(&b->mut);
+    }
+    // The spares now hold the data being written, workers keep appending to the other side meanwhile
+    if (!ordered) {
+        write_all(iov, count);
+        return;
+    }
+    int i;
+    for (i = 0; i < count; i++) {
+        reorder(iov[i].iov_base, iov[i].iov_len);
+    }
+    window_emit(last);
+    struct iovec out = { window.out, window.out_len };
+    write_all(&out, 1);
+    window.out_len = 0;
+}
+
+/**
+ * Places the records of one worker buffer into the reorder window.
+ *
+ * @param data - records as buffered by writer_append and writer_skip
+ * @param len  - bytes in data
+ */
+static void reorder(const char * data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        struct order_record rec;
+        memcpy(&rec, data + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (rec.id - window.next_id >= window.cap) {
+            window_grow(rec.id - window.next_id + 1);
+        }
+        struct order_slot * slot = &window.slots[rec.id & (window.cap - 1)];
+        slot->len = rec.len;
+        slot->present = 1;
+        slot->done_ns = rec.done_ns;
+        if (rec.len > 0) {
+            memcpy(slot->text, data + pos, rec.len);
+            pos += rec.len;
+        }
+        if (rec.id > window.high_id) {
+            window.high_id = rec.id;
+        }
+    }
+}
+
+/**
+ * Doubles the reorder window until it holds need IDs from next_id on.
+ *
+ * @param need - IDs the window must cover
+ */
+static void window_grow(int need) {
+    int cap = window.cap;
+    while (cap < need) {
+        cap <<= 1;
+    }
+    struct order_slot * slots = calloc(cap, sizeof(struct order_slot));
+    if (slots == NULL) {
+        out_of_memory();
+    }
+    int id;
+    for (id = window.next_id; id <= window.high_id; id++) {
+        struct order_slot * old = &window.slots[id & (window.cap - 1)];
+        if (old->present) {
+            slots[id & (cap - 1)] = *old;
+        }
+    }
+    free(window.slots);
+    window.slots = slots;
+    window.cap = cap;
+}
+
+/**
+ * Moves the lines that are next in ID order from the window to its output buffer and updates the metrics.
+ *
+ * @param drain - 1 to move every line, skipping over IDs that never arrived
+ */
+static void window_emit(int drain) {
+    uint64_t now = stats_now();
+    uint64_t delayMax = atomic_load(&delayMaxNs);
+    while (window.next_id <= window.high_id) {
+        struct order_slot * slot = &window.slots[window.next_id & (window.cap - 1)];
+        if (!slot->present) {
+            if (!drain) {
+                break;
+            }
+            window.next_id++;
+            continue;
+        }
+        if (slot->len > 0) {
+            if (window.out_len + slot->len > window.out_cap) {
+                window.out_cap = (window.out_len + slot->len) * 2;
+                window.out = grow(window.out, window.out_cap);
+            }
+            memcpy(window.out + window.out_len, slot->text, slot->len);
+            window.out_len += slot->len;
+        }
+        if (now - slot->done_ns > delayMax) {
+            delayMax = now - slot->done_ns;
+        }
+        slot->present = 0;
+        window.next_id++;
+    }
+    atomic_store(&delayMaxNs, delayMax);
+    int size = window.high_id - window.next_id + 1;
+    atomic_store(&windowNow, size > 0 ? size : 0);
+    if (size > atomic_load(&windowPeak)) {
+        atomic_store(&windowPeak, size);
+    }
+}
+
+/**
+ * Writes the buffers in as few writev calls as possible, retrying short writes.
+ *
+ * @param iov   - buffers to write, modified
+ * @param count - number of buffers
+ */
+static void write_all(struct iovec * iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(outFd, iov, count < WRITEV_MAX ? count : WRITEV_MAX);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        // Skip what was written
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/**
+ * Resizes a buffer of results. Results cannot be dropped, so the server stops if there is no memory for them.
+ *
+ * @param data - buffer to resize
+ * @param cap  - new size
+ * @return void* - the resized buffer
+ */
+static void* grow(void * data, size_t cap) {
+    void * bigger = realloc(data, cap);
+    if (bigger == NULL) {
+        out_of_memory();
+    }
+    return bigger;
+}
+
+/**
+ * Stops the server when the writer cannot hold the results it was handed.
+ */
+static void out_of_memory() {
+    printf("ERROR: Result writer out of memory: %s\n", strerror(errno));
+    exit(1);
+}
@@ -0,0 +1,36 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Result_Writer.h declares the asynchronous result writer. Workers
+ *      append finished result lines to buffers of their own, and one writer
+ *      thread moves every buffer to the output file with a single writev.
+ *      Optionally the writer puts the lines in request ID order first.
+*/
+#ifndef RESULT_WRITER_H
+#define RESULT_WRITER_H
+
+#include <stddef.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define WRITER_INTERVAL_DEFAULT 10          // most milliseconds a result waits before being written
+#define WRITER_BATCH_DEFAULT (64 * 1024)    // buffered bytes of one worker that wake the writer early
+#define WRITER_BUF_INITIAL 4096             // starting size of each worker buffer
+#define WRITER_LINE_MAX 96                  // longest result line (an ISF line with every field at its widest)
+#define ORDER_WINDOW_DEFAULT 4096           // starting slots of the ordered-mode reorder window
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int writer_init(int fd, int num_workers, int interval_ms, size_t batch_bytes, int in_order, int order_window);
+void writer_attach(int worker);
+void writer_append(int id, const char * line, size_t len);
+void writer_skip(int id);
+int writer_report(char * buf, size_t size);
+void writer_stop();
+/*===============================================================*/
+
+#endif
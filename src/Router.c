@@ -0,0 +1,954 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Router.c contains the router of a sharded deployment on one host. It
+ *      starts one appserver process per shard, gives each shard every S-th
+ *      account and serves clients itself with the same CHECK/TRANS/END
+ *      protocol and "ID n" replies as a single server. A request whose
+ *      accounts all live on one shard is forwarded to that shard over a Unix
+ *      domain socket. Each shard writes its results into a FIFO the router
+ *      reads, and the router puts them in its own output file under its own
+ *      request IDs.
+ *
+ *      A TRANS spanning shards is committed in two phases. Every shard it
+ *      touches is sent a PREPARE with its pairs, checks the debits under the
+ *      account locks like a TRANS and holds the funds without changing any
+ *      balance, so no CHECK sees them gone and no other TRANS can spend them.
+ *      If every shard answered OK, each is sent COMMIT and applies its pairs;
+ *      otherwise the shards holding funds are sent ABORT and release them.
+ *      The result is the all-or-nothing OK or ISF a single server writes, and
+ *      no request sees a debit that is taken back later. What still differs
+ *      from a single server:
+ *          - while funds are held, a TRANS that could only be paid from them
+ *            is answered ISF, even if the TRANS holding them is then aborted
+ *          - the COMMITs reach the shards one at a time, so a CHECK on one
+ *            shard can see the TRANS applied while a later CHECK on another
+ *            shard does not yet
+ *          - holds only live in the shards' memory. A shard aborts what the
+ *            router prepared once the router's connection closes, and the
+ *            router stops when a shard does. The router keeps no log, so if
+ *            it dies while sending the COMMITs of a TRANS, the shards already
+ *            sent one apply their part and the others abort theirs.
+
+ *      Build with: make router
+ *      Run:        ./router <# of shards> <# of worker threads per shard> <# of accounts> <output file> [options]
+ *                           [-- shard options]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Server.h"
+#include "Net_Server.h"
+#include "Result_Writer.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define MAX_SHARDS 64                   // most shard processes one router starts
+#define SHARD_OUT_MAX (1024 * 1024)     // bytes queued for one shard before clients wait for it
+#define ROUTES_INITIAL 4096             // starting slots for the requests a shard has not answered yet
+#define RESULT_READ_SIZE 65536          // bytes read from a shard at a time
+#define CONNECT_TRIES 1000              // attempts to reach a starting shard's socket
+#define CONNECT_WAIT_US 10000           // microseconds between attempts
+
+// Phases of a TRANS spanning shards
+#define TXN_PREPARE 0   // every shard is holding its part's debits, its OK or ISF is the vote
+#define TXN_COMMIT 1    // every vote was OK, the shards are applying their parts
+#define TXN_ABORT 2     // some debit was insufficient, the shards that hold funds are releasing them
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct txn {                                    // A TRANS spanning shards
+    int id;                                     // router request ID
+    struct timeval starttime;                   // when the router took the request
+    int num_trans;                              // number of pairs
+    struct trans transactions[MAX_TRANS_PAIRS]; // pairs with the client's account IDs
+    int num_parts;                              // shards the pairs live on
+    int shards[MAX_TRANS_PAIRS];                // shard of each part
+    int insuf[MAX_TRANS_PAIRS];                 // TXN_PREPARE: ISF account reported by each part's shard, or -1
+    int insufAccID;                             // first account with insufficient funds once the votes are in, or -1
+    int phase;                                  // TXN_PREPARE, TXN_COMMIT or TXN_ABORT
+    _Atomic int pending;                        // parts of the current phase not answered yet
+};
+
+struct route {                  // A request sent to a shard and not answered yet
+    int busy;                   // set while the slot holds a request
+    int id;                     // forwarded request: router request ID
+    struct timeval starttime;   // forwarded request: when the router took it
+    struct txn * txn;           // TRANS spanning shards this is a part of, NULL for a forwarded request
+    int part;                   // index of the part within txn
+};
+
+struct shard {                          // One appserver process and the router's connection to it
+    int index;                          // shard number, also its result writer slot
+    int num_accounts;                   // accounts the shard owns
+    pid_t pid;                          // shard process
+    int sock;                           // connection requests are sent over
+    int results;                        // read end of the FIFO the shard writes its results to
+    char sock_path[108];                // Unix domain socket of the shard
+    char fifo_path[108];                // output file of the shard
+    pthread_t sender_tid, reader_tid;   // threads sending requests and reading answers
+    pthread_mutex_t mut;                // protects everything below
+    pthread_cond_t has_out;             // the sender waits for requests to send
+    pthread_cond_t has_room;            // clients wait while out is full
+    char * out;                         // requests not yet sent
+    size_t out_len, out_cap;            // used and allocated size of out
+    int closing;                        // END was queued, the sender stops once it is sent
+    int failed;                         // the shard went away, nothing more is sent
+    struct route * routes;              // unanswered requests, slot (shard ID & (route_cap - 1))
+    int route_cap;                      // slots in routes, a power of two
+    int next_id;                        // request ID the shard will give the next request sent
+    int oldest;                         // oldest request ID the shard has not answered
+};
+
+struct line_buffer {                    // Partial line carried between reads
+    char buf[RESULT_READ_SIZE];
+    size_t len;
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+struct server_config config;            // Client listener options, read by the network front end
+int numAccounts;                        // Number of accounts across every shard
+FILE *fp;                               // Pointer to output file
+static struct shard shards[MAX_SHARDS]; // Every shard
+static int numShards;                   // Number of shards
+static int shardWorkers;                // Worker threads of each shard
+static char * shardBin = "./appserver"; // --shard-bin=PATH, server program started for each shard
+static char * shardDir = "/tmp";        // --shard-dir=DIR, directory of the shards' sockets and FIFOs
+static char ** shardArgs = NULL;        // options after "--", passed to every shard
+static int numShardArgs = 0;            // number of shardArgs
+static atomic_int requestCount = 1;     // Next router request ID
+static atomic_int closed = 0;           // END was received, later requests are refused
+static atomic_int inflight = 0;         // requests given an ID and not answered yet
+static atomic_int draining = 0;         // main waits for inflight to reach 0
+static atomic_int shardFailed = 0;      // a shard went away before END
+static pthread_mutex_t drainMut = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static atomic_long forwarded = 0;       // STATS: requests sent whole to one shard
+static atomic_long committed = 0;       // STATS: TRANS spanning shards that went through
+static atomic_long aborted = 0;         // STATS: TRANS spanning shards that were aborted
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int parse_options(int argc, char *argv[]);
+static int start_shard(struct shard * s);
+static void stop_shard(struct shard * s);
+static void* shard_sender(void * arg);
+static void* shard_reader(void * arg);
+static int read_lines(int fd, struct line_buffer * lb, struct shard * s, void (*handle)(struct shard * s, char * line));
+static void handle_ack(struct shard * s, char * line);
+static void handle_result(struct shard * s, char * line);
+static void send_request(struct shard * s, const char * line, int len, const struct route * r, int client);
+static void queue_bytes(struct shard * s, const char * line, int len);
+static int take_route(struct shard * s, int shard_id, struct route * r);
+static int start_txn(int id, const struct timeval * start, const struct parsed_request * p, const int * parts, int num_parts);
+static int send_phase(struct txn * t);
+static void part_done(struct txn * t, int part, int insufAccID);
+static void finish_txn(struct txn * t);
+static void request_done();
+static int shard_of(int acc_id);
+static int local_id(int acc_id);
+static int global_id(int shard, int local);
+/*===============================================================*/
+
+/**
+ * Main function of the router. Starts the shards, serves clients until one sends END, waits for every request to be
+ * answered, then stops the shards.
+ *
+ * Syntax to launch the router:
+ *      $ router <# of shards> <# of worker threads per shard> <# of accounts> <output file> [options] [-- shard options]
+ *
+ * Options:
+ *      --tcp=PORT          accept clients on 127.0.0.1:PORT
+ *      --unix=PATH         accept clients on a Unix domain socket at PATH
+ *      --net-threads=N     number of epoll loops serving clients (default 1)
+ *      --shard-bin=PATH    server program started for each shard (default ./appserver)
+ *      --shard-dir=DIR     directory for the shards' sockets and result FIFOs (default /tmp)
+ *      -- ...              everything after is passed to every shard, the first "%d" of each becomes the shard number
+ *                          (e.g. -- --exec=occ --wal=/data/shard%d.wal)
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 5 || !parse_options(argc, argv)) {
+        printf("ERROR: Command line input invalid, required format:\n\t$ router <# of shards> <# of worker threads per shard> <# of accounts> <output file> [--tcp=PORT] [--unix=PATH]\n\t\t[--net-threads=N] [--shard-bin=PATH] [--shard-dir=DIR] [-- shard options]\n");
+        return 0;
+    }
+    if (!config.tcp_port && config.unix_path == NULL) {
+        printf("ERROR: No input source, give --tcp/--unix.\n");
+        return 0;
+    }
+    numShards = atoi(argv[1]);
+    shardWorkers = atoi(argv[2]);
+    numAccounts = atoi(argv[3]);
+    if (numShards < 1 || numShards > MAX_SHARDS) {
+        printf("ERROR: Invalid shard amount, must be between 1 and %d.\n", MAX_SHARDS);
+        return 0;
+    }
+    if (shardWorkers < 1) {
+        printf("ERROR: Invalid worker thread amount, must be at least 1.\n");
+        return 0;
+    }
+    if (numAccounts < numShards) {
+        printf("ERROR: Invalid account amount, every shard needs at least one account.\n");
+        return 0;
+    }
+
+    // Setting Up Output File
+    fp = fopen(argv[4], "w");
+    if (fp == NULL || !writer_init(fileno(fp), numShards, WRITER_INTERVAL_DEFAULT, WRITER_BATCH_DEFAULT, 0, ORDER_WINDOW_DEFAULT)) {
+        printf("ERROR: Output file or result writer creation failed.\n");
+        return 0;
+    }
+
+    int k;
+    for (k = 0; k < numShards; k++) {
+        shards[k].index = k;
+        shards[k].num_accounts = (numAccounts - k + numShards - 1) / numShards;
+        if (!start_shard(&shards[k])) {
+            printf("ERROR: Shard %d could not be started.\n", k);
+            while (k >= 0) {
+                stop_shard(&shards[k--]);
+            }
+            return 0;
+        }
+    }
+
+    if (!net_start()) {
+        printf("ERROR: Could not open the client listeners.\n");
+        for (k = 0; k < numShards; k++) {
+            stop_shard(&shards[k]);
+        }
+        return 0;
+    }
+    // Returns once a client sent END
+    net_join();
+
+    // Every request given an ID is answered before the shards are stopped, a TRANS spanning shards may still
+    // have to send its second phase
+    atomic_store(&draining, 1);
+    pthread_mutex_lock(&drainMut);
+    while (atomic_load(&inflight) > 0 && !atomic_load(&shardFailed)) {
+        pthread_cond_wait(&drained, &drainMut);
+    }
+    pthread_mutex_unlock(&drainMut);
+    if (atomic_load(&shardFailed)) {
+        printf("ERROR: A shard stopped early, %d requests were not answered.\n", atomic_load(&inflight));
+    }
+
+    for (k = 0; k < numShards; k++) {
+        stop_shard(&shards[k]);
+    }
+    writer_stop();
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * Reads the optional "--name=value" arguments that follow the required command line arguments into config, and
+ * collects the shard options after "--".
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int - 1 if every option was recognized, 0 otherwise
+ */
+int parse_options(int argc, char *argv[]) {
+    config.tcp_port = 0;
+    config.unix_path = NULL;
+    config.net_threads = 1;
+
+    int i;
+    for (i = 5; i < argc; i++) {
+        if (!strcmp(argv[i], "--")) {
+            shardArgs = argv + i + 1;
+            numShardArgs = argc - i - 1;
+            break;
+        } else if (!strncmp(argv[i], "--tcp=", 6)) {
+            config.tcp_port = atoi(argv[i] + 6);
+        } else if (!strncmp(argv[i], "--unix=", 7)) {
+            config.unix_path = argv[i] + 7;
+        } else if (!strncmp(argv[i], "--net-threads=", 14)) {
+            config.net_threads = atoi(argv[i] + 14);
+            if (config.net_threads < 1) {
+                return 0;
+            }
+        } else if (!strncmp(argv[i], "--shard-bin=", 12)) {
+            shardBin = argv[i] + 12;
+        } else if (!strncmp(argv[i], "--shard-dir=", 12)) {
+            shardDir = argv[i] + 12;
+        } else {
+            printf("ERROR: Unknown option %s\n", argv[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Acts on one request a client sent: END stops the client listeners, CHECK and TRANS get a router request ID and
+ * are sent to the shards. The text to send back to the client is written to reply. PREPARE, COMMIT and ABORT are
+ * only for the router to send, a client's are refused.
+ *
+ * @param p      - the parsed request
+ * @param client - connection the request came from
+ * @param reply  - buffer receiving the answer, including its newline
+ * @param size   - size of reply
+ * @return int - length of the answer, 0 if there is nothing to answer
+ */
+int dispatch_request(const struct parsed_request * p, int client, char * reply, size_t size) {
+    char line[STR_MAX_SIZE];
+    int len, i, j;
+    switch (p->type) {
+        case REQ_END:
+            atomic_store(&closed, 1);
+            net_stop();
+            reply[0] = '\0';
+            return 0;
+        case REQ_INVALID:
+            return snprintf(reply, size, "%s\n", p->error);
+        case REQ_PREPARE:
+        case REQ_COMMIT:
+        case REQ_ABORT:
+            return snprintf(reply, size, "INVALID REQUEST: no action taken.\n");
+        case REQ_STATS:
+            return snprintf(reply, size, "ROUTER shards %d forwarded %ld committed %ld aborted %ld in_flight %d\n",
+                            numShards, atomic_load(&forwarded), atomic_load(&committed), atomic_load(&aborted),
+                            atomic_load(&inflight));
+        default:
+            break;
+    }
+    if (atomic_load(&closed)) {
+        return snprintf(reply, size, "INVALID REQUEST: the server is shutting down.\n");
+    }
+
+    struct route r = { 1, atomic_fetch_add(&requestCount, 1), { 0, 0 }, NULL, 0 };
+    gettimeofday(&r.starttime, NULL);
+    atomic_fetch_add(&inflight, 1);
+    if (p->type == REQ_CHECK) {
+        len = snprintf(line, sizeof(line), "CHECK %d\n", local_id(p->check_acc_id));
+        send_request(&shards[shard_of(p->check_acc_id)], line, len, &r, 1);
+        atomic_fetch_add(&forwarded, 1);
+        return snprintf(reply, size, "ID %d\n", r.id);
+    }
+
+    // Collect the distinct shards of the pairs
+    int parts[MAX_TRANS_PAIRS];
+    int num = 0;
+    for (i = 0; i < p->num_trans; i++) {
+        int shard = shard_of(p->transactions[i].acc_id);
+        for (j = 0; j < num && parts[j] != shard; j++);
+        if (j == num) {
+            parts[num++] = shard;
+        }
+    }
+    if (num == 1) {
+        // One shard runs the whole TRANS with its own locks
+        len = snprintf(line, sizeof(line), "TRANS");
+        for (i = 0; i < p->num_trans; i++) {
+            len += snprintf(line + len, sizeof(line) - len, " %d %d", local_id(p->transactions[i].acc_id), p->transactions[i].amount);
+        }
+        line[len++] = '\n';
+        send_request(&shards[parts[0]], line, len, &r, 1);
+        atomic_fetch_add(&forwarded, 1);
+    } else if (!start_txn(r.id, &r.starttime, p, parts, num)) {
+        // No shard heard of it, so the client is told instead of getting an ID with no result
+        request_done();
+        return snprintf(reply, size, "INVALID REQUEST: the router is out of memory, no action taken.\n");
+    }
+    return snprintf(reply, size, "ID %d\n", r.id);
+}
+
+/**
+ * Called by the network front end once a client is gone. The router holds nothing for its clients.
+ *
+ * @param client - connection that closed
+ */
+void client_closed(int client) {
+}
+
+/**
+ * Starts one shard: creates its result FIFO, runs the server program on it and connects to its socket.
+ *
+ * @param s - shard to start, index and num_accounts filled in
+ * @return int - 1 if the shard is up, 0 if it could not be started
+ */
+static int start_shard(struct shard * s) {
+    pthread_mutex_init(&s->mut, NULL);
+    pthread_cond_init(&s->has_out, NULL);
+    pthread_cond_init(&s->has_room, NULL);
+    s->route_cap = ROUTES_INITIAL;
+    s->routes = calloc(s->route_cap, sizeof(struct route));
+    s->next_id = s->oldest = 1;
+    s->sock = s->results = -1;
+    s->pid = -1;
+    snprintf(s->sock_path, sizeof(s->sock_path), "%s/shard%d.%d.sock", shardDir, s->index, (int)getpid());
+    snprintf(s->fifo_path, sizeof(s->fifo_path), "%s/shard%d.%d.out", shardDir, s->index, (int)getpid());
+
+    // Opened without waiting for the shard, it blocks once the shard has it open too
+    unlink(s->fifo_path);
+    if (mkfifo(s->fifo_path, 0600) < 0) {
+        perror("mkfifo");
+        return 0;
+    }
+    s->results = open(s->fifo_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (s->results < 0) {
+        perror("open");
+        return 0;
+    }
+
+    // <server> <workers> <accounts> <fifo> --unix=<socket> --stdin=0 [shard options]
+    char workers[16], accounts[16], unixArg[sizeof(s->sock_path) + 8];
+    char args[numShardArgs + 1][STR_MAX_SIZE];
+    char * argv[numShardArgs + 7];
+    snprintf(workers, sizeof(workers), "%d", shardWorkers);
+    snprintf(accounts, sizeof(accounts), "%d", s->num_accounts);
+    snprintf(unixArg, sizeof(unixArg), "--unix=%s", s->sock_path);
+    argv[0] = shardBin;
+    argv[1] = workers;
+    argv[2] = accounts;
+    argv[3] = s->fifo_path;
+    argv[4] = unixArg;
+    argv[5] = "--stdin=0";
+    int i;
+    for (i = 0; i < numShardArgs; i++) {
+        // First "%d" becomes the shard number so every shard can get its own files
+        char * mark = strstr(shardArgs[i], "%d");
+        if (mark == NULL) {
+            snprintf(args[i], STR_MAX_SIZE, "%s", shardArgs[i]);
+        } else {
+            snprintf(args[i], STR_MAX_SIZE, "%.*s%d%s", (int)(mark - shardArgs[i]), shardArgs[i], s->index, mark + 2);
+        }
+        argv[6 + i] = args[i];
+    }
+    argv[6 + numShardArgs] = NULL;
+
+    s->pid = fork();
+    if (s->pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (s->pid == 0) {
+        execv(shardBin, argv);
+        perror(shardBin);
+        _exit(127);
+    }
+
+    // The shard listens once it is fully started
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, s->sock_path);
+    for (i = 0; i < CONNECT_TRIES; i++) {
+        s->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(s->sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        close(s->sock);
+        s->sock = -1;
+        if (waitpid(s->pid, NULL, WNOHANG) == s->pid) {
+            s->pid = -1;
+            return 0;
+        }
+        usleep(CONNECT_WAIT_US);
+    }
+    if (s->sock < 0) {
+        return 0;
+    }
+
+    // The shard has its output open by now, so an end of file really means it went away
+    fcntl(s->results, F_SETFL, fcntl(s->results, F_GETFL) & ~O_NONBLOCK);
+    pthread_create(&s->reader_tid, NULL, shard_reader, s);
+    pthread_create(&s->sender_tid, NULL, shard_sender, s);
+    return 1;
+}
+
+/**
+ * Sends END to a shard, waits for it to answer everything and exit, then removes its files. Also cleans up after a
+ * shard that start_shard gave up on.
+ *
+ * @param s - shard to stop
+ */
+static void stop_shard(struct shard * s) {
+    if (s->sock >= 0) {
+        // Together, so the sender cannot stop before END is sent and the reader knows the shard will exit
+        pthread_mutex_lock(&s->mut);
+        queue_bytes(s, "END\n", 4);
+        s->closing = 1;
+        pthread_mutex_unlock(&s->mut);
+        pthread_join(s->sender_tid, NULL);
+        pthread_join(s->reader_tid, NULL);
+        close(s->sock);
+    } else if (s->pid > 0) {
+        kill(s->pid, SIGTERM);
+    }
+    if (s->pid > 0) {
+        waitpid(s->pid, NULL, 0);
+    }
+    if (s->results >= 0) {
+        close(s->results);
+    }
+    unlink(s->fifo_path);
+    // Normally removed by the shard itself, not if it was killed
+    unlink(s->sock_path);
+    free(s->routes);
+    free(s->out);
+}
+
+/**
+ * Sender thread of one shard. Sends whatever was queued for the shard, so neither clients nor the readers driving a
+ * TRANS spanning shards ever block on its socket. Exits once END was sent or the shard went away.
+ *
+ * @param arg - the struct shard to serve
+ */
+static void* shard_sender(void * arg) {
+    struct shard * s = arg;
+    char * buf = NULL;
+    size_t cap = 0;
+
+    pthread_mutex_lock(&s->mut);
+    for (;;) {
+        while (s->out_len == 0 && !s->closing) {
+            pthread_cond_wait(&s->has_out, &s->mut);
+        }
+        if (s->out_len == 0) {
+            break;
+        }
+        // Swap buffers so requests keep being queued while this batch is sent
+        char * batch = s->out;
+        size_t len = s->out_len;
+        s->out = buf;
+        s->out_len = 0;
+        buf = batch;
+        size_t batchCap = s->out_cap;
+        s->out_cap = cap;
+        cap = batchCap;
+        pthread_cond_broadcast(&s->has_room);
+        pthread_mutex_unlock(&s->mut);
+
+        size_t sent = 0;
+        while (sent < len) {
+            ssize_t n = send(s->sock, buf + sent, len - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                // The reader notices the shard is gone, what is left is dropped
+                break;
+            }
+            sent += n;
+        }
+        pthread_mutex_lock(&s->mut);
+    }
+    pthread_mutex_unlock(&s->mut);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Reader thread of one shard. Takes the "ID n" replies off the shard's socket, checking they match the IDs the
+ * router expected, and the results off its FIFO, completing the requests they answer. Exits once the shard closed
+ * its output.
+ *
+ * @param arg - the struct shard to serve
+ */
+static void* shard_reader(void * arg) {
+    struct shard * s = arg;
+    struct line_buffer * acks = calloc(1, sizeof(struct line_buffer));
+    struct line_buffer * results = calloc(1, sizeof(struct line_buffer));
+    // Results of forwarded requests and finished TRANS spanning shards are buffered in this shard's writer slot
+    writer_attach(s->index);
+
+    struct pollfd fds[2];
+    fds[0].fd = s->results;
+    fds[0].events = POLLIN;
+    fds[1].fd = s->sock;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents && read_lines(s->sock, acks, s, handle_ack) <= 0) {
+            // Socket closed, the FIFO still has to be drained
+            fds[1].fd = -1;
+        }
+        if (fds[0].revents && read_lines(s->results, results, s, handle_result) <= 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&s->mut);
+    int expected = s->closing;
+    s->failed = 1;
+    pthread_cond_broadcast(&s->has_room);
+    pthread_mutex_unlock(&s->mut);
+    if (!expected) {
+        printf("ERROR: Shard %d stopped unexpectedly.\n", s->index);
+        atomic_store(&shardFailed, 1);
+        pthread_mutex_lock(&drainMut);
+        pthread_cond_broadcast(&drained);
+        pthread_mutex_unlock(&drainMut);
+    }
+    free(acks);
+    free(results);
+    return NULL;
+}
+
+/**
+ * Reads once from fd and hands every line completed to handle, keeping a partial last line for the next call.
+ *
+ * @param fd     - socket or FIFO to read
+ * @param lb     - partial line carried between calls
+ * @param s      - shard the lines come from
+ * @param handle - called with each line, newline replaced by '\0'
+ * @return int - bytes read, 0 at end of file, -1 on error
+ */
+static int read_lines(int fd, struct line_buffer * lb, struct shard * s, void (*handle)(struct shard * s, char * line)) {
+    ssize_t got;
+    do {
+        got = read(fd, lb->buf + lb->len, sizeof(lb->buf) - lb->len);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+        return got;
+    }
+    lb->len += got;
+    char * line = lb->buf;
+    char * end = lb->buf + lb->len;
+    char * nl;
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+        *nl = '\0';
+        handle(s, line);
+        line = nl + 1;
+    }
+    lb->len = end - line;
+    memmove(lb->buf, line, lb->len);
+    return got;
+}
+
+/**
+ * Checks one reply to a request sent to the shard. The router relies on the shard numbering requests in the order
+ * they were sent.
+ *
+ * @param s    - shard that replied
+ * @param line - the reply without its newline
+ */
+static void handle_ack(struct shard * s, char * line) {
+    if (strncmp(line, "ID ", 3)) {
+        printf("ERROR: Shard %d answered \"%s\".\n", s->index, line);
+    }
+}
+
+/**
+ * Completes the request one result line of the shard answers: a forwarded request gets its result written under
+ * its router request ID and account IDs, a part of a TRANS spanning shards counts towards its phase.
+ *
+ * @param s    - shard that wrote the result
+ * @param line - "<shard ID> OK|ISF <account>|BAL <balance> TIME <start> <end>" without its newline
+ */
+static void handle_result(struct shard * s, char * line) {
+    char * p;
+    int shardID = strtol(line, &p, 10);
+    struct route r;
+    if (!take_route(s, shardID, &r)) {
+        printf("ERROR: Shard %d answered unknown request %d.\n", s->index, shardID);
+        return;
+    }
+    while (*p == ' ') {
+        p++;
+    }
+    int insufAccID = -1;
+    long long balance = 0;
+    if (*p == 'I') {
+        insufAccID = global_id(s->index, strtol(p + 3, NULL, 10));
+    } else if (*p == 'B') {
+        balance = strtoll(p + 3, NULL, 10);
+    }
+    if (r.txn != NULL) {
+        part_done(r.txn, r.part, insufAccID);
+        return;
+    }
+
+    struct timeval endtime;
+    gettimeofday(&endtime, NULL);
+    char out[STR_MAX_SIZE];
+    int len;
+    if (*p == 'B') {
+        len = snprintf(out, sizeof(out), "%d BAL %lld TIME %ld.%06ld %ld.%06ld\n", r.id, balance, r.starttime.tv_sec, r.starttime.tv_usec, endtime.tv_sec, endtime.tv_usec);
+    } else if (insufAccID == -1) {
+        len = snprintf(out, sizeof(out), "%d OK TIME %ld.%06ld %ld.%06ld\n", r.id, r.starttime.tv_sec, r.starttime.tv_usec, endtime.tv_sec, endtime.tv_usec);
+    } else {
+        len = snprintf(out, sizeof(out), "%d ISF %d TIME %ld.%06ld %ld.%06ld\n", r.id, insufAccID, r.starttime.tv_sec, r.starttime.tv_usec, endtime.tv_sec, endtime.tv_usec);
+    }
+    writer_append(r.id, out, len);
+    request_done();
+}
+
+/**
+ * Queues one request line for a shard and remembers what it answers under the ID the shard will give it.
+ *
+ * @param s      - shard to send to
+ * @param line   - request including its newline
+ * @param len    - length of line
+ * @param r      - what the request answers
+ * @param client - 1 if called for a client, which waits while the shard is behind; 0 from a shard's reader, which
+ *                 never waits so shards cannot end up waiting on each other
+ */
+static void send_request(struct shard * s, const char * line, int len, const struct route * r, int client) {
+    pthread_mutex_lock(&s->mut);
+    while (client && s->out_len >= SHARD_OUT_MAX && !s->failed) {
+        pthread_cond_wait(&s->has_room, &s->mut);
+    }
+    if (s->next_id - s->oldest == s->route_cap) {
+        // Every slot is waiting for an answer, double the table
+        struct route * grown = calloc(s->route_cap * 2, sizeof(struct route));
+        int id;
+        for (id = s->oldest; id < s->next_id; id++) {
+            grown[id & (s->route_cap * 2 - 1)] = s->routes[id & (s->route_cap - 1)];
+        }
+        free(s->routes);
+        s->routes = grown;
+        s->route_cap *= 2;
+    }
+    s->routes[s->next_id & (s->route_cap - 1)] = *r;
+    s->next_id++;
+    queue_bytes(s, line, len);
+    pthread_mutex_unlock(&s->mut);
+}
+
+/**
+ * Appends bytes to what the shard's sender sends next. Caller holds s->mut.
+ *
+ * @param s    - shard to send to
+ * @param line - bytes to send
+ * @param len  - number of bytes
+ */
+static void queue_bytes(struct shard * s, const char * line, int len) {
+    if (s->out_len + len > s->out_cap) {
+        s->out_cap = (s->out_len + len) * 2;
+        s->out = realloc(s->out, s->out_cap);
+    }
+    memcpy(s->out + s->out_len, line, len);
+    s->out_len += len;
+    pthread_cond_signal(&s->has_out);
+}
+
+/**
+ * Takes the record of the request a shard answered out of its slot.
+ *
+ * @param s        - shard that answered
+ * @param shard_id - request ID the shard gave the request
+ * @param r        - receives the record
+ * @return int - 1 if the request was waiting for an answer, 0 otherwise
+ */
+static int take_route(struct shard * s, int shard_id, struct route * r) {
+    pthread_mutex_lock(&s->mut);
+    struct route * slot = &s->routes[shard_id & (s->route_cap - 1)];
+    if (shard_id < s->oldest || shard_id >= s->next_id || !slot->busy) {
+        pthread_mutex_unlock(&s->mut);
+        return 0;
+    }
+    *r = *slot;
+    slot->busy = 0;
+    // Answers come in any order, the oldest unanswered request bounds the slots in use
+    while (s->oldest < s->next_id && !s->routes[s->oldest & (s->route_cap - 1)].busy) {
+        s->oldest++;
+    }
+    pthread_mutex_unlock(&s->mut);
+    return 1;
+}
+
+/**
+ * Starts a TRANS spanning shards by sending every shard it touches a PREPARE of its part.
+ *
+ * @param id        - router request ID, also the transaction ID the shards know it by
+ * @param start     - when the router took the request
+ * @param p         - the parsed TRANS
+ * @param parts     - distinct shards of the pairs
+ * @param num_parts - number of parts, at least 2
+ * @return int - 1 if the PREPAREs went out, 0 if the transaction could not be allocated
+ */
+static int start_txn(int id, const struct timeval * start, const struct parsed_request * p, const int * parts, int num_parts) {
+    struct txn * t = malloc(sizeof(struct txn));
+    if (t == NULL) {
+        return 0;
+    }
+    t->id = id;
+    t->starttime = *start;
+    t->num_trans = p->num_trans;
+    memcpy(t->transactions, p->transactions, sizeof(struct trans) * p->num_trans);
+    t->num_parts = num_parts;
+    memcpy(t->shards, parts, sizeof(int) * num_parts);
+    t->insufAccID = -1;
+    t->phase = TXN_PREPARE;
+    int i;
+    for (i = 0; i < num_parts; i++) {
+        t->insuf[i] = -1;
+    }
+    send_phase(t);
+    return 1;
+}
+
+/**
+ * Sends every part of the TRANS's current phase to its shard: the PREPARE with the part's pairs, then COMMIT to every
+ * shard, or ABORT to every shard that holds funds for it.
+ *
+ * @param t - TRANS spanning shards, phase set
+ * @return int - number of parts sent, 0 if the phase had nothing to do
+ */
+static int send_phase(struct txn * t) {
+    char lines[MAX_TRANS_PAIRS][STR_MAX_SIZE];
+    int lens[MAX_TRANS_PAIRS];
+    int part, i, count = 0;
+    for (part = 0; part < t->num_parts; part++) {
+        lens[part] = 0;
+        if (t->phase == TXN_ABORT && t->insuf[part] != -1) {
+            // This shard refused its part, it holds nothing
+            continue;
+        }
+        if (t->phase != TXN_PREPARE) {
+            lens[part] = snprintf(lines[part], STR_MAX_SIZE, "%s %d\n", t->phase == TXN_COMMIT ? "COMMIT" : "ABORT", t->id);
+            count++;
+            continue;
+        }
+        int len = snprintf(lines[part], STR_MAX_SIZE, "PREPARE %d", t->id);
+        for (i = 0; i < t->num_trans; i++) {
+            struct trans * tr = &t->transactions[i];
+            if (shard_of(tr->acc_id) == t->shards[part]) {
+                len += snprintf(lines[part] + len, STR_MAX_SIZE - len, " %d %d", local_id(tr->acc_id), tr->amount);
+            }
+        }
+        lines[part][len++] = '\n';
+        lens[part] = len;
+        count++;
+    }
+
+    // Answers may come back before the last part is sent, and the last answer may free t, so nothing of t is used
+    // once the last part is queued
+    atomic_store(&t->pending, count);
+    struct route r = { 1, t->id, t->starttime, t, 0 };
+    int client = t->phase == TXN_PREPARE;
+    int targets[MAX_TRANS_PAIRS];
+    int num_parts = t->num_parts;
+    memcpy(targets, t->shards, sizeof(int) * num_parts);
+    for (part = 0; part < num_parts; part++) {
+        if (lens[part] > 0) {
+            r.part = part;
+            send_request(&shards[targets[part]], lines[part], lens[part], &r, client);
+        }
+    }
+    return count;
+}
+
+/**
+ * Counts the answer of one part of a TRANS spanning shards. The last answer of a phase moves the TRANS on:
+ * once every vote is in it commits or aborts, and once that is answered its result is written.
+ *
+ * @param t          - TRANS spanning shards
+ * @param part       - index of the part that was answered
+ * @param insufAccID - account the shard reported insufficient, or -1
+ */
+static void part_done(struct txn * t, int part, int insufAccID) {
+    if (t->phase == TXN_PREPARE) {
+        t->insuf[part] = insufAccID;
+    }
+    if (atomic_fetch_sub(&t->pending, 1) != 1) {
+        return;
+    }
+    if (t->phase == TXN_PREPARE) {
+        // Like a single server, report the lowest account that was insufficient
+        int i;
+        for (i = 0; i < t->num_parts; i++) {
+            if (t->insuf[i] != -1 && (t->insufAccID == -1 || t->insuf[i] < t->insufAccID)) {
+                t->insufAccID = t->insuf[i];
+            }
+        }
+        t->phase = t->insufAccID == -1 ? TXN_COMMIT : TXN_ABORT;
+        if (send_phase(t) > 0) {
+            return;
+        }
+    }
+    finish_txn(t);
+}
+
+/**
+ * Writes the result of a finished TRANS spanning shards and frees it.
+ *
+ * @param t - TRANS whose last phase was answered
+ */
+static void finish_txn(struct txn * t) {
+    struct timeval endtime;
+    gettimeofday(&endtime, NULL);
+    char line[STR_MAX_SIZE];
+    int len;
+    if (t->insufAccID == -1) {
+        len = snprintf(line, sizeof(line), "%d OK TIME %ld.%06ld %ld.%06ld\n", t->id, t->starttime.tv_sec, t->starttime.tv_usec, endtime.tv_sec, endtime.tv_usec);
+        atomic_fetch_add(&committed, 1);
+    } else {
+        len = snprintf(line, sizeof(line), "%d ISF %d TIME %ld.%06ld %ld.%06ld\n", t->id, t->insufAccID, t->starttime.tv_sec, t->starttime.tv_usec, endtime.tv_sec, endtime.tv_usec);
+        atomic_fetch_add(&aborted, 1);
+    }
+    writer_append(t->id, line, len);
+    free(t);
+    request_done();
+}
+
+/**
+ * Counts one request as answered and wakes main if it was the last one it is waiting for.
+ */
+static void request_done() {
+    if (atomic_fetch_sub(&inflight, 1) == 1 && atomic_load(&draining)) {
+        pthread_mutex_lock(&drainMut);
+        pthread_cond_broadcast(&drained);
+        pthread_mutex_unlock(&drainMut);
+    }
+}
+
+/**
+ * @param acc_id - account ID as the client knows it
+ * @return int - shard owning the account
+ */
+static int shard_of(int acc_id) {
+    return (acc_id - 1) % numShards;
+}
+
+/**
+ * @param acc_id - account ID as the client knows it
+ * @return int - ID of the account on its shard
+ */
+static int local_id(int acc_id) {
+    return (acc_id - 1) / numShards + 1;
+}
+
+/**
+ * @param shard - shard owning the account
+ * @param local - ID of the account on that shard
+ * @return int - account ID as the client knows it
+ */
+static int global_id(int shard, int local) {
+    return (local - 1) * numShards + shard + 1;
+}
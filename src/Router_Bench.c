@@ -0,0 +1,393 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Router_Bench.c measures how a sharded deployment scales with the number
+ *      of shards. For 1 to N shards it starts the router, streams the same
+ *      generated requests to it over a Unix domain socket and waits for the
+ *      router to write the last result. It then reads the router's output file
+ *      for the outcome and latency of every request.
+ *
+ *      Build with: make bench_router
+ *      Run:        ./router_bench <max shards> <# of worker threads per shard> <# of accounts> <# of requests>
+ *                                 [pairs per TRANS] [-- shard options]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define ROUTER_BIN "./router"                   // router program, started from the build directory
+#define SERVER_BIN "./appserver"                // server program the router starts per shard
+#define BENCH_SOCK "/tmp/router_bench.sock"     // client socket of the router
+#define BENCH_OUT "/tmp/router_bench.out"       // output file of the router
+#define DEFAULT_PAIRS 2                         // pairs per TRANS unless given
+#define CHECK_PERCENT 20                        // share of the requests that are CHECKs
+#define MAX_PAIRS 10                            // most pairs a TRANS may carry
+#define CONNECT_TRIES 1000                      // attempts to reach the router's socket
+#define CONNECT_WAIT_US 10000                   // microseconds between attempts
+#define POLL_WAIT_US 1000                       // microseconds between looks at the output file
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct sender {         // Requests streamed to the router by a thread of their own
+    int fd;             // connection to the router
+    const char * data;  // every request line
+    size_t len;         // bytes of data
+};
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+char * generate(int numAccounts, int numRequests, int pairs, size_t * len, int ** accounts);
+double cross_shard_share(const int * accounts, int numRequests, int pairs, int shards);
+double run(int shards, int workers, int numAccounts, int numRequests, const char * data, size_t len, char ** shardArgs, int numShardArgs);
+void* send_all(void * arg);
+int connect_router();
+int count_results(FILE * in, int * counted);
+void read_results(int numRequests, double * meanMs, double * p99Ms, int * ok, int * isf);
+int compare_doubles(const void * a, const void * b);
+double now();
+/*===============================================================*/
+
+/**
+ * Runs the benchmark once for every shard count from 1 to the maximum and prints one row per run.
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        printf("Usage: %s <max shards> <# of worker threads per shard> <# of accounts> <# of requests> [pairs per TRANS] [-- shard options]\n", argv[0]);
+        return 1;
+    }
+    int maxShards = atoi(argv[1]);
+    int workers = atoi(argv[2]);
+    int numAccounts = atoi(argv[3]);
+    int numRequests = atoi(argv[4]);
+    int pairs = (argc > 5 && strcmp(argv[5], "--")) ? atoi(argv[5]) : DEFAULT_PAIRS;
+    char ** shardArgs = NULL;
+    int numShardArgs = 0;
+    int i;
+    for (i = 5; i < argc; i++) {
+        if (!strcmp(argv[i], "--")) {
+            shardArgs = argv + i + 1;
+            numShardArgs = argc - i - 1;
+            break;
+        }
+    }
+    if (maxShards < 1 || workers < 1 || numAccounts < maxShards || numRequests < 1 || pairs < 1 || pairs > MAX_PAIRS) {
+        printf("ERROR: invalid arguments\n");
+        return 1;
+    }
+
+    size_t len;
+    int * accounts;
+    char * data = generate(numAccounts, numRequests, pairs, &len, &accounts);
+    printf("%d requests (%d%% CHECK, TRANS with %d pairs), %d accounts, %d workers per shard\n", numRequests,
+           CHECK_PERCENT, pairs, numAccounts, workers);
+    printf("%6s %12s %12s %10s %8s %8s %10s %10s\n", "shards", "requests/s", "speedup", "cross", "OK", "ISF", "mean ms", "p99 ms");
+
+    double base = 0;
+    int shards;
+    for (shards = 1; shards <= maxShards; shards++) {
+        double elapsed = run(shards, workers, numAccounts, numRequests, data, len, shardArgs, numShardArgs);
+        if (elapsed < 0) {
+            printf("ERROR: run with %d shards failed\n", shards);
+            return 1;
+        }
+        double meanMs, p99Ms;
+        int ok, isf;
+        read_results(numRequests, &meanMs, &p99Ms, &ok, &isf);
+        double rate = numRequests / elapsed;
+        if (shards == 1) {
+            base = rate;
+        }
+        printf("%6d %12.0f %11.2fx %9.1f%% %8d %8d %10.2f %10.2f\n", shards, rate, rate / base,
+               100 * cross_shard_share(accounts, numRequests, pairs, shards), ok, isf, meanMs, p99Ms);
+        fflush(stdout);
+    }
+    free(data);
+    free(accounts);
+    return 0;
+}
+
+/**
+ * Builds the request stream: CHECKs and TRANS with distinct accounts picked uniformly, mostly deposits so the
+ * balances grow and debits mostly go through.
+ *
+ * @param numAccounts - accounts to pick from
+ * @param numRequests - number of requests
+ * @param pairs       - pairs per TRANS
+ * @param len         - receives the size of the stream
+ * @param accounts    - receives the accounts of every request, pairs per request, 0 past a CHECK's one account
+ * @return char* - request lines followed by END
+ */
+char * generate(int numAccounts, int numRequests, int pairs, size_t * len, int ** accounts) {
+    char * data = malloc((size_t)numRequests * (8 + pairs * 24) + 8);
+    *accounts = calloc((size_t)numRequests * pairs, sizeof(int));
+    size_t off = 0;
+    srand(7);
+    int i, j, k;
+    for (i = 0; i < numRequests; i++) {
+        int * accs = *accounts + (size_t)i * pairs;
+        if (rand() % 100 < CHECK_PERCENT) {
+            accs[0] = rand() % numAccounts + 1;
+            off += sprintf(data + off, "CHECK %d\n", accs[0]);
+            continue;
+        }
+        off += sprintf(data + off, "TRANS");
+        for (j = 0; j < pairs; j++) {
+            // Distinct accounts, as long as there are enough of them
+            do {
+                accs[j] = rand() % numAccounts + 1;
+                for (k = 0; k < j && accs[k] != accs[j]; k++);
+            } while (k < j && numAccounts >= pairs);
+            off += sprintf(data + off, " %d %d", accs[j], rand() % 3 ? rand() % 100 + 1 : -(rand() % 100 + 1));
+        }
+        off += sprintf(data + off, "\n");
+    }
+    *len = off;
+    return data;
+}
+
+/**
+ * @param accounts    - accounts of every request, as filled in by generate
+ * @param numRequests - number of requests
+ * @param pairs       - pairs per TRANS
+ * @param shards      - number of shards, an account lives on shard (ID - 1) % shards
+ * @return double - share of the requests whose accounts live on more than one shard
+ */
+double cross_shard_share(const int * accounts, int numRequests, int pairs, int shards) {
+    int i, j, cross = 0;
+    for (i = 0; i < numRequests; i++) {
+        const int * accs = accounts + (size_t)i * pairs;
+        for (j = 1; j < pairs && accs[j] != 0; j++) {
+            if ((accs[j] - 1) % shards != (accs[0] - 1) % shards) {
+                cross++;
+                break;
+            }
+        }
+    }
+    return (double)cross / numRequests;
+}
+
+/**
+ * Starts a router with the given shard count, streams every request to it and waits for every result to be written.
+ * The shards' shutdown, which flushes their caches, is not timed.
+ *
+ * @param shards       - number of shards
+ * @param workers      - worker threads per shard
+ * @param numAccounts  - number of accounts
+ * @param numRequests  - number of requests in data
+ * @param data         - request lines
+ * @param len          - bytes of data
+ * @param shardArgs    - options passed to every shard
+ * @param numShardArgs - number of shardArgs
+ * @return double - seconds from the first request sent to the last result written, -1 if the run failed
+ */
+double run(int shards, int workers, int numAccounts, int numRequests, const char * data, size_t len, char ** shardArgs, int numShardArgs) {
+    char shardCount[16], workerCount[16], accountCount[16];
+    snprintf(shardCount, sizeof(shardCount), "%d", shards);
+    snprintf(workerCount, sizeof(workerCount), "%d", workers);
+    snprintf(accountCount, sizeof(accountCount), "%d", numAccounts);
+    char * argv[numShardArgs + 10];
+    int a = 0, i;
+    argv[a++] = ROUTER_BIN;
+    argv[a++] = shardCount;
+    argv[a++] = workerCount;
+    argv[a++] = accountCount;
+    argv[a++] = BENCH_OUT;
+    argv[a++] = "--unix=" BENCH_SOCK;
+    argv[a++] = "--shard-bin=" SERVER_BIN;
+    argv[a++] = "--";
+    for (i = 0; i < numShardArgs; i++) {
+        argv[a++] = shardArgs[i];
+    }
+    argv[a] = NULL;
+
+    unlink(BENCH_SOCK);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execv(ROUTER_BIN, argv);
+        perror(ROUTER_BIN);
+        _exit(127);
+    }
+    int fd = connect_router();
+    if (fd < 0) {
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    double start = now();
+    struct sender s = { fd, data, len };
+    pthread_t tid;
+    pthread_create(&tid, NULL, send_all, &s);
+    // Take every "ID n" reply off the socket so the router never has to hold them
+    char buf[65536];
+    int replies = 0;
+    while (replies < numRequests) {
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        for (i = 0; i < got; i++) {
+            replies += buf[i] == '\n';
+        }
+    }
+    pthread_join(tid, NULL);
+    FILE * in = fopen(BENCH_OUT, "r");
+    int results = 0;
+    while (replies == numRequests && in != NULL && count_results(in, &results) < numRequests) {
+        usleep(POLL_WAIT_US);
+    }
+    double elapsed = now() - start;
+    if (in != NULL) {
+        fclose(in);
+    }
+
+    if (write(fd, "END\n", 4) != 4) {
+        perror("END");
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    close(fd);
+    return results == numRequests && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : -1;
+}
+
+/**
+ * Sender thread: writes every request line to the router.
+ *
+ * @param arg - the struct sender to send
+ */
+void* send_all(void * arg) {
+    struct sender * s = arg;
+    size_t sent = 0;
+    while (sent < s->len) {
+        ssize_t n = write(s->fd, s->data + sent, s->len - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("send");
+            break;
+        }
+        sent += n;
+    }
+    return NULL;
+}
+
+/**
+ * Connects to the router's socket, waiting for the router and its shards to start.
+ *
+ * @return int - connected socket, -1 if the router never listened
+ */
+int connect_router() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, BENCH_SOCK);
+    int i;
+    for (i = 0; i < CONNECT_TRIES; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(CONNECT_WAIT_US);
+    }
+    return -1;
+}
+
+/**
+ * Counts the result lines the router wrote since the last call.
+ *
+ * @param in      - the router's output file
+ * @param counted - running count of result lines
+ * @return int - result lines written so far
+ */
+int count_results(FILE * in, int * counted) {
+    char buf[65536];
+    size_t got, i;
+    clearerr(in);
+    while ((got = fread(buf, 1, sizeof(buf), in)) > 0) {
+        for (i = 0; i < got; i++) {
+            *counted += buf[i] == '\n';
+        }
+    }
+    return *counted;
+}
+
+/**
+ * Reads the router's output file: counts OK and ISF results and computes the latency between each result's TIME
+ * stamps.
+ *
+ * @param numRequests - number of results expected
+ * @param meanMs      - receives the mean latency in milliseconds
+ * @param p99Ms       - receives the 99th percentile latency in milliseconds
+ * @param ok          - receives the number of TRANS that went through
+ * @param isf         - receives the number of TRANS with insufficient funds
+ */
+void read_results(int numRequests, double * meanMs, double * p99Ms, int * ok, int * isf) {
+    FILE * in = fopen(BENCH_OUT, "r");
+    double * lat = malloc(sizeof(double) * numRequests);
+    char line[256];
+    int n = 0;
+    double sum = 0;
+    *ok = *isf = 0;
+    while (in != NULL && n < numRequests && fgets(line, sizeof(line), in) != NULL) {
+        char * time = strstr(line, "TIME ");
+        double t0, t1;
+        if (time == NULL || sscanf(time + 5, "%lf %lf", &t0, &t1) != 2) {
+            continue;
+        }
+        *ok += strstr(line, " OK ") != NULL;
+        *isf += strstr(line, " ISF ") != NULL;
+        lat[n] = (t1 - t0) * 1e3;
+        sum += lat[n++];
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    qsort(lat, n, sizeof(double), compare_doubles);
+    *meanMs = n ? sum / n : 0;
+    *p99Ms = n ? lat[(int)(n * 0.99)] : 0;
+    free(lat);
+}
+
+/**
+ * qsort comparator for doubles in ascending order.
+ */
+int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @return double - monotonic time in seconds
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
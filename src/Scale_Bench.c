@@ -0,0 +1,373 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Scale_Bench.c sweeps the server across worker thread counts, account
+ *      counts and contention levels. Every point is one closed loop run of
+ *      loadgen, whose throughput, p99 latency and server CPU use go into a
+ *      CSV row. A summary then shows, for every account count and contention
+ *      level, the speedup over the fewest workers and the worker count where
+ *      adding workers stopped paying off. Given the CSV of an earlier sweep,
+ *      every point that lost more than the tolerance of its throughput is
+ *      reported and the sweep fails, so regressions in the worker and
+ *      transaction paths show up before they ship.
+ *
+ *      Contention levels:
+ *          uniform   accounts picked uniformly
+ *          zipf:S    accounts picked Zipfian with exponent S
+ *          hot:PCT   PCT% of TRANS name account 1, 100 for a single hot account
+ *
+ *      Build with: make bench_scale
+ *      Run:        ./scale_bench [--workers=LIST] [--accounts=LIST] [--contention=LIST] [--requests=N]
+ *                                [--outstanding=N] [--csv=FILE] [--baseline=FILE] [--tolerance=PCT]
+ *                                [-- server options]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define LOADGEN_BIN "./loadgen"                 // load generator run for every point, from the build directory
+#define MAX_VALUES 32                           // most values swept on one axis
+#define FLAT_GAIN 1.10                          // throughput gain of the next worker count below which scaling is flat
+#define DEFAULT_ACCOUNTS "1000,10000,100000"
+#define DEFAULT_CONTENTION "uniform,zipf:0.99,hot:100"
+#define DEFAULT_REQUESTS 100000
+#define DEFAULT_OUTSTANDING 1024
+#define DEFAULT_TOLERANCE 10
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct point {              // One run of the sweep
+    int workers;            // worker threads
+    int accounts;           // number of accounts
+    char contention[32];    // contention level as given
+    double throughput;      // requests per second, 0 if the run failed
+    double p99;             // 99th percentile latency in milliseconds
+    double cores;           // server CPU use in cores
+};
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int parse_list(const char * list, int * values);
+int split_list(char * list, char ** values);
+int run_point(struct point * p, int requests, int outstanding, char ** serverArgs, int numServerArgs);
+void summarize(struct point * points, int numPoints, const int * workers, int numWorkers);
+int compare_baseline(const char * path, struct point * points, int numPoints, double tolerance);
+/*===============================================================*/
+
+/**
+ * Runs every combination of worker count, account count and contention level, writes the CSV and prints the summary.
+ *
+ * Options:
+ *      --workers=LIST      comma separated worker counts (default 1, 2, 4, ... up to the core count, and it)
+ *      --accounts=LIST     comma separated account counts (default 1000,10000,100000)
+ *      --contention=LIST   comma separated uniform, zipf:S and hot:PCT (default uniform,zipf:0.99,hot:100)
+ *      --requests=N        measured requests per point (default 100000)
+ *      --outstanding=N     requests in flight (default 1024)
+ *      --csv=FILE          where the results go (default scale.csv)
+ *      --baseline=FILE     CSV of an earlier sweep to compare throughput with
+ *      --tolerance=PCT     throughput a point may lose against the baseline (default 10)
+ * Everything after -- is passed to the server.
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int - 0 if every run succeeded and nothing regressed
+ */
+int main(int argc, char *argv[]) {
+    int workers[MAX_VALUES], accounts[MAX_VALUES];
+    char * contention[MAX_VALUES];
+    char contentionList[1024] = DEFAULT_CONTENTION;
+    int numWorkers = 0, numAccounts = parse_list(DEFAULT_ACCOUNTS, accounts);
+    int requests = DEFAULT_REQUESTS, outstanding = DEFAULT_OUTSTANDING;
+    const char * csvPath = "scale.csv";
+    const char * baseline = NULL;
+    double tolerance = DEFAULT_TOLERANCE;
+    char ** serverArgs = NULL;
+    int numServerArgs = 0;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--")) {
+            serverArgs = argv + i + 1;
+            numServerArgs = argc - i - 1;
+            break;
+        } else if (!strncmp(argv[i], "--workers=", 10)) {
+            numWorkers = parse_list(argv[i] + 10, workers);
+        } else if (!strncmp(argv[i], "--accounts=", 11)) {
+            numAccounts = parse_list(argv[i] + 11, accounts);
+        } else if (!strncmp(argv[i], "--contention=", 13)) {
+            snprintf(contentionList, sizeof(contentionList), "%s", argv[i] + 13);
+        } else if (!strncmp(argv[i], "--requests=", 11)) {
+            requests = atoi(argv[i] + 11);
+        } else if (!strncmp(argv[i], "--outstanding=", 14)) {
+            outstanding = atoi(argv[i] + 14);
+        } else if (!strncmp(argv[i], "--csv=", 6)) {
+            csvPath = argv[i] + 6;
+        } else if (!strncmp(argv[i], "--baseline=", 11)) {
+            baseline = argv[i] + 11;
+        } else if (!strncmp(argv[i], "--tolerance=", 12)) {
+            tolerance = atof(argv[i] + 12);
+        } else {
+            printf("Usage: %s [--workers=LIST] [--accounts=LIST] [--contention=LIST] [--requests=N] [--outstanding=N]\n\t\t"
+                   "[--csv=FILE] [--baseline=FILE] [--tolerance=PCT] [-- server options]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (numWorkers == 0) {
+        // Powers of two up to the core count, and the core count itself
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        int w;
+        for (w = 1; w < cores && numWorkers < MAX_VALUES - 1; w *= 2) {
+            workers[numWorkers++] = w;
+        }
+        workers[numWorkers++] = cores;
+    }
+    int numContention = split_list(contentionList, contention);
+    if (numWorkers < 1 || numAccounts < 1 || numContention < 1 || requests < 1 || outstanding < 1) {
+        printf("ERROR: invalid arguments\n");
+        return 1;
+    }
+
+    FILE * csv = fopen(csvPath, "w");
+    if (csv == NULL) {
+        perror(csvPath);
+        return 1;
+    }
+    fprintf(csv, "workers,accounts,contention,throughput,p99_ms,cpu_cores,cpu_pct\n");
+    struct point * points = calloc(numWorkers * numAccounts * numContention, sizeof(struct point));
+    int numPoints = 0, failed = 0;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%d requests per point, %d outstanding, %ld cores\n", requests, outstanding, cores);
+    printf("%8s %10s %14s %12s %10s %10s\n", "workers", "accounts", "contention", "requests/s", "p99 ms", "cpu cores");
+    int a, c, w;
+    for (a = 0; a < numAccounts; a++) {
+        for (c = 0; c < numContention; c++) {
+            for (w = 0; w < numWorkers; w++) {
+                struct point * p = &points[numPoints++];
+                p->workers = workers[w];
+                p->accounts = accounts[a];
+                snprintf(p->contention, sizeof(p->contention), "%s", contention[c]);
+                if (!run_point(p, requests, outstanding, serverArgs, numServerArgs)) {
+                    printf("%8d %10d %14s %12s\n", p->workers, p->accounts, p->contention, "FAILED");
+                    failed++;
+                    continue;
+                }
+                printf("%8d %10d %14s %12.0f %10.3f %10.2f\n", p->workers, p->accounts, p->contention, p->throughput,
+                       p->p99, p->cores);
+                fprintf(csv, "%d,%d,%s,%.0f,%.3f,%.2f,%.0f\n", p->workers, p->accounts, p->contention, p->throughput,
+                        p->p99, p->cores, 100 * p->cores / cores);
+                fflush(stdout);
+                fflush(csv);
+            }
+        }
+    }
+    fclose(csv);
+    printf("\nResults written to %s\n", csvPath);
+
+    summarize(points, numPoints, workers, numWorkers);
+    int regressed = baseline != NULL ? compare_baseline(baseline, points, numPoints, tolerance) : 0;
+    free(points);
+    return failed || regressed ? 1 : 0;
+}
+
+/**
+ * @param list   - comma separated positive numbers
+ * @param values - receives the numbers, at most MAX_VALUES
+ * @return int - how many there are, 0 if one is not a positive number
+ */
+int parse_list(const char * list, int * values) {
+    int n = 0;
+    while (*list != '\0' && n < MAX_VALUES) {
+        char * end;
+        long v = strtol(list, &end, 10);
+        if (end == list || v < 1 || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        values[n++] = v;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+/**
+ * Splits a comma separated list in place.
+ *
+ * @param list   - the list, its commas overwritten
+ * @param values - receives the entries, at most MAX_VALUES
+ * @return int - how many there are
+ */
+int split_list(char * list, char ** values) {
+    int n = 0;
+    char * save;
+    char * v;
+    for (v = strtok_r(list, ",", &save); v != NULL && n < MAX_VALUES; v = strtok_r(NULL, ",", &save)) {
+        values[n++] = v;
+    }
+    return n;
+}
+
+/**
+ * Runs loadgen for one point and reads its throughput, p99 latency and server CPU use from what it prints. The
+ * server is killed once measured, so every account need not be flushed to the bank.
+ *
+ * @param p             - the point, receives the results
+ * @param requests      - measured requests
+ * @param outstanding   - requests in flight
+ * @param serverArgs    - options passed to the server
+ * @param numServerArgs - number of serverArgs
+ * @return int - 1 if the run succeeded
+ */
+int run_point(struct point * p, int requests, int outstanding, char ** serverArgs, int numServerArgs) {
+    char workerCount[16], accountCount[16], requestOpt[32], outstandingOpt[32], contentionOpt[48];
+    snprintf(workerCount, sizeof(workerCount), "%d", p->workers);
+    snprintf(accountCount, sizeof(accountCount), "%d", p->accounts);
+    snprintf(requestOpt, sizeof(requestOpt), "--requests=%d", requests);
+    snprintf(outstandingOpt, sizeof(outstandingOpt), "--outstanding=%d", outstanding);
+    if (!strncmp(p->contention, "zipf:", 5)) {
+        snprintf(contentionOpt, sizeof(contentionOpt), "--zipf=%s", p->contention + 5);
+    } else if (!strncmp(p->contention, "hot:", 4)) {
+        snprintf(contentionOpt, sizeof(contentionOpt), "--hot=%s", p->contention + 4);
+    } else if (!strcmp(p->contention, "uniform")) {
+        strcpy(contentionOpt, "--zipf=0");
+    } else {
+        return 0;
+    }
+    char * argv[numServerArgs + 12];
+    int a = 0, i;
+    argv[a++] = LOADGEN_BIN;
+    argv[a++] = workerCount;
+    argv[a++] = accountCount;
+    argv[a++] = "--mode=closed";
+    argv[a++] = requestOpt;
+    argv[a++] = outstandingOpt;
+    argv[a++] = contentionOpt;
+    argv[a++] = "--stop=kill";
+    argv[a++] = "--";
+    for (i = 0; i < numServerArgs; i++) {
+        argv[a++] = serverArgs[i];
+    }
+    argv[a] = NULL;
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return 0;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(LOADGEN_BIN, argv);
+        perror(LOADGEN_BIN);
+        _exit(127);
+    }
+    close(fds[1]);
+    FILE * in = fdopen(fds[0], "r");
+    char line[512];
+    int found = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        double mean, p50, p90;
+        found |= sscanf(line, "throughput %lf", &p->throughput) == 1;
+        found |= (sscanf(line, "from sent %lf %lf %lf %lf", &mean, &p50, &p90, &p->p99) == 4) << 1;
+        found |= (sscanf(line, "server cpu %lf", &p->cores) == 1) << 2;
+    }
+    fclose(in);
+    int status;
+    waitpid(pid, &status, 0);
+    return found == 7 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Prints, for every account count and contention level, the throughput at each worker count, the speedup over the
+ * fewest workers, and the worker count after which the next one gained less than FLAT_GAIN.
+ *
+ * @param points     - every point, the worker counts of one account count and contention level next to each other
+ * @param numPoints  - number of points
+ * @param workers    - worker counts swept
+ * @param numWorkers - number of worker counts
+ */
+void summarize(struct point * points, int numPoints, const int * workers, int numWorkers) {
+    printf("\n%10s %14s  %s\n", "accounts", "contention", "speedup over the fewest workers, where scaling flattens");
+    int i, w;
+    for (i = 0; i + numWorkers <= numPoints; i += numWorkers) {
+        struct point * row = points + i;
+        printf("%10d %14s ", row->accounts, row->contention);
+        int flat = -1, failed = 0;
+        for (w = 0; w < numWorkers; w++) {
+            failed |= row[w].throughput == 0;
+            if (row[0].throughput > 0 && row[w].throughput > 0) {
+                printf(" %dw %.2fx", workers[w], row[w].throughput / row[0].throughput);
+            } else {
+                printf(" %dw -", workers[w]);
+            }
+            if (flat < 0 && w + 1 < numWorkers && row[w + 1].throughput < row[w].throughput * FLAT_GAIN) {
+                flat = w;
+            }
+        }
+        if (failed) {
+            printf("  (runs failed)\n");
+        } else if (numWorkers == 1) {
+            printf("  (one worker count)\n");
+        } else if (flat < 0) {
+            printf("  scales through %d workers\n", workers[numWorkers - 1]);
+        } else {
+            printf("  flattens at %d worker%s\n", workers[flat], workers[flat] == 1 ? "" : "s");
+        }
+    }
+}
+
+/**
+ * Compares throughput with an earlier sweep's CSV point by point and prints every point that lost more than the
+ * tolerance.
+ *
+ * @param path      - CSV written by an earlier sweep
+ * @param points    - this sweep's points
+ * @param numPoints - number of points
+ * @param tolerance - percent of throughput a point may lose
+ * @return int - number of regressed points, or 1 if the baseline could not be read
+ */
+int compare_baseline(const char * path, struct point * points, int numPoints, double tolerance) {
+    FILE * in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return 1;
+    }
+    char line[512];
+    int regressed = 0, compared = 0, i;
+    printf("\nAgainst %s (tolerance %.0f%%):\n", path, tolerance);
+    while (fgets(line, sizeof(line), in) != NULL) {
+        int w, a;
+        char contention[32];
+        double throughput, p99;
+        if (sscanf(line, "%d,%d,%31[^,],%lf,%lf", &w, &a, contention, &throughput, &p99) != 5) {
+            continue;
+        }
+        for (i = 0; i < numPoints; i++) {
+            struct point * p = &points[i];
+            if (p->workers != w || p->accounts != a || strcmp(p->contention, contention)) {
+                continue;
+            }
+            compared++;
+            if (p->throughput < throughput * (1 - tolerance / 100)) {
+                printf("  REGRESSION %d workers, %d accounts, %s: %.0f requests/s, was %.0f (%.1f%%), p99 %.3f ms, "
+                       "was %.3f\n", w, a, contention, p->throughput, throughput,
+                       100 * (p->throughput - throughput) / throughput, p->p99, p99);
+                regressed++;
+            }
+        }
+    }
+    fclose(in);
+    printf("  %d points compared, %d regressed\n", compared, regressed);
+    return regressed;
+}
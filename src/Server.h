@@ -0,0 +1,111 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Server.h contains the request structures, startup configuration and
+ *      global state shared between the server's input sources and workers.
+*/
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "Request_Queue.h"
+#include "Request_Parser.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define STR_MAX_SIZE 256
+
+// Execution modes selected with --exec
+#define EXEC_LOCK 0         // any worker runs any request under per-account mutexes
+#define EXEC_PARTITION 1    // each worker owns a partition of the accounts and runs its requests lock-free
+#define EXEC_OCC 2          // any worker runs any request, a TRANS reads without locks and validates before writing
+#define EXEC_BATCH 3        // a scheduler runs requests in waves that share no account, as if serially in ID order
+
+#define OCC_RETRIES_DEFAULT 8   // optimistic attempts of a TRANS before it runs under locks
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct request {                        // Structure for a request object, lives in the request pool
+    _Alignas(CACHE_LINE_SIZE) struct request * pool_next;  // next free request while the request is in the pool
+    int request_id;                     // request ID assigned by the input source
+    int step;                           // type it was parsed as: REQ_CHECK, REQ_TRANS, REQ_PREPARE, REQ_COMMIT or REQ_ABORT
+    int txid;                           // PREPARE, COMMIT and ABORT: the router's transaction ID
+    int client;                         // PREPARE, COMMIT and ABORT: connection of the router
+    int check_acc_id;                   // account ID for a CHECK request
+    int num_trans;                      // number of accounts in this transaction
+    struct trans transactions[MAX_TRANS_PAIRS];  // transaction pairs, stored inline, distinct accounts sorted by ID
+    int num_debits;                     // number of debited accounts, 0 for a deposit-only TRANS
+    int debit_ids[MAX_TRANS_PAIRS];     // debited accounts in ID order, the locks a TRANS takes
+    struct timeval starttime, endtime;  // starttime and endtime for TIME
+    int num_parts;                      // EXEC_PARTITION: number of partitions the request touches
+    _Atomic uint32_t arrived;           // EXEC_PARTITION: partition owners that reached the request
+    _Atomic uint32_t done;              // EXEC_PARTITION: set once the request has been executed
+    _Atomic uint32_t refs;              // EXEC_PARTITION: partition owners still holding the request
+    uint64_t enqueued_ns;               // STATS: monotonic time the request was queued
+    uint64_t dequeued_ns;               // STATS: a worker took it
+    uint64_t locked_ns;                 // STATS: its account locks were held
+    uint64_t stored_ns;                 // STATS: its balances were read and written
+};
+
+struct server_config {          // Options given after the required command line arguments
+    int stdin_enabled;          // --stdin=0|1, read requests from the terminal (default 1)
+    int tcp_port;               // --tcp=PORT, listen on 127.0.0.1:PORT (0 = off)
+    char * unix_path;           // --unix=PATH, listen on a Unix domain socket (NULL = off)
+    int net_threads;            // --net-threads=N, number of epoll loops serving clients (default 1)
+    int exec_mode;              // --exec=lock|partition|occ|batch, how workers share the accounts (default lock)
+    int cache_policy;           // --cache=none|writethrough|writeback, balance cache in front of Bank.c (default writeback)
+    int flush_batch;            // --flush-batch=N, dirty accounts that wake the flusher early
+    int flush_interval;         // --flush-interval=MS, most milliseconds a change stays unflushed
+    int io_threads;             // --io-threads=N, storage helpers issuing calls in parallel (0 = off)
+    int fibers;                 // --fibers=N, coroutines per worker thread (0 = one request per thread)
+    int stats;                  // --stats=0|1, time every stage of every request for STATS (default 1)
+    int writer;                 // --writer=0|1, results go through the result writer thread (default 1)
+    int writer_interval;        // --writer-interval=MS, most milliseconds a result stays buffered
+    int writer_batch;           // --writer-batch=N, buffered bytes of one worker that wake the writer early
+    int ordered;                // --ordered=0|1, the writer emits results in request ID order (default 0)
+    int order_window;           // --order-window=N, starting slots of the reorder window
+    int check_lockfree;         // --check=lock|lockfree, how CHECK reads its account (default lockfree)
+    int occ_retries;            // --occ-retries=N, optimistic attempts of a TRANS before falling back to locks
+    int batch_size;             // --batch-size=N, most requests the batch scheduler splits into waves at once
+    int batch_latency;          // --batch-latency=US, most microseconds the batch scheduler waits for a batch to fill
+    int lock_stripes;           // --lock-stripes=N, lock words shared by all accounts (0 = one per account)
+    int hugepages;              // --hugepages=0|1, back the account table with huge pages (default 0)
+    char * wal_path;            // --wal=PATH, commit log making every TRANS durable (NULL = off)
+    int wal_window;             // --wal-window=US, most microseconds a commit waits to share an fdatasync
+    char * snapshot_path;       // --snapshot=PATH, checkpointed copy of every balance (NULL = off)
+    int checkpoint_interval;    // --checkpoint-interval=MS, most milliseconds between checkpoints
+    char * replicate_path;      // --replicate=PATH, ship the commit log to standbys connecting here (NULL = off)
+    char * standby_path;        // --standby=PATH, follow the primary at PATH and answer CHECK only (NULL = off)
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+extern struct request_queue Q;      // Global Queue containing the requests
+extern FILE *fp;                    // Pointer to output file
+extern int numAccounts;             // Number of accounts
+extern int numWThreads;             // Number of threads at startup
+extern struct server_config config; // Startup options
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int dispatch_request(const struct parsed_request * p, int client, char * reply, size_t size);
+void client_closed(int client);
+struct request * create_request(const struct parsed_request * p, int client);
+int submit_request(struct request * r);
+void server_shutdown();
+void execute_locked(struct request * job);
+void execute_optimistic(struct request * job);
+void execute_unlocked(struct request * job);
+/*===============================================================*/
+
+#endif
@@ -0,0 +1,353 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Snapshot.c implements the checkpointed snapshot of the balances. The
+ *      snapshot file holds a header page and two copies of every balance as
+ *      a 64-bit integer, indexed by account ID - 1. Each copy is exactly the
+ *      commit log up to some offset folded into balances, which the header
+ *      records together with a checkpoint number.
+ *
+ *      A checkpoint never looks at the live account table, so workers are
+ *      never paused and never see the checkpointer. It brings the older copy
+ *      up to the end of the durable log by adding the amounts of the records
+ *      it is missing, which are exactly the TRANS that went through since, in
+ *      log order. The copy is marked invalid in the header while it changes,
+ *      its pages are synced, and only then is it marked valid with the new
+ *      offset and a higher number. A crash at any point leaves at least one
+ *      valid copy consistent with the log, and the next checkpoint rebuilds a
+ *      copy left invalid from the other one.
+ *
+ *      At startup the newest valid copy is read into the account table and
+ *      the commit log is replayed from its offset. The file is sparse: pages
+ *      of accounts that never held money are holes, which loading skips, so
+ *      untouched accounts stay unmaterialized.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Accounts.h"
+#include "Commit_Log.h"
+#include "Stats.h"
+#include "Snapshot.h"
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define SNAPSHOT_MAGIC 0x31544f4853504e53ULL   // "SNPSHOT1" in little endian, marks a snapshot file
+#define SNAPSHOT_PAGE 4096                      // size of the header, copies start page aligned
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct snapshot_copy {          // Header entry of one copy of the balances
+    uint64_t seq;               // checkpoint number, the newer copy has the larger one
+    int64_t log_offset;         // bytes of the commit log folded into the copy
+    uint32_t valid;             // 1 once the copy holds exactly those bytes, 0 while a checkpoint changes it
+    uint32_t pad;               // unused
+};
+
+struct snapshot_header {        // First page of the snapshot file
+    uint64_t magic;             // SNAPSHOT_MAGIC
+    int64_t num_accounts;       // number of accounts the copies hold
+    struct snapshot_copy copies[2];  // the two copies
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static int snapFd = -1;                         // snapshot file
+static int logFd = -1;                          // commit log, read only
+static char * base = NULL;                      // mapping of the whole snapshot file
+static size_t fileBytes;                        // size of the snapshot file
+static size_t copyBytes;                        // size of one copy, page aligned
+static struct snapshot_header * header;         // start of base
+static int64_t * copies[2];                     // balances of each copy
+static int numAccs;                             // number of accounts
+static int intervalMs;                          // most milliseconds between checkpoints
+static pthread_t checkpointTid;                 // checkpointer thread
+static pthread_mutex_t checkpointMut = PTHREAD_MUTEX_INITIALIZER;  // guards stopping
+static pthread_cond_t checkpointCond = PTHREAD_COND_INITIALIZER;   // signaled on shutdown
+static int stopping = 0;                        // set by snapshot_close
+static int started = 0;                         // the checkpointer thread is running
+static _Atomic uint64_t numCheckpoints;         // STATS: checkpoints taken
+static _Atomic uint64_t lastNs;                 // STATS: length of the last checkpoint
+static _Atomic int64_t coveredEnd;              // STATS: log offset the newest copy holds
+static int numLoaded;                           // STATS: accounts loaded at startup
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static int newest_copy();
+static void load(int c);
+static void checkpoint();
+static void add_record(void * ctx, const struct trans * pairs, int num_pairs);
+static void sync_range(void * start, size_t len);
+static void* checkpoint_loop(void * arg);
+/*===============================================================*/
+
+/**
+ * Opens the snapshot, creating an empty one if missing, and loads the newest copy into the accounts. The accounts
+ * must be initialized and nothing else may have changed them yet.
+ *
+ * @param path         - snapshot file
+ * @param num_accounts - number of accounts, must match an existing snapshot
+ * @param covered      - receives the log offset the loaded balances hold, replay the log from there
+ * @return int - 1 if succeeded, 0 if the file could not be opened or is not a snapshot of this many accounts
+ */
+int snapshot_init(const char * path, int num_accounts, off_t * covered) {
+    numAccs = num_accounts;
+    copyBytes = ((size_t)num_accounts * sizeof(int64_t) + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE * SNAPSHOT_PAGE;
+    fileBytes = SNAPSHOT_PAGE + 2 * copyBytes;
+    snapFd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (snapFd < 0 || fstat(snapFd, &st) != 0) {
+        return 0;
+    }
+    int fresh = st.st_size == 0;
+    if (fresh) {
+        // Holes until written, so a new snapshot costs no disk
+        if (ftruncate(snapFd, fileBytes) != 0) {
+            return 0;
+        }
+    } else if ((size_t)st.st_size != fileBytes) {
+        return 0;
+    }
+    base = mmap(NULL, fileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, snapFd, 0);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        return 0;
+    }
+    header = (struct snapshot_header *)base;
+    copies[0] = (int64_t *)(base + SNAPSHOT_PAGE);
+    copies[1] = (int64_t *)(base + SNAPSHOT_PAGE + copyBytes);
+    if (fresh) {
+        // Both copies hold nothing of the log, which is every balance at 0
+        header->magic = SNAPSHOT_MAGIC;
+        header->num_accounts = num_accounts;
+        header->copies[0].valid = 1;
+        header->copies[1].valid = 1;
+        sync_range(header, SNAPSHOT_PAGE);
+    }
+    if (header->magic != SNAPSHOT_MAGIC || header->num_accounts != num_accounts) {
+        return 0;
+    }
+    int c = newest_copy();
+    if (c < 0) {
+        return 0;
+    }
+    load(c);
+    *covered = header->copies[c].log_offset;
+    atomic_store(&coveredEnd, header->copies[c].log_offset);
+    return 1;
+}
+
+/**
+ * Starts the checkpointer. Called once the commit log has been replayed.
+ *
+ * @param log_path    - commit log the snapshot follows
+ * @param interval_ms - most milliseconds between checkpoints
+ * @return int - 1 if succeeded, 0 if the log could not be opened or the thread created
+ */
+int snapshot_start(const char * log_path, int interval_ms) {
+    logFd = open(log_path, O_RDONLY);
+    if (logFd < 0) {
+        return 0;
+    }
+    intervalMs = interval_ms;
+    started = pthread_create(&checkpointTid, NULL, checkpoint_loop, NULL) == 0;
+    return started;
+}
+
+/**
+ * Writes the SNAPSHOT line of the STATS answer.
+ *
+ * @param buf  - receives the line, ending in a newline
+ * @param size - size of buf
+ * @return int - length of the line
+ */
+int snapshot_report(char * buf, size_t size) {
+    int64_t covered = atomic_load(&coveredEnd);
+    int64_t lag = commit_log_durable() - covered;
+    return snprintf(buf, size, "SNAPSHOT checkpoints %llu covered %lld lag %lld bytes last %.1f ms loaded %d\n",
+                    (unsigned long long)atomic_load(&numCheckpoints), (long long)covered,
+                    (long long)(lag > 0 ? lag : 0), atomic_load(&lastNs) / 1e6, numLoaded);
+}
+
+/**
+ * Stops the checkpointer and takes one last checkpoint, so a restart replays nothing. The commit log must be closed
+ * already.
+ */
+void snapshot_close() {
+    if (base == NULL) {
+        return;
+    }
+    if (started) {
+        pthread_mutex_lock(&checkpointMut);
+        stopping = 1;
+        pthread_cond_signal(&checkpointCond);
+        pthread_mutex_unlock(&checkpointMut);
+        pthread_join(checkpointTid, NULL);
+        checkpoint();
+        started = 0;
+    }
+    munmap(base, fileBytes);
+    base = NULL;
+    close(snapFd);
+    if (logFd >= 0) {
+        close(logFd);
+    }
+}
+
+/**
+ * @return int - index of the valid copy with the highest checkpoint number, -1 if neither is valid
+ */
+static int newest_copy() {
+    struct snapshot_copy * c = header->copies;
+    if (c[0].valid && (!c[1].valid || c[0].seq >= c[1].seq)) {
+        return 0;
+    }
+    return c[1].valid ? 1 : -1;
+}
+
+/**
+ * Adds the balances of a copy to the accounts, skipping the holes of the file.
+ *
+ * @param c - index of the copy
+ */
+static void load(int c) {
+    off_t start = (char *)copies[c] - base;
+    off_t end = start + (off_t)numAccs * sizeof(int64_t);
+    madvise(copies[c], copyBytes, MADV_SEQUENTIAL);
+    off_t pos = start;
+    while (pos < end) {
+        off_t data = lseek(snapFd, pos, SEEK_DATA);
+        if (data < 0 || data >= end) {
+            // ENXIO: nothing but holes from here on
+            break;
+        }
+        off_t hole = lseek(snapFd, data, SEEK_HOLE);
+        if (hole < 0 || hole > end) {
+            hole = end;
+        }
+        int64_t i;
+        for (i = (data - start) / sizeof(int64_t); i < (hole - start) / (off_t)sizeof(int64_t); i++) {
+            if (copies[c][i] != 0) {
+                account_restore(i + 1, copies[c][i]);
+                numLoaded++;
+            }
+        }
+        pos = hole;
+    }
+    madvise(copies[c], copyBytes, MADV_DONTNEED);
+}
+
+/**
+ * Brings the older copy up to the end of the durable log and makes it the newest.
+ */
+static void checkpoint() {
+    int newest = newest_copy();
+    int c = 1 - newest;
+    off_t target = commit_log_durable();
+    if (target <= header->copies[newest].log_offset) {
+        return;
+    }
+    uint64_t start = stats_now();
+    off_t from;
+    if (header->copies[c].valid) {
+        from = header->copies[c].log_offset;
+        header->copies[c].valid = 0;
+        sync_range(header, SNAPSHOT_PAGE);
+    } else {
+        // Left invalid by a crash during a checkpoint, start over from the newest copy
+        memcpy(copies[c], copies[newest], copyBytes);
+        from = header->copies[newest].log_offset;
+    }
+
+    off_t end = commit_log_read(logFd, from, target, numAccs, add_record, copies[c]);
+    if (end < 0) {
+        // The copy stays invalid, the newest one is still good
+        printf("ERROR: Checkpoint could not read the commit log: %s\n", strerror(errno));
+        return;
+    }
+    sync_range(copies[c], copyBytes);
+    header->copies[c].seq = header->copies[newest].seq + 1;
+    header->copies[c].log_offset = end;
+    header->copies[c].valid = 1;
+    sync_range(header, SNAPSHOT_PAGE);
+
+    atomic_store(&coveredEnd, end);
+    atomic_store(&lastNs, stats_now() - start);
+    atomic_fetch_add(&numCheckpoints, 1);
+}
+
+/**
+ * Folds one log record into a copy.
+ *
+ * @param ctx       - balances of the copy
+ * @param pairs     - the record's pairs
+ * @param num_pairs - number of pairs
+ */
+static void add_record(void * ctx, const struct trans * pairs, int num_pairs) {
+    int64_t * balances = ctx;
+    int i;
+    for (i = 0; i < num_pairs; i++) {
+        balances[pairs[i].acc_id - 1] += pairs[i].amount;
+    }
+}
+
+/**
+ * Writes the changed pages of part of the snapshot to disk and waits for them.
+ *
+ * @param start - page aligned start of the part
+ * @param len   - length of the part
+ */
+static void sync_range(void * start, size_t len) {
+    if (msync(start, len, MS_SYNC) != 0) {
+        printf("ERROR: Snapshot sync failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/**
+ * Checkpointer thread. Takes a checkpoint every interval until the snapshot is closed.
+ */
+static void* checkpoint_loop(void * arg) {
+    pthread_mutex_lock(&checkpointMut);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += intervalMs / 1000;
+        deadline.tv_nsec += (long)(intervalMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!stopping) {
+            if (pthread_cond_timedwait(&checkpointCond, &checkpointMut, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&checkpointMut);
+        checkpoint();
+        pthread_mutex_lock(&checkpointMut);
+    }
+    pthread_mutex_unlock(&checkpointMut);
+    return NULL;
+}
@@ -0,0 +1,32 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Snapshot.h declares the checkpointed snapshot of the balances
+ *      (--snapshot). A checkpointer thread keeps a memory-mapped file of every
+ *      balance up to date from the durable commit log, without stopping the
+ *      workers. At startup the balances are loaded from the snapshot and only
+ *      the log written since the last checkpoint is replayed.
+*/
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define CHECKPOINT_INTERVAL_DEFAULT 1000    // most milliseconds between checkpoints
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+int snapshot_init(const char * path, int num_accounts, off_t * covered);
+int snapshot_start(const char * log_path, int interval_ms);
+int snapshot_report(char * buf, size_t size);
+void snapshot_close();
+/*===============================================================*/
+
+#endif
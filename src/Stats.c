@@ -0,0 +1,263 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Stats.c implements the STATS histograms. Every worker thread owns one
+ *      histogram per stage, in log-linear buckets like an HDR histogram: the
+ *      power of two of a duration picks a group and its next HIST_SUB_BITS
+ *      bits pick a bucket in it. Only the owner writes its counters, with
+ *      plain relaxed stores, so recording takes no lock and no atomic
+ *      read-modify-write. STATS sums every worker's counters. Under --exec=occ
+ *      the workers also count optimistic commits, aborts and fallbacks.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include "Server.h"
+#include "Stats.h"
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct worker_stats {                                   // Counters written only by one worker thread
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t completed;   // requests finished
+    _Atomic uint64_t occ_commits;                       // TRANS committed without holding locks while reading
+    _Atomic uint64_t occ_aborts;                        // optimistic attempts that found an account changed
+    _Atomic uint64_t occ_fallbacks;                     // TRANS that gave up and ran under locks
+    _Atomic uint64_t hist[NUM_STAGES][HIST_BUCKETS];    // nanoseconds spent per stage
+};
+/*===============================================================*/
+
+/*================================================================
+ *                      GLOBAL VARIABLES                         *
+=================================================================*/
+static struct worker_stats * workers = NULL;    // one entry per worker thread
+static int numWorkers = 0;                      // number of entries
+static uint64_t startNs = 0;                    // when stats_init ran
+static __thread struct worker_stats * mine = NULL;  // the calling worker's entry
+static const char * stageNames[NUM_STAGES] = { "queue", "lock", "storage", "output", "total" };
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+static int bucket_of(uint64_t ns);
+static uint64_t bucket_value(int bucket);
+static void add(_Atomic uint64_t * counter, uint64_t n);
+static size_t append(char * buf, size_t size, size_t len, const char * fmt, ...);
+/*===============================================================*/
+
+/**
+ * Allocates the counters of every worker.
+ *
+ * @param num_workers - number of worker threads
+ * @return int - 1 if succeeded, 0 if memory could not be allocated
+ */
+int stats_init(int num_workers) {
+    workers = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct worker_stats) * num_workers);
+    if (workers == NULL) {
+        return 0;
+    }
+    int w, s, b;
+    for (w = 0; w < num_workers; w++) {
+        atomic_init(&workers[w].completed, 0);
+        atomic_init(&workers[w].occ_commits, 0);
+        atomic_init(&workers[w].occ_aborts, 0);
+        atomic_init(&workers[w].occ_fallbacks, 0);
+        for (s = 0; s < NUM_STAGES; s++) {
+            for (b = 0; b < HIST_BUCKETS; b++) {
+                atomic_init(&workers[w].hist[s][b], 0);
+            }
+        }
+    }
+    numWorkers = num_workers;
+    startNs = stats_now();
+    return 1;
+}
+
+/**
+ * Frees the counters. No worker may be recording anymore.
+ */
+void stats_destroy() {
+    free(workers);
+    workers = NULL;
+    numWorkers = 0;
+}
+
+/**
+ * Makes the calling thread record into the counters of a worker.
+ *
+ * @param worker - index of the worker
+ */
+void stats_attach(int worker) {
+    mine = &workers[worker];
+}
+
+/**
+ * Records the stages of a finished request. The caller must be attached.
+ *
+ * @param r          - finished request with every stage stamped
+ * @param written_ns - when its result was written
+ */
+void stats_record(const struct request * r, uint64_t written_ns) {
+    add(&mine->hist[STAGE_QUEUE][bucket_of(r->dequeued_ns - r->enqueued_ns)], 1);
+    add(&mine->hist[STAGE_LOCK][bucket_of(r->locked_ns - r->dequeued_ns)], 1);
+    add(&mine->hist[STAGE_STORAGE][bucket_of(r->stored_ns - r->locked_ns)], 1);
+    add(&mine->hist[STAGE_OUTPUT][bucket_of(written_ns - r->stored_ns)], 1);
+    add(&mine->hist[STAGE_TOTAL][bucket_of(written_ns - r->enqueued_ns)], 1);
+    add(&mine->completed, 1);
+}
+
+/**
+ * Counts one optimistic TRANS. Kept even with --stats=0. The caller must be attached.
+ *
+ * @param aborts    - attempts that had to be redone
+ * @param fell_back - 1 if the TRANS finally ran under locks, 0 if an attempt committed
+ */
+void stats_occ(int aborts, int fell_back) {
+    add(&mine->occ_aborts, aborts);
+    if (fell_back) {
+        add(&mine->occ_fallbacks, 1);
+    } else {
+        add(&mine->occ_commits, 1);
+    }
+}
+
+/**
+ * Writes the STATS answer: percentiles per stage, queue depth and throughput of every worker. Workers that do not fit
+ * in buf are summed on one line.
+ *
+ * @param buf         - receives the answer, one line per item, ending in a newline
+ * @param size        - size of buf
+ * @param queue_depth - requests waiting for a worker
+ * @return int - length of the answer
+ */
+int stats_report(char * buf, size_t size, size_t queue_depth) {
+    double uptime = (stats_now() - startNs) / 1e9;
+    static const double quantiles[3] = { 0.50, 0.99, 0.999 };
+    uint64_t merged[HIST_BUCKETS];
+    size_t len = 0;
+    int s, w, b, q;
+
+    len = append(buf, size, len, "STATS uptime %.3f s queue %zu workers %d\n", uptime, queue_depth, numWorkers);
+    for (s = 0; s < NUM_STAGES; s++) {
+        uint64_t count = 0;
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            merged[b] = 0;
+            for (w = 0; w < numWorkers; w++) {
+                merged[b] += atomic_load_explicit(&workers[w].hist[s][b], memory_order_relaxed);
+            }
+            count += merged[b];
+        }
+        // Walk the buckets once for all three quantiles
+        double us[3] = { 0, 0, 0 };
+        uint64_t seen = 0;
+        for (b = 0, q = 0; b < HIST_BUCKETS && q < 3 && count > 0; b++) {
+            seen += merged[b];
+            while (q < 3 && seen >= (uint64_t)(quantiles[q] * count + 0.5) && seen > 0) {
+                us[q++] = bucket_value(b) / 1e3;
+            }
+        }
+        len = append(buf, size, len, "STAGE %s count %llu p50 %.1f us p99 %.1f us p999 %.1f us\n",
+                     stageNames[s], (unsigned long long)count, us[0], us[1], us[2]);
+    }
+
+    if (config.exec_mode == EXEC_OCC) {
+        uint64_t commits = 0, aborts = 0, fallbacks = 0;
+        for (w = 0; w < numWorkers; w++) {
+            commits += atomic_load_explicit(&workers[w].occ_commits, memory_order_relaxed);
+            aborts += atomic_load_explicit(&workers[w].occ_aborts, memory_order_relaxed);
+            fallbacks += atomic_load_explicit(&workers[w].occ_fallbacks, memory_order_relaxed);
+        }
+        // Share of optimistic attempts thrown away, the fallback's own locked run is not an attempt
+        uint64_t attempts = commits + aborts;
+        len = append(buf, size, len, "OCC commits %llu aborts %llu fallbacks %llu abort_rate %.2f%%\n",
+                     (unsigned long long)commits, (unsigned long long)aborts, (unsigned long long)fallbacks,
+                     attempts ? 100.0 * aborts / attempts : 0.0);
+    }
+
+    for (w = 0; w < numWorkers; w++) {
+        uint64_t done = atomic_load_explicit(&workers[w].completed, memory_order_relaxed);
+        // Keep room for a summary line of the remaining workers
+        if (size - len < 2 * STR_MAX_SIZE) {
+            uint64_t rest = 0;
+            int first = w;
+            for (; w < numWorkers; w++) {
+                rest += atomic_load_explicit(&workers[w].completed, memory_order_relaxed);
+            }
+            len = append(buf, size, len, "WORKER %d-%d completed %llu rate %.1f/s\n", first, numWorkers - 1,
+                         (unsigned long long)rest, rest / uptime);
+            break;
+        }
+        len = append(buf, size, len, "WORKER %d completed %llu rate %.1f/s\n", w,
+                     (unsigned long long)done, done / uptime);
+    }
+    return len;
+}
+
+/**
+ * Keeps the length of a report being built inside its buffer. snprintf returns the length it would have written, so
+ * adding it up blindly can pass the end, after which size - len wraps and the next line writes past the buffer.
+ *
+ * @param len  - length so far, as added up from snprintf results
+ * @param size - size of the buffer, at least 1
+ * @return size_t - len, or size - 1 if the answer was cut short
+ */
+size_t stats_fit(size_t len, size_t size) {
+    return len < size ? len : size - 1;
+}
+
+/**
+ * @param ns - duration in nanoseconds
+ * @return int - histogram bucket holding the duration
+ */
+static int bucket_of(uint64_t ns) {
+    if (ns < (1 << HIST_SUB_BITS)) {
+        return ns;
+    }
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+/**
+ * @param bucket - histogram bucket
+ * @return uint64_t - middle of the durations the bucket holds, in nanoseconds
+ */
+static uint64_t bucket_value(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    uint64_t width = 1ULL << (exp - HIST_SUB_BITS);
+    return (((1ULL << HIST_SUB_BITS) + sub) << (exp - HIST_SUB_BITS)) + width / 2;
+}
+
+/**
+ * Adds to a counter only the calling thread writes. Readers may see it slightly late but never torn.
+ *
+ * @param counter - counter owned by the caller
+ * @param n       - amount to add
+ */
+static void add(_Atomic uint64_t * counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Formats one more line of a report after the len bytes already in buf.
+ *
+ * @param buf  - report being built
+ * @param size - size of buf
+ * @param len  - length of the report so far, less than size
+ * @param fmt  - printf format of the line
+ * @return size_t - new length of the report, cut to what fits
+ */
+static size_t append(char * buf, size_t size, size_t len, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + len, size - len, fmt, args);
+    va_end(args);
+    return stats_fit(len + (n > 0 ? n : 0), size);
+}
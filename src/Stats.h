@@ -0,0 +1,56 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Stats.h declares the per-stage latency statistics answered by the
+ *      STATS request. Workers stamp each request with a monotonic clock as
+ *      it moves through the server and record the time spent in every stage
+ *      into histograms private to the worker.
+*/
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+// Stages of a request
+#define STAGE_QUEUE 0       // submitted until a worker takes it
+#define STAGE_LOCK 1        // taken until its account locks are held
+#define STAGE_STORAGE 2     // locks held until its balances are read and written
+#define STAGE_OUTPUT 3      // storage done until its result is written
+#define STAGE_TOTAL 4       // submitted until its result is written
+#define NUM_STAGES 5
+
+#define HIST_SUB_BITS 4                             // 16 linear buckets per power of two, within 1/16 of the value
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)          // covers every 64 bit nanosecond count
+#define STATS_REPLY_SIZE 16384                      // room for a STATS answer
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+struct request;
+
+int stats_init(int num_workers);
+void stats_destroy();
+void stats_attach(int worker);
+void stats_record(const struct request * r, uint64_t written_ns);
+void stats_occ(int aborts, int fell_back);
+int stats_report(char * buf, size_t size, size_t queue_depth);
+size_t stats_fit(size_t len, size_t size);
+
+/**
+ * @return uint64_t - monotonic clock in nanoseconds
+ */
+static inline uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/*===============================================================*/
+
+#endif
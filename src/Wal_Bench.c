@@ -0,0 +1,409 @@
+/**
+ * Author: Brayton Rude (rude87@iastate.edu)
+ *
+ * CPR E 308 Project 2 - Multithreaded Server
+ *      Wal_Bench.c measures how the group commit window trades throughput
+ *      against fsyncs. It runs the server once without --wal and once with
+ *      --wal for every window given, streams the same mix of TRANS and
+ *      CHECKs at it and waits for every result to be written. The sync
+ *      counts are read from the server's STATS.
+ *
+ *      Build with: make bench_wal
+ *      Run:        ./wal_bench <# of worker threads> <# of accounts> <# of requests> [window US]...
+ *                              [-- server options]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*================================================================
+ *                         CONSTANTS                             *
+=================================================================*/
+#define SERVER_BIN "./appserver"                // server program, started from the build directory
+#define BENCH_WAL "/tmp/wal_bench.wal"          // commit log, started fresh every run
+#define BENCH_SOCK "/tmp/wal_bench.sock"        // client socket of the server
+#define BENCH_OUT "/tmp/wal_bench.out"          // output file of the server
+#define MAX_WINDOWS 32                          // most windows measured
+#define MAX_PAIRS 4                             // most pairs of a TRANS
+#define CHECK_PERCENT 20                        // share of the requests that are CHECKs
+#define CONNECT_TRIES 1000                      // attempts to reach the server's socket
+#define CONNECT_WAIT_US 10000                   // microseconds between attempts
+#define POLL_WAIT_US 1000                       // microseconds between looks at the output file
+/*===============================================================*/
+
+/*================================================================
+ *                         STRUCTURES                            *
+=================================================================*/
+struct server {             // The running server and the requests streamed to it
+    pid_t pid;              // the server process
+    int fd;                 // connection to it
+    FILE * out;             // its output file, read as it grows
+    char * data;            // request lines sent to it
+    size_t len;             // bytes of data
+    int replies;            // "ID n" replies expected on fd
+    int results;            // results written so far
+};
+
+struct wal_stats {                  // The server's WAL line
+    unsigned long long records;     // records logged
+    unsigned long long syncs;       // fsyncs of the log
+    double per_sync;                // records per fsync
+    double sync_avg;                // microseconds per fsync
+};
+/*===============================================================*/
+
+/*================================================================
+ *                    FUNCTION DECLARATIONS                      *
+ ================================================================*/
+char * generate(int numAccounts, int count, size_t * len);
+int run(int window, int workers, int numAccounts, int numRequests, char * data, size_t len, char ** serverArgs, int numServerArgs, double * secs, struct wal_stats * wal);
+int start_server(struct server * s, int window, int workers, int numAccounts, char ** serverArgs, int numServerArgs);
+int stop_server(struct server * s, int window, struct wal_stats * wal);
+int connect_server();
+void* send_all(void * arg);
+void* read_replies(void * arg);
+void count_results(struct server * s);
+double now();
+/*===============================================================*/
+
+/**
+ * Runs the benchmark without the log and then once for every window, and prints one row per run.
+ *
+ * @param argc - number of command line arguments
+ * @param argv - array of command line arguments
+ * @return int
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        printf("Usage: %s <# of worker threads> <# of accounts> <# of requests> [window US]... [-- server options]\n", argv[0]);
+        return 1;
+    }
+    int workers = atoi(argv[1]);
+    int numAccounts = atoi(argv[2]);
+    int numRequests = atoi(argv[3]);
+    int windows[MAX_WINDOWS] = { 0, 100, 1000, 5000, 20000 };
+    int numWindows = 5;
+    int a = 4;
+    if (argc > a && strcmp(argv[a], "--")) {
+        for (numWindows = 0; argc > a && strcmp(argv[a], "--") && numWindows < MAX_WINDOWS; a++) {
+            windows[numWindows++] = atoi(argv[a]);
+        }
+    }
+    char ** serverArgs = NULL;
+    int numServerArgs = 0;
+    if (argc > a && !strcmp(argv[a], "--")) {
+        serverArgs = argv + a + 1;
+        numServerArgs = argc - a - 1;
+    }
+    int i;
+    for (i = 0; i < numWindows; i++) {
+        if (windows[i] < 0) {
+            break;
+        }
+    }
+    if (workers < 1 || numAccounts < MAX_PAIRS || numRequests < 1 || i < numWindows) {
+        printf("ERROR: invalid arguments\n");
+        return 1;
+    }
+
+    size_t len;
+    char * data = generate(numAccounts, numRequests, &len);
+    printf("%d requests (%d%% CHECK), %d accounts, %d workers\n", numRequests, CHECK_PERCENT, numAccounts, workers);
+    printf("%10s %12s %10s %10s %10s %12s\n", "window us", "req/s", "records", "syncs", "per_sync", "sync_avg us");
+
+    // Run -1 has no log, for the cost of logging at all
+    for (i = -1; i < numWindows; i++) {
+        int window = i < 0 ? -1 : windows[i];
+        double secs;
+        struct wal_stats wal;
+        if (!run(window, workers, numAccounts, numRequests, data, len, serverArgs, numServerArgs, &secs, &wal)) {
+            printf("ERROR: run with window %d failed\n", window);
+            return 1;
+        }
+        if (window < 0) {
+            printf("%10s %12.0f %10s %10s %10s %12s\n", "no wal", numRequests / secs, "-", "-", "-", "-");
+        } else {
+            printf("%10d %12.0f %10llu %10llu %10.1f %12.1f\n", window, numRequests / secs, wal.records, wal.syncs,
+                   wal.per_sync, wal.sync_avg);
+        }
+        fflush(stdout);
+    }
+    free(data);
+    return 0;
+}
+
+/**
+ * Builds the request stream: CHECK_PERCENT CHECKs, the rest TRANS of one to MAX_PAIRS distinct accounts that mostly
+ * deposit so the debits mostly go through. Every run sends the same stream.
+ *
+ * @param numAccounts - accounts to pick from
+ * @param count       - number of requests
+ * @param len         - receives the size of the stream
+ * @return char* - request lines
+ */
+char * generate(int numAccounts, int count, size_t * len) {
+    char * data = malloc((size_t)count * (8 + MAX_PAIRS * 24) + 1);
+    size_t off = 0;
+    unsigned int r = 5;
+    int i, j, k;
+    for (i = 0; i < count; i++) {
+        if (rand_r(&r) % 100 < CHECK_PERCENT) {
+            off += sprintf(data + off, "CHECK %d\n", rand_r(&r) % numAccounts + 1);
+            continue;
+        }
+        int accs[MAX_PAIRS];
+        int pairs = rand_r(&r) % MAX_PAIRS + 1;
+        off += sprintf(data + off, "TRANS");
+        for (j = 0; j < pairs; j++) {
+            do {
+                accs[j] = rand_r(&r) % numAccounts + 1;
+                for (k = 0; k < j && accs[k] != accs[j]; k++);
+            } while (k < j);
+            off += sprintf(data + off, " %d %d", accs[j], rand_r(&r) % 3 ? rand_r(&r) % 100 + 1 : -(rand_r(&r) % 50 + 1));
+        }
+        off += sprintf(data + off, "\n");
+    }
+    *len = off;
+    return data;
+}
+
+/**
+ * Starts the server, streams the requests and waits for every result to be written. Stopping the server is not
+ * timed.
+ *
+ * @param window        - --wal-window in microseconds, -1 to run without --wal
+ * @param workers       - worker threads
+ * @param numAccounts   - number of accounts
+ * @param numRequests   - requests in data
+ * @param data          - request lines
+ * @param len           - bytes of data
+ * @param serverArgs    - options passed to the server
+ * @param numServerArgs - number of serverArgs
+ * @param secs          - receives the seconds until the last result was written
+ * @param wal           - receives the server's WAL line, when there is a log
+ * @return int - 1 if the run succeeded, 0 if it failed
+ */
+int run(int window, int workers, int numAccounts, int numRequests, char * data, size_t len, char ** serverArgs, int numServerArgs, double * secs, struct wal_stats * wal) {
+    struct server s;
+    memset(&s, 0, sizeof(s));
+    unlink(BENCH_WAL);
+    if (!start_server(&s, window, workers, numAccounts, serverArgs, numServerArgs)) {
+        return 0;
+    }
+    s.data = data;
+    s.len = len;
+    s.replies = numRequests;
+
+    pthread_t sender, reader;
+    double start = now();
+    pthread_create(&sender, NULL, send_all, &s);
+    pthread_create(&reader, NULL, read_replies, &s);
+    while (s.results < numRequests) {
+        usleep(POLL_WAIT_US);
+        count_results(&s);
+    }
+    *secs = now() - start;
+    pthread_join(sender, NULL);
+    pthread_join(reader, NULL);
+    return stop_server(&s, window, wal);
+}
+
+/**
+ * Starts the server and connects to it.
+ *
+ * @param s             - receives the running server
+ * @param window        - --wal-window in microseconds, -1 to run without --wal
+ * @param workers       - worker threads
+ * @param numAccounts   - number of accounts
+ * @param serverArgs    - options passed to the server
+ * @param numServerArgs - number of serverArgs
+ * @return int - 1 if the server is up, 0 if it could not be reached
+ */
+int start_server(struct server * s, int window, int workers, int numAccounts, char ** serverArgs, int numServerArgs) {
+    char workerCount[16], accountCount[16], windowOpt[32];
+    snprintf(workerCount, sizeof(workerCount), "%d", workers);
+    snprintf(accountCount, sizeof(accountCount), "%d", numAccounts);
+    snprintf(windowOpt, sizeof(windowOpt), "--wal-window=%d", window);
+    char * argv[numServerArgs + 10];
+    int a = 0, i;
+    argv[a++] = SERVER_BIN;
+    argv[a++] = workerCount;
+    argv[a++] = accountCount;
+    argv[a++] = BENCH_OUT;
+    argv[a++] = "--unix=" BENCH_SOCK;
+    argv[a++] = "--stdin=0";
+    // The result writer gets every line to the output file within its interval, stdio would hold the last ones
+    argv[a++] = "--writer=1";
+    if (window >= 0) {
+        argv[a++] = "--wal=" BENCH_WAL;
+        argv[a++] = windowOpt;
+    }
+    for (i = 0; i < numServerArgs; i++) {
+        argv[a++] = serverArgs[i];
+    }
+    argv[a] = NULL;
+
+    unlink(BENCH_SOCK);
+    unlink(BENCH_OUT);
+    s->pid = fork();
+    if (s->pid < 0) {
+        return 0;
+    }
+    if (s->pid == 0) {
+        execv(SERVER_BIN, argv);
+        perror(SERVER_BIN);
+        _exit(127);
+    }
+    s->fd = connect_server();
+    s->out = fopen(BENCH_OUT, "r");
+    if (s->fd < 0 || s->out == NULL) {
+        kill(s->pid, SIGKILL);
+        waitpid(s->pid, NULL, 0);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Asks the server for its WAL line when it has a log, then ends it and waits for it to exit.
+ *
+ * @param s      - the running server
+ * @param window - --wal-window of the run, -1 when there is no log to ask about
+ * @param wal    - receives the WAL line
+ * @return int - 1 if the server exited cleanly (and reported its WAL line when asked)
+ */
+int stop_server(struct server * s, int window, struct wal_stats * wal) {
+    int found = window < 0;
+    if (!found && write(s->fd, "STATS\n", 6) == 6) {
+        // The STATS answer comes back on the socket
+        char buf[8192];
+        size_t have = 0;
+        while (!found && have < sizeof(buf) - 1) {
+            ssize_t got = read(s->fd, buf + have, sizeof(buf) - 1 - have);
+            if (got <= 0) {
+                break;
+            }
+            have += got;
+            buf[have] = '\0';
+            char * line = strstr(buf, "WAL records ");
+            found = line != NULL && strchr(line, '\n') != NULL &&
+                    sscanf(line, "WAL records %llu syncs %llu per_sync %lf sync_avg %lf", &wal->records, &wal->syncs,
+                           &wal->per_sync, &wal->sync_avg) == 4;
+        }
+    }
+    if (write(s->fd, "END\n", 4) != 4) {
+        perror("END");
+    }
+    int status;
+    waitpid(s->pid, &status, 0);
+    close(s->fd);
+    fclose(s->out);
+    return found && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Connects to the server's socket, waiting for the server to start.
+ *
+ * @return int - connected socket, -1 if the server never listened
+ */
+int connect_server() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, BENCH_SOCK);
+    int i;
+    for (i = 0; i < CONNECT_TRIES; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(CONNECT_WAIT_US);
+    }
+    return -1;
+}
+
+/**
+ * Sender thread: writes every request line to the server.
+ *
+ * @param arg - the struct server to send to
+ */
+void* send_all(void * arg) {
+    struct server * s = arg;
+    size_t sent = 0;
+    while (sent < s->len) {
+        ssize_t n = write(s->fd, s->data + sent, s->len - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("send");
+            break;
+        }
+        sent += n;
+    }
+    return NULL;
+}
+
+/**
+ * Reader thread: takes every "ID n" reply off the socket so the server never has to hold them.
+ *
+ * @param arg - the struct server to read from
+ */
+void* read_replies(void * arg) {
+    struct server * s = arg;
+    char buf[65536];
+    int replies = 0;
+    while (replies < s->replies) {
+        ssize_t got = read(s->fd, buf, sizeof(buf));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        ssize_t i;
+        for (i = 0; i < got; i++) {
+            replies += buf[i] == '\n';
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Counts the results the server wrote since the last call.
+ *
+ * @param s - the running server
+ */
+void count_results(struct server * s) {
+    char line[256];
+    clearerr(s->out);
+    // A line still being written is read again once it is whole
+    long pos = ftell(s->out);
+    while (fgets(line, sizeof(line), s->out) != NULL) {
+        if (strchr(line, '\n') == NULL) {
+            fseek(s->out, pos, SEEK_SET);
+            break;
+        }
+        s->results++;
+        pos = ftell(s->out);
+    }
+}
+
+/**
+ * @return double - monotonic time in seconds
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}